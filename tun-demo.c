@@ -8,6 +8,88 @@
 #include <linux/if_tun.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define BUFFER_SIZE 2000
+#define RX_BATCH 32               // 每批最多处理的数据包数
+#define MAX_PEERS 64              // 出口对端数上限
+#define MAX_GROUP_PEERS 16        // 每个对端组的成员上限
+#define MAX_ROUTES 256            // 路由（允许IP）条目上限
+#define ECMP_BUCKETS 256          // 每个对端组的流哈希桶数
+#define PEER_DEAD_SECONDS 10      // 发包后超过该时长无回包视为不健康
+#define RTT_EWMA_SHIFT 3          // RTT平滑系数 1/8
+#define PKT_POOL_SIZE 1024        // 数据包缓冲池初始大小（向上取整到整块）
+#define PKT_POOL_MAX_SIZE 32768   // 缓冲池按需增长的上限
+#define PKT_CHUNK_BYTES (2u << 20)  // 缓冲池按2MB（一个大页）整块增长和归还
+#define PKT_POOL_MAX_CHUNKS 64
+#define PKT_POOL_SHRINK_NS (10ULL * 1000000000ULL)  // 空闲低水位观察窗口
+#define PKT_RETURN_BATCH 32       // 非属主线程攒够这么多缓冲区再一次性归还
+#define MIRROR_RING_SIZE 256      // 镜像队列长度（2的幂），满则丢弃镜像副本
+#define MIRROR_DEFAULT_PPS 1000   // 默认镜像速率上限（包/秒）
+#define ICMP_RATE_PPS 100         // ICMP不可达报文速率上限（包/秒）
+#define ICMP_BURST 20
+#define ICMP_MAX_LEN 576          // ICMPv4差错报文最大长度（RFC 1812）
+#define ICMP6_MAX_LEN 1280        // ICMPv6差错报文最大长度（IPv6最小MTU）
+#define TUN_PREFIX_LEN 24         // TUN接口所在子网的前缀长度（与 configure_tun_interface 的参数一致）
+#define FLOW_TABLE_MAX (1 << 20)  // 活跃流上限，达到后新流淘汰最久未活动的流
+#define FLOW_IDLE_NS (120ULL * 1000000000ULL)  // 流空闲超过该时长可被复用
+#define FLOW_REPORT_SECONDS 30    // 流统计输出间隔
+#define FLOW_EXPIRE_SCAN 1024     // 每批最多回收的过期流数
+#define FLOW_LRU_GRANULARITY_NS 1000000000ULL  // 流距上次移到链尾超过该时长才再次移动
+#define FLOW_REAP_ROUNDS 64       // 每这么多批回收一次流表项的闲置弹匣
+#define SLAB_BYTES (64u << 10)    // slab大小，按此对齐以便由对象地址找到所属slab
+#define SLAB_MAGAZINE_SIZE 64     // 每个弹匣的对象数
+#define SLAB_MAX_CACHES 8         // slab缓存（对象类型）数上限
+#define SLAB_DEPOT_KEEP 16        // 仓库保留的满弹匣数，多出的拆回slab
+#define QSBR_RECLAIM_THRESHOLD 64 // 待回收节点超过该数时在挂起处立即尝试回收
+#define CHASH_MIN_BUCKETS 64      // 并发哈希表最小桶数（2的幂）
+#define CHASH_MIGRATE_STEP 16     // 扩缩容期间每次写操作顺带迁移的旧桶数
+#define CHASH_FREE_STEP 64        // 每次写操作顺带释放的旧节点数
+#define FIB_MAX_NODES (1u << 20)  // FIB中256项子节点数上限
+#define FIB_DIR24_MIN_DEEP 64     // 自动模式下长于/16的前缀达到此数时改用DIR-24-8（不超过 MAX_ROUTES）
+#define FIB_TBL24_BYTES ((size_t)(1u << 24) * sizeof(uint16_t))  // DIR-24-8第一级，32MB
+#define FIB_TBL8_MAX 32768        // DIR-24-8第二级256项组数上限（15位编号）
+#define ROUTE_RECLAIM_MS 10       // 路由构建线程空闲时回收旧FIB的间隔
+#define SNI_MAX_LEN 64            // 流表中保存的SNI最大长度（超出截断）
+#define SNI_MAX_ATTEMPTS 4        // 每条流最多检查前几个发起方数据包
+#define SNI_REASSEMBLY_MAX 4096   // 跨TCP段的ClientHello每条流最多缓存的字节数
+#define SNI_REASSEMBLY_FLOWS 4096 // 同时缓存ClientHello的流数上限
+#define PM_MIN_PATTERN_LEN 3      // 预过滤按模式的前3字节工作，更短的模式不接受
+#define PM_TEDDY_BUCKETS 8        // Teddy桶数（掩码中每个桶占1位）
+#define PM_TEDDY_SATURATED 0.25   // 估计候选率超过此值视为掩码饱和
+#define PM_TEDDY_PROBE_BYTES 128  // 掩码饱和时，先用预过滤扫这么多字节，候选过半则改走标量路径
+#define PM_IPV6_MAX_EXT 8         // 取IPv6载荷时最多跳过的扩展头数，超出后把余下部分当作载荷
+#define PM_PREFIX_FILTER_BITS 19  // 前缀哈希位图大小（2^19位 = 64KB）
+#define QOS_MAX_RULES 64          // 用户QoS规则上限
+#define QOS_INTERACTIVE_LIMIT 64  // 各类队列长度上限（包），超出尾丢弃
+#define QOS_BULK_LIMIT 256
+#define QOS_BACKGROUND_LIMIT 256
+#define QOS_BULK_QUANTUM 6000     // 加权轮转每轮字节数：bulk:background = 4:1
+#define QOS_BACKGROUND_QUANTUM 1500
+#define EGRESS_BURST_NS 5000000ULL  // 整形令牌桶深度：5ms的发送量
+#define IMPAIR_MAX_PACKETS 512    // 损伤层延迟线容量（包），满时丢弃
+#define FAKE_PACKET_SIZE 200      // 假TUN流量发生器的包长
+#define FAKE_MAX_SEQ (1 << 20)    // 流量发生器最多跟踪的序号数
+#define container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+#define MEM_HEADER_MAGIC 0x4d454d41u  // 内存记账头部校验值
 
 /*
  * awenawtun - TUN接口流量捕获工具
@@ -22,7 +104,38 @@
  * - 自动设置IP地址 192.168.233.1/24
  * - 自动添加路由规则，拦截 192.168.233.0/24 网段流量
  * - 实时解析并显示IP数据包信息（源IP、目标IP、协议类型、长度）
- * - 简单的数据包回显功能（用于ping响应）
+ * - 没有匹配路由的包返回限速的ICMP/ICMPv6目的不可达，应用立即失败而不是等待超时
+ *   （可用 --echo 恢复旧的简单回显行为）
+ * - 流表与被动TCP分析：握手RTT（隧道外侧 SYN→SYN-ACK，本地侧 SYN-ACK→ACK）、
+ *   序号/确认号跟踪、重传和乱序计数，用于判断慢是在隧道内还是隧道外
+ * - 从TLS ClientHello和QUIC v1 Initial中提取SNI，标注到流上
+ * - 载荷多模式匹配（Teddy风格AVX2预过滤 + 锚定字典树确认，IPv4/IPv6），命中的包丢弃
+ * - 按端口/SNI把流分为交互、批量、后台三类，出口按对端排队：交互类严格优先，
+ *   其余两类加权轮转；配合 --egress-rate 整形，让队列留在本地而不是隧道瓶颈处
+ * - 无需root的假传输：--fake-tun 用socketpair代替TUN并内置流量发生器，
+ *   --fake-peer 在本地回环上反射数据包；--impair 在对端链路的两个方向上
+ *   注入延迟、抖动、丢包、重复、乱序和带宽限制（可指定随机种子复现）
+ *
+ * - 按子系统的内存记账（每线程计数，无原子读改写），经 --stats-port 的文本接口导出，
+ *   --bench-memory 给出每条流/每个缓冲区/每个对端的字节数
+ * - 流表项由按类型的slab分配（每线程弹匣，批量释放），过期流增量回收（--bench-slab）
+ * - 静止状态回收（QSBR）：数据路径每批宣告一次静止点，poll时离线（--stress-qsbr）
+ * - 可扩缩容的并发哈希表：读者无锁，扩缩容增量迁移（--bench-chash），
+ *   用于按来源地址查对端和按五元组查流，流表随流数增长而无整表重哈希的停顿
+ * - 路由查找用只读的16-8-8字典树，变更由后台线程批量重建后原子替换
+ *   （--route-file 加 SIGHUP 重新加载，--bench-route-storm）
+ * - 长前缀多时自动改用大页上的DIR-24-8表，查找1到2次访存（--fib、--bench-fib）
+ * - mmap回放pcap/pcapng抓包，驱动完整流水线并报告各阶段速率（--replay）
+ * - 飞行记录器：常开的环形缓冲保存最近的包头，SIGUSR1或丢包突增时写出pcapng（--recorder）
+ * - 弹性数据包缓冲池：按2MB大页整块增长，低负载时归还，跨线程释放批量回流（--bench-pool）
+ *
+ * 无root示例：
+ *   ./awenawtun --fake-tun 2000 --fake-peer 9999 --route 192.168.233.0/24=127.0.0.1:9999 \
+ *       --impair delay=20,jitter=5,loss=1,dup=0.5,reorder=2,rate=10,seed=1 --duration 10
+ * - 允许IP路由表：前缀可映射到一组出口对端（ECMP），按流哈希保持同一流走同一对端，
+ *   对端权重随健康状态和RTT变化，在每批数据包开始时统一生效
+ * - 流量镜像：按过滤条件把部分隧道流量复制到分析用TUN接口或UDP对端，
+ *   通过引用计数共享缓冲区（不拷贝），独立限速，由单独线程发送
  *
  * 【系统要求】
  * - Linux操作系统（内核支持TUN/TAP）
@@ -37,11 +150,16 @@
  * 3. 有root权限：sudo whoami
  *
  * 【编译方法】
- * gcc -o awenawtun awenawtun.c
+ * gcc -o awenawtun awenawtun.c -pthread
  *
  * 【使用方法】
- * 1. 编译程序：gcc -o awenawtun awenawtun.c
+ * 1. 编译程序：gcc -o awenawtun awenawtun.c -pthread
  * 2. 运行程序：sudo ./awenawtun
+ *    可选添加出口路由（可重复），发往该前缀的包经UDP转发到对端组：
+ *    sudo ./awenawtun --route 192.168.233.128/25=127.0.0.1:51821*2,127.0.0.1:51822
+ *    可选镜像流量到分析接口或UDP端点（过滤条件和速率可选）：
+ *    sudo ./awenawtun --mirror tun:awenawmirror --mirror-filter proto=6,port=80 --mirror-rate 500
+ *    sudo ./awenawtun --mirror udp:127.0.0.1:9999 --mirror-filter net=192.168.233.0/28
  * 3. 程序会自动配置网络接口和路由
  * 4. 在另一个终端测试：
  *    ping 192.168.233.2      # ICMP流量测试
@@ -196,80 +314,6195 @@ void parse_ip_packet(unsigned char* buffer, int length) {
            length);
 }
 
+/*
+ * 允许IP路由表与ECMP对端组
+ *
+ * 每条路由把一个IPv4前缀映射到一个对端组。组内用 ECMP_BUCKETS 个哈希桶
+ * 按权重分配给成员，包的五元组哈希决定桶，因此同一条流始终走同一个对端、
+ * 不会乱序。健康检查和RTT测量只更新对端的目标权重并打脏标记，
+ * 每批数据包开始时由 route_commit_weights 统一重算：只把超出配额或已失效
+ * 成员的桶挪给配额不足的成员，其余桶保持不动，现有流尽量不迁移。
+ */
+struct tun_peer {
+    struct sockaddr_in endpoint;  // 对端UDP地址
+    uint32_t base_weight;         // 配置权重
+    uint32_t weight;              // 生效权重（按健康状态和RTT调整）
+    uint32_t rtt_us;              // RTT平滑值（微秒），0表示未知
+    int healthy;
+    time_t unanswered_since;      // 最早一个尚未等到回包的发送时间，0表示无
+    time_t last_rx;               // 最近一次收到该对端的时间
+    uint64_t tx_packets;
+};
+
+struct peer_group {
+    uint16_t npeers;
+    uint16_t peers[MAX_GROUP_PEERS];  // 成员在 route_table.peers 中的下标
+    uint8_t buckets[ECMP_BUCKETS];    // 哈希桶 -> 组内成员序号
+};
+
+struct route_entry {
+    uint32_t prefix;              // 网络字节序
+    uint8_t prefix_len;
+    uint16_t group;               // 对端组下标
+};
+
+struct route_fib;
+
+struct route_table {
+    struct route_entry routes[MAX_ROUTES];   // 启动时配置的路由，按前缀长度降序排列
+    int nroutes;
+    struct route_fib *fib;        // 当前发布的查找结构，只经原子指针替换
+    struct peer_group groups[MAX_ROUTES];
+    int ngroups;
+    struct tun_peer peers[MAX_PEERS];
+    int npeers;
+    int weights_dirty;            // 有待生效的权重变化
+    int fib_mode;                 // FIB_AUTO / FIB_TRIE / FIB_DIR24
+};
+
+enum { FIB_AUTO, FIB_TRIE, FIB_DIR24 };
+
+static uint32_t prefix_mask(uint8_t len) {
+    return len == 0 ? 0 : htonl(0xffffffffu << (32 - len));
+}
+
+// 查找或添加对端（相同端点的对端在多个组之间共享）
+static int route_find_or_add_peer(struct route_table *table, const struct sockaddr_in *endpoint,
+                                  uint32_t weight) {
+    for (int i = 0; i < table->npeers; i++) {
+        if (table->peers[i].endpoint.sin_addr.s_addr == endpoint->sin_addr.s_addr &&
+            table->peers[i].endpoint.sin_port == endpoint->sin_port) {
+            return i;
+        }
+    }
+    if (table->npeers >= MAX_PEERS) return -1;
+
+    struct tun_peer *peer = &table->peers[table->npeers];
+    memset(peer, 0, sizeof(*peer));
+    peer->endpoint = *endpoint;
+    peer->base_weight = peer->weight = weight;
+    peer->healthy = 1;
+    return table->npeers++;
+}
+
 /**
- * 显示使用说明
+ * 按成员生效权重重新分配对端组的哈希桶，尽量保持已有桶不变
  */
-void show_usage() {
-    printf("\n=== awenawtun 使用说明 ===\n");
-    printf("1. 程序已创建 awenawtun 接口\n");
-    printf("2. 配置了IP地址: 192.168.233.1/24\n");
-    printf("3. 添加了路由: 192.168.233.0/24 -> awenawtun\n");
-    printf("\n测试方法:\n");
-    printf("  ping 192.168.233.2    # 会被awenawtun捕获\n");
-    printf("  ping 192.168.233.100  # 会被awenawtun捕获\n");
-    printf("  curl 192.168.233.50   # 会被awenawtun捕获\n");
-    printf("\n按 Ctrl+C 退出程序\n");
-    printf("========================\n\n");
+static void peer_group_rebalance(struct route_table *table, struct peer_group *group) {
+    int quota[MAX_GROUP_PEERS], have[MAX_GROUP_PEERS] = {0};
+    uint64_t remainder[MAX_GROUP_PEERS];
+    uint64_t total = 0;
+
+    for (int i = 0; i < group->npeers; i++) total += table->peers[group->peers[i]].weight;
+    if (total == 0) return;  // 全部失效时保持原分配，总比丢包好
+
+    // 最大余数法计算每个成员应得的桶数：先取整数部分，
+    // 剩下的桶（少于成员数）依次给余数最大的成员，余数相同时下标小的优先
+    int assigned = 0;
+    for (int i = 0; i < group->npeers; i++) {
+        uint64_t share = (uint64_t)ECMP_BUCKETS * table->peers[group->peers[i]].weight;
+        quota[i] = (int)(share / total);
+        remainder[i] = share % total;
+        assigned += quota[i];
+    }
+    while (assigned < ECMP_BUCKETS) {
+        int best = 0;
+        for (int i = 1; i < group->npeers; i++) {
+            if (remainder[i] > remainder[best]) best = i;
+        }
+        quota[best]++;
+        remainder[best] = 0;
+        assigned++;
+    }
+
+    // 保留配额内的桶，其余桶释放
+    int free_buckets[ECMP_BUCKETS], nfree = 0;
+    for (int b = 0; b < ECMP_BUCKETS; b++) {
+        int member = group->buckets[b];
+        if (member < group->npeers && have[member] < quota[member]) {
+            have[member]++;
+        } else {
+            free_buckets[nfree++] = b;
+        }
+    }
+    // 释放的桶分给配额不足的成员
+    for (int i = 0, f = 0; i < group->npeers; i++) {
+        while (have[i] < quota[i] && f < nfree) {
+            group->buckets[free_buckets[f++]] = i;
+            have[i]++;
+        }
+    }
 }
 
-int main() {
-    int tun_fd;
-    char tun_name[IFNAMSIZ] = "awenawtun";  // 设定TUN设备名称
-    unsigned char buffer[2000];           // 数据包缓冲区
-    int nread;
-    
-    printf("正在创建 awenawtun 接口...\n");
-    
-    // 1. 创建TUN设备
-    tun_fd = tun_alloc(tun_name);
-    if (tun_fd < 0) {
-        perror("创建TUN接口失败");
-        exit(1);
+/**
+ * 解析一条路由，格式：前缀/长度=端点[*权重],端点[*权重]...
+ * 成员完全相同的对端组只建一个，重新加载路由时不会耗尽组
+ * @param entry 输出的路由条目
+ * @return 成功返回0
+ */
+static int route_parse_spec(struct route_table *table, const char *spec, struct route_entry *entry) {
+    char buf[512], *targets, *save = NULL;
+    struct in_addr addr;
+    int len;
+
+    if (table->ngroups >= MAX_ROUTES) return -1;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    targets = strchr(buf, '=');
+    char *slash = strchr(buf, '/');
+    if (!targets || !slash || slash > targets) return -1;
+    *targets++ = '\0';
+    *slash = '\0';
+    len = atoi(slash + 1);
+    if (inet_pton(AF_INET, buf, &addr) != 1 || len < 0 || len > 32) return -1;
+
+    struct peer_group *group = &table->groups[table->ngroups];
+    memset(group, 0, sizeof(*group));
+    for (char *tok = strtok_r(targets, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct sockaddr_in endpoint = { .sin_family = AF_INET };
+        uint32_t weight = 1;
+        char *star = strchr(tok, '*');
+        char *colon = strchr(tok, ':');
+        if (star) {
+            *star = '\0';
+            weight = (uint32_t)atoi(star + 1);
+        }
+        if (!colon || group->npeers >= MAX_GROUP_PEERS) return -1;
+        *colon = '\0';
+        if (inet_pton(AF_INET, tok, &endpoint.sin_addr) != 1) return -1;
+        endpoint.sin_port = htons(atoi(colon + 1));
+
+        int peer = route_find_or_add_peer(table, &endpoint, weight);
+        if (peer < 0) return -1;
+        group->peers[group->npeers++] = peer;
     }
-    printf("✓ TUN接口 %s 创建成功\n", tun_name);
-    
-    // 2. 配置TUN接口IP地址和路由
-    if (configure_tun_interface(tun_name, "192.168.233.1/24", "192.168.233.0/24") < 0) {
-        printf("配置TUN接口失败\n");
-        close(tun_fd);
-        exit(1);
+    if (group->npeers == 0) return -1;
+
+    entry->prefix_len = len;
+    entry->prefix = addr.s_addr & prefix_mask(len);
+    for (int g = 0; g < table->ngroups; g++) {
+        if (table->groups[g].npeers == group->npeers &&
+            memcmp(table->groups[g].peers, group->peers, group->npeers * sizeof(group->peers[0])) == 0) {
+            entry->group = g;
+            return 0;
+        }
     }
-    
-    // 3. 显示使用说明
-    show_usage();
-    
-    // 4. 主循环：捕获并处理数据包
-    printf("开始监听 192.168.233.x 网段的流量...\n\n");
-    
-    while (1) {
-        // 从TUN接口读取IP数据包
-        nread = read(tun_fd, buffer, sizeof(buffer));
-        
-        if (nread < 0) {
-            perror("读取TUN接口数据失败");
-            break;
+    for (int b = 0; b < ECMP_BUCKETS; b++) group->buckets[b] = b % group->npeers;
+    peer_group_rebalance(table, group);
+    entry->group = table->ngroups++;
+    return 0;
+}
+
+// 插入排序，保持前缀长度降序，第一个匹配即最长前缀
+static void route_insert_sorted(struct route_entry *routes, int *n, const struct route_entry *entry) {
+    int pos = (*n)++;
+    while (pos > 0 && routes[pos - 1].prefix_len < entry->prefix_len) {
+        routes[pos] = routes[pos - 1];
+        pos--;
+    }
+    routes[pos] = *entry;
+}
+
+/**
+ * 添加一条路由，格式：前缀/长度=端点[*权重],端点[*权重]...
+ * 例如：10.8.0.0/16=127.0.0.1:51821*2,127.0.0.1:51822
+ * @return 成功返回0
+ */
+int route_add_spec(struct route_table *table, const char *spec) {
+    struct route_entry entry;
+
+    if (table->nroutes >= MAX_ROUTES || route_parse_spec(table, spec, &entry) < 0) return -1;
+    route_insert_sorted(table->routes, &table->nroutes, &entry);
+    return 0;
+}
+
+/**
+ * 健康检查结果：不健康的对端权重降为0
+ */
+void route_set_peer_health(struct route_table *table, int peer, int healthy) {
+    if (table->peers[peer].healthy != healthy) {
+        table->peers[peer].healthy = healthy;
+        table->weights_dirty = 1;
+    }
+}
+
+/**
+ * RTT测量结果，平滑后按RTT反比调整权重
+ * 样本来自经该对端往返的TCP握手（SYN → SYN-ACK，见 flow_table_update）
+ */
+void route_observe_peer_rtt(struct route_table *table, int peer, uint32_t rtt_us) {
+    struct tun_peer *p = &table->peers[peer];
+    if (p->rtt_us == 0) {
+        p->rtt_us = rtt_us;
+    } else {
+        p->rtt_us += ((int32_t)rtt_us - (int32_t)p->rtt_us) >> RTT_EWMA_SHIFT;
+    }
+    table->weights_dirty = 1;
+}
+
+/**
+ * 每批开始时调用：检测无回包的对端，重算生效权重并重新分配哈希桶
+ */
+void route_commit_weights(struct route_table *table, time_t now) {
+    uint32_t min_rtt = 0;
+
+    for (int i = 0; i < table->npeers; i++) {
+        struct tun_peer *p = &table->peers[i];
+        // 发出包后长时间没有任何回包（WireGuard对端至少会回心跳），认为对端不可达
+        if (p->healthy && p->unanswered_since && now - p->unanswered_since > PEER_DEAD_SECONDS) {
+            route_set_peer_health(table, i, 0);
         }
-        
-        printf("\n--- 收到数据包 ---\n");
-        parse_ip_packet(buffer, nread);
-        
-        // 这里可以添加数据包处理逻辑
-        // 例如：转发到真实网络、加密处理、记录日志等
-        
-        // 简单回显数据包（仅用于演示ICMP ping的响应）
-        if (write(tun_fd, buffer, nread) < 0) {
-            perror("写入TUN接口失败");
+        if (p->rtt_us && (min_rtt == 0 || p->rtt_us < min_rtt)) min_rtt = p->rtt_us;
+    }
+    if (!table->weights_dirty) return;
+    table->weights_dirty = 0;
+
+    for (int i = 0; i < table->npeers; i++) {
+        struct tun_peer *p = &table->peers[i];
+        if (!p->healthy) {
+            p->weight = 0;
+        } else if (p->rtt_us && min_rtt) {
+            // 权重与RTT成反比，最快的对端保持配置权重，至少保留1
+            uint64_t w = (uint64_t)p->base_weight * 16 * min_rtt / p->rtt_us;
+            p->weight = w > 0 ? (uint32_t)w : 1;
         } else {
-            printf("数据包已回显\n");
+            p->weight = p->base_weight * 16;
         }
     }
-    
-    // 清理资源
-    printf("\n正在清理资源...\n");
+    for (int g = 0; g < table->ngroups; g++) {
+        peer_group_rebalance(table, &table->groups[g]);
+    }
+}
+
+/**
+ * 计算IPv4包的五元组哈希（非TCP/UDP或分片包只用地址和协议）
+ */
+static uint32_t flow_hash(const unsigned char *buffer, int length) {
+    const struct iphdr *ip = (const struct iphdr*)buffer;
+    uint32_t h = ip->saddr * 0x9e3779b1u ^ ip->daddr * 0x85ebca6bu ^ ip->protocol;
+    int ihl = ip->ihl * 4;
+
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+        !(ntohs(ip->frag_off) & 0x1fff) && length >= ihl + 4) {
+        uint32_t ports;
+        memcpy(&ports, buffer + ihl, 4);
+        h ^= ports * 0xc2b2ae35u;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+}
+
+static inline int route_fib_lookup(const struct route_fib *fib, uint32_t addr);
+
+/**
+ * 为TUN读出的包选择出口对端（调用线程须处于QSBR在线状态）
+ * @return 对端下标，没有匹配路由返回-1
+ */
+int route_select_peer(struct route_table *table, const unsigned char *buffer, int length) {
+    const struct iphdr *ip = (const struct iphdr*)buffer;
+
+    if (length < (int)sizeof(struct iphdr) || ip->version != 4) return -1;
+    const struct route_fib *fib = __atomic_load_n(&table->fib, __ATOMIC_ACQUIRE);
+    int g = fib ? route_fib_lookup(fib, ntohl(ip->daddr)) : -1;
+    if (g < 0) return -1;
+    const struct peer_group *group = &table->groups[g];
+    uint32_t bucket = flow_hash(buffer, length) % ECMP_BUCKETS;
+    return group->peers[group->buckets[bucket]];
+}
+
+/*
+ * 按子系统的内存记账
+ *
+ * 每个线程第一次分配时登记一块自己的计数器（挂在只增不减的全局链表上，
+ * 线程退出后保留），之后只修改自己的计数器：单写者，普通加减后用relaxed存储发布，
+ * 没有原子读改写，也不共享缓存行。读取方把所有线程的计数相加，
+ * 某线程释放另一线程分配的内存时其计数可以为负，总和仍然正确。
+ * 动态分配带16字节头部记录大小和子系统；嵌入在静态结构体中的数组用 mem_account 登记。
+ */
+enum {
+    MEM_PEERS = 0,                // 对端、路由和出口队列
+    MEM_FLOWS,                    // 流表
+    MEM_POOLS,                    // 数据包缓冲池
+    MEM_CAPTURE,                  // 镜像/抓包环
+    MEM_PATTERNS,                 // 载荷匹配
+    MEM_IMPAIR,                   // 链路损伤模拟
+    MEM_ROUTES,                   // 路由查找结构（FIB）和路由库
+    MEM_SUBSYS_COUNT,
+};
+
+static const char *mem_subsys_names[MEM_SUBSYS_COUNT] = {
+    "peers", "flows", "pools", "capture", "patterns", "impair", "routes",
+};
+
+struct mem_counters {
+    struct mem_counters *next;
+    int64_t bytes[MEM_SUBSYS_COUNT];
+    int64_t allocs[MEM_SUBSYS_COUNT];
+} __attribute__((aligned(64)));
+
+struct mem_header {
+    uint64_t size;
+    uint32_t subsys;
+    uint32_t magic;
+};
+
+static struct mem_counters *mem_all_threads;
+static __thread struct mem_counters *mem_self;
+
+static struct mem_counters *mem_counters_self(void) {
+    if (!mem_self) {
+        struct mem_counters *c = aligned_alloc(64, sizeof(*c));
+        if (!c) abort();
+        memset(c, 0, sizeof(*c));
+        c->next = __atomic_load_n(&mem_all_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&mem_all_threads, &c->next, c, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        mem_self = c;
+    }
+    return mem_self;
+}
+
+/**
+ * 登记内存变化（bytes可为负），allocs为分配次数变化
+ */
+static inline void mem_account(int subsys, int64_t bytes, int allocs) {
+    struct mem_counters *c = mem_counters_self();
+    __atomic_store_n(&c->bytes[subsys], c->bytes[subsys] + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->allocs[subsys], c->allocs[subsys] + allocs, __ATOMIC_RELAXED);
+}
+
+static void *mem_alloc(int subsys, size_t size, int zero) {
+    struct mem_header *h = zero ? calloc(1, sizeof(*h) + size) : malloc(sizeof(*h) + size);
+    if (!h) return NULL;
+    h->size = size;
+    h->subsys = subsys;
+    h->magic = MEM_HEADER_MAGIC;
+    mem_account(subsys, size, 1);
+    return h + 1;
+}
+
+static void mem_free(void *ptr) {
+    if (!ptr) return;
+    struct mem_header *h = (struct mem_header*)ptr - 1;
+    if (h->magic != MEM_HEADER_MAGIC) abort();  // 不是 mem_alloc 分配的
+    mem_account(h->subsys, -(int64_t)h->size, -1);
+    h->magic = 0;
+    free(h);
+}
+
+static void *mem_realloc(int subsys, void *ptr, size_t size) {
+    if (!ptr) return mem_alloc(subsys, size, 0);
+    struct mem_header *old = (struct mem_header*)ptr - 1;
+    uint64_t old_size = old->size;
+    struct mem_header *h = realloc(old, sizeof(*h) + size);
+    if (!h) return NULL;
+    h->size = size;
+    mem_account(h->subsys, (int64_t)size - (int64_t)old_size, 0);
+    return h + 1;
+}
+
+/**
+ * 汇总所有线程的计数
+ */
+void mem_snapshot(int64_t bytes[MEM_SUBSYS_COUNT], int64_t allocs[MEM_SUBSYS_COUNT]) {
+    memset(bytes, 0, MEM_SUBSYS_COUNT * sizeof(int64_t));
+    if (allocs) memset(allocs, 0, MEM_SUBSYS_COUNT * sizeof(int64_t));
+    for (struct mem_counters *c = __atomic_load_n(&mem_all_threads, __ATOMIC_ACQUIRE); c; c = c->next) {
+        for (int i = 0; i < MEM_SUBSYS_COUNT; i++) {
+            bytes[i] += __atomic_load_n(&c->bytes[i], __ATOMIC_RELAXED);
+            if (allocs) allocs[i] += __atomic_load_n(&c->allocs[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * 以文本形式输出内存记账，返回写入的字节数
+ */
+int mem_format(char *out, size_t size) {
+    int64_t bytes[MEM_SUBSYS_COUNT], allocs[MEM_SUBSYS_COUNT], total = 0;
+    int n = 0;
+
+    mem_snapshot(bytes, allocs);
+    for (int i = 0; i < MEM_SUBSYS_COUNT && n < (int)size; i++) {
+        n += snprintf(out + n, size - n, "memory.%s.bytes %ld\nmemory.%s.allocations %ld\n",
+                      mem_subsys_names[i], bytes[i], mem_subsys_names[i], allocs[i]);
+        total += bytes[i];
+    }
+    if (n < (int)size) n += snprintf(out + n, size - n, "memory.total.bytes %ld\n", total);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/*
+ * 静止状态回收（QSBR）
+ *
+ * 无锁读的结构（路由表、并发哈希表等）替换节点后不能马上释放旧节点，读者可能还拿着指针。
+ * 读者线程在两批之间、不持有任何共享指针时调用 qsbr_quiescent 宣告经过了静止点，
+ * 阻塞等待前调用 qsbr_offline，离线期间不会拖住回收。写者用 qsbr_retire 挂起旧节点，
+ * 等所有在线线程都在挂起之后经过静止点，再调用节点的释放函数。
+ * 读路径本身没有任何开销，每批只多一次acquire读和一次release写。
+ *
+ * 纪元：每次挂起把全局纪元加1并记在节点上；线程在静止点记下当时的全局纪元。
+ * 所有在线线程记下的纪元都不小于节点的纪元时，节点已对所有读者不可见。
+ */
+struct qsbr_node {
+    struct qsbr_node *next;
+    uint64_t epoch;               // 挂起时的全局纪元
+    void (*free_fn)(struct qsbr_node *node);
+};
+
+struct qsbr_thread {
+    struct qsbr_thread *next;     // 域内线程链表（只增不减，记录由调用方提供）
+    struct qsbr *domain;
+    uint64_t seen;                // 最近一次静止点时的全局纪元，0表示离线
+    struct qsbr_node *limbo_head, *limbo_tail;  // 待回收节点，纪元递增
+    int limbo_count;
+    uint64_t retired, reclaimed;
+} __attribute__((aligned(64)));
+
+struct qsbr {
+    uint64_t epoch;
+    struct qsbr_thread *threads;
+};
+
+void qsbr_init(struct qsbr *d) {
+    d->epoch = 1;
+    d->threads = NULL;
+}
+
+/**
+ * 登记线程，登记后处于离线状态；读共享结构前先 qsbr_online
+ */
+void qsbr_register(struct qsbr *d, struct qsbr_thread *t) {
+    memset(t, 0, sizeof(*t));
+    t->domain = d;
+    t->next = __atomic_load_n(&d->threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&d->threads, &t->next, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline void qsbr_online(struct qsbr_thread *t) {
+    // 顺序一致：回收方要么看到本线程在线，要么本线程之后读到的都是已替换后的指针
+    __atomic_store_n(&t->seen, __atomic_load_n(&t->domain->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void qsbr_offline(struct qsbr_thread *t) {
+    __atomic_store_n(&t->seen, 0, __ATOMIC_RELEASE);
+}
+
+// 所有在线线程记下的最小纪元，没有在线线程时为UINT64_MAX
+static uint64_t qsbr_min_seen(struct qsbr *d) {
+    uint64_t min = UINT64_MAX;
+    for (struct qsbr_thread *t = __atomic_load_n(&d->threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        uint64_t seen = __atomic_load_n(&t->seen, __ATOMIC_SEQ_CST);
+        if (seen && seen < min) min = seen;
+    }
+    return min;
+}
+
+/**
+ * 释放本线程挂起的、已经没有读者的节点
+ * @return 释放的节点数
+ */
+int qsbr_reclaim(struct qsbr_thread *t) {
+    if (!t->limbo_head) return 0;
+    uint64_t safe = qsbr_min_seen(t->domain);
+    int n = 0;
+    while (t->limbo_head && t->limbo_head->epoch <= safe) {
+        struct qsbr_node *node = t->limbo_head;
+        t->limbo_head = node->next;
+        node->free_fn(node);
+        n++;
+    }
+    if (!t->limbo_head) t->limbo_tail = NULL;
+    t->limbo_count -= n;
+    t->reclaimed += n;
+    return n;
+}
+
+/**
+ * 读者线程每批调用一次：此时不能再持有之前读到的任何共享指针
+ */
+static inline void qsbr_quiescent(struct qsbr_thread *t) {
+    __atomic_store_n(&t->seen, __atomic_load_n(&t->domain->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    if (t->limbo_head) qsbr_reclaim(t);
+}
+
+/**
+ * 挂起一个已从共享结构中摘除的节点，稍后在本线程上调用 free_fn
+ */
+void qsbr_retire(struct qsbr_thread *t, struct qsbr_node *node, void (*free_fn)(struct qsbr_node *node)) {
+    node->free_fn = free_fn;
+    node->next = NULL;
+    node->epoch = __atomic_add_fetch(&t->domain->epoch, 1, __ATOMIC_SEQ_CST);
+    if (t->limbo_tail) t->limbo_tail->next = node;
+    else t->limbo_head = node;
+    t->limbo_tail = node;
+    t->limbo_count++;
+    t->retired++;
+    if (t->limbo_count >= QSBR_RECLAIM_THRESHOLD) qsbr_reclaim(t);
+}
+
+/**
+ * 等到本线程挂起的节点全部释放（调用方应处于离线状态，例如线程退出或后台写者）
+ */
+void qsbr_barrier(struct qsbr_thread *t) {
+    struct timespec wait = { 0, 100000 };
+    qsbr_offline(t);
+    while (t->limbo_head) {
+        if (!qsbr_reclaim(t)) nanosleep(&wait, NULL);
+    }
+}
+
+/*
+ * 数据包缓冲池
+ *
+ * 缓冲区带引用计数，镜像等旁路阶段只增加引用而不拷贝数据。
+ * 内存按2MB整块映射（优先用大页），每块有自己的空闲链表，分配总是取编号最小的
+ * 有空闲的块，使负载集中在前面的块上，后面的块在低负载时能完全空出来。
+ * 空闲耗尽或低于1/8块时增加一块；整个观察窗口内空闲都多于一块时归还最后一块。
+ *
+ * 分配和块的增减只在属主线程（数据路径）进行。属主线程释放的缓冲区直接回到所在块；
+ * 其他线程（如镜像线程）先放进线程本地缓存，攒够一批后一次CAS挂到归还栈，
+ * 属主线程每批取回一次，缓冲区就这样在线程之间回流。
+ */
+struct pkt_buf {
+    struct pkt_buf *next;         // 空闲链表/归还栈/出口队列链接
+    uint32_t refcnt;              // 引用计数（原子操作）
+    int len;                      // 数据长度
+    uint64_t queued_ns;           // 进入出口队列的时间，用于统计排队时延
+    uint32_t chunk;               // 所在块编号
+    unsigned char data[BUFFER_SIZE];
+};
+
+#define PKT_CHUNK_BUFS ((int)(PKT_CHUNK_BYTES / sizeof(struct pkt_buf)))
+
+struct pkt_chunk {
+    struct pkt_buf *bufs;         // NULL表示未映射
+    struct pkt_buf *free_list;
+    int nfree;
+    int hugepage;                 // 是否拿到了显式大页
+};
+
+struct pkt_pool {
+    struct pkt_chunk chunks[PKT_POOL_MAX_CHUNKS];
+    int nchunks;                  // 已映射的块都在 [0, nchunks)
+    int min_chunks, max_chunks;
+    int first_free;               // 可能有空闲的最小块编号
+    int nfree;                    // 各块空闲数之和（不含归还栈）
+    const void *owner;            // 属主线程标识
+    struct pkt_buf *returned;     // 其他线程归还的缓冲区（无锁栈）
+
+    // 收缩判断：观察窗口内的空闲低水位
+    int low_water;
+    uint64_t window_start_ns;
+
+    uint64_t grown, shrunk, exhausted;
+};
+
+// 线程本地变量的地址在各线程中不同，用作线程标识
+static __thread char pkt_thread_token;
+
+// 非属主线程的归还缓存
+static __thread struct {
+    struct pkt_pool *pool;
+    struct pkt_buf *head, *tail;
+    int count;
+} pkt_return_cache;
+
+static int pkt_pool_grow(struct pkt_pool *pool) {
+    if (pool->nchunks >= pool->max_chunks) return -1;
+    struct pkt_chunk *c = &pool->chunks[pool->nchunks];
+    c->hugepage = 1;
+    c->bufs = mmap(NULL, PKT_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (c->bufs == MAP_FAILED) {
+        // 没有预留大页时退回普通映射，让透明大页尽量合并
+        c->hugepage = 0;
+        c->bufs = mmap(NULL, PKT_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (c->bufs == MAP_FAILED) {
+            c->bufs = NULL;
+            return -1;
+        }
+        madvise(c->bufs, PKT_CHUNK_BYTES, MADV_HUGEPAGE);
+    }
+    c->free_list = NULL;
+    for (int i = PKT_CHUNK_BUFS - 1; i >= 0; i--) {
+        c->bufs[i].chunk = pool->nchunks;
+        c->bufs[i].next = c->free_list;
+        c->free_list = &c->bufs[i];
+    }
+    c->nfree = PKT_CHUNK_BUFS;
+    pool->nfree += PKT_CHUNK_BUFS;
+    pool->nchunks++;
+    pool->grown++;
+    mem_account(MEM_POOLS, PKT_CHUNK_BYTES, 1);
+    return 0;
+}
+
+// 只归还最后一块，且必须整块空闲
+static int pkt_pool_shrink(struct pkt_pool *pool) {
+    struct pkt_chunk *c = &pool->chunks[pool->nchunks - 1];
+    if (pool->nchunks <= pool->min_chunks || c->nfree != PKT_CHUNK_BUFS) return -1;
+    munmap(c->bufs, PKT_CHUNK_BYTES);
+    pool->nfree -= PKT_CHUNK_BUFS;
+    memset(c, 0, sizeof(*c));
+    pool->nchunks--;
+    pool->shrunk++;
+    mem_account(MEM_POOLS, -(int64_t)PKT_CHUNK_BYTES, -1);
+    return 0;
+}
+
+/**
+ * @param min_size 常驻缓冲区数，不会收缩到它以下
+ * @param max_size 增长上限
+ */
+int pkt_pool_init(struct pkt_pool *pool, int min_size, int max_size) {
+    memset(pool, 0, sizeof(*pool));
+    pool->min_chunks = (min_size + PKT_CHUNK_BUFS - 1) / PKT_CHUNK_BUFS;
+    pool->max_chunks = (max_size + PKT_CHUNK_BUFS - 1) / PKT_CHUNK_BUFS;
+    if (pool->min_chunks < 1) pool->min_chunks = 1;
+    if (pool->max_chunks > PKT_POOL_MAX_CHUNKS) pool->max_chunks = PKT_POOL_MAX_CHUNKS;
+    if (pool->max_chunks < pool->min_chunks) pool->max_chunks = pool->min_chunks;
+    pool->owner = &pkt_thread_token;
+    for (int i = 0; i < pool->min_chunks; i++) {
+        if (pkt_pool_grow(pool) < 0) return -1;
+    }
+    pool->grown = 0;
+    pool->low_water = pool->nfree;
+    return 0;
+}
+
+void pkt_pool_free(struct pkt_pool *pool) {
+    for (int i = 0; i < pool->nchunks; i++) {
+        munmap(pool->chunks[i].bufs, PKT_CHUNK_BYTES);
+        mem_account(MEM_POOLS, -(int64_t)PKT_CHUNK_BYTES, -1);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+static inline int pkt_pool_capacity(const struct pkt_pool *pool) {
+    return pool->nchunks * PKT_CHUNK_BUFS;
+}
+
+static inline void pkt_chunk_put(struct pkt_pool *pool, struct pkt_buf *buf) {
+    struct pkt_chunk *c = &pool->chunks[buf->chunk];
+    buf->next = c->free_list;
+    c->free_list = buf;
+    c->nfree++;
+    pool->nfree++;
+    if ((int)buf->chunk < pool->first_free) pool->first_free = buf->chunk;
+}
+
+// 取回其他线程归还的缓冲区（属主线程）
+static void pkt_pool_reclaim(struct pkt_pool *pool) {
+    struct pkt_buf *buf = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+    while (buf) {
+        struct pkt_buf *next = buf->next;
+        pkt_chunk_put(pool, buf);
+        buf = next;
+    }
+}
+
+// 取一个缓冲区，引用计数为1；已到增长上限且耗尽时返回NULL（仅属主线程）
+static struct pkt_buf *pkt_pool_get(struct pkt_pool *pool) {
+    if (pool->nfree == 0) {
+        pkt_pool_reclaim(pool);
+        if (pool->nfree == 0 && pkt_pool_grow(pool) < 0) {
+            pool->exhausted++;
+            return NULL;
+        }
+    }
+    while (pool->chunks[pool->first_free].nfree == 0) pool->first_free++;
+    struct pkt_chunk *c = &pool->chunks[pool->first_free];
+    struct pkt_buf *buf = c->free_list;
+    c->free_list = buf->next;
+    c->nfree--;
+    pool->nfree--;
+    if (pool->nfree < pool->low_water) pool->low_water = pool->nfree;
+    buf->refcnt = 1;
+    buf->len = 0;
+    return buf;
+}
+
+static inline void pkt_buf_ref(struct pkt_buf *buf) {
+    __atomic_fetch_add(&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+// 把本线程缓存的缓冲区一次性挂到归还栈（非属主线程空闲或退出前调用）
+static void pkt_pool_flush_thread(void) {
+    struct pkt_pool *pool = pkt_return_cache.pool;
+    if (!pool || !pkt_return_cache.count) return;
+    pkt_return_cache.tail->next = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->returned, &pkt_return_cache.tail->next, pkt_return_cache.head, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    pkt_return_cache.head = pkt_return_cache.tail = NULL;
+    pkt_return_cache.count = 0;
+}
+
+// 释放一个引用，最后一个引用释放时归还缓冲池（任意线程可调用）
+static void pkt_buf_unref(struct pkt_pool *pool, struct pkt_buf *buf) {
+    if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    if (pool->owner == &pkt_thread_token) {
+        pkt_chunk_put(pool, buf);
+        return;
+    }
+    if (pkt_return_cache.pool != pool) {
+        pkt_pool_flush_thread();
+        pkt_return_cache.pool = pool;
+    }
+    buf->next = pkt_return_cache.head;
+    pkt_return_cache.head = buf;
+    if (!pkt_return_cache.tail) pkt_return_cache.tail = buf;
+    if (++pkt_return_cache.count >= PKT_RETURN_BATCH) pkt_pool_flush_thread();
+}
+
+/**
+ * 属主线程每批调用一次：取回其他线程归还的缓冲区，按压力增减块
+ */
+void pkt_pool_maintain(struct pkt_pool *pool, uint64_t now_ns) {
+    pkt_pool_reclaim(pool);
+    if (!pool->window_start_ns) pool->window_start_ns = now_ns;
+    if (pool->nfree < PKT_CHUNK_BUFS / 8) pkt_pool_grow(pool);  // 提前增长，避免在取包时才映射
+    if (pool->nfree < pool->low_water) pool->low_water = pool->nfree;
+    if (now_ns - pool->window_start_ns < PKT_POOL_SHRINK_NS) return;
+    // 整个窗口里都用不到的块可以一次归还多块，但始终留1/4块余量
+    while (pool->low_water >= PKT_CHUNK_BUFS + PKT_CHUNK_BUFS / 4 && pkt_pool_shrink(pool) == 0)
+        pool->low_water -= PKT_CHUNK_BUFS;
+    pool->low_water = pool->nfree;
+    pool->window_start_ns = now_ns;
+}
+
+/*
+ * 流量镜像
+ *
+ * 数据路径对每个包只做过滤匹配和令牌桶判断，命中后增加缓冲区引用并放入
+ * 单生产者/单消费者环形队列；镜像线程负责写分析TUN或发UDP，然后释放引用。
+ * 队列满或超过速率时直接丢弃镜像副本，主路径永远不会等待镜像。
+ */
+struct mirror_filter {
+    uint8_t protocol;             // 0表示任意协议
+    uint32_t net;                 // 源或目的地址匹配的网段（网络字节序）
+    uint32_t mask;                // 0表示任意地址
+    uint16_t port;                // 源或目的端口，0表示任意
+};
+
+struct mirror {
+    int fd;                       // 镜像目标：分析TUN或UDP socket
+    int is_tun;
+    struct sockaddr_in dest;      // UDP目标地址
+    struct mirror_filter filter;
+    struct pkt_pool *pool;
+
+    // 令牌桶（仅数据路径线程访问）
+    double tokens;
+    double rate;                  // 包/秒
+    double burst;
+    uint64_t last_refill_ns;
+
+    // SPSC环形队列
+    struct pkt_buf *ring[MIRROR_RING_SIZE];
+    uint32_t head;                // 消费者（镜像线程）位置
+    uint32_t tail;                // 生产者（数据路径）位置
+    int stopping;
+    pthread_t thread;
+
+    uint64_t mirrored;            // 已镜像包数
+    uint64_t dropped_rate;        // 超过速率丢弃的镜像副本
+    uint64_t dropped_full;        // 队列满丢弃的镜像副本
+};
+
+static int mirror_filter_match(const struct mirror_filter *f, const unsigned char *data, int len) {
+    const struct iphdr *ip = (const struct iphdr*)data;
+
+    if (len < (int)sizeof(struct iphdr) || ip->version != 4) return 0;
+    if (f->protocol && ip->protocol != f->protocol) return 0;
+    if (f->mask && (ip->saddr & f->mask) != f->net && (ip->daddr & f->mask) != f->net) return 0;
+    if (f->port) {
+        int ihl = ip->ihl * 4;
+        uint16_t ports[2];
+        if ((ip->protocol != IPPROTO_TCP && ip->protocol != IPPROTO_UDP) || len < ihl + 4) return 0;
+        memcpy(ports, data + ihl, 4);
+        if (ntohs(ports[0]) != f->port && ntohs(ports[1]) != f->port) return 0;
+    }
+    return 1;
+}
+
+static void *mirror_thread(void *arg) {
+    struct mirror *m = arg;
+    struct timespec idle = { 0, 200000 };  // 队列为空时休眠200微秒
+
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&m->tail, __ATOMIC_ACQUIRE);
+        if (m->head == tail) {
+            pkt_pool_flush_thread();  // 空闲时把攒下的缓冲区还给数据路径
+            if (__atomic_load_n(&m->stopping, __ATOMIC_RELAXED)) break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        while (m->head != tail) {
+            struct pkt_buf *buf = m->ring[m->head % MIRROR_RING_SIZE];
+            if (m->is_tun) {
+                if (write(m->fd, buf->data, buf->len) < 0) { /* 分析接口未启用时忽略 */ }
+            } else {
+                sendto(m->fd, buf->data, buf->len, 0, (struct sockaddr*)&m->dest, sizeof(m->dest));
+            }
+            pkt_buf_unref(m->pool, buf);
+            __atomic_store_n(&m->head, m->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 解析镜像过滤条件，格式：proto=6,net=192.168.233.0/24,port=80（各项可选）
+ */
+int mirror_parse_filter(struct mirror_filter *f, const char *spec) {
+    char buf[256], *save = NULL;
+
+    memset(f, 0, sizeof(*f));
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (strncmp(tok, "proto=", 6) == 0) {
+            f->protocol = (uint8_t)atoi(tok + 6);
+        } else if (strncmp(tok, "port=", 5) == 0) {
+            f->port = (uint16_t)atoi(tok + 5);
+        } else if (strncmp(tok, "net=", 4) == 0) {
+            char *slash = strchr(tok, '/');
+            struct in_addr addr;
+            int len = slash ? atoi(slash + 1) : 32;
+            if (slash) *slash = '\0';
+            if (inet_pton(AF_INET, tok + 4, &addr) != 1 || len < 0 || len > 32) return -1;
+            f->mask = prefix_mask(len);
+            f->net = addr.s_addr & f->mask;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 创建镜像阶段
+ * @param target "tun:接口名" 或 "udp:IP:端口"
+ * @param pps 镜像速率上限（包/秒）
+ * @return 成功返回0
+ */
+int mirror_start(struct mirror *m, struct pkt_pool *pool, const char *target, double pps) {
+    m->pool = pool;
+    m->rate = pps;
+    m->burst = pps / 10 > 32 ? pps / 10 : 32;
+    m->tokens = m->burst;
+
+    if (strncmp(target, "tun:", 4) == 0) {
+        char name[IFNAMSIZ], cmd[128];
+        snprintf(name, sizeof(name), "%s", target + 4);
+        m->fd = tun_alloc(name);
+        if (m->fd < 0) return -1;
+        snprintf(cmd, sizeof(cmd), "ip link set %s up", name);
+        if (system(cmd) != 0) printf("⚠ 启用镜像接口 %s 失败\n", name);
+        m->is_tun = 1;
+        printf("✓ 镜像到分析接口 %s\n", name);
+    } else if (strncmp(target, "udp:", 4) == 0) {
+        char host[64];
+        snprintf(host, sizeof(host), "%s", target + 4);
+        char *colon = strrchr(host, ':');
+        if (!colon) return -1;
+        *colon = '\0';
+        m->dest.sin_family = AF_INET;
+        m->dest.sin_port = htons(atoi(colon + 1));
+        if (inet_pton(AF_INET, host, &m->dest.sin_addr) != 1) return -1;
+        m->fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (m->fd < 0) return -1;
+        printf("✓ 镜像到 %s:%d\n", host, ntohs(m->dest.sin_port));
+    } else {
+        return -1;
+    }
+
+    if (pthread_create(&m->thread, NULL, mirror_thread, m) != 0) {
+        close(m->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * 数据路径调用：满足过滤和速率条件时把缓冲区引用交给镜像线程
+ */
+static void mirror_offer(struct mirror *m, struct pkt_buf *buf) {
+    if (!mirror_filter_match(&m->filter, buf->data, buf->len)) return;
+
+    // 令牌桶限速，使用粗粒度时钟（vDSO，无系统调用）
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    m->tokens += (now - m->last_refill_ns) * m->rate / 1e9;
+    if (m->tokens > m->burst) m->tokens = m->burst;
+    m->last_refill_ns = now;
+    if (m->tokens < 1) {
+        m->dropped_rate++;
+        return;
+    }
+
+    uint32_t head = __atomic_load_n(&m->head, __ATOMIC_ACQUIRE);
+    if (m->tail - head >= MIRROR_RING_SIZE) {
+        m->dropped_full++;
+        return;
+    }
+    m->tokens -= 1;
+    pkt_buf_ref(buf);
+    m->ring[m->tail % MIRROR_RING_SIZE] = buf;
+    __atomic_store_n(&m->tail, m->tail + 1, __ATOMIC_RELEASE);
+    m->mirrored++;
+}
+
+// 停止镜像线程，释放队列中剩余的引用
+void mirror_stop(struct mirror *m) {
+    __atomic_store_n(&m->stopping, 1, __ATOMIC_RELAXED);
+    pthread_join(m->thread, NULL);
+    close(m->fd);
+    printf("镜像统计: 已镜像 %lu, 限速丢弃 %lu, 队列满丢弃 %lu\n",
+           m->mirrored, m->dropped_rate, m->dropped_full);
+}
+
+/*
+ * ICMP目的不可达生成
+ *
+ * 没有匹配对端的包在这里回一个"主机不可达"，写回TUN后内核把它交给
+ * 发起连接的应用，TCP连接立即报错而不是重传到超时。
+ * 与内核行为一致：不回应ICMP差错报文、非首片分片和组播/广播源，并做全局限速。
+ */
+struct icmp_limiter {
+    double tokens;
+    uint64_t last_ns;
+    uint64_t sent;
+    uint64_t suppressed;          // 被限速抑制的次数
+};
+
+static int icmp_rate_allow(struct icmp_limiter *lim) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    lim->tokens += (now - lim->last_ns) * (double)ICMP_RATE_PPS / 1e9;
+    if (lim->tokens > ICMP_BURST) lim->tokens = ICMP_BURST;
+    lim->last_ns = now;
+    if (lim->tokens < 1) {
+        lim->suppressed++;
+        return 0;
+    }
+    lim->tokens -= 1;
+    lim->sent++;
+    return 1;
+}
+
+// 标准互联网校验和（可分段累加）
+static uint32_t csum_add(uint32_t sum, const void *data, int len) {
+    const uint8_t *p = data;
+    for (; len > 1; len -= 2, p += 2) sum += (p[0] << 8) | p[1];
+    if (len) sum += p[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+/**
+ * 地址是否为TUN接口子网或某条已配置路由前缀的定向广播地址（主机位全1，/31和/32没有广播地址）
+ * @param local_addr TUN接口的IPv4地址（网络字节序）
+ */
+static int icmp_is_directed_broadcast(const struct route_table *routes, uint32_t addr, uint32_t local_addr) {
+    uint32_t mask = prefix_mask(TUN_PREFIX_LEN);
+    if ((addr & mask) == (local_addr & mask) && (addr | mask) == 0xffffffff) return 1;
+    for (int i = 0; routes && i < routes->nroutes; i++) {
+        const struct route_entry *r = &routes->routes[i];
+        if (r->prefix_len >= 31) continue;
+        mask = prefix_mask(r->prefix_len);
+        if ((addr & mask) == r->prefix && (addr | mask) == 0xffffffff) return 1;
+    }
+    return 0;
+}
+
+static int icmp4_build_unreachable(unsigned char *out, const unsigned char *pkt, int len, uint32_t local_addr,
+                                   const struct route_table *routes) {
+    const struct iphdr *orig = (const struct iphdr*)pkt;
+
+    if (len < (int)sizeof(struct iphdr)) return 0;
+    // 不回应ICMP差错报文、非首片分片、组播/广播或未指定的源地址，也不回应发往组播/广播地址的包
+    // （RFC 1812 4.3.2.7：包括受限广播和子网定向广播，否则一个广播包会引来整个子网的差错报文）
+    if (ntohs(orig->frag_off) & 0x1fff) return 0;
+    if (orig->saddr == 0 || IN_MULTICAST(ntohl(orig->saddr)) || orig->saddr == 0xffffffff) return 0;
+    if (IN_MULTICAST(ntohl(orig->daddr)) || orig->daddr == 0xffffffff) return 0;
+    if (icmp_is_directed_broadcast(routes, orig->saddr, local_addr) ||
+        icmp_is_directed_broadcast(routes, orig->daddr, local_addr))
+        return 0;
+    if (orig->protocol == IPPROTO_ICMP && len >= orig->ihl * 4 + 1) {
+        uint8_t type = pkt[orig->ihl * 4];
+        if (type != ICMP_ECHO && type != ICMP_TIMESTAMP && type != ICMP_INFO_REQUEST) return 0;
+    }
+
+    int quote = len;
+    if (quote > ICMP_MAX_LEN - (int)sizeof(struct iphdr) - 8) quote = ICMP_MAX_LEN - sizeof(struct iphdr) - 8;
+    int total = sizeof(struct iphdr) + 8 + quote;
+
+    struct iphdr *ip = (struct iphdr*)out;
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(total);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_ICMP;
+    ip->saddr = local_addr;
+    ip->daddr = orig->saddr;
+    ip->check = csum_fold(csum_add(0, ip, sizeof(*ip)));
+
+    struct icmphdr *icmp = (struct icmphdr*)(out + sizeof(*ip));
+    memset(icmp, 0, sizeof(*icmp));
+    icmp->type = ICMP_DEST_UNREACH;
+    icmp->code = ICMP_HOST_UNREACH;
+    memcpy(icmp + 1, pkt, quote);
+    icmp->checksum = csum_fold(csum_add(0, icmp, 8 + quote));
+    return total;
+}
+
+static int icmp6_build_unreachable(unsigned char *out, const unsigned char *pkt, int len) {
+    const struct ip6_hdr *orig = (const struct ip6_hdr*)pkt;
+
+    if (len < (int)sizeof(struct ip6_hdr)) return 0;
+    if (IN6_IS_ADDR_UNSPECIFIED(&orig->ip6_src) || IN6_IS_ADDR_MULTICAST(&orig->ip6_src)) return 0;
+    // 发往组播地址的包不回送差错（RFC 4443 2.4(e.3)），否则回复的源地址会是组播地址
+    if (IN6_IS_ADDR_MULTICAST(&orig->ip6_dst)) return 0;
+    // ICMPv6差错报文（类型<128）不再回应；这里只看紧跟的首部，不解析扩展头
+    if (orig->ip6_nxt == IPPROTO_ICMPV6 && len > (int)sizeof(*orig) && pkt[sizeof(*orig)] < 128) return 0;
+
+    int quote = len;
+    if (quote > ICMP6_MAX_LEN - (int)sizeof(struct ip6_hdr) - 8) quote = ICMP6_MAX_LEN - sizeof(struct ip6_hdr) - 8;
+    int plen = 8 + quote;
+
+    struct ip6_hdr *ip6 = (struct ip6_hdr*)out;
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->ip6_flow = htonl(6u << 28);
+    ip6->ip6_plen = htons(plen);
+    ip6->ip6_nxt = IPPROTO_ICMPV6;
+    ip6->ip6_hlim = 64;
+    ip6->ip6_src = orig->ip6_dst;  // 接口没有IPv6地址，以不可达的目的地址作为源
+    ip6->ip6_dst = orig->ip6_src;
+
+    struct icmp6_hdr *icmp6 = (struct icmp6_hdr*)(out + sizeof(*ip6));
+    memset(icmp6, 0, sizeof(*icmp6));
+    icmp6->icmp6_type = ICMP6_DST_UNREACH;
+    icmp6->icmp6_code = ICMP6_DST_UNREACH_ADDR;
+    memcpy(icmp6 + 1, pkt, quote);
+
+    // 校验和包含IPv6伪首部
+    uint32_t sum = csum_add(0, &ip6->ip6_src, 32);
+    sum += plen + IPPROTO_ICMPV6;
+    icmp6->icmp6_cksum = csum_fold(csum_add(sum, icmp6, plen));
+    return sizeof(*ip6) + plen;
+}
+
+/**
+ * 对没有匹配路由的包回送ICMP/ICMPv6目的不可达
+ * @param local_addr TUN接口的IPv4地址（网络字节序），作为ICMP报文源地址
+ * @param routes 当前路由，用于识别各前缀的定向广播地址
+ * @return 写回TUN返回1，不需要或被限速返回0
+ */
+int icmp_send_unreachable(int tun_fd, struct icmp_limiter *lim, const unsigned char *pkt, int len,
+                          uint32_t local_addr, const struct route_table *routes) {
+    unsigned char reply[ICMP6_MAX_LEN];
+    int reply_len = 0;
+
+    if (len < 1) return 0;
+    if ((pkt[0] >> 4) == 4) {
+        reply_len = icmp4_build_unreachable(reply, pkt, len, local_addr, routes);
+    } else if ((pkt[0] >> 4) == 6) {
+        reply_len = icmp6_build_unreachable(reply, pkt, len);
+    }
+    if (reply_len == 0 || !icmp_rate_allow(lim)) return 0;
+
+    if (write(tun_fd, reply, reply_len) < 0) {
+        perror("写入ICMP不可达失败");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * 按类型的slab分配器
+ *
+ * 每种对象（流表项，以后的连接跟踪/NAT表项）一个 slab_cache，对象从64KB的slab中切出，
+ * 不同类型互不混用，碎片只限于各自slab内部。分配和释放走每线程的两个弹匣
+ * （loaded/previous，各 SLAB_MAGAZINE_SIZE 个对象），绝大多数操作不加锁也不调用malloc；
+ * 弹匣满或空时才到加锁的仓库里换一个整弹匣。仓库中满弹匣超过 SLAB_DEPOT_KEEP 个时
+ * 拆回slab，整个空出来的slab立即释放；slab_cache_reap 再把两次回收之间一直闲置的满弹匣
+ * 也拆回去，所以占用随工作集回落。
+ * slab_free_batch 一次释放一组对象，每换一个弹匣才加一次锁。
+ */
+struct slab_magazine {
+    struct slab_magazine *next;
+    int count;
+    void *objs[SLAB_MAGAZINE_SIZE];
+};
+
+struct slab {
+    struct slab *next, *prev;     // 部分空闲slab链表；全部分出的slab不在任何链表中
+    void *free;                   // slab内的空闲对象
+    int inuse;                    // 已分出（包括躺在弹匣里）的对象数
+};
+
+struct slab_cache {
+    const char *name;
+    size_t obj_size;
+    int objs_per_slab;
+    int mem_tag;                  // 内存记账的子系统
+    int id;                       // 每线程弹匣数组下标
+    pthread_mutex_t lock;         // 保护下面的仓库和slab链表
+    struct slab *partial;
+    int nslabs;
+    struct slab_magazine *full, *empty;
+    int nfull;
+    int nfull_min;                // 上次回收以来满弹匣数的最低值，即一直没人用的弹匣数
+    uint64_t depot_exchanges;     // 到仓库换弹匣的次数
+};
+
+struct slab_cpu {
+    struct slab_magazine *loaded, *previous;
+};
+
+static __thread struct slab_cpu slab_cpus[SLAB_MAX_CACHES];
+static int slab_ncaches;
+
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 63) & ~(size_t)63)
+
+int slab_cache_init(struct slab_cache *cache, const char *name, size_t obj_size, int mem_tag) {
+    memset(cache, 0, sizeof(*cache));
+    cache->id = __atomic_fetch_add(&slab_ncaches, 1, __ATOMIC_RELAXED);
+    if (cache->id >= SLAB_MAX_CACHES) return -1;
+    cache->name = name;
+    cache->obj_size = (obj_size + 15) & ~(size_t)15;
+    cache->objs_per_slab = (SLAB_BYTES - SLAB_HEADER_SIZE) / cache->obj_size;
+    cache->mem_tag = mem_tag;
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+}
+
+static void slab_list_remove(struct slab_cache *cache, struct slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else cache->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static void slab_list_push(struct slab_cache *cache, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial) cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+// 从slab切出最多n个对象（持锁）
+static int slab_take(struct slab_cache *cache, void **objs, int n) {
+    int got = 0;
+    while (got < n) {
+        struct slab *slab = cache->partial;
+        if (!slab) {
+            slab = aligned_alloc(SLAB_BYTES, SLAB_BYTES);
+            if (!slab) break;
+            memset(slab, 0, sizeof(*slab));
+            char *base = (char*)slab + SLAB_HEADER_SIZE;
+            for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+                void **obj = (void**)(base + i * cache->obj_size);
+                *obj = slab->free;
+                slab->free = obj;
+            }
+            slab_list_push(cache, slab);
+            cache->nslabs++;
+            mem_account(cache->mem_tag, SLAB_BYTES, 1);
+        }
+        while (got < n && slab->free) {
+            void **obj = slab->free;
+            slab->free = *obj;
+            slab->inuse++;
+            objs[got++] = obj;
+        }
+        if (!slab->free) slab_list_remove(cache, slab);
+    }
+    return got;
+}
+
+// 对象还回所属slab，slab整个空出时释放（持锁）
+static void slab_give(struct slab_cache *cache, void *obj) {
+    struct slab *slab = (struct slab*)((uintptr_t)obj & ~(uintptr_t)(SLAB_BYTES - 1));
+    if (!slab->free) slab_list_push(cache, slab);
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    if (--slab->inuse == 0) {
+        slab_list_remove(cache, slab);
+        free(slab);
+        cache->nslabs--;
+        mem_account(cache->mem_tag, -(int64_t)SLAB_BYTES, -1);
+    }
+}
+
+static struct slab_magazine *slab_magazine_get_empty(struct slab_cache *cache) {
+    struct slab_magazine *mag = cache->empty;
+    if (mag) {
+        cache->empty = mag->next;
+    } else {
+        mag = mem_alloc(cache->mem_tag, sizeof(*mag), 0);
+        if (!mag) return NULL;
+    }
+    mag->count = 0;
+    return mag;
+}
+
+// 满弹匣交给仓库，超出保留数时拆一个满弹匣回slab（持锁）
+static void slab_depot_put_full(struct slab_cache *cache, struct slab_magazine *mag) {
+    mag->next = cache->full;
+    cache->full = mag;
+    if (++cache->nfull <= SLAB_DEPOT_KEEP) return;
+    struct slab_magazine *victim = cache->full->next;
+    cache->full->next = victim->next;
+    cache->nfull--;
+    for (int i = 0; i < victim->count; i++) slab_give(cache, victim->objs[i]);
+    victim->next = cache->empty;
+    cache->empty = victim;
+}
+
+static void *slab_alloc_slow(struct slab_cache *cache, struct slab_cpu *cpu) {
+    pthread_mutex_lock(&cache->lock);
+    cache->depot_exchanges++;
+    if (cache->full) {
+        struct slab_magazine *mag = cache->full;
+        cache->full = mag->next;
+        if (--cache->nfull < cache->nfull_min) cache->nfull_min = cache->nfull;
+        if (cpu->previous) {
+            cpu->previous->next = cache->empty;
+            cache->empty = cpu->previous;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+    } else {
+        if (!cpu->loaded) cpu->loaded = slab_magazine_get_empty(cache);
+        if (cpu->loaded) cpu->loaded->count = slab_take(cache, cpu->loaded->objs, SLAB_MAGAZINE_SIZE);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!cpu->loaded || !cpu->loaded->count) return NULL;
+    return cpu->loaded->objs[--cpu->loaded->count];
+}
+
+/**
+ * 分配一个对象（内容未初始化），内存不足返回NULL
+ */
+static inline void *slab_alloc(struct slab_cache *cache) {
+    struct slab_cpu *cpu = &slab_cpus[cache->id];
+    if (cpu->loaded && cpu->loaded->count) return cpu->loaded->objs[--cpu->loaded->count];
+    if (cpu->previous && cpu->previous->count) {
+        struct slab_magazine *t = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = t;
+        return cpu->loaded->objs[--cpu->loaded->count];
+    }
+    return slab_alloc_slow(cache, cpu);
+}
+
+// 让 loaded 弹匣至少有一个空位；仓库也换不到空弹匣时返回-1
+static int slab_make_room(struct slab_cache *cache, struct slab_cpu *cpu) {
+    if (cpu->loaded && cpu->loaded->count < SLAB_MAGAZINE_SIZE) return 0;
+    if (cpu->previous && cpu->previous->count < SLAB_MAGAZINE_SIZE) {
+        struct slab_magazine *t = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = t;
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache->depot_exchanges++;
+    struct slab_magazine *mag = slab_magazine_get_empty(cache);
+    if (mag) {
+        if (cpu->previous) slab_depot_put_full(cache, cpu->previous);
+        cpu->previous = cpu->loaded;
+        cpu->loaded = mag;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return mag ? 0 : -1;
+}
+
+static void slab_free_direct(struct slab_cache *cache, void *obj) {
+    pthread_mutex_lock(&cache->lock);
+    slab_give(cache, obj);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * 释放一个对象（任意线程，不必是分配它的线程）
+ */
+static inline void slab_free(struct slab_cache *cache, void *obj) {
+    struct slab_cpu *cpu = &slab_cpus[cache->id];
+    if (cpu->loaded && cpu->loaded->count < SLAB_MAGAZINE_SIZE) {
+        cpu->loaded->objs[cpu->loaded->count++] = obj;
+        return;
+    }
+    if (slab_make_room(cache, cpu) < 0) {
+        slab_free_direct(cache, obj);  // 连弹匣都分配不出来时直接还回slab
+        return;
+    }
+    cpu->loaded->objs[cpu->loaded->count++] = obj;
+}
+
+/**
+ * 批量释放：按弹匣整段拷贝，每换一个弹匣才进一次仓库
+ */
+void slab_free_batch(struct slab_cache *cache, void **objs, int n) {
+    struct slab_cpu *cpu = &slab_cpus[cache->id];
+    for (int i = 0; i < n; ) {
+        if (slab_make_room(cache, cpu) < 0) {
+            slab_free_direct(cache, objs[i++]);
+            continue;
+        }
+        int room = SLAB_MAGAZINE_SIZE - cpu->loaded->count;
+        int k = n - i < room ? n - i : room;
+        memcpy(cpu->loaded->objs + cpu->loaded->count, objs + i, k * sizeof(void*));
+        cpu->loaded->count += k;
+        i += k;
+    }
+}
+
+/**
+ * 把本线程的弹匣交还仓库（线程退出前调用）
+ */
+void slab_flush_thread(struct slab_cache *cache) {
+    struct slab_cpu *cpu = &slab_cpus[cache->id];
+    struct slab_magazine *mags[2] = { cpu->loaded, cpu->previous };
+
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < 2; i++) {
+        if (!mags[i]) continue;
+        for (int j = 0; j < mags[i]->count; j++) slab_give(cache, mags[i]->objs[j]);
+        mags[i]->next = cache->empty;
+        cache->empty = mags[i];
+    }
+    pthread_mutex_unlock(&cache->lock);
+    cpu->loaded = cpu->previous = NULL;
+}
+
+/**
+ * 周期回收（由使用该缓存的线程调用）：交还本线程的弹匣，并把上次回收以来
+ * 一直闲置的满弹匣拆回slab。弹匣里零散的空闲对象会钉住各自的slab，不拆回去就释放不了
+ */
+void slab_cache_reap(struct slab_cache *cache) {
+    slab_flush_thread(cache);
+    pthread_mutex_lock(&cache->lock);
+    for (int k = cache->nfull_min; k > 0 && cache->full; k--) {
+        struct slab_magazine *mag = cache->full;
+        cache->full = mag->next;
+        cache->nfull--;
+        for (int i = 0; i < mag->count; i++) slab_give(cache, mag->objs[i]);
+        mag->next = cache->empty;
+        cache->empty = mag;
+    }
+    cache->nfull_min = cache->nfull;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * 销毁缓存：所有对象都必须已经释放，其他线程的弹匣也已交还
+ * @return 仍未释放的slab数（正常为0）
+ */
+int slab_cache_destroy(struct slab_cache *cache) {
+    slab_flush_thread(cache);
+    pthread_mutex_lock(&cache->lock);
+    while (cache->full) {
+        struct slab_magazine *mag = cache->full;
+        cache->full = mag->next;
+        for (int i = 0; i < mag->count; i++) slab_give(cache, mag->objs[i]);
+        mem_free(mag);
+    }
+    while (cache->empty) {
+        struct slab_magazine *mag = cache->empty;
+        cache->empty = mag->next;
+        mem_free(mag);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+    return cache->nslabs;
+}
+
+/*
+ * 可扩缩容的并发哈希表（64位键 -> 指针）
+ *
+ * 读者无锁：沿桶链读取，不写任何共享数据，只需处于QSBR在线状态。
+ * 写者之间用互斥锁串行。元素数超过桶数时翻倍、低于1/8时减半，但不会一次迁移完：
+ * 新表挂在旧表的 next 上，此后每次写操作顺带把 CHASH_MIGRATE_STEP 个旧桶复制到新表，
+ * 复制完的旧桶头换成 CHASH_MOVED，读者看到它就转到新表去查。
+ * 旧节点不修改，正在旧链上走的读者不受影响；全部迁完后切换表指针，旧表和旧节点经QSBR回收。
+ * 旧节点的释放同样摊到后续写操作上，每次最多 CHASH_FREE_STEP 个。
+ * 于是任何一次写操作的工作量都有上限，没有整表重哈希或整表释放的停顿。
+ */
+#define CHASH_MOVED ((struct chash_node*)1)
+
+struct chash;
+
+struct chash_node {
+    struct chash_node *next;
+    uint64_t key;
+    void *value;
+    struct chash *map;
+    struct qsbr_node qsbr;        // 删除时单独回收；迁移后借用 qsbr.next 串进旧表的墓地
+};
+
+struct chash_table {
+    uint32_t mask;
+    uint32_t migrated;            // 已迁移的旧桶数（仅写者访问）
+    struct chash_table *next;     // 扩缩容的目标表
+    struct chash_node *graveyard; // 已复制到新表的旧节点（经 qsbr.next 串起）
+    struct chash_node *graveyard_tail;
+    struct chash *map;
+    struct qsbr_node qsbr;
+    struct chash_node *buckets[];
+};
+
+struct chash {
+    struct chash_table *table;    // 读者入口，扩缩容完成时整体切换
+    pthread_mutex_t lock;
+    struct slab_cache nodes;
+    int mem_tag;
+    int stop_the_world;           // 对比用：开始扩缩容时一次迁移完
+    struct chash_node *free_pending;  // 宽限期已过、待释放的旧节点（无锁栈，回收回调压入）
+    struct chash_node *freeing;   // 写者正在分批释放的旧节点（持锁）
+    size_t count;
+    uint64_t resizes;
+};
+
+static inline uint64_t chash_mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct chash_table *chash_table_alloc(struct chash *map, uint32_t nbuckets) {
+    struct chash_table *t = mem_alloc(map->mem_tag, sizeof(*t) + nbuckets * sizeof(struct chash_node*), 1);
+    if (!t) return NULL;
+    t->mask = nbuckets - 1;
+    t->map = map;
+    return t;
+}
+
+static void chash_node_free(struct qsbr_node *q) {
+    struct chash_node *node = container_of(q, struct chash_node, qsbr);
+    slab_free(&node->map->nodes, node);
+}
+
+static void chash_free_chain(struct chash *map, struct chash_node *node) {
+    while (node) {
+        struct chash_node *next = (struct chash_node*)node->qsbr.next;
+        slab_free(&map->nodes, node);
+        node = next;
+    }
+}
+
+// 旧表宽限期已过：桶数组马上释放，旧节点整串交给写者分批释放
+static void chash_table_free(struct qsbr_node *q) {
+    struct chash_table *t = container_of(q, struct chash_table, qsbr);
+    struct chash *map = t->map;
+    if (t->graveyard) {
+        t->graveyard_tail->qsbr.next = (struct qsbr_node*)__atomic_load_n(&map->free_pending, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&map->free_pending, (struct chash_node**)&t->graveyard_tail->qsbr.next,
+                                            t->graveyard, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    mem_free(t);
+}
+
+// 释放最多 budget 个旧节点（持锁）
+static void chash_free_some(struct chash *map, int budget) {
+    if (!map->freeing) {
+        if (!__atomic_load_n(&map->free_pending, __ATOMIC_RELAXED)) return;
+        map->freeing = __atomic_exchange_n(&map->free_pending, NULL, __ATOMIC_ACQUIRE);
+    }
+    while (map->freeing && budget--) {
+        struct chash_node *node = map->freeing;
+        map->freeing = (struct chash_node*)node->qsbr.next;
+        slab_free(&map->nodes, node);
+    }
+}
+
+int chash_init(struct chash *map, int mem_tag) {
+    memset(map, 0, sizeof(*map));
+    map->mem_tag = mem_tag;
+    if (slab_cache_init(&map->nodes, "chash", sizeof(struct chash_node), mem_tag) < 0) return -1;
+    pthread_mutex_init(&map->lock, NULL);
+    map->table = chash_table_alloc(map, CHASH_MIN_BUCKETS);
+    return map->table ? 0 : -1;
+}
+
+/**
+ * 无锁查找，调用线程须处于QSBR在线状态
+ * @return 键对应的值，不存在返回NULL
+ */
+static inline void *chash_lookup(struct chash *map, uint64_t key) {
+    uint64_t h = chash_mix(key);
+    struct chash_table *t = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    for (;;) {
+        struct chash_node *node = __atomic_load_n(&t->buckets[h & t->mask], __ATOMIC_ACQUIRE);
+        if (node == CHASH_MOVED) {
+            t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        for (; node; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+            if (node->key == key) return __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+        }
+        return NULL;
+    }
+}
+
+// 对端索引的键：IPv4地址和端口（网络字节序）
+static inline uint64_t peer_endpoint_key(const struct sockaddr_in *addr) {
+    return (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+// 把旧表第 i 个桶复制到新表（持锁）
+static int chash_migrate_bucket(struct chash *map, struct chash_table *t, uint32_t i) {
+    struct chash_table *n = t->next;
+    struct chash_node *head = t->buckets[i], *copies = NULL;
+
+    // 先分配好全部副本，内存不足时整桶放弃，不会在新表里留下半个桶
+    for (struct chash_node *old = head; old; old = old->next) {
+        struct chash_node *copy = slab_alloc(&map->nodes);
+        if (!copy) {
+            while (copies) {
+                struct chash_node *next = copies->next;
+                slab_free(&map->nodes, copies);
+                copies = next;
+            }
+            return -1;
+        }
+        copy->key = old->key;
+        copy->value = old->value;
+        copy->map = map;
+        copy->next = copies;
+        copies = copy;
+    }
+    while (copies) {
+        struct chash_node *copy = copies;
+        struct chash_node **bucket = &n->buckets[chash_mix(copy->key) & n->mask];
+        copies = copy->next;
+        copy->next = *bucket;
+        __atomic_store_n(bucket, copy, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&t->buckets[i], CHASH_MOVED, __ATOMIC_RELEASE);
+    for (struct chash_node *old = head; old; old = old->next) {
+        if (!t->graveyard) t->graveyard_tail = old;
+        old->qsbr.next = (struct qsbr_node*)t->graveyard;
+        t->graveyard = old;
+    }
+    return 0;
+}
+
+// 推进正在进行的扩缩容，最多迁移 steps 个旧桶（持锁）
+static void chash_migrate(struct chash *map, struct qsbr_thread *qt, uint32_t steps) {
+    struct chash_table *t = map->table;
+    chash_free_some(map, CHASH_FREE_STEP);
+    if (!t->next) return;
+    while (steps-- && t->migrated <= t->mask) {
+        if (chash_migrate_bucket(map, t, t->migrated) < 0) return;  // 内存不足，下次再试
+        t->migrated++;
+    }
+    if (t->migrated > t->mask) {
+        __atomic_store_n(&map->table, t->next, __ATOMIC_RELEASE);
+        qsbr_retire(qt, &t->qsbr, chash_table_free);
+    }
+}
+
+// 按负载因子决定是否开始扩缩容（持锁，且当前没有进行中的迁移）
+static void chash_maybe_resize(struct chash *map, struct qsbr_thread *qt) {
+    struct chash_table *t = map->table;
+    uint32_t nbuckets = t->mask + 1, target = nbuckets;
+
+    if (t->next) return;
+    if (map->count > nbuckets) target = nbuckets * 2;
+    else if (map->count < nbuckets / 8 && nbuckets > CHASH_MIN_BUCKETS) target = nbuckets / 2;
+    if (target == nbuckets) return;
+
+    struct chash_table *n = chash_table_alloc(map, target);
+    if (!n) return;
+    __atomic_store_n(&t->next, n, __ATOMIC_RELEASE);
+    map->resizes++;
+    if (map->stop_the_world) chash_migrate(map, qt, UINT32_MAX);
+}
+
+// 键所在的桶：旧桶已迁走时落到新表（持锁）
+static struct chash_node **chash_bucket(struct chash *map, uint64_t h) {
+    struct chash_table *t = map->table;
+    struct chash_node **bucket = &t->buckets[h & t->mask];
+    if (*bucket == CHASH_MOVED) bucket = &t->next->buckets[h & t->next->mask];
+    return bucket;
+}
+
+/**
+ * 插入或替换
+ * @param qt 调用线程的QSBR记录，用于挂起迁移完的旧表
+ * @return 新插入返回1，替换已有值返回0，内存不足返回-1
+ */
+int chash_insert(struct chash *map, struct qsbr_thread *qt, uint64_t key, void *value) {
+    uint64_t h = chash_mix(key);
+    int ret = 1;
+
+    pthread_mutex_lock(&map->lock);
+    chash_migrate(map, qt, CHASH_MIGRATE_STEP);
+    struct chash_node **bucket = chash_bucket(map, h);
+    struct chash_node *node;
+    for (node = *bucket; node; node = node->next) {
+        if (node->key == key) break;
+    }
+    if (node) {
+        __atomic_store_n(&node->value, value, __ATOMIC_RELEASE);
+        ret = 0;
+    } else if ((node = slab_alloc(&map->nodes))) {
+        node->key = key;
+        node->value = value;
+        node->map = map;
+        node->next = *bucket;
+        __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+        map->count++;
+        chash_maybe_resize(map, qt);
+    } else {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&map->lock);
+    return ret;
+}
+
+/**
+ * 删除，节点在宽限期后回收
+ * @return 删除返回1，不存在返回0
+ */
+int chash_remove(struct chash *map, struct qsbr_thread *qt, uint64_t key) {
+    uint64_t h = chash_mix(key);
+    int ret = 0;
+
+    pthread_mutex_lock(&map->lock);
+    chash_migrate(map, qt, CHASH_MIGRATE_STEP);
+    for (struct chash_node **link = chash_bucket(map, h); *link; link = &(*link)->next) {
+        struct chash_node *node = *link;
+        if (node->key != key) continue;
+        __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+        qsbr_retire(qt, &node->qsbr, chash_node_free);
+        map->count--;
+        chash_maybe_resize(map, qt);
+        ret = 1;
+        break;
+    }
+    pthread_mutex_unlock(&map->lock);
+    return ret;
+}
+
+/**
+ * 写操作稀少时由写者周期调用，把进行中的迁移做完
+ */
+void chash_maintain(struct chash *map, struct qsbr_thread *qt) {
+    if (!__atomic_load_n(&map->table, __ATOMIC_RELAXED)->next && !map->freeing &&
+        !__atomic_load_n(&map->free_pending, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&map->lock);
+    chash_migrate(map, qt, CHASH_MIGRATE_STEP * 4);
+    pthread_mutex_unlock(&map->lock);
+}
+
+/**
+ * 释放整张表，调用时不能再有读者和写者；已挂起的节点和旧表由QSBR负责
+ */
+void chash_destroy(struct chash *map) {
+    struct chash_table *t = map->table;
+    while (t) {
+        struct chash_table *next = t->next;
+        for (uint32_t i = 0; i <= t->mask; i++) {
+            struct chash_node *node = t->buckets[i];
+            if (node == CHASH_MOVED) continue;
+            while (node) {
+                struct chash_node *n = node->next;
+                slab_free(&map->nodes, node);
+                node = n;
+            }
+        }
+        chash_free_chain(map, t->graveyard);
+        mem_free(t);
+        t = next;
+    }
+    chash_free_chain(map, map->freeing);
+    chash_free_chain(map, map->free_pending);
+    slab_cache_destroy(&map->nodes);
+    pthread_mutex_destroy(&map->lock);
+    map->table = NULL;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * 路由查找结构（FIB）与后台重建
+ *
+ * FIB是只读的16-8-8多比特字典树：根表按目的地址高16位直接索引，
+ * 更长的前缀展开到256项的子节点里，查找最多3次相互依赖的内存访问，没有分支比较前缀。
+ * 表项最高位表示子节点，否则是对端组编号+1（0表示无路由）。
+ *
+ * FIB一经发布就不再修改。路由变更提交给构建线程，构建线程把一段时间内积累的变更
+ * 一起应用到路由库（RIB），从头建一棵新的FIB，用一次原子指针替换发布，
+ * 旧FIB经QSBR等到所有数据路径线程经过静止点后释放。数据路径查找不加锁，
+ * 也不会看到构建到一半的结构，更新风暴期间查找速度不受影响。
+ *
+ * 长于/16的前缀多时字典树再展开成DIR-24-8：第一级按高24位直接索引的1600万项表（放在大页里），
+ * 更长的前缀落到256项的第二级组，查找只要1到2次内存访问。只看路由总数不行：
+ * /16及更短的前缀在字典树里本来就只要一次访问，慢的是要走子节点的长前缀。
+ */
+#define FIB_CHILD 0x80000000u
+#define FIB_TBL8 0x8000u
+
+struct route_fib {
+    struct qsbr_node qsbr;
+    uint32_t nroutes;
+    uint32_t nnodes, cap_nodes;
+    uint32_t *nodes;              // 子节点，每个256项
+    uint16_t *tbl24;              // 非空时改用DIR-24-8查找，字典树节点已释放
+    uint16_t *tbl8;
+    uint32_t ntbl8;
+    int hugepage;                 // tbl24 是否映射在预留大页上
+    uint32_t root[65536];
+};
+
+static inline int route_fib_lookup(const struct route_fib *fib, uint32_t addr) {
+    if (fib->tbl24) {
+        uint32_t e = fib->tbl24[addr >> 8];
+        if (e & FIB_TBL8) e = fib->tbl8[(e & ~FIB_TBL8) * 256 + (addr & 0xff)];
+        return (int)e - 1;
+    }
+    uint32_t e = fib->root[addr >> 16];
+    if (e & FIB_CHILD) {
+        e = fib->nodes[(e & ~FIB_CHILD) * 256 + ((addr >> 8) & 0xff)];
+        if (e & FIB_CHILD) e = fib->nodes[(e & ~FIB_CHILD) * 256 + (addr & 0xff)];
+    }
+    return (int)e - 1;
+}
+
+static void route_fib_free(struct route_fib *fib) {
+    if (!fib) return;
+    mem_free(fib->nodes);
+    if (fib->tbl24) {
+        munmap(fib->tbl24, FIB_TBL24_BYTES);
+        mem_account(MEM_ROUTES, -(int64_t)FIB_TBL24_BYTES, -1);
+    }
+    mem_free(fib->tbl8);
+    mem_free(fib);
+}
+
+static void route_fib_free_qsbr(struct qsbr_node *q) {
+    route_fib_free(container_of(q, struct route_fib, qsbr));
+}
+
+// 表项若还不是子节点，就建一个继承原值的子节点；返回子节点编号，失败返回-1
+static int64_t route_fib_child(struct route_fib *fib, uint32_t *entry_index, int in_root) {
+    uint32_t e = in_root ? fib->root[*entry_index] : fib->nodes[*entry_index];
+    if (e & FIB_CHILD) return e & ~FIB_CHILD;
+    if (fib->nnodes >= FIB_MAX_NODES) return -1;
+    if (fib->nnodes == fib->cap_nodes) {
+        uint32_t cap = fib->cap_nodes ? fib->cap_nodes * 2 : 64;
+        uint32_t *nodes = mem_realloc(MEM_ROUTES, fib->nodes, (size_t)cap * 256 * sizeof(uint32_t));
+        if (!nodes) return -1;
+        fib->nodes = nodes;
+        fib->cap_nodes = cap;
+    }
+    uint32_t child = fib->nnodes++;
+    for (int i = 0; i < 256; i++) fib->nodes[child * 256 + i] = e;
+    if (in_root) fib->root[*entry_index] = FIB_CHILD | child;
+    else fib->nodes[*entry_index] = FIB_CHILD | child;
+    return child;
+}
+
+/**
+ * 向正在构建的FIB加入一条路由。必须按前缀长度从短到长加入，
+ * 这样新建的子节点继承的总是已经覆盖它的最长前缀
+ * @param prefix 主机字节序
+ */
+static int route_fib_add(struct route_fib *fib, uint32_t prefix, int len, int group) {
+    uint32_t value = group + 1;
+    prefix &= len ? 0xffffffffu << (32 - len) : 0;
+    if (len <= 16) {
+        uint32_t first = prefix >> 16, count = 1u << (16 - len);
+        for (uint32_t i = 0; i < count; i++) fib->root[first + i] = value;
+        return 0;
+    }
+    uint32_t index = prefix >> 16;
+    int64_t child = route_fib_child(fib, &index, 1);
+    if (child < 0) return -1;
+    if (len <= 24) {
+        uint32_t first = (prefix >> 8) & 0xff, count = 1u << (24 - len);
+        for (uint32_t i = 0; i < count; i++) fib->nodes[child * 256 + first + i] = value;
+        return 0;
+    }
+    index = child * 256 + ((prefix >> 8) & 0xff);
+    child = route_fib_child(fib, &index, 0);
+    if (child < 0) return -1;
+    uint32_t first = prefix & 0xff, count = 1u << (32 - len);
+    for (uint32_t i = 0; i < count; i++) fib->nodes[child * 256 + first + i] = value;
+    return 0;
+}
+
+/**
+ * 把建好的字典树展开成DIR-24-8：第二层节点的每一项对应第一级的一项，
+ * 第三层节点原样成为第二级的组。第二级组数超出15位编号时保留字典树
+ */
+static int route_fib_expand_dir24(struct route_fib *fib) {
+    uint32_t ntbl8 = 0;
+
+    for (uint32_t i = 0; i < 65536; i++) {
+        if (!(fib->root[i] & FIB_CHILD)) continue;
+        const uint32_t *node = &fib->nodes[(fib->root[i] & ~FIB_CHILD) * 256];
+        for (int j = 0; j < 256; j++) ntbl8 += (node[j] & FIB_CHILD) != 0;
+    }
+    if (ntbl8 > FIB_TBL8_MAX) return -1;
+
+    fib->hugepage = 1;
+    uint16_t *tbl24 = mmap(NULL, FIB_TBL24_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (tbl24 == MAP_FAILED) {
+        fib->hugepage = 0;
+        tbl24 = mmap(NULL, FIB_TBL24_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tbl24 == MAP_FAILED) return -1;
+        madvise(tbl24, FIB_TBL24_BYTES, MADV_HUGEPAGE);
+    }
+    uint16_t *tbl8 = mem_alloc(MEM_ROUTES, (ntbl8 ? ntbl8 : 1) * 256 * sizeof(uint16_t), 0);
+    if (!tbl8) {
+        munmap(tbl24, FIB_TBL24_BYTES);
+        return -1;
+    }
+    mem_account(MEM_ROUTES, FIB_TBL24_BYTES, 1);
+
+    ntbl8 = 0;
+    for (uint32_t i = 0; i < 65536; i++) {
+        uint16_t *slot = &tbl24[i << 8];
+        uint32_t e = fib->root[i];
+        if (!(e & FIB_CHILD)) {
+            for (int j = 0; j < 256; j++) slot[j] = e;
+            continue;
+        }
+        const uint32_t *node = &fib->nodes[(e & ~FIB_CHILD) * 256];
+        for (int j = 0; j < 256; j++) {
+            if (!(node[j] & FIB_CHILD)) {
+                slot[j] = node[j];
+                continue;
+            }
+            const uint32_t *leaf = &fib->nodes[(node[j] & ~FIB_CHILD) * 256];
+            for (int k = 0; k < 256; k++) tbl8[ntbl8 * 256 + k] = leaf[k];
+            slot[j] = FIB_TBL8 | ntbl8++;
+        }
+    }
+    fib->tbl24 = tbl24;
+    fib->tbl8 = tbl8;
+    fib->ntbl8 = ntbl8;
+    mem_free(fib->nodes);
+    fib->nodes = NULL;
+    fib->nnodes = fib->cap_nodes = 0;
+    return 0;
+}
+
+/**
+ * 路由库中的一条路由（构建线程私有）
+ */
+struct rib_entry {
+    uint32_t prefix;              // 主机字节序
+    uint8_t len;
+    uint16_t group;
+};
+
+struct route_update {
+    uint32_t prefix;              // 主机字节序
+    uint8_t len;
+    int16_t group;                // -1 表示删除
+};
+
+static inline uint64_t rib_key(uint32_t prefix, int len) {
+    return (uint64_t)prefix << 8 | len;
+}
+
+/**
+ * 从路由库建一棵新的FIB：按前缀长度计数排序后依次加入，
+ * 再按模式和长前缀数决定是否展开成DIR-24-8
+ */
+static struct route_fib *route_fib_build(const struct rib_entry *rib, int n, int mode) {
+    int count[34] = {0};
+    int *order = malloc((n ? n : 1) * sizeof(int));
+    struct route_fib *fib = mem_alloc(MEM_ROUTES, sizeof(*fib), 1);
+
+    if (!order || !fib) {
+        free(order);
+        mem_free(fib);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) count[rib[i].len + 1]++;
+    int deep = 0;  // 字典树中要走子节点的前缀数
+    for (int l = 17; l <= 32; l++) deep += count[l + 1];
+    for (int l = 1; l < 34; l++) count[l] += count[l - 1];
+    for (int i = 0; i < n; i++) order[count[rib[i].len]++] = i;
+    for (int i = 0; i < n; i++) {
+        const struct rib_entry *r = &rib[order[i]];
+        if (route_fib_add(fib, r->prefix, r->len, r->group) < 0) {
+            free(order);
+            route_fib_free(fib);
+            return NULL;
+        }
+    }
+    fib->nroutes = n;
+    free(order);
+    if (mode == FIB_DIR24 || (mode == FIB_AUTO && deep >= FIB_DIR24_MIN_DEEP)) route_fib_expand_dir24(fib);
+    return fib;
+}
+
+/**
+ * 启动时用配置的路由建第一棵FIB（此时还没有读者，直接发布）
+ */
+int route_table_build_fib(struct route_table *table) {
+    struct rib_entry rib[MAX_ROUTES];
+    for (int i = 0; i < table->nroutes; i++) {
+        rib[i].prefix = ntohl(table->routes[i].prefix);
+        rib[i].len = table->routes[i].prefix_len;
+        rib[i].group = table->routes[i].group;
+    }
+    struct route_fib *fib = route_fib_build(rib, table->nroutes, table->fib_mode);
+    if (!fib) return -1;
+    route_fib_free(table->fib);
+    table->fib = fib;
+    return 0;
+}
+
+/*
+ * 路由构建线程：提交的变更先进队列，线程醒来后把队列整个取走，
+ * 一次应用到路由库再重建，更新越密集合并得越多
+ */
+struct route_builder {
+    struct route_table *table;
+    struct qsbr_thread qsbr;      // 构建线程的QSBR记录（始终离线，只挂起旧FIB）
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;          // 有新变更 / 有新版本发布
+    struct route_update *queue;
+    int nqueue, cap_queue;
+    uint64_t submitted, published;  // 已提交 / 已发布的变更数
+    int stopping;
+
+    // 以下仅构建线程访问
+    struct rib_entry *rib;
+    int nrib, cap_rib;
+    struct chash index;           // 前缀 -> rib下标+1
+    uint64_t rebuilds;
+    uint64_t build_ns;            // 累计构建耗时
+    uint64_t max_build_ns;
+};
+
+static void route_builder_apply(struct route_builder *b, const struct route_update *u) {
+    uint64_t key = rib_key(u->prefix, u->len);
+    int pos = (int)(intptr_t)chash_lookup(&b->index, key) - 1;
+
+    if (u->group < 0) {
+        if (pos < 0) return;
+        // 用最后一项填补空位
+        chash_remove(&b->index, &b->qsbr, key);
+        if (pos != --b->nrib) {
+            b->rib[pos] = b->rib[b->nrib];
+            chash_insert(&b->index, &b->qsbr, rib_key(b->rib[pos].prefix, b->rib[pos].len), (void*)(intptr_t)(pos + 1));
+        }
+        return;
+    }
+    if (pos >= 0) {
+        b->rib[pos].group = u->group;
+        return;
+    }
+    if (b->nrib == b->cap_rib) {
+        int cap = b->cap_rib ? b->cap_rib * 2 : 1024;
+        struct rib_entry *rib = mem_realloc(MEM_ROUTES, b->rib, cap * sizeof(*rib));
+        if (!rib) return;
+        b->rib = rib;
+        b->cap_rib = cap;
+    }
+    b->rib[b->nrib] = (struct rib_entry){ u->prefix, u->len, u->group };
+    chash_insert(&b->index, &b->qsbr, key, (void*)(intptr_t)(++b->nrib));
+}
+
+static void *route_builder_thread(void *arg) {
+    struct route_builder *b = arg;
+    struct route_update *batch = NULL;
+    int cap_batch = 0;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (!b->nqueue && !b->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += ROUTE_RECLAIM_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&b->cond, &b->lock, &deadline);
+            qsbr_reclaim(&b->qsbr);  // 空闲时释放读者已经用完的旧FIB
+        }
+        if (!b->nqueue && b->stopping) break;
+
+        // 交换两个队列数组，构建期间提交者不必等待
+        struct route_update *work = b->queue;
+        int nwork = b->nqueue, cap_work = b->cap_queue;
+        uint64_t upto = b->submitted;
+        b->queue = batch;
+        b->cap_queue = cap_batch;
+        b->nqueue = 0;
+        pthread_mutex_unlock(&b->lock);
+
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < nwork; i++) route_builder_apply(b, &work[i]);
+        struct route_fib *fib = route_fib_build(b->rib, b->nrib, b->table->fib_mode);
+        if (fib) {
+            struct route_fib *old = __atomic_exchange_n(&b->table->fib, fib, __ATOMIC_ACQ_REL);
+            if (old) qsbr_retire(&b->qsbr, &old->qsbr, route_fib_free_qsbr);
+            qsbr_reclaim(&b->qsbr);
+        }
+        uint64_t elapsed = monotonic_ns() - start;
+        b->rebuilds++;
+        b->build_ns += elapsed;
+        if (elapsed > b->max_build_ns) b->max_build_ns = elapsed;
+        batch = work;
+        cap_batch = cap_work;
+
+        pthread_mutex_lock(&b->lock);
+        b->published = upto;
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    free(batch);
+    qsbr_barrier(&b->qsbr);
+    slab_flush_thread(&b->index.nodes);  // 弹匣是线程局部的，退出前交还，否则销毁索引时泄漏
+    return NULL;
+}
+
+/**
+ * 启动构建线程，路由库从表中当前配置的路由开始
+ */
+int route_builder_start(struct route_builder *b, struct route_table *table, struct qsbr *domain) {
+    memset(b, 0, sizeof(*b));
+    b->table = table;
+    qsbr_register(domain, &b->qsbr);
+    if (chash_init(&b->index, MEM_ROUTES) < 0) return -1;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    for (int i = 0; i < table->nroutes; i++) {
+        struct route_update u = { ntohl(table->routes[i].prefix), table->routes[i].prefix_len, table->routes[i].group };
+        route_builder_apply(b, &u);
+    }
+    slab_flush_thread(&b->index.nodes);  // 初始路由在调用线程上插入，同样交还弹匣
+    return pthread_create(&b->thread, NULL, route_builder_thread, b) == 0 ? 0 : -1;
+}
+
+/**
+ * 提交一批路由变更（任意线程），立即返回
+ * @return 这批变更的序号，可交给 route_builder_wait
+ */
+uint64_t route_builder_submit(struct route_builder *b, const struct route_update *updates, int n) {
+    pthread_mutex_lock(&b->lock);
+    if (b->nqueue + n > b->cap_queue) {
+        int cap = b->cap_queue ? b->cap_queue : 1024;
+        while (cap < b->nqueue + n) cap *= 2;
+        struct route_update *q = realloc(b->queue, cap * sizeof(*q));
+        if (!q) {
+            pthread_mutex_unlock(&b->lock);
+            return 0;
+        }
+        b->queue = q;
+        b->cap_queue = cap;
+    }
+    memcpy(b->queue + b->nqueue, updates, n * sizeof(*updates));
+    b->nqueue += n;
+    b->submitted += n;
+    uint64_t seq = b->submitted;
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    return seq;
+}
+
+// 等到序号 seq 之前提交的变更都已发布
+void route_builder_wait(struct route_builder *b, uint64_t seq) {
+    pthread_mutex_lock(&b->lock);
+    while (b->published < seq) pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void route_builder_stop(struct route_builder *b) {
+    pthread_mutex_lock(&b->lock);
+    b->stopping = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    pthread_join(b->thread, NULL);
+    free(b->queue);
+    mem_free(b->rib);
+    chash_destroy(&b->index);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+}
+
+// 解析一条路由加入新路由集，同一前缀以最后出现的为准
+static int route_load_spec(struct route_table *table, struct route_entry *next, int *nnext, const char *spec) {
+    struct route_entry entry;
+
+    if (route_parse_spec(table, spec, &entry) < 0) {
+        printf("无效的路由: %s\n", spec);
+        return -1;
+    }
+    for (int k = 0; k < *nnext; k++) {
+        if (next[k].prefix == entry.prefix && next[k].prefix_len == entry.prefix_len) {
+            next[k].group = entry.group;
+            return 0;
+        }
+    }
+    if (*nnext >= MAX_ROUTES) {
+        printf("路由超过 %d 条: %s\n", MAX_ROUTES, spec);
+        return -1;
+    }
+    route_insert_sorted(next, nnext, &entry);
+    return 0;
+}
+
+/**
+ * 由命令行路由和路由文件重新组成路由集，替换表中的路由，并算出与原路由集的差异。
+ * 路由文件每行一条路由（格式同 --route），空行和 # 开头的行忽略。
+ * 新的对端和对端组直接加入表中（只有数据路径线程调用），FIB交给构建线程重建
+ * @param specs 命令行给出的路由
+ * @param path 路由文件，NULL表示没有
+ * @param updates 输出：增删改的前缀，至少 2*MAX_ROUTES 项
+ * @return 差异条数；文件无法读取或有无效行返回-1，表中的路由保持不变
+ */
+int route_table_load(struct route_table *table, char **specs, int nspecs, const char *path,
+                     struct route_update *updates) {
+    struct route_entry next[MAX_ROUTES];
+    int nnext = 0, nupdates = 0;
+    char line[512];
+    FILE *f = NULL;
+
+    if (path && !(f = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+    int ok = 1;
+    for (int i = 0; ok && i < nspecs; i++) {
+        ok = route_load_spec(table, next, &nnext, specs[i]) == 0;
+    }
+    while (ok && f && fgets(line, sizeof(line), f)) {
+        char *spec = line + strspn(line, " \t");
+        spec[strcspn(spec, " \t\r\n#")] = '\0';
+        ok = !*spec || route_load_spec(table, next, &nnext, spec) == 0;
+    }
+    if (f) fclose(f);
+    if (!ok) return -1;
+
+    for (int i = 0; i < table->nroutes; i++) {
+        const struct route_entry *r = &table->routes[i];
+        int k = 0;
+        while (k < nnext && (next[k].prefix != r->prefix || next[k].prefix_len != r->prefix_len)) k++;
+        if (k == nnext) updates[nupdates++] = (struct route_update){ ntohl(r->prefix), r->prefix_len, -1 };
+    }
+    for (int k = 0; k < nnext; k++) {
+        int i = 0;
+        while (i < table->nroutes && (table->routes[i].prefix != next[k].prefix ||
+                                      table->routes[i].prefix_len != next[k].prefix_len)) i++;
+        if (i == table->nroutes || table->routes[i].group != next[k].group)
+            updates[nupdates++] = (struct route_update){ ntohl(next[k].prefix), next[k].prefix_len, next[k].group };
+    }
+    memcpy(table->routes, next, nnext * sizeof(next[0]));
+    table->nroutes = nnext;
+    return nupdates;
+}
+
+/*
+ * 流表与被动TCP分析
+ *
+ * 流按双向规范化的五元组索引在并发哈希表（chash）中，方向0为首个包的方向（发起方）。
+ * 五元组有104位，索引键取它的64位哈希，命中后再比较完整五元组；两条流哈希相同的
+ * 概率可以忽略，真遇到时后来的流不跟踪。索引随流数增减，扩缩容增量迁移，不停顿。
+ * 流表项另串在按最近活动排序的链表上，过期回收和达到 FLOW_TABLE_MAX 时的淘汰都从表头取，
+ * 不用扫描索引。活跃的流每 FLOW_LRU_GRANULARITY_NS 才移到链尾一次，链表顺序因此有这么多误差，
+ * 换来每包的开销只有一次哈希、一次无锁查找和一次比较，
+ * 时间戳由调用方每批读取一次传入，不在每个包上读时钟。
+ *
+ * TCP分析：
+ * - SYN → SYN-ACK：隧道到服务器一侧的往返时间（隧道外）
+ * - SYN-ACK → ACK：隧道到本地应用一侧的往返时间（隧道内/本机）
+ * - 某方向的段完全落在已见序号之前：重传；起始序号超过期望值：乱序（前面有段丢失或被重排）
+ * - 不带数据、确认号没有前进的ACK：重复ACK（接收方看到了空洞）
+ * - 确认号超过另一方向已见的序号：对方收到了这里没看到的数据，记为漏抓并以确认号为准
+ */
+enum {
+    FLOW_DIR_INITIATOR = 0,       // 与流的首个包同方向
+    FLOW_DIR_RESPONDER = 1,
+};
+
+#define TCP_SEEN_SYN     0x01
+#define TCP_SEEN_SYNACK  0x02
+#define TCP_ESTABLISHED  0x04
+#define TCP_SEQ_VALID0   0x10     // 方向0的next_seq已初始化
+#define TCP_SEQ_VALID1   0x20
+#define TCP_ACK_VALID0   0x40     // 方向0的max_ack已初始化
+#define TCP_ACK_VALID1   0x80
+
+struct flow_key {
+    uint32_t addr[2];             // 规范化后：addr[0]/port[0] 为较小的一端
+    uint16_t port[2];
+    uint8_t protocol;
+};
+
+struct tcp_analysis {
+    uint32_t next_seq[2];         // 各方向期望的下一个序号
+    uint32_t max_ack[2];          // 各方向见过的最大确认号
+    uint64_t syn_ns;
+    uint64_t synack_ns;
+    uint32_t rtt_outer_us;        // SYN → SYN-ACK
+    uint32_t rtt_inner_us;        // SYN-ACK → ACK
+    uint32_t retransmits[2];
+    uint32_t out_of_order[2];
+    uint32_t dup_acks[2];         // 按发出ACK的方向计
+    uint32_t capture_gaps[2];     // 按数据方向计：对方确认了未经过这里的数据
+    uint8_t state;                // TCP_* 标志
+};
+
+struct flow_entry {
+    struct flow_entry *lru_prev;  // 按最近活动排序的链表，表头最久未活动
+    struct flow_entry *lru_next;
+    uint64_t lru_ns;              // 上次移到链尾的时间，与 last_ns 相差不超过 FLOW_LRU_GRANULARITY_NS
+    struct flow_key key;
+    uint8_t initiator;            // 发起方是 key 中的哪一端（0或1）
+    uint64_t packets[2];
+    uint64_t bytes[2];
+    uint64_t first_ns;
+    uint64_t last_ns;
+    struct tcp_analysis tcp;
+    uint8_t sni_state;            // SNI_PENDING / SNI_FOUND / SNI_GAVE_UP
+    uint8_t sni_attempts;
+    uint8_t qos_class;            // QOS_* 分类结果
+    uint8_t qos_state;            // 0未分类，1已按端口分类（SNI待定），2最终
+    char sni[SNI_MAX_LEN];
+    unsigned char *sni_buf;       // 跨段ClientHello的已收部分（含TLS记录头），只在SNI待定时存在
+    uint16_t sni_buf_len;
+    uint16_t sni_buf_want;        // 记录总长，超过 SNI_REASSEMBLY_MAX 时截断
+    uint32_t sni_seq;             // 下一个应续接的TCP序号
+};
+
+enum {
+    SNI_PENDING = 0,
+    SNI_FOUND,
+    SNI_GAVE_UP,
+};
+
+struct flow_table {
+    struct chash index;           // 五元组哈希 -> flow_entry
+    struct qsbr qsbr;             // 索引只有本线程读写，私有的回收域，移除的节点在下一个静止点释放
+    struct qsbr_thread reader;
+    struct slab_cache entries;
+    struct flow_entry *lru_head;  // 最久未活动
+    struct flow_entry *lru_tail;  // 最近活动
+    uint32_t expire_rounds;
+    int active;
+    uint64_t flows_created;
+    uint64_t flows_evicted;
+    uint64_t flows_expired;
+    uint64_t flows_untracked;     // 索引键冲突或内存不足而未跟踪的包
+    int sni_buffered;             // 正在缓存ClientHello的流数
+    uint32_t rtt_sample_us;       // 最近一次 flow_table_update 得到的隧道外握手RTT，0表示没有
+};
+
+int flow_table_init(struct flow_table *ft) {
+    memset(ft, 0, sizeof(*ft));
+    if (slab_cache_init(&ft->entries, "flow", sizeof(struct flow_entry), MEM_FLOWS) < 0) return -1;
+    qsbr_init(&ft->qsbr);
+    qsbr_register(&ft->qsbr, &ft->reader);
+    qsbr_online(&ft->reader);
+    return chash_init(&ft->index, MEM_FLOWS);
+}
+
+// 释放流上缓存的ClientHello片段
+static inline void flow_sni_release(struct flow_table *ft, struct flow_entry *e) {
+    if (!e->sni_buf) return;
+    free(e->sni_buf);
+    e->sni_buf = NULL;
+    ft->sni_buffered--;
+}
+
+void flow_table_free(struct flow_table *ft) {
+    while (ft->lru_head) {
+        struct flow_entry *e = ft->lru_head;
+        ft->lru_head = e->lru_next;
+        flow_sni_release(ft, e);
+        slab_free(&ft->entries, e);
+    }
+    ft->lru_tail = NULL;
+    qsbr_barrier(&ft->reader);
+    chash_destroy(&ft->index);
+    slab_cache_destroy(&ft->entries);
+}
+
+static inline void flow_lru_unlink(struct flow_table *ft, struct flow_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else ft->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else ft->lru_tail = e->lru_prev;
+}
+
+static inline void flow_lru_append(struct flow_table *ft, struct flow_entry *e, uint64_t now_ns) {
+    e->lru_ns = now_ns;
+    e->lru_prev = ft->lru_tail;
+    e->lru_next = NULL;
+    if (ft->lru_tail) ft->lru_tail->lru_next = e;
+    else ft->lru_head = e;
+    ft->lru_tail = e;
+}
+
+static inline uint64_t flow_key_hash(const struct flow_key *k) {
+    uint64_t h = ((uint64_t)k->addr[0] << 32 | k->addr[1]) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)k->port[0] << 24 | (uint64_t)k->port[1] << 8 | k->protocol) * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ h >> 29;
+}
+
+static inline int flow_key_equal(const struct flow_key *a, const struct flow_key *b) {
+    return a->addr[0] == b->addr[0] && a->addr[1] == b->addr[1] &&
+           a->port[0] == b->port[0] && a->port[1] == b->port[1] && a->protocol == b->protocol;
+}
+
+// 从索引和链表中摘除，表项由调用方处理；索引节点在本线程下一个静止点释放
+static void flow_unlink(struct flow_table *ft, struct flow_entry *e) {
+    flow_sni_release(ft, e);
+    flow_lru_unlink(ft, e);
+    chash_remove(&ft->index, &ft->reader, flow_key_hash(&e->key));
+    ft->active--;
+}
+
+// 索引键，chash 会再混合一次，这里只需把104位无损地折叠得足够分散
+/**
+ * 从IPv4包提取规范化的流键
+ * @param side 输出：包的源地址是键中的哪一端
+ * @return 成功返回IP首部长度，非IPv4或长度不足返回0
+ */
+static int flow_key_from_packet(const unsigned char *data, int len, struct flow_key *key, int *side) {
+    const struct iphdr *ip = (const struct iphdr*)data;
+    uint16_t sport = 0, dport = 0;
+
+    if (len < (int)sizeof(struct iphdr) || ip->version != 4) return 0;
+    int ihl = ip->ihl * 4;
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+        !(ntohs(ip->frag_off) & 0x1fff) && len >= ihl + 4) {
+        uint16_t ports[2];
+        memcpy(ports, data + ihl, 4);
+        sport = ports[0];
+        dport = ports[1];
+    }
+
+    *side = (ip->saddr > ip->daddr) || (ip->saddr == ip->daddr && sport > dport);
+    key->addr[*side] = ip->saddr;
+    key->addr[!*side] = ip->daddr;
+    key->port[*side] = sport;
+    key->port[!*side] = dport;
+    key->protocol = ip->protocol;
+    return ihl;
+}
+
+static void flow_entry_reset(struct flow_entry *e, const struct flow_key *key, int side, uint64_t now_ns) {
+    memset(e, 0, sizeof(*e));
+    e->key = *key;
+    e->initiator = side;
+    e->first_ns = now_ns;
+}
+
+/**
+ * 查找流，不存在时创建（达到 FLOW_TABLE_MAX 时复用最久未活动的流），并把流移到链尾
+ */
+static struct flow_entry *flow_lookup_or_create(struct flow_table *ft, const struct flow_key *key,
+                                                int side, uint64_t now_ns) {
+    uint64_t hash = flow_key_hash(key);
+    struct flow_entry *e = chash_lookup(&ft->index, hash);
+
+    if (e) {
+        if (!flow_key_equal(&e->key, key)) {  // 索引键冲突：不跟踪
+            ft->flows_untracked++;
+            return NULL;
+        }
+        if (now_ns - e->last_ns > FLOW_IDLE_NS) {  // 同一五元组但早已过期，视为新流
+            struct flow_entry *prev = e->lru_prev, *next = e->lru_next;
+            flow_sni_release(ft, e);
+            flow_entry_reset(e, key, side, now_ns);
+            e->lru_prev = prev;
+            e->lru_next = next;
+            e->lru_ns = 0;
+            ft->flows_created++;
+        }
+        if (now_ns - e->lru_ns > FLOW_LRU_GRANULARITY_NS) {
+            flow_lru_unlink(ft, e);
+            flow_lru_append(ft, e, now_ns);
+        }
+        return e;
+    }
+
+    if (ft->active < FLOW_TABLE_MAX) e = slab_alloc(&ft->entries);
+    if (!e) {
+        // 已达上限（或内存不足）：复用最久未活动的流
+        e = ft->lru_head;
+        if (!e) {
+            ft->flows_untracked++;
+            return NULL;
+        }
+        if (now_ns - e->last_ns <= FLOW_IDLE_NS) ft->flows_evicted++;
+        flow_unlink(ft, e);
+    }
+    flow_entry_reset(e, key, side, now_ns);
+    if (chash_insert(&ft->index, &ft->reader, hash, e) < 0) {
+        slab_free(&ft->entries, e);
+        ft->flows_untracked++;
+        return NULL;
+    }
+    flow_lru_append(ft, e, now_ns);
+    ft->active++;
+    ft->flows_created++;
+    return e;
+}
+
+/**
+ * 增量回收过期流：每次从链表头最多摘除 FLOW_EXPIRE_SCAN 条，表项批量还给slab，
+ * 顺带推进索引进行中的迁移并宣告静止点（调用方此时不持有流表内的指针）
+ */
+void flow_table_expire(struct flow_table *ft, uint64_t now_ns) {
+    void *expired[FLOW_EXPIRE_SCAN];
+    int n = 0;
+
+    while (n < FLOW_EXPIRE_SCAN && ft->lru_head && now_ns - ft->lru_head->last_ns > FLOW_IDLE_NS) {
+        struct flow_entry *e = ft->lru_head;
+        flow_unlink(ft, e);
+        expired[n++] = e;
+    }
+    if (n) {
+        slab_free_batch(&ft->entries, expired, n);
+        ft->flows_expired += n;
+    }
+    if (++ft->expire_rounds % FLOW_REAP_ROUNDS == 0) slab_cache_reap(&ft->entries);  // 定期回收闲置弹匣
+    chash_maintain(&ft->index, &ft->reader);
+    qsbr_quiescent(&ft->reader);
+}
+
+// 返回本段新测得的隧道外握手RTT（微秒），没有则为0
+static uint32_t tcp_analyze(struct tcp_analysis *t, const struct tcphdr *th, int payload_len, int dir, uint64_t now_ns) {
+    uint32_t seq = ntohl(th->seq), sample = 0;
+    uint8_t seq_valid = dir ? TCP_SEQ_VALID1 : TCP_SEQ_VALID0;
+
+    if (th->syn) {
+        if (!th->ack && dir == FLOW_DIR_INITIATOR) {
+            if (t->state & TCP_SEEN_SYN) t->retransmits[dir]++;  // SYN重传
+            t->syn_ns = now_ns;
+            t->state |= TCP_SEEN_SYN;
+        } else if (th->ack && dir == FLOW_DIR_RESPONDER) {
+            if (t->state & TCP_SEEN_SYNACK) {
+                t->retransmits[dir]++;
+            } else if (t->state & TCP_SEEN_SYN) {
+                t->rtt_outer_us = (now_ns - t->syn_ns) / 1000;
+                sample = t->rtt_outer_us;
+            }
+            t->synack_ns = now_ns;
+            t->state |= TCP_SEEN_SYNACK;
+        }
+        t->next_seq[dir] = seq + 1;
+        t->state |= seq_valid;
+    } else if (th->ack && dir == FLOW_DIR_INITIATOR && (t->state & TCP_SEEN_SYNACK) &&
+               !(t->state & TCP_ESTABLISHED)) {
+        t->rtt_inner_us = (now_ns - t->synack_ns) / 1000;
+        t->state |= TCP_ESTABLISHED;
+    }
+
+    uint32_t seg_len = payload_len + (th->fin ? 1 : 0);
+    if (seg_len > 0 && !th->syn) {
+        uint32_t end = seq + seg_len;
+        if (!(t->state & seq_valid)) {
+            t->next_seq[dir] = end;  // 中途接入的流：以首个段为基准
+            t->state |= seq_valid;
+        } else if ((int32_t)(end - t->next_seq[dir]) <= 0) {
+            t->retransmits[dir]++;
+        } else {
+            if ((int32_t)(seq - t->next_seq[dir]) > 0) t->out_of_order[dir]++;
+            t->next_seq[dir] = end;
+        }
+    }
+    if (th->ack) {
+        uint32_t ack = ntohl(th->ack_seq);
+        uint8_t ack_valid = dir ? TCP_ACK_VALID1 : TCP_ACK_VALID0;
+        uint8_t peer_seq_valid = dir ? TCP_SEQ_VALID0 : TCP_SEQ_VALID1;
+
+        if (!(t->state & ack_valid) || (int32_t)(ack - t->max_ack[dir]) > 0) {
+            t->max_ack[dir] = ack;
+            t->state |= ack_valid;
+        } else if (ack == t->max_ack[dir] && seg_len == 0 && !th->syn) {
+            t->dup_acks[dir]++;
+        }
+        if ((t->state & peer_seq_valid) && (int32_t)(ack - t->next_seq[!dir]) > 0) {
+            t->capture_gaps[!dir]++;
+            t->next_seq[!dir] = ack;  // 之后的段不再因这段空洞被记为乱序
+        }
+    }
+    return sample;
+}
+
+void flow_label_sni(struct flow_table *ft, struct flow_entry *flow, const unsigned char *data, int len);
+
+/**
+ * 按包更新流表（TUN读出的包和对端发回的包都应经过这里）
+ * @param now_ns 调用方每批读取一次的时间戳
+ * @return 包所属的流，非IPv4返回NULL；该包测得握手RTT时记在 ft->rtt_sample_us
+ */
+struct flow_entry *flow_table_update(struct flow_table *ft, const unsigned char *data, int len, uint64_t now_ns) {
+    struct flow_key key;
+    int side;
+    ft->rtt_sample_us = 0;
+    int ihl = flow_key_from_packet(data, len, &key, &side);
+    if (!ihl) return NULL;
+
+    struct flow_entry *flow = flow_lookup_or_create(ft, &key, side, now_ns);
+    if (!flow) return NULL;
+    int dir = side == flow->initiator ? FLOW_DIR_INITIATOR : FLOW_DIR_RESPONDER;
+    flow->packets[dir]++;
+    flow->bytes[dir] += len;
+    flow->last_ns = now_ns;
+
+    const struct iphdr *ip = (const struct iphdr*)data;
+    if (key.protocol == IPPROTO_TCP && !(ntohs(ip->frag_off) & 0x1fff) &&
+        len >= ihl + (int)sizeof(struct tcphdr)) {
+        const struct tcphdr *th = (const struct tcphdr*)(data + ihl);
+        int ip_len = ntohs(ip->tot_len) < len ? ntohs(ip->tot_len) : len;
+        int payload = ip_len - ihl - th->doff * 4;
+        ft->rtt_sample_us = tcp_analyze(&flow->tcp, th, payload > 0 ? payload : 0, dir, now_ns);
+    }
+    if (dir == FLOW_DIR_INITIATOR && flow->sni_state == SNI_PENDING) flow_label_sni(ft, flow, data, len);
+    return flow;
+}
+
+/*
+ * SNI提取
+ *
+ * 只检查每条流发起方的前 SNI_MAX_ATTEMPTS 个带载荷的包，找到或放弃后不再进入；
+ * 其余包在首字节判断处即退出。所有长度字段都先做边界检查，解析代价受包长限制。
+ * 一个段装不下的ClientHello（带大密钥交换参数时常见）按序缓存后续段，
+ * 每条流最多 SNI_REASSEMBLY_MAX 字节、同时最多 SNI_REASSEMBLY_FLOWS 条流，找到或放弃即释放。
+ *
+ * QUIC Initial 的载荷由DCID派生的公开密钥加密（RFC 9001 第5.2节），
+ * 因此这里带了最小的 SHA-256/HKDF 和 AES-128 实现，只在 Initial 包上运行。
+ * 作为被动观察者不校验GCM标签：伪造的包只会解出无效数据并在解析时被丢弃。
+ */
+
+/* ---- SHA-256 / HMAC / HKDF ---- */
+
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char buf[64];
+    size_t used;                  // buf 中已缓存的字节数
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256_ctx *c, const unsigned char *p) {
+    uint32_t w[64], a, b, d, e, f, g, h, cc, t1, t2;
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = c->h[0]; b = c->h[1]; cc = c->h[2]; d = c->h[3];
+    e = c->h[4]; f = c->h[5]; g = c->h[6]; h = c->h[7];
+    for (int i = 0; i < 64; i++) {
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g; g = f; f = e; e = d + t1;
+        d = cc; cc = b; b = a; a = t1 + t2;
+    }
+    c->h[0] += a; c->h[1] += b; c->h[2] += cc; c->h[3] += d;
+    c->h[4] += e; c->h[5] += f; c->h[6] += g; c->h[7] += h;
+}
+
+static void sha256_init(struct sha256_ctx *c) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(c->h, iv, sizeof(iv));
+    c->len = 0;
+    c->used = 0;
+}
+
+static void sha256_update(struct sha256_ctx *c, const unsigned char *p, size_t n) {
+    c->len += n;
+    while (n > 0) {
+        size_t take = 64 - c->used < n ? 64 - c->used : n;
+        memcpy(c->buf + c->used, p, take);
+        c->used += take;
+        p += take;
+        n -= take;
+        if (c->used == 64) {
+            sha256_block(c, c->buf);
+            c->used = 0;
+        }
+    }
+}
+
+static void sha256_final(struct sha256_ctx *c, unsigned char out[32]) {
+    uint64_t bits = c->len * 8;
+    unsigned char pad = 0x80;
+
+    sha256_update(c, &pad, 1);
+    pad = 0;
+    while (c->used != 56) sha256_update(c, &pad, 1);
+    for (int i = 7; i >= 0; i--) {
+        unsigned char b = bits >> (i * 8);
+        sha256_update(c, &b, 1);
+    }
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = c->h[i] >> 24;
+        out[4 * i + 1] = c->h[i] >> 16;
+        out[4 * i + 2] = c->h[i] >> 8;
+        out[4 * i + 3] = c->h[i];
+    }
+}
+
+static void hmac_sha256(const unsigned char *key, size_t key_len, const unsigned char *msg, size_t msg_len,
+                        unsigned char out[32]) {
+    unsigned char k[64] = {0}, pad[64];
+    struct sha256_ctx c;
+
+    memcpy(k, key, key_len);  // 这里的密钥长度都不超过32字节
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    sha256_init(&c);
+    sha256_update(&c, pad, 64);
+    sha256_update(&c, msg, msg_len);
+    sha256_final(&c, out);
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    sha256_init(&c);
+    sha256_update(&c, pad, 64);
+    sha256_update(&c, out, 32);
+    sha256_final(&c, out);
+}
+
+/**
+ * TLS 1.3 HKDF-Expand-Label（上下文为空，输出不超过32字节）
+ */
+static void hkdf_expand_label(const unsigned char secret[32], const char *label, unsigned char *out, int out_len) {
+    unsigned char info[64], block[32];
+    int label_len = strlen(label);
+    int n = 0;
+
+    info[n++] = out_len >> 8;
+    info[n++] = out_len;
+    info[n++] = 6 + label_len;
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, label_len);
+    n += label_len;
+    info[n++] = 0;     // 空上下文
+    info[n++] = 0x01;  // HKDF-Expand 的计数器T(1)
+    hmac_sha256(secret, 32, info, n, block);
+    memcpy(out, block, out_len);
+}
+
+/* ---- AES-128（仅加密方向，用于头部保护掩码和CTR） ---- */
+
+static const unsigned char aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static inline unsigned char aes_xtime(unsigned char x) {
+    return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void aes128_expand_key(const unsigned char key[16], unsigned char rk[176]) {
+    unsigned char rcon = 1;
+
+    memcpy(rk, key, 16);
+    for (int i = 16; i < 176; i += 4) {
+        unsigned char t[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+        if (i % 16 == 0) {
+            unsigned char t0 = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon;
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[t0];
+            rcon = aes_xtime(rcon);
+        }
+        for (int j = 0; j < 4; j++) rk[i + j] = rk[i - 16 + j] ^ t[j];
+    }
+}
+
+static void aes128_encrypt_block(const unsigned char rk[176], const unsigned char in[16], unsigned char out[16]) {
+    unsigned char s[16], t[16];
+
+    for (int i = 0; i < 16; i++) s[i] = in[i] ^ rk[i];
+    for (int round = 1; round <= 10; round++) {
+        // SubBytes + ShiftRows
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++) t[4 * c + r] = aes_sbox[s[4 * ((c + r) & 3) + r]];
+        if (round < 10) {  // MixColumns
+            for (int c = 0; c < 4; c++) {
+                unsigned char *col = t + 4 * c;
+                unsigned char all = col[0] ^ col[1] ^ col[2] ^ col[3], c0 = col[0];
+                col[0] ^= all ^ aes_xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ aes_xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ aes_xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ aes_xtime(col[3] ^ c0);
+            }
+        }
+        for (int i = 0; i < 16; i++) s[i] = t[i] ^ rk[16 * round + i];
+    }
+    memcpy(out, s, 16);
+}
+
+/* ---- TLS ClientHello ---- */
+
+static inline int sni_rd16(const unsigned char *p) {
+    return p[0] << 8 | p[1];
+}
+
+/**
+ * 从ClientHello握手消息（从握手类型字节开始）中找 server_name 扩展
+ * 数据可以被截断：只要 SNI 本身完整地落在 len 之内即可
+ * @return 成功返回1，确定没有或数据不足返回0
+ */
+static int tls_client_hello_sni(const unsigned char *p, int len, char *out, int out_size) {
+    int pos = 4 + 2 + 32;  // 握手头、版本、随机数
+
+    if (len < pos + 1 || p[0] != 0x01) return 0;
+    pos += 1 + p[pos];                                  // session_id
+    if (len < pos + 2) return 0;
+    pos += 2 + sni_rd16(p + pos);                       // cipher_suites
+    if (len < pos + 1) return 0;
+    pos += 1 + p[pos];                                  // compression_methods
+    if (len < pos + 2) return 0;
+    int ext_end = pos + 2 + sni_rd16(p + pos);
+    pos += 2;
+
+    while (pos + 4 <= len && pos + 4 <= ext_end) {
+        int type = sni_rd16(p + pos), ext_len = sni_rd16(p + pos + 2);
+        pos += 4;
+        if (type != 0) {
+            pos += ext_len;
+            continue;
+        }
+        // server_name_list: 列表长度(2) 名称类型(1) 名称长度(2) 名称
+        if (ext_len < 5 || pos + 5 > len || p[pos + 2] != 0) return 0;
+        int name_len = sni_rd16(p + pos + 3);
+        if (name_len == 0 || name_len + 5 > ext_len || pos + 5 + name_len > len) return 0;
+        if (name_len >= out_size) name_len = out_size - 1;
+        for (int i = 0; i < name_len; i++) {
+            unsigned char ch = p[pos + 5 + i];
+            out[i] = (ch >= 0x21 && ch < 0x7f) ? ch : '?';
+        }
+        out[name_len] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- QUIC v1 Initial ---- */
+
+static int quic_varint(const unsigned char *p, int len, uint64_t *value) {
+    if (len < 1) return 0;
+    int n = 1 << (p[0] >> 6);
+    if (len < n) return 0;
+    uint64_t v = p[0] & 0x3f;
+    for (int i = 1; i < n; i++) v = v << 8 | p[i];
+    *value = v;
+    return n;
+}
+
+/**
+ * 解开QUIC v1客户端Initial包的保护，拼出从偏移0开始连续的CRYPTO数据后查找SNI
+ */
+static int quic_initial_sni(const unsigned char *p, int len, char *out, int out_size) {
+    static const unsigned char initial_salt[20] = {
+        0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+        0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a,
+    };
+    unsigned char secret[32], client_secret[32], key[16], iv[12], hp[16];
+    unsigned char rk[176], mask[16];
+    unsigned char plain[1500], crypto[1500];
+    uint64_t v;
+    int pos = 5, n;
+
+    // 长包头、v1、Initial 类型；DCID 最长20字节
+    if (len < 7 || (p[0] & 0xf0) != 0xc0 || sni_rd16(p + 1) != 0 || sni_rd16(p + 3) != 1) return 0;
+    int dcid_len = p[pos];
+    if (dcid_len > 20 || len < pos + 1 + dcid_len + 1) return 0;
+    const unsigned char *dcid = p + pos + 1;
+    pos += 1 + dcid_len;
+    pos += 1 + p[pos];                                  // SCID
+    if (pos >= len || !(n = quic_varint(p + pos, len - pos, &v)) || v > (uint64_t)len) return 0;
+    pos += n + v;                                       // token
+    if (pos >= len || !(n = quic_varint(p + pos, len - pos, &v)) || v > (uint64_t)(len - pos - n)) return 0;
+    pos += n;
+    int pn_offset = pos, payload_end = pos + v;
+    if (pn_offset + 4 + 16 > payload_end) return 0;
+
+    // 派生客户端Initial密钥
+    hmac_sha256(initial_salt, sizeof(initial_salt), dcid, dcid_len, secret);
+    hkdf_expand_label(secret, "client in", client_secret, 32);
+    hkdf_expand_label(client_secret, "quic key", key, 16);
+    hkdf_expand_label(client_secret, "quic iv", iv, 12);
+    hkdf_expand_label(client_secret, "quic hp", hp, 16);
+
+    // 去除头部保护：只需要首字节和包号（不校验GCM标签，用不到完整头部），
+    // 因此带令牌的长头部也不受限制
+    aes128_expand_key(hp, rk);
+    aes128_encrypt_block(rk, p + pn_offset + 4, mask);
+    int pn_len = ((p[0] ^ (mask[0] & 0x0f)) & 3) + 1;
+    uint64_t pn = 0;
+    for (int i = 0; i < pn_len; i++) pn = pn << 8 | (p[pn_offset + i] ^ mask[1 + i]);
+
+    // AES-GCM 的 CTR 部分：计数器块 = nonce || 从2开始的32位计数
+    int ct_len = payload_end - (pn_offset + pn_len) - 16;
+    if (ct_len <= 0 || ct_len > (int)sizeof(plain)) return 0;
+    const unsigned char *ct = p + pn_offset + pn_len;
+    unsigned char counter[16], stream[16];
+    aes128_expand_key(key, rk);
+    memcpy(counter, iv, 12);
+    for (int i = 0; i < 8; i++) counter[4 + i] ^= pn >> (56 - 8 * i);
+    for (int off = 0, block = 2; off < ct_len; off += 16, block++) {
+        counter[12] = block >> 24;
+        counter[13] = block >> 16;
+        counter[14] = block >> 8;
+        counter[15] = block;
+        aes128_encrypt_block(rk, counter, stream);
+        for (int i = 0; i < 16 && off + i < ct_len; i++) plain[off + i] = ct[off + i] ^ stream[i];
+    }
+
+    // 记录CRYPTO帧后按偏移拼接（浏览器会打乱帧顺序），只用从0开始的连续部分
+    struct { uint32_t off, len, pos; } frames[32];
+    int nframes = 0, have = 0;
+    pos = 0;
+    while (pos < ct_len && nframes < 32) {
+        unsigned char type = plain[pos];
+        if (type == 0x00 || type == 0x01) {             // PADDING / PING
+            pos++;
+            continue;
+        }
+        if (type != 0x06) break;                        // 客户端首个Initial里只应有CRYPTO
+        uint64_t off, flen;
+        pos++;
+        if (!(n = quic_varint(plain + pos, ct_len - pos, &off))) break;
+        pos += n;
+        if (!(n = quic_varint(plain + pos, ct_len - pos, &flen))) break;
+        pos += n;
+        if (flen > (uint64_t)(ct_len - pos)) break;
+        if (off + flen <= sizeof(crypto)) {
+            memcpy(crypto + off, plain + pos, flen);
+            frames[nframes].off = off;
+            frames[nframes].len = flen;
+            frames[nframes].pos = pos;
+            nframes++;
+        }
+        pos += flen;
+    }
+    for (int grown = 1; grown;) {
+        grown = 0;
+        for (int i = 0; i < nframes; i++) {
+            if ((int)frames[i].off <= have && (int)(frames[i].off + frames[i].len) > have) {
+                have = frames[i].off + frames[i].len;
+                grown = 1;
+            }
+        }
+    }
+    return have > 0 && tls_client_hello_sni(crypto, have, out, out_size);
+}
+
+/**
+ * 续接跨段的ClientHello：只接受按序到达的段，收到记录全长（或缓存上限）后仍找不到即放弃
+ * @return 找到返回1，还需要更多数据返回0，放弃返回-1
+ */
+static int flow_sni_reassemble(struct flow_entry *flow, const unsigned char *payload, int payload_len, uint32_t seq) {
+    if (seq != flow->sni_seq) return 0;  // 乱序或重传：本次不续接，计入尝试次数
+
+    int take = flow->sni_buf_want - flow->sni_buf_len;
+    if (take > payload_len) take = payload_len;
+    memcpy(flow->sni_buf + flow->sni_buf_len, payload, take);
+    flow->sni_buf_len += take;
+    flow->sni_seq += take;
+    if (tls_client_hello_sni(flow->sni_buf + 5, flow->sni_buf_len - 5, flow->sni, SNI_MAX_LEN)) return 1;
+    return flow->sni_buf_len >= flow->sni_buf_want ? -1 : 0;
+}
+
+/**
+ * 对发起方的早期数据包尝试提取SNI并标注到流上（由 flow_table_update 调用）
+ * 已找到/已放弃的流不会进入这里，不像握手的包在首字节判断处退出
+ */
+void flow_label_sni(struct flow_table *ft, struct flow_entry *flow, const unsigned char *data, int len) {
+    const struct iphdr *ip = (const struct iphdr*)data;
+    int ihl = ip->ihl * 4;
+    int ip_len = ntohs(ip->tot_len) < len ? ntohs(ip->tot_len) : len;
+    const unsigned char *payload;
+    int payload_len, found = 0;
+
+    if (ip->protocol == IPPROTO_TCP) {
+        if (ip_len < ihl + (int)sizeof(struct tcphdr)) return;
+        const struct tcphdr *th = (const struct tcphdr*)(data + ihl);
+        int doff = th->doff * 4;
+        payload = data + ihl + doff;
+        payload_len = ip_len - ihl - doff;
+        if (payload_len <= 0) return;  // 握手阶段的纯ACK不计入尝试次数
+
+        if (flow->sni_buf) {
+            found = flow_sni_reassemble(flow, payload, payload_len, ntohl(th->seq));
+            if (found < 0) flow->sni_state = SNI_GAVE_UP;
+        } else if (payload_len > 5 && payload[0] == 0x16 && payload[1] == 0x03) {
+            // TLS记录头：handshake(0x16) 03 xx，随后是ClientHello(0x01)
+            found = tls_client_hello_sni(payload + 5, payload_len - 5, flow->sni, SNI_MAX_LEN);
+            int want = 5 + sni_rd16(payload + 3);
+            if (want > SNI_REASSEMBLY_MAX) want = SNI_REASSEMBLY_MAX;
+            if (!found && payload[5] == 0x01 && payload_len < want && ft->sni_buffered < SNI_REASSEMBLY_FLOWS &&
+                (flow->sni_buf = malloc(want))) {
+                memcpy(flow->sni_buf, payload, payload_len);
+                flow->sni_buf_len = payload_len;
+                flow->sni_buf_want = want;
+                flow->sni_seq = ntohl(th->seq) + payload_len;
+                ft->sni_buffered++;
+            }
+        }
+    } else if (ip->protocol == IPPROTO_UDP) {
+        payload = data + ihl + 8;
+        payload_len = ip_len - ihl - 8;
+        if (payload_len <= 0) return;
+        if ((payload[0] & 0xf0) == 0xc0)
+            found = quic_initial_sni(payload, payload_len, flow->sni, SNI_MAX_LEN);
+    } else {
+        flow->sni_state = SNI_GAVE_UP;
+        return;
+    }
+
+    if (found > 0) {
+        flow->sni_state = SNI_FOUND;
+    } else if (++flow->sni_attempts >= SNI_MAX_ATTEMPTS) {
+        flow->sni_state = SNI_GAVE_UP;
+    }
+    if (flow->sni_state != SNI_PENDING) flow_sni_release(ft, flow);
+}
+
+/**
+ * 输出TCP流的分析结果
+ * @param max_flows 最多输出的流数
+ */
+void flow_table_report(struct flow_table *ft, int max_flows) {
+    int shown = 0;
+
+    printf("\n=== 流统计 (活跃 %d, 已创建 %lu, 淘汰 %lu, 过期回收 %lu, 未跟踪 %lu) ===\n", ft->active,
+           ft->flows_created, ft->flows_evicted, ft->flows_expired, ft->flows_untracked);
+    for (const struct flow_entry *f = ft->lru_tail; f && shown < max_flows; f = f->lru_prev) {  // 大致按最近活动排序
+        if ((f->key.protocol != IPPROTO_TCP && f->sni_state != SNI_FOUND)) continue;
+
+        int a = f->initiator, b = !f->initiator;
+        struct in_addr src = { f->key.addr[a] }, dst = { f->key.addr[b] };
+        char src_str[INET_ADDRSTRLEN], dst_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &src, src_str, sizeof(src_str));
+        inet_ntop(AF_INET, &dst, dst_str, sizeof(dst_str));
+
+        printf("%s:%d -> %s:%d  包 %lu/%lu", src_str, ntohs(f->key.port[a]), dst_str, ntohs(f->key.port[b]),
+               f->packets[0], f->packets[1]);
+        if (f->sni_state == SNI_FOUND) printf("  [%s]", f->sni);
+        if (f->tcp.rtt_outer_us) printf("  隧道外RTT %.2fms", f->tcp.rtt_outer_us / 1000.0);
+        if (f->tcp.rtt_inner_us) printf("  本地侧RTT %.2fms", f->tcp.rtt_inner_us / 1000.0);
+        printf("  重传 %u/%u  乱序 %u/%u  重复ACK %u/%u", f->tcp.retransmits[0], f->tcp.retransmits[1],
+               f->tcp.out_of_order[0], f->tcp.out_of_order[1], f->tcp.dup_acks[0], f->tcp.dup_acks[1]);
+        if (f->tcp.capture_gaps[0] || f->tcp.capture_gaps[1])
+            printf("  漏抓 %u/%u", f->tcp.capture_gaps[0], f->tcp.capture_gaps[1]);
+        printf("\n");
+        shown++;
+    }
+}
+
+/**
+ * 流表基准测试：不需要TUN接口和root权限
+ * 在 nflows 条TCP流上生成合成数据段，测量 flow_table_update 的每包开销
+ */
+int run_flow_benchmark(int nflows) {
+    const int packets = 5000000;
+    static struct flow_table ft;
+    unsigned char (*pkts)[64] = calloc(nflows, 64);
+
+    if (!pkts || flow_table_init(&ft) < 0) return -1;
+    for (int i = 0; i < nflows; i++) {
+        struct iphdr *ip = (struct iphdr*)pkts[i];
+        struct tcphdr *th = (struct tcphdr*)(pkts[i] + 20);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(64);
+        ip->protocol = IPPROTO_TCP;
+        ip->saddr = htonl(0xc0a8e900 | (i & 0xff));
+        ip->daddr = htonl(0x0a000000 | (i >> 8));
+        th->source = htons(10000 + i % 50000);
+        th->dest = htons(443);
+        th->doff = 5;
+        th->ack = 1;
+    }
+
+    // 第一轮只生成数据段作为基线，第二轮加上流表更新，差值即流表的每包开销
+    double elapsed[2];
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t start = monotonic_ns();
+        uint64_t now = start;
+        for (int i = 0, f = 0; i < packets; i++, f = f + 1 == nflows ? 0 : f + 1) {
+            unsigned char *pkt = pkts[f];
+            struct tcphdr *th = (struct tcphdr*)(pkt + 20);
+            th->seq = htonl(ntohl(th->seq) + 24);
+            if ((i & (RX_BATCH - 1)) == 0) now += 1000;  // 模拟每批读取一次时钟
+            if (pass) flow_table_update(&ft, pkt, 64, now);
+            else __asm__ volatile("" : : "r"(pkt) : "memory");
+        }
+        elapsed[pass] = monotonic_ns() - start;
+    }
+
+    printf("=== 流表基准测试 (%d 条流, %d 个包) ===\n", nflows, packets);
+    printf("  流表更新 %.1f ns/包 (含生成 %.1f ns/包), 已创建 %lu 条流, 淘汰 %lu\n",
+           (elapsed[1] - elapsed[0]) / packets, elapsed[1] / packets, ft.flows_created, ft.flows_evicted);
+    free(pkts);
+    flow_table_free(&ft);
+    return 0;
+}
+
+/*
+ * 多模式载荷匹配
+ *
+ * 两级结构：
+ * 1. Teddy风格预过滤：按模式前3字节的高/低半字节建表，模式按前缀排序后分进8个桶。
+ *    AVX2下每次用 vpshufb 并行检查32个起始位置，只有所有3个字节都落在同一桶里才成为候选。
+ *    不支持AVX2时退化为逐位置查前缀哈希位图。
+ * 2. 确认：候选位置先查前缀位图（长度>=4的模式按前4字节，3字节模式单独一张），
+ *    再从该位置锚定地沿模式字典树走，经过的每个模式终点都是一次命中。字典树没有失败链接
+ *    （不是Aho-Corasick自动机），每个候选位置独立地从根开始走，最多走最长模式的长度。
+ *
+ * 模式数很多（上万）且载荷是文本时，各桶的半字节掩码趋于饱和，预过滤的效果会下降，
+ * 这时开销主要在确认阶段。编译时按模式自身的字节分布估计候选率（载荷与模式同类时的
+ * 最坏情况），超过 PM_TEDDY_SATURATED 时AVX2扫描先试扫 PM_TEDDY_PROBE_BYTES 字节，
+ * 候选过半说明该载荷让掩码失效，余下部分直接走标量路径；二进制载荷仍享受预过滤。
+ * --bench-patterns 会分别给出二进制和文本载荷的吞吐。
+ */
+struct pm_edge {
+    int32_t parent;               // -1 表示空槽
+    int32_t child;
+    uint8_t byte;
+};
+
+struct pattern_matcher {
+    unsigned char teddy_lo[3][32];  // 第k个字节低半字节 -> 桶位（两个128位通道各存一份）
+    unsigned char teddy_hi[3][32];
+    uint64_t *prefix_filter;      // 长度>=4的模式的4字节前缀
+    uint64_t *short_filter;       // 3字节模式
+    int nshort;
+    struct pm_edge *edges;        // 字典树的边：(父节点, 字节) -> 子节点，开放寻址
+    uint32_t edge_mask;
+    uint32_t nedges;
+    int32_t *node_pattern;        // 以该节点结尾的模式编号，-1 表示不是终点
+    int nnodes;
+    int cap_nodes;
+    uint32_t *prefixes;           // 各模式前3字节，编译时用于分桶
+    int npatterns;
+    double teddy_density;         // 估计的候选率（载荷字节分布与模式前缀相同时）
+    int (*scan)(const struct pattern_matcher *m, const unsigned char *data, int len,
+                void (*on_match)(int pattern, int end, void *ctx), void *ctx);
+};
+
+static inline uint32_t pm_prefix_hash(const unsigned char *p, int n) {
+    uint32_t v = (uint32_t)p[0] | p[1] << 8 | p[2] << 16;
+    if (n == 4) v |= (uint32_t)p[3] << 24;
+    return ((v * 0x9e3779b1u) ^ n) >> (32 - PM_PREFIX_FILTER_BITS);
+}
+
+static inline int pm_filter_test(const uint64_t *filter, uint32_t h) {
+    return (filter[h / 64] >> (h % 64)) & 1;
+}
+
+static inline uint32_t pm_edge_slot(int32_t parent, uint8_t byte) {
+    return ((uint32_t)parent * 0x9e3779b1u) ^ (byte * 0x85ebca6bu);
+}
+
+static inline int32_t pm_child(const struct pattern_matcher *m, int32_t parent, uint8_t byte) {
+    for (uint32_t i = pm_edge_slot(parent, byte) & m->edge_mask;; i = (i + 1) & m->edge_mask) {
+        const struct pm_edge *e = &m->edges[i];
+        if (e->parent == parent && e->byte == byte) return e->child;
+        if (e->parent < 0) return -1;
+    }
+}
+
+static void pm_edge_insert(struct pm_edge *edges, uint32_t mask, int32_t parent, uint8_t byte, int32_t child) {
+    uint32_t i = pm_edge_slot(parent, byte) & mask;
+    while (edges[i].parent >= 0) i = (i + 1) & mask;
+    edges[i].parent = parent;
+    edges[i].byte = byte;
+    edges[i].child = child;
+}
+
+int pm_init(struct pattern_matcher *m) {
+    memset(m, 0, sizeof(*m));
+    m->edge_mask = 1023;
+    m->cap_nodes = 1024;
+    m->edges = mem_alloc(MEM_PATTERNS, (m->edge_mask + 1) * sizeof(struct pm_edge), 0);
+    m->node_pattern = mem_alloc(MEM_PATTERNS, m->cap_nodes * sizeof(int32_t), 0);
+    m->prefix_filter = mem_alloc(MEM_PATTERNS, (1u << PM_PREFIX_FILTER_BITS) / 8, 1);
+    m->short_filter = mem_alloc(MEM_PATTERNS, (1u << PM_PREFIX_FILTER_BITS) / 8, 1);
+    if (!m->edges || !m->node_pattern || !m->prefix_filter || !m->short_filter) return -1;
+    for (uint32_t i = 0; i <= m->edge_mask; i++) m->edges[i].parent = -1;
+    m->node_pattern[0] = -1;  // 根节点
+    m->nnodes = 1;
+    return 0;
+}
+
+/**
+ * 添加一个模式
+ * @return 模式编号，长度不足或内存不足返回-1
+ */
+int pm_add(struct pattern_matcher *m, const unsigned char *pattern, int len) {
+    if (len < PM_MIN_PATTERN_LEN) return -1;
+    if (m->npatterns % 1024 == 0) {
+        uint32_t *p = mem_realloc(MEM_PATTERNS, m->prefixes, (m->npatterns + 1024) * sizeof(uint32_t));
+        if (!p) return -1;
+        m->prefixes = p;
+    }
+
+    int32_t node = 0;
+    for (int i = 0; i < len; i++) {
+        int32_t next = pm_child(m, node, pattern[i]);
+        if (next < 0) {
+            if (m->nnodes == m->cap_nodes) {
+                int32_t *np = mem_realloc(MEM_PATTERNS, m->node_pattern, m->cap_nodes * 2 * sizeof(int32_t));
+                if (!np) return -1;
+                m->node_pattern = np;
+                m->cap_nodes *= 2;
+            }
+            if ((m->nedges + 1) * 2 > m->edge_mask + 1) {  // 负载超过一半时扩容
+                uint32_t new_mask = m->edge_mask * 2 + 1;
+                struct pm_edge *ne = mem_alloc(MEM_PATTERNS, (new_mask + 1) * sizeof(struct pm_edge), 0);
+                if (!ne) return -1;
+                for (uint32_t j = 0; j <= new_mask; j++) ne[j].parent = -1;
+                for (uint32_t j = 0; j <= m->edge_mask; j++)
+                    if (m->edges[j].parent >= 0)
+                        pm_edge_insert(ne, new_mask, m->edges[j].parent, m->edges[j].byte, m->edges[j].child);
+                mem_free(m->edges);
+                m->edges = ne;
+                m->edge_mask = new_mask;
+            }
+            next = m->nnodes++;
+            m->node_pattern[next] = -1;
+            pm_edge_insert(m->edges, m->edge_mask, node, pattern[i], next);
+            m->nedges++;
+        }
+        node = next;
+    }
+    if (m->node_pattern[node] < 0) m->node_pattern[node] = m->npatterns;  // 重复模式沿用首个编号
+
+    uint32_t h = pm_prefix_hash(pattern, len >= 4 ? 4 : 3);
+    if (len >= 4) {
+        m->prefix_filter[h / 64] |= 1ULL << (h % 64);
+    } else {
+        m->short_filter[h / 64] |= 1ULL << (h % 64);
+        m->nshort++;
+    }
+    m->prefixes[m->npatterns] = (uint32_t)pattern[0] << 16 | pattern[1] << 8 | pattern[2];
+    return m->npatterns++;
+}
+
+static int pm_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 在候选起始位置确认：前缀位图 + 锚定的字典树遍历
+ */
+static inline int pm_confirm(const struct pattern_matcher *m, const unsigned char *data, int len, int pos,
+                             void (*on_match)(int, int, void*), void *ctx) {
+    int found = 0;
+
+    if (!(m->nshort && pm_filter_test(m->short_filter, pm_prefix_hash(data + pos, 3))) &&
+        !(pos + 4 <= len && pm_filter_test(m->prefix_filter, pm_prefix_hash(data + pos, 4))))
+        return 0;
+    for (int32_t node = 0, i = pos; i < len; i++) {
+        node = pm_child(m, node, data[i]);
+        if (node < 0) break;
+        if (m->node_pattern[node] >= 0) {
+            found++;
+            if (on_match) on_match(m->node_pattern[node], i + 1, ctx);
+        }
+    }
+    return found;
+}
+
+// 从 pos 开始逐位置确认，也用作AVX2扫描的尾部和掩码饱和时的退路
+__attribute__((noinline))
+static int pm_scan_scalar_from(const struct pattern_matcher *m, const unsigned char *data, int len, int pos,
+                               void (*on_match)(int, int, void*), void *ctx) {
+    int found = 0;
+    for (; pos + PM_MIN_PATTERN_LEN <= len; pos++) found += pm_confirm(m, data, len, pos, on_match, ctx);
+    return found;
+}
+
+static int pm_scan_scalar(const struct pattern_matcher *m, const unsigned char *data, int len,
+                          void (*on_match)(int, int, void*), void *ctx) {
+    return pm_scan_scalar_from(m, data, len, 0, on_match, ctx);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int pm_scan_avx2(const struct pattern_matcher *m, const unsigned char *data, int len,
+                        void (*on_match)(int, int, void*), void *ctx) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo[3], hi[3];
+    int found = 0, pos = 0, ncand = 0;
+    int probing = m->teddy_density > PM_TEDDY_SATURATED;
+
+    for (int k = 0; k < 3; k++) {
+        lo[k] = _mm256_loadu_si256((const __m256i*)m->teddy_lo[k]);
+        hi[k] = _mm256_loadu_si256((const __m256i*)m->teddy_hi[k]);
+    }
+    for (; pos + 32 + 2 <= len; pos += 32) {
+        __m256i acc = _mm256_set1_epi8(-1);
+        for (int k = 0; k < 3; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + pos + k));
+            __m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(v, nibble));
+            __m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            acc = _mm256_and_si256(acc, _mm256_and_si256(l, h));
+        }
+        uint32_t cand = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, _mm256_setzero_si256()));
+        ncand += __builtin_popcount(cand);
+        while (cand) {
+            found += pm_confirm(m, data, len, pos + __builtin_ctz(cand), on_match, ctx);
+            cand &= cand - 1;
+        }
+        if (probing && pos + 32 >= PM_TEDDY_PROBE_BYTES) {
+            probing = 0;
+            if (ncand * 2 > pos + 32) {  // 掩码对这个载荷已失效，预过滤只是额外开销
+                pos += 32;
+                break;
+            }
+        }
+    }
+    return found + pm_scan_scalar_from(m, data, len, pos, on_match, ctx);
+}
+#endif
+
+/**
+ * 添加完模式后调用：按前缀分桶生成Teddy掩码，并选择扫描实现
+ * @param allow_simd 为0时强制使用标量实现（用于基准对比）
+ */
+void pm_compile(struct pattern_matcher *m, int allow_simd) {
+    uint32_t *sorted = malloc((m->npatterns + 1) * sizeof(uint32_t));
+    int nuniq = 0, have_masks = sorted != NULL;
+
+    memset(m->teddy_lo, 0, sizeof(m->teddy_lo));
+    memset(m->teddy_hi, 0, sizeof(m->teddy_hi));
+    if (sorted) {
+        // 相近的前缀放进同一个桶，桶内半字节掩码更稀疏
+        memcpy(sorted, m->prefixes, m->npatterns * sizeof(uint32_t));
+        qsort(sorted, m->npatterns, sizeof(uint32_t), pm_cmp_u32);
+        for (int i = 0; i < m->npatterns; i++)
+            if (nuniq == 0 || sorted[nuniq - 1] != sorted[i]) sorted[nuniq++] = sorted[i];
+        for (int i = 0; i < nuniq; i++) {
+            unsigned char bit = 1 << (i * PM_TEDDY_BUCKETS / nuniq);
+            for (int k = 0; k < 3; k++) {
+                unsigned char c = sorted[i] >> (16 - 8 * k);
+                m->teddy_lo[k][c & 15] |= bit;
+                m->teddy_lo[k][16 + (c & 15)] |= bit;
+                m->teddy_hi[k][c >> 4] |= bit;
+                m->teddy_hi[k][16 + (c >> 4)] |= bit;
+            }
+        }
+
+        // 估计候选率：第k个载荷字节按各前缀第k字节的分布取值，
+        // 某个桶三个字节都通过的概率相乘，各桶相加（上限1）
+        double pass[3][PM_TEDDY_BUCKETS] = {{0}};
+        for (int i = 0; i < nuniq; i++) {
+            for (int k = 0; k < 3; k++) {
+                unsigned char c = sorted[i] >> (16 - 8 * k);
+                unsigned char buckets = m->teddy_lo[k][c & 15] & m->teddy_hi[k][c >> 4];
+                for (int b = 0; b < PM_TEDDY_BUCKETS; b++)
+                    if (buckets & (1 << b)) pass[k][b] += 1.0 / nuniq;
+            }
+        }
+        m->teddy_density = 0;
+        for (int b = 0; b < PM_TEDDY_BUCKETS; b++) m->teddy_density += pass[0][b] * pass[1][b] * pass[2][b];
+        if (m->teddy_density > 1) m->teddy_density = 1;
+        free(sorted);
+    }
+
+    m->scan = pm_scan_scalar;
+#if defined(__x86_64__)
+    if (allow_simd && have_masks && __builtin_cpu_supports("avx2")) m->scan = pm_scan_avx2;
+#else
+    (void)allow_simd;
+#endif
+}
+
+void pm_free(struct pattern_matcher *m) {
+    mem_free(m->edges);
+    mem_free(m->node_pattern);
+    mem_free(m->prefix_filter);
+    mem_free(m->short_filter);
+    mem_free(m->prefixes);
+}
+
+/**
+ * 从文件加载模式，每行一个，支持 \xHH 转义
+ * @return 加载的模式数，文件打不开返回-1
+ */
+int pm_load_file(struct pattern_matcher *m, const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    unsigned char pat[1024];
+    int loaded = 0;
+
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)) {
+        int n = 0;
+        for (char *c = line; *c && *c != '\n' && *c != '\r'; c++) {
+            unsigned int v;
+            if (c[0] == '\\' && c[1] == 'x' && sscanf(c + 2, "%2x", &v) == 1) {
+                pat[n++] = v;
+                c += 3;
+            } else {
+                pat[n++] = *c;
+            }
+        }
+        if (pm_add(m, pat, n) >= 0) loaded++;
+    }
+    fclose(f);
+    pm_compile(m, 1);
+    return loaded;
+}
+
+/**
+ * 跳过IPv6扩展头，返回上层协议号，*off 指向上层首部
+ * 非首个分片没有上层首部，返回 IPPROTO_FRAGMENT，*off 指向分片数据
+ */
+static int packet_skip_ipv6_ext(const unsigned char *data, int len, int *off) {
+    int next = ((const struct ip6_hdr*)data)->ip6_nxt;
+
+    for (int n = 0; n < PM_IPV6_MAX_EXT && *off + 8 <= len; n++) {
+        const unsigned char *ext = data + *off;
+        if (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING || next == IPPROTO_DSTOPTS) {
+            *off += (ext[1] + 1) * 8;
+        } else if (next == IPPROTO_AH) {
+            *off += (ext[1] + 2) * 4;
+        } else if (next == IPPROTO_FRAGMENT) {
+            *off += 8;
+            if (ntohs(((const struct ip6_frag*)ext)->ip6f_offlg & IP6F_OFF_MASK)) return IPPROTO_FRAGMENT;
+        } else {
+            return next;
+        }
+        next = ext[0];
+    }
+    return next;  // 扩展头过多或被截断：余下部分按载荷处理，不让扩展头链绕过匹配
+}
+
+/**
+ * 返回IPv4/IPv6包的传输层载荷（TCP/UDP首部之后），其他协议返回整个IP载荷
+ */
+static const unsigned char *packet_payload(const unsigned char *data, int len, int *payload_len) {
+    int protocol, off;
+
+    *payload_len = 0;
+    if (len < 1) return NULL;
+    if ((data[0] >> 4) == 4) {
+        const struct iphdr *ip = (const struct iphdr*)data;
+        off = ip->ihl * 4;
+        if (len < (int)sizeof(struct iphdr) || len < off) return NULL;
+        if (ntohs(ip->tot_len) < len) len = ntohs(ip->tot_len);
+        protocol = ip->protocol;
+    } else if ((data[0] >> 4) == 6) {
+        if (len < (int)sizeof(struct ip6_hdr)) return NULL;
+        int ip_len = (int)sizeof(struct ip6_hdr) + ntohs(((const struct ip6_hdr*)data)->ip6_plen);
+        if (ip_len < len) len = ip_len;
+        off = sizeof(struct ip6_hdr);
+        protocol = packet_skip_ipv6_ext(data, len, &off);
+    } else {
+        return NULL;
+    }
+
+    int l4 = off;
+    if (protocol == IPPROTO_TCP && len >= l4 + (int)sizeof(struct tcphdr)) {
+        off += ((const struct tcphdr*)(data + l4))->doff * 4;
+    } else if (protocol == IPPROTO_UDP) {
+        off += 8;
+    }
+    if (off >= len) return NULL;
+    *payload_len = len - off;
+    return data + off;
+}
+
+/**
+ * 对一批数据包的载荷做匹配
+ * @param matched 输出：每个包命中的模式数
+ * @return 命中的包数
+ */
+int pm_scan_batch(const struct pattern_matcher *m, struct pkt_buf **pkts, int n, int *matched) {
+    int hit_packets = 0;
+    for (int i = 0; i < n; i++) {
+        int plen;
+        const unsigned char *payload = packet_payload(pkts[i]->data, pkts[i]->len, &plen);
+        matched[i] = payload ? m->scan(m, payload, plen, NULL, NULL) : 0;
+        if (matched[i]) hit_packets++;
+    }
+    return hit_packets;
+}
+
+/**
+ * 多模式匹配基准测试：随机模式，二进制（类似加密流量）和小写文本两种载荷
+ */
+int run_pattern_benchmark(int npatterns) {
+    const int nbufs = 256, buf_len = 1460, rounds = 200;
+    unsigned char *bufs = malloc(nbufs * buf_len);
+    unsigned int seed = 12345;
+
+    if (!bufs) return -1;
+    printf("=== 多模式匹配基准测试 (%d 个模式, %d 字节载荷) ===\n", npatterns, buf_len);
+    for (int simd = 1; simd >= 0; simd--) {
+        struct pattern_matcher m;
+        unsigned char pat[16];
+        if (pm_init(&m) < 0) return -1;
+        seed = 12345;
+        for (int i = 0; i < npatterns; i++) {
+            int len = 4 + rand_r(&seed) % 12;
+            for (int j = 0; j < len; j++) pat[j] = 'a' + rand_r(&seed) % 26;
+            pm_add(&m, pat, len);
+        }
+        pm_compile(&m, simd);
+        const char *impl = m.scan == pm_scan_scalar ? "标量" : "AVX2";
+        if (simd && m.scan == pm_scan_scalar) {
+            pm_free(&m);
+            continue;  // CPU不支持AVX2，只跑标量
+        }
+        if (simd) printf("  Teddy估计候选率 %.1f%%%s\n", m.teddy_density * 100,
+                         m.teddy_density > PM_TEDDY_SATURATED ? "（掩码饱和，按载荷试扫后选择路径）" : "");
+
+        for (int text = 0; text <= 1; text++) {
+            for (int i = 0; i < nbufs * buf_len; i++)
+                bufs[i] = text ? (i % 7 == 0 ? ' ' : 'a' + rand_r(&seed) % 26) : rand_r(&seed);
+            long hits = 0;
+            uint64_t start = monotonic_ns();
+            for (int r = 0; r < rounds; r++)
+                for (int b = 0; b < nbufs; b++) hits += m.scan(&m, bufs + b * buf_len, buf_len, NULL, NULL);
+            double ns = monotonic_ns() - start;
+            printf("  %-4s %s载荷: %.2f Gbps, 命中 %ld\n", impl, text ? "文本" : "二进制",
+                   (double)rounds * nbufs * buf_len * 8 / ns, hits);
+        }
+        pm_free(&m);
+    }
+    free(bufs);
+    return 0;
+}
+
+/*
+ * 链路损伤模拟
+ *
+ * 类似netem但在用户态、无需root：要发出的包增加一个引用后按释放时间放进小顶堆，
+ * 主循环每轮把到期的包真正发出（sendto 或写TUN）。
+ * - 带宽限制：包依次占用链路，释放时间 = 链路空闲时刻 + 传输时间
+ * - 延迟/抖动：再加上 delay ± 均匀分布的 jitter（抖动本身就会造成乱序）
+ * - 乱序：按概率跳过延迟立即发送，与netem的reorder语义相同
+ * - 丢包/重复：按概率丢弃或额外再排一份
+ * 随机数由种子决定，同样的配置和输入得到同样的损伤序列。
+ */
+struct impair_config {
+    double delay_ms;
+    double jitter_ms;
+    double loss;                  // 概率（0~1）
+    double duplicate;
+    double reorder;
+    double rate;                  // 字节/秒，0表示不限
+    uint64_t seed;
+};
+
+struct impair_entry {
+    uint64_t release_ns;
+    struct pkt_buf *pkt;
+    int fd;
+    struct sockaddr_in dest;
+    int has_dest;                 // 0表示 write()（TUN方向）
+};
+
+struct impair {
+    int enabled;
+    struct impair_config cfg;
+    uint64_t rng;
+    uint64_t link_free_ns;        // 带宽限制：链路下一次空闲的时刻
+    struct impair_entry heap[IMPAIR_MAX_PACKETS];
+    int count;
+    struct pkt_pool *pool;
+    uint64_t passed, lost, duplicated, reordered, overflow;
+};
+
+/**
+ * 解析损伤参数："delay=20,jitter=5,loss=1,dup=0.5,reorder=2,rate=10,seed=42"
+ * 时间单位毫秒，概率单位百分比，rate单位Mbit/s
+ */
+int impair_parse(struct impair_config *cfg, const char *spec) {
+    char buf[256], *save = NULL;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->seed = 1;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (v < 0) return -1;
+        if (strcmp(tok, "delay") == 0) cfg->delay_ms = v;
+        else if (strcmp(tok, "jitter") == 0) cfg->jitter_ms = v;
+        else if (strcmp(tok, "loss") == 0) cfg->loss = v / 100;
+        else if (strcmp(tok, "dup") == 0) cfg->duplicate = v / 100;
+        else if (strcmp(tok, "reorder") == 0) cfg->reorder = v / 100;
+        else if (strcmp(tok, "rate") == 0) cfg->rate = v * 1e6 / 8;
+        else if (strcmp(tok, "seed") == 0) cfg->seed = strtoull(eq + 1, NULL, 10);
+        else return -1;
+    }
+    return 0;
+}
+
+/**
+ * @param stream 区分两个方向，同一种子下两个方向得到不同的随机序列
+ */
+void impair_init(struct impair *imp, const struct impair_config *cfg, struct pkt_pool *pool, int stream) {
+    memset(imp, 0, sizeof(*imp));
+    imp->enabled = 1;
+    imp->cfg = *cfg;
+    imp->pool = pool;
+    imp->rng = (cfg->seed + stream) * 0x9e3779b97f4a7c15ULL | 1;
+}
+
+// xorshift64*，返回[0,1)
+static double impair_random(struct impair *imp) {
+    imp->rng ^= imp->rng >> 12;
+    imp->rng ^= imp->rng << 25;
+    imp->rng ^= imp->rng >> 27;
+    return ((imp->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void impair_push(struct impair *imp, const struct impair_entry *entry) {
+    int i = imp->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (imp->heap[parent].release_ns <= entry->release_ns) break;
+        imp->heap[i] = imp->heap[parent];
+        i = parent;
+    }
+    imp->heap[i] = *entry;
+}
+
+static void impair_pop(struct impair *imp, struct impair_entry *out) {
+    *out = imp->heap[0];
+    struct impair_entry last = imp->heap[--imp->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= imp->count) break;
+        if (child + 1 < imp->count && imp->heap[child + 1].release_ns < imp->heap[child].release_ns) child++;
+        if (last.release_ns <= imp->heap[child].release_ns) break;
+        imp->heap[i] = imp->heap[child];
+        i = child;
+    }
+    if (imp->count > 0) imp->heap[i] = last;
+}
+
+static ssize_t impair_transmit(int fd, const struct pkt_buf *pkt, const struct sockaddr_in *dest) {
+    if (dest) return sendto(fd, pkt->data, pkt->len, 0, (const struct sockaddr*)dest, sizeof(*dest));
+    return write(fd, pkt->data, pkt->len);
+}
+
+/**
+ * 经损伤层发送；未启用时直接发送。调用方保留自己的引用
+ * @param dest 为NULL时用 write() 写TUN
+ * @return 与 sendto/write 相同；被损伤层接收（含模拟丢包）时返回包长
+ */
+ssize_t impair_send(struct impair *imp, int fd, struct pkt_buf *pkt, const struct sockaddr_in *dest, uint64_t now_ns) {
+    if (!imp || !imp->enabled) return impair_transmit(fd, pkt, dest);
+
+    if (impair_random(imp) < imp->cfg.loss) {
+        imp->lost++;
+        return pkt->len;
+    }
+    int copies = impair_random(imp) < imp->cfg.duplicate ? 2 : 1;
+    for (int c = 0; c < copies; c++) {
+        if (imp->count >= IMPAIR_MAX_PACKETS) {
+            imp->overflow++;
+            break;
+        }
+        uint64_t release = now_ns;
+        if (imp->cfg.rate > 0) {
+            if (imp->link_free_ns > release) release = imp->link_free_ns;
+            release += (uint64_t)(pkt->len / imp->cfg.rate * 1e9);
+            imp->link_free_ns = release;
+        }
+        if (impair_random(imp) < imp->cfg.reorder) {
+            release = now_ns;  // 跳过延迟，越过前面排队的包
+            imp->reordered++;
+        } else {
+            double delay = imp->cfg.delay_ms + imp->cfg.jitter_ms * (2 * impair_random(imp) - 1);
+            if (delay > 0) release += (uint64_t)(delay * 1e6);
+        }
+
+        struct impair_entry entry = { .release_ns = release, .pkt = pkt, .fd = fd, .has_dest = dest != NULL };
+        if (dest) entry.dest = *dest;
+        pkt_buf_ref(pkt);
+        impair_push(imp, &entry);
+        if (c > 0) imp->duplicated++;
+    }
+    return pkt->len;
+}
+
+/**
+ * 发出所有已到释放时间的包
+ */
+void impair_pump(struct impair *imp, uint64_t now_ns) {
+    struct impair_entry entry;
+
+    while (imp->enabled && imp->count > 0 && imp->heap[0].release_ns <= now_ns) {
+        impair_pop(imp, &entry);
+        if (impair_transmit(entry.fd, entry.pkt, entry.has_dest ? &entry.dest : NULL) >= 0) imp->passed++;
+        pkt_buf_unref(imp->pool, entry.pkt);
+    }
+}
+
+// 距下一个包到期的毫秒数（向上取整），没有待发的包返回-1
+int impair_timeout_ms(const struct impair *imp, uint64_t now_ns) {
+    if (!imp->enabled || imp->count == 0) return -1;
+    if (imp->heap[0].release_ns <= now_ns) return 0;
+    return (imp->heap[0].release_ns - now_ns + 999999) / 1000000;
+}
+
+void impair_drain(struct impair *imp) {
+    struct impair_entry entry;
+    while (imp->count > 0) {
+        impair_pop(imp, &entry);
+        pkt_buf_unref(imp->pool, entry.pkt);
+    }
+}
+
+/*
+ * 假传输后端
+ *
+ * 假TUN：SOCK_SEQPACKET 的socketpair保留包边界，主循环把一端当作TUN；
+ * 另一端由流量发生器线程按给定速率写入带序号和发送时间的UDP包，
+ * 同时读回经对端反射回来的包，统计丢失、重复、乱序和往返时延。
+ * 假对端：本地回环上的UDP socket，把收到的包交换源/目的地址和端口后原样发回，
+ * 交换不改变IP和UDP校验和。
+ */
+struct fake_host {
+    int fd;
+    double pps;
+    volatile int stop;
+    volatile int quiesce;         // 停止发送，只接收在途的包
+    pthread_t thread;
+    uint64_t sent, received, duplicates, reordered;
+    uint64_t rtt_sum_ns, rtt_max_ns;
+    uint32_t max_seq_seen;
+    uint8_t *seen;                // 已收到序号的位图
+};
+
+struct fake_probe {
+    char magic[4];
+    uint32_t seq;
+    uint64_t send_ns;
+} __attribute__((packed));
+
+static void fake_host_receive(struct fake_host *h) {
+    unsigned char buf[BUFFER_SIZE];
+    ssize_t n;
+
+    while ((n = recv(h->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        struct fake_probe probe;
+        if (n < 28 + (ssize_t)sizeof(probe)) continue;
+        memcpy(&probe, buf + 28, sizeof(probe));
+        if (memcmp(probe.magic, "AWIM", 4) != 0 || probe.seq >= FAKE_MAX_SEQ) continue;
+
+        if (h->seen[probe.seq / 8] & (1 << (probe.seq % 8))) {
+            h->duplicates++;
+            continue;
+        }
+        h->seen[probe.seq / 8] |= 1 << (probe.seq % 8);
+        h->received++;
+        if (h->received > 1 && probe.seq < h->max_seq_seen) h->reordered++;
+        if (probe.seq > h->max_seq_seen) h->max_seq_seen = probe.seq;
+        uint64_t rtt = monotonic_ns() - probe.send_ns;
+        h->rtt_sum_ns += rtt;
+        if (rtt > h->rtt_max_ns) h->rtt_max_ns = rtt;
+    }
+}
+
+static void *fake_host_thread(void *arg) {
+    struct fake_host *h = arg;
+    unsigned char pkt[FAKE_PACKET_SIZE] = {0};
+    struct iphdr *ip = (struct iphdr*)pkt;
+    struct udphdr *udp = (struct udphdr*)(pkt + 20);
+    uint64_t start = monotonic_ns();
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->tot_len = htons(FAKE_PACKET_SIZE);
+    ip->saddr = inet_addr("192.168.233.1");
+    ip->daddr = inet_addr("192.168.233.2");
+    udp->source = htons(40000);
+    udp->dest = htons(7);
+    udp->len = htons(FAKE_PACKET_SIZE - 20);  // 校验和为0：UDP/IPv4允许不校验
+
+    while (!h->stop) {
+        // 按速率补发到当前应发的数量（每毫秒醒来一次）
+        uint64_t due = (uint64_t)((monotonic_ns() - start) / 1e9 * h->pps);
+        while (!h->quiesce && h->sent < due && h->sent < FAKE_MAX_SEQ) {
+            struct fake_probe probe = { .magic = "AWIM", .seq = h->sent, .send_ns = monotonic_ns() };
+            ip->id = htons(h->sent);
+            ip->check = 0;
+            ip->check = csum_fold(csum_add(0, pkt, 20));
+            memcpy(pkt + 28, &probe, sizeof(probe));
+            if (send(h->fd, pkt, sizeof(pkt), MSG_DONTWAIT) < 0) break;
+            h->sent++;
+        }
+        fake_host_receive(h);
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    fake_host_receive(h);
+    return NULL;
+}
+
+/**
+ * 创建假TUN
+ * @return 交给主循环当作TUN的一端，失败返回-1
+ */
+int fake_tun_start(struct fake_host *h, double pps) {
+    int sv[2];
+
+    memset(h, 0, sizeof(*h));
+    h->seen = calloc(FAKE_MAX_SEQ / 8, 1);
+    if (!h->seen || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) return -1;
+    h->fd = sv[1];
+    h->pps = pps;
+    if (pthread_create(&h->thread, NULL, fake_host_thread, h) != 0) return -1;
+    return sv[0];
+}
+
+void fake_tun_stop(struct fake_host *h) {
+    h->stop = 1;
+    pthread_join(h->thread, NULL);
+    uint64_t lost = h->sent > h->received ? h->sent - h->received : 0;
+    printf("假TUN流量: 发送 %lu, 收回 %lu, 丢失 %lu (%.2f%%), 重复 %lu, 乱序 %lu, RTT 平均 %.2fms 最大 %.2fms\n",
+           h->sent, h->received, lost, h->sent ? 100.0 * lost / h->sent : 0.0, h->duplicates, h->reordered,
+           h->received ? h->rtt_sum_ns / 1e6 / h->received : 0.0, h->rtt_max_ns / 1e6);
+    close(h->fd);
+    free(h->seen);
+}
+
+struct fake_peer {
+    int fd;
+    volatile int stop;
+    pthread_t thread;
+    uint64_t reflected;
+};
+
+static void *fake_peer_thread(void *arg) {
+    struct fake_peer *fp = arg;
+    unsigned char buf[BUFFER_SIZE];
+
+    while (!fp->stop) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        struct pollfd pfd = { .fd = fp->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        ssize_t n = recvfrom(fp->fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+        if (n < (ssize_t)sizeof(struct iphdr)) continue;
+
+        struct iphdr *ip = (struct iphdr*)buf;
+        uint32_t addr = ip->saddr;
+        ip->saddr = ip->daddr;
+        ip->daddr = addr;
+        int ihl = ip->ihl * 4;
+        if ((ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_TCP) && n >= ihl + 4) {
+            uint16_t ports[2];
+            memcpy(ports, buf + ihl, 4);
+            memcpy(buf + ihl, &ports[1], 2);
+            memcpy(buf + ihl + 2, &ports[0], 2);
+        }
+        if (sendto(fp->fd, buf, n, 0, (struct sockaddr*)&from, from_len) >= 0) fp->reflected++;
+    }
+    return NULL;
+}
+
+int fake_peer_start(struct fake_peer *fp, int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+
+    memset(fp, 0, sizeof(*fp));
+    fp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fp->fd < 0 || bind(fp->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
+    return pthread_create(&fp->thread, NULL, fake_peer_thread, fp) == 0 ? 0 : -1;
+}
+
+void fake_peer_stop(struct fake_peer *fp) {
+    fp->stop = 1;
+    pthread_join(fp->thread, NULL);
+    printf("假对端: 反射 %lu 个包\n", fp->reflected);
+    close(fp->fd);
+}
+
+/*
+ * 抓包回放
+ *
+ * 把pcap或pcapng文件整个mmap进来，先建一张索引，记下每个IP包在文件中的位置、长度和时间戳
+ * （链路层头已跳过）。回放线程按索引经SOCK_SEQPACKET的socketpair把包送进主循环，
+ * 和假TUN一样走完整的解析、匹配、路由和发送流程。可以按抓包时的间隔回放（可加速），
+ * 也可以尽快回放，还可以循环多遍。回放完关闭写方向，主循环读到EOF后退出。
+ */
+#define REPLAY_MAX_IFACES 16      // pcapng每段最多识别的接口数
+
+struct replay_pkt {
+    size_t offset;                // IP头在文件中的位置
+    uint32_t len;
+    uint64_t ts_ns;
+};
+
+struct replay {
+    const unsigned char *map;
+    size_t map_len;
+    struct replay_pkt *pkts;
+    int npkts, cap_pkts;
+    uint64_t skipped;             // 非IP、超长或接口未知的记录
+    double speed;                 // 相对抓包时间的倍速，0表示尽快
+    int loops;                    // 回放遍数，0表示无限循环
+    int fd;
+    volatile int stop;
+    pthread_t thread;
+    uint64_t sent, bytes, returned;
+    uint64_t start_ns, end_ns;
+};
+
+static inline uint32_t replay_u32(const unsigned char *p, int swap) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t replay_u16(const unsigned char *p, int swap) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+// 返回IP头在链路层帧中的偏移，不是IP包返回-1
+static int replay_l3_offset(uint32_t linktype, const unsigned char *frame, uint32_t caplen) {
+    uint32_t offset;
+
+    switch (linktype) {
+    case 0:                       // BSD回环，4字节地址族
+        offset = 4;
+        break;
+    case 1: {                     // 以太网，跳过VLAN标签
+        if (caplen < 14) return -1;
+        uint16_t type = frame[12] << 8 | frame[13];
+        offset = 14;
+        while ((type == 0x8100 || type == 0x88a8) && caplen >= offset + 4) {
+            type = frame[offset + 2] << 8 | frame[offset + 3];
+            offset += 4;
+        }
+        if (type != 0x0800 && type != 0x86dd) return -1;
+        break;
+    }
+    case 12: case 14: case 101: case 228: case 229:  // 原始IP
+        offset = 0;
+        break;
+    case 113:                     // Linux cooked
+        offset = 16;
+        break;
+    case 276:                     // Linux cooked v2
+        offset = 20;
+        break;
+    default:
+        return -1;
+    }
+    if (caplen < offset + 20) return -1;
+    int version = frame[offset] >> 4;
+    return version == 4 || version == 6 ? (int)offset : -1;
+}
+
+static void replay_add(struct replay *r, uint32_t linktype, size_t offset, uint32_t caplen, uint64_t ts_ns) {
+    int l3 = replay_l3_offset(linktype, r->map + offset, caplen);
+    if (l3 < 0 || caplen - l3 > BUFFER_SIZE) {
+        r->skipped++;
+        return;
+    }
+    if (r->npkts == r->cap_pkts) {
+        int cap = r->cap_pkts ? r->cap_pkts * 2 : 4096;
+        struct replay_pkt *pkts = mem_realloc(MEM_CAPTURE, r->pkts, cap * sizeof(*pkts));
+        if (!pkts) {
+            r->skipped++;
+            return;
+        }
+        r->pkts = pkts;
+        r->cap_pkts = cap;
+    }
+    r->pkts[r->npkts++] = (struct replay_pkt){ offset + l3, caplen - l3, ts_ns };
+}
+
+static void replay_index_pcap(struct replay *r) {
+    const unsigned char *p = r->map;
+    uint32_t magic;
+
+    memcpy(&magic, p, 4);
+    int swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    int nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    uint32_t linktype = replay_u32(p + 20, swap) & 0x0fffffff;  // 高位是FCS信息
+    for (size_t off = 24; off + 16 <= r->map_len; ) {
+        uint32_t sec = replay_u32(p + off, swap), frac = replay_u32(p + off + 4, swap);
+        uint32_t caplen = replay_u32(p + off + 8, swap);
+        if (caplen > r->map_len - off - 16) break;  // 文件末尾截断
+        replay_add(r, linktype, off + 16, caplen, sec * 1000000000ULL + (nsec ? frac : frac * 1000ULL));
+        off += 16 + caplen;
+    }
+}
+
+static void replay_index_pcapng(struct replay *r) {
+    const unsigned char *p = r->map;
+    uint32_t linktype[REPLAY_MAX_IFACES];
+    uint64_t units[REPLAY_MAX_IFACES];  // 各接口时间戳每秒的单位数
+    uint32_t nifaces = 0;
+    uint64_t last_ts = 0;
+    int swap = 0;
+
+    for (size_t off = 0; off + 12 <= r->map_len; ) {
+        uint32_t type = replay_u32(p + off, swap);
+        if (type == 0x0A0D0D0A) {
+            // 段头块：字节序标记决定本段的字节序，接口重新编号
+            swap = replay_u32(p + off + 8, 0) == 0x4D3C2B1A;
+            nifaces = 0;
+        }
+        uint32_t len = replay_u32(p + off + 4, swap);
+        if (len < 12 || len % 4 || len > r->map_len - off) break;
+        const unsigned char *body = p + off + 8;
+        uint32_t body_len = len - 12;
+
+        if (type == 1 && body_len >= 8) {
+            // 接口描述块：链路类型和 if_tsresol 选项
+            if (nifaces >= REPLAY_MAX_IFACES) break;
+            linktype[nifaces] = replay_u16(body, swap);
+            units[nifaces] = 1000000;
+            for (uint32_t o = 8; o + 4 <= body_len; ) {
+                uint16_t code = replay_u16(body + o, swap), olen = replay_u16(body + o + 2, swap);
+                if (code == 0 || o + 4 + olen > body_len) break;
+                if (code == 9 && olen >= 1) {
+                    uint8_t v = body[o + 4];
+                    if (v & 0x80) {
+                        if ((v & 0x7f) < 64) units[nifaces] = 1ULL << (v & 0x7f);
+                    } else if (v <= 19) {
+                        units[nifaces] = 1;
+                        while (v--) units[nifaces] *= 10;
+                    }
+                }
+                o += 4 + ((olen + 3) & ~3u);
+            }
+            nifaces++;
+        } else if (type == 6 && body_len >= 20) {
+            // 增强包块
+            uint32_t iface = replay_u32(body, swap), caplen = replay_u32(body + 12, swap);
+            if (iface < nifaces && caplen <= body_len - 20) {
+                uint64_t ts = (uint64_t)replay_u32(body + 4, swap) << 32 | replay_u32(body + 8, swap);
+                last_ts = (unsigned __int128)ts * 1000000000u / units[iface];
+                replay_add(r, linktype[iface], body + 20 - p, caplen, last_ts);
+            } else {
+                r->skipped++;
+            }
+        } else if (type == 3 && body_len >= 4 && nifaces > 0) {
+            // 简单包块没有时间戳，沿用上一个包的
+            uint32_t caplen = replay_u32(body, swap);
+            if (caplen > body_len - 4) caplen = body_len - 4;
+            replay_add(r, linktype[0], body + 4 - p, caplen, last_ts);
+        }
+        off += len;
+    }
+}
+
+void replay_close(struct replay *r) {
+    if (r->map) munmap((void*)r->map, r->map_len);
+    mem_free(r->pkts);
+    r->map = NULL;
+    r->pkts = NULL;
+}
+
+/**
+ * 映射抓包文件并建立索引
+ * @return 0 成功；文件无法读取、格式不认识或没有IP包返回-1
+ */
+int replay_open(struct replay *r, const char *path) {
+    struct stat st;
+    uint32_t magic;
+
+    memset(r, 0, sizeof(*r));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < 24) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    r->map = map;
+    r->map_len = st.st_size;
+    madvise(map, r->map_len, MADV_SEQUENTIAL);
+
+    memcpy(&magic, r->map, 4);
+    if (magic == 0x0A0D0D0A) {
+        replay_index_pcapng(r);
+    } else if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+        replay_index_pcap(r);
+    }
+    if (r->npkts == 0) {
+        replay_close(r);
+        return -1;
+    }
+    return 0;
+}
+
+// 读走经对端反射回来的包
+static void replay_drain(struct replay *r) {
+    unsigned char buf[BUFFER_SIZE];
+    while (recv(r->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) r->returned++;
+}
+
+static void *replay_thread(void *arg) {
+    struct replay *r = arg;
+
+    r->start_ns = monotonic_ns();
+    for (int loop = 0; !r->stop && (r->loops == 0 || loop < r->loops); loop++) {
+        uint64_t loop_start = monotonic_ns(), first_ts = r->pkts[0].ts_ns;
+        for (int i = 0; i < r->npkts && !r->stop; i++) {
+            const struct replay_pkt *pkt = &r->pkts[i];
+            if (r->speed > 0) {
+                // 多接口合并的抓包时间戳可能倒退，早于首包的立即发送
+                uint64_t due = loop_start + (pkt->ts_ns > first_ts ? (uint64_t)((pkt->ts_ns - first_ts) / r->speed) : 0);
+                for (uint64_t now = monotonic_ns(); now < due && !r->stop; now = monotonic_ns()) {
+                    replay_drain(r);
+                    uint64_t wait = due - now < 100000000 ? due - now : 100000000;
+                    struct timespec ts = { 0, wait };
+                    nanosleep(&ts, NULL);
+                }
+            }
+            // 主循环跟不上时等它读走，尽快模式下也不丢包
+            while (!r->stop && send(r->fd, r->map + pkt->offset, pkt->len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+                if (errno != EAGAIN && errno != ENOBUFS) {
+                    r->stop = 1;
+                    break;
+                }
+                replay_drain(r);
+                struct pollfd pfd = { .fd = r->fd, .events = POLLOUT };
+                poll(&pfd, 1, 100);
+            }
+            if (r->stop) break;
+            r->sent++;
+            r->bytes += pkt->len;
+            if ((r->sent & 31) == 0) replay_drain(r);
+        }
+    }
+    r->end_ns = monotonic_ns();
+    shutdown(r->fd, SHUT_WR);
+    while (!r->stop) {
+        replay_drain(r);
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        poll(&pfd, 1, 100);
+    }
+    replay_drain(r);
+    return NULL;
+}
+
+/**
+ * 开始回放
+ * @param speed 相对抓包时间的倍速，0表示尽快
+ * @param loops 回放遍数，0表示无限循环
+ * @return 交给主循环当作TUN的一端，失败返回-1
+ */
+int replay_start(struct replay *r, double speed, int loops) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) return -1;
+    r->fd = sv[1];
+    r->speed = speed;
+    r->loops = loops;
+    if (pthread_create(&r->thread, NULL, replay_thread, r) != 0) return -1;
+    return sv[0];
+}
+
+void replay_stop(struct replay *r) {
+    r->stop = 1;
+    pthread_join(r->thread, NULL);
+    if (!r->end_ns) r->end_ns = monotonic_ns();
+    double seconds = (r->end_ns - r->start_ns) / 1e9;
+    printf("抓包回放: 发送 %lu 个包 (%.1f MB), 用时 %.2fs, %.0f 包/秒, %.1f Mbit/s, 收回 %lu, 跳过 %lu 条记录\n",
+           r->sent, r->bytes / 1e6, seconds, seconds > 0 ? r->sent / seconds : 0.0,
+           seconds > 0 ? r->bytes * 8 / seconds / 1e6 : 0.0, r->returned, r->skipped);
+    close(r->fd);
+    replay_close(r);
+}
+
+/*
+ * 飞行记录器
+ *
+ * 每个数据路径线程一个定长环形缓冲区，循环保存最近经过的包的前snaplen字节、原始长度、
+ * 方向和批时间戳。记录只是一次短memcpy，常开也几乎没有开销。收到SIGUSR1，
+ * 或触发条件成立（每秒丢包数突增、收到来自未知对端的包）时，把最近若干秒的记录写成pcapng，
+ * 每个记录器是文件中的一个接口，方向写在epb_flags里。
+ * 记录在属主线程里进行，不需要加锁。落盘时属主线程只把环换成一块新分配的空环，
+ * 旧环交给写线程生成文件，转发循环不会因写文件停顿；上一次还没写完时推迟到下一批再落盘。
+ */
+#define FLIGHT_DEFAULT_SNAPLEN 128
+#define FLIGHT_DEFAULT_MB 4
+#define FLIGHT_DEFAULT_SECONDS 30
+#define FLIGHT_POST_TRIGGER_NS 1000000000ULL  // 触发后再记录1秒才落盘，事故之后的包也在文件里
+#define FLIGHT_HOLDOFF_NS 10000000000ULL      // 两次自动落盘的最小间隔
+#define FLIGHT_MAX_RECORDERS 8
+
+enum { FLIGHT_OUT, FLIGHT_IN };   // 从TUN读出发往对端 / 从对端收到
+
+struct flight_config {
+    int enabled;
+    uint32_t snaplen;
+    double mb;                    // 每个记录器的缓冲区大小
+    double seconds;               // 落盘时保留最近多少秒，0表示整个缓冲区
+    double drops;                 // 每秒丢包达到此数时触发，0表示不触发
+    int unknown_peer;             // 收到未知对端的包时触发
+    char *dir;                    // 落盘目录（flight_parse 分配，flight_config_free 释放）
+};
+
+struct flight_slot {
+    uint64_t ts_ns;               // 单调时钟，落盘时换算成墙上时间
+    uint16_t len;
+    uint16_t caplen;
+    uint8_t dir;
+};
+
+struct flight_recorder {
+    const char *name;             // pcapng中的接口名
+    unsigned char *ring;
+    uint32_t snaplen, slot_size, nslots;
+    uint32_t head;                // 下一个写入的槽
+    uint32_t used;                // 环中有效的记录数，写满后等于 nslots
+    uint64_t recorded;
+};
+
+struct flight_trigger {
+    uint64_t last_check_ns;       // 每秒比较一次累计计数
+    uint64_t last_drops, last_unknown;
+    uint64_t dump_at_ns;          // 已触发、等待落盘的时间，0表示没有
+    uint64_t last_dump_ns;
+    const char *reason;
+    uint64_t dumps;
+    // 写线程：snap 中是换下来的旧环，写完后由写线程释放并清除 writing
+    pthread_t writer;
+    int writer_started;
+    int writing;
+    struct flight_recorder snap[FLIGHT_MAX_RECORDERS];
+    int nsnap;
+    char path[512];
+    const char *snap_reason;
+    double seconds;
+    uint64_t snap_ns;
+};
+
+int flight_parse(struct flight_config *cfg, const char *spec) {
+    char buf[256], *save = NULL;
+
+    if (strcmp(spec, "off") == 0) {
+        cfg->enabled = 0;
+        return 0;
+    }
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (v < 0) return -1;
+        if (strcmp(tok, "size") == 0) cfg->mb = v;
+        else if (strcmp(tok, "snaplen") == 0) cfg->snaplen = v;
+        else if (strcmp(tok, "seconds") == 0) cfg->seconds = v;
+        else if (strcmp(tok, "drops") == 0) cfg->drops = v;
+        else if (strcmp(tok, "peer") == 0) cfg->unknown_peer = v != 0;
+        else if (strcmp(tok, "dir") == 0) {
+            free(cfg->dir);
+            cfg->dir = strdup(eq + 1);
+            if (!cfg->dir) return -1;
+        }
+        else return -1;
+    }
+    if (cfg->snaplen < 20 || cfg->snaplen > BUFFER_SIZE || cfg->mb <= 0) return -1;
+    return 0;
+}
+
+void flight_config_free(struct flight_config *cfg) {
+    free(cfg->dir);
+    cfg->dir = NULL;
+}
+
+int flight_init(struct flight_recorder *fr, const char *name, const struct flight_config *cfg) {
+    memset(fr, 0, sizeof(*fr));
+    fr->name = name;
+    fr->snaplen = cfg->snaplen;
+    fr->slot_size = (sizeof(struct flight_slot) + cfg->snaplen + 7) & ~7u;
+    fr->nslots = cfg->mb * (1 << 20) / fr->slot_size;
+    if (fr->nslots == 0) return -1;
+    fr->ring = mem_alloc(MEM_CAPTURE, (size_t)fr->nslots * fr->slot_size, 0);
+    return fr->ring ? 0 : -1;
+}
+
+void flight_free(struct flight_recorder *fr) {
+    mem_free(fr->ring);
+    fr->ring = NULL;
+}
+
+static inline void flight_record(struct flight_recorder *fr, const unsigned char *data, int len, int dir,
+                                 uint64_t now_ns) {
+    if (!fr->ring) return;
+    unsigned char *slot = fr->ring + (size_t)fr->head * fr->slot_size;
+    struct flight_slot *rec = (struct flight_slot*)slot;
+    uint32_t caplen = (uint32_t)len < fr->snaplen ? (uint32_t)len : fr->snaplen;
+
+    rec->ts_ns = now_ns;
+    rec->len = len;
+    rec->caplen = caplen;
+    rec->dir = dir;
+    memcpy(slot + sizeof(*rec), data, caplen);
+    if (++fr->head == fr->nslots) fr->head = 0;
+    if (fr->used < fr->nslots) fr->used++;
+    fr->recorded++;
+}
+
+// 写一个pcapng块：块类型、总长、正文（补齐到4字节）、总长
+static void flight_write_block(FILE *f, uint32_t type, const void *body, uint32_t body_len,
+                               const void *tail, uint32_t tail_len) {
+    static const unsigned char pad[4];
+    uint32_t padded = (body_len + 3) & ~3u;
+    uint32_t total = 12 + padded + tail_len;
+
+    fwrite(&type, 4, 1, f);
+    fwrite(&total, 4, 1, f);
+    fwrite(body, 1, body_len, f);
+    fwrite(pad, 1, padded - body_len, f);
+    if (tail_len) fwrite(tail, 1, tail_len, f);
+    fwrite(&total, 4, 1, f);
+}
+
+/**
+ * 把记录器中最近 seconds 秒的包写成pcapng
+ * @return 写入的包数，无法创建文件返回-1
+ */
+int flight_dump(struct flight_recorder *const *recs, int nrecs, const char *path, double seconds, uint64_t now_ns) {
+    FILE *f = fopen(path, "wb");
+    struct timespec rt;
+    int written = 0;
+
+    if (!f) return -1;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    // 在写线程里调用时 now_ns 已过去一段时间，墙上时间偏移按当前的单调时钟算
+    uint64_t wall_offset = (uint64_t)rt.tv_sec * 1000000000ULL + rt.tv_nsec - monotonic_ns();
+    uint64_t oldest = seconds > 0 && now_ns > seconds * 1e9 ? now_ns - (uint64_t)(seconds * 1e9) : 0;
+
+    // 段头块：字节序标记、版本1.0、段长度未知
+    struct { uint32_t bom; uint16_t major, minor; int64_t section_len; } shb = { 0x1A2B3C4D, 1, 0, -1 };
+    flight_write_block(f, 0x0A0D0D0A, &shb, sizeof(shb), NULL, 0);
+    for (int i = 0; i < nrecs; i++) {
+        // 接口描述块：原始IP链路，if_name 和 if_tsresol=9（纳秒）
+        unsigned char idb[8 + 4 + 64 + 8 + 4];
+        uint16_t linktype = 101, zero = 0, code, olen;
+        uint32_t snaplen = recs[i]->snaplen;
+        size_t name_len = strnlen(recs[i]->name, 63), n = 0;
+        memcpy(idb + n, &linktype, 2); n += 2;
+        memcpy(idb + n, &zero, 2); n += 2;
+        memcpy(idb + n, &snaplen, 4); n += 4;
+        code = 2; olen = name_len;
+        memcpy(idb + n, &code, 2); n += 2;
+        memcpy(idb + n, &olen, 2); n += 2;
+        memset(idb + n, 0, (name_len + 3) & ~3u);
+        memcpy(idb + n, recs[i]->name, name_len); n += (name_len + 3) & ~3u;
+        code = 9; olen = 1;
+        memcpy(idb + n, &code, 2); n += 2;
+        memcpy(idb + n, &olen, 2); n += 2;
+        memset(idb + n, 0, 4);
+        idb[n] = 9; n += 4;
+        memset(idb + n, 0, 4); n += 4;  // opt_endofopt
+        flight_write_block(f, 1, idb, n, NULL, 0);
+    }
+
+    for (int i = 0; i < nrecs; i++) {
+        const struct flight_recorder *fr = recs[i];
+        uint64_t count = fr->used;
+        uint32_t slot = fr->used < fr->nslots ? 0 : fr->head;  // 从最旧的一条开始
+
+        for (uint64_t k = 0; k < count; k++, slot = slot + 1 == fr->nslots ? 0 : slot + 1) {
+            const unsigned char *p = fr->ring + (size_t)slot * fr->slot_size;
+            const struct flight_slot *rec = (const struct flight_slot*)p;
+            if (rec->ts_ns < oldest) continue;
+            uint64_t ts = rec->ts_ns + wall_offset;
+            unsigned char epb[20 + BUFFER_SIZE];
+            uint32_t hdr[5] = { i, ts >> 32, (uint32_t)ts, rec->caplen, rec->len };
+            memcpy(epb, hdr, sizeof(hdr));
+            memcpy(epb + sizeof(hdr), p + sizeof(*rec), rec->caplen);
+            // epb_flags：方向，入站1，出站2
+            struct { uint16_t code, len; uint32_t flags; uint32_t end; } opts = { 2, 4, rec->dir == FLIGHT_IN ? 1 : 2, 0 };
+            flight_write_block(f, 6, epb, sizeof(hdr) + rec->caplen, &opts, sizeof(opts));
+            written++;
+        }
+    }
+    if (fclose(f) != 0) return -1;
+    return written;
+}
+
+static void *flight_writer_thread(void *arg) {
+    struct flight_trigger *t = arg;
+    struct flight_recorder *recs[FLIGHT_MAX_RECORDERS];
+
+    for (int i = 0; i < t->nsnap; i++) recs[i] = &t->snap[i];
+    int n = flight_dump(recs, t->nsnap, t->path, t->seconds, t->snap_ns);
+    if (n < 0) {
+        perror("飞行记录器落盘失败");
+    } else {
+        printf("飞行记录器: 因 %s 写出 %s (%d 个包)\n", t->snap_reason, t->path, n);
+    }
+    for (int i = 0; i < t->nsnap; i++) flight_free(&t->snap[i]);
+    __atomic_store_n(&t->writing, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * 每批末尾调用：检查触发条件，到时间后换下记录环交给写线程落盘
+ * @param manual 收到了SIGUSR1
+ * @param drops 累计丢包数
+ * @param unknown 累计收到的未知对端包数
+ */
+void flight_poll(struct flight_trigger *t, const struct flight_config *cfg, struct flight_recorder *const *recs,
+                 int nrecs, uint64_t now_ns, int manual, uint64_t drops, uint64_t unknown) {
+    if (!cfg->enabled) return;
+    if (manual) {
+        if (!t->dump_at_ns) t->reason = "manual";
+        t->dump_at_ns = now_ns;  // 已触发的提前落盘
+    } else if (now_ns - t->last_check_ns >= 1000000000ULL) {
+        double elapsed = (now_ns - t->last_check_ns) / 1e9;
+        int armed = t->last_check_ns && !t->dump_at_ns &&
+                    (!t->last_dump_ns || now_ns - t->last_dump_ns >= FLIGHT_HOLDOFF_NS);
+        if (armed && cfg->drops > 0 && (drops - t->last_drops) / elapsed >= cfg->drops) {
+            t->reason = "drops";
+            t->dump_at_ns = now_ns + FLIGHT_POST_TRIGGER_NS;
+        } else if (armed && cfg->unknown_peer && unknown > t->last_unknown) {
+            t->reason = "unknown-peer";
+            t->dump_at_ns = now_ns + FLIGHT_POST_TRIGGER_NS;
+        }
+        t->last_drops = drops;
+        t->last_unknown = unknown;
+        t->last_check_ns = now_ns;
+    }
+    if (!t->dump_at_ns || now_ns < t->dump_at_ns) return;
+
+    if (__atomic_load_n(&t->writing, __ATOMIC_ACQUIRE)) return;  // 上一次还在写，下一批再来
+    if (t->writer_started) {
+        pthread_join(t->writer, NULL);
+        t->writer_started = 0;
+    }
+    if (nrecs > FLIGHT_MAX_RECORDERS) nrecs = FLIGHT_MAX_RECORDERS;
+
+    // 换环：新环分配失败的记录器本次不落盘
+    t->nsnap = 0;
+    for (int i = 0; i < nrecs; i++) {
+        struct flight_recorder *fr = recs[i];
+        unsigned char *ring = fr->used ? mem_alloc(MEM_CAPTURE, (size_t)fr->nslots * fr->slot_size, 0) : NULL;
+        if (!ring) continue;
+        t->snap[t->nsnap++] = *fr;
+        fr->ring = ring;
+        fr->head = 0;
+        fr->used = 0;
+    }
+
+    char stamp[32];
+    time_t wall = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&wall));
+    snprintf(t->path, sizeof(t->path), "%s/flight-%s-%s.pcapng", cfg->dir ? cfg->dir : ".", stamp, t->reason);
+    t->snap_reason = t->reason;
+    t->seconds = cfg->seconds;
+    t->snap_ns = now_ns;
+    t->dump_at_ns = 0;
+    t->last_dump_ns = now_ns;
+    t->dumps++;
+    if (!t->nsnap) return;
+
+    __atomic_store_n(&t->writing, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&t->writer, NULL, flight_writer_thread, t) == 0) {
+        t->writer_started = 1;
+    } else {
+        flight_writer_thread(t);  // 起不了线程时退回在本线程里写
+    }
+}
+
+/**
+ * 等待进行中的落盘写完（退出前调用）
+ */
+void flight_wait(struct flight_trigger *t) {
+    if (!t->writer_started) return;
+    pthread_join(t->writer, NULL);
+    t->writer_started = 0;
+}
+
+/*
+ * 流水线各阶段耗时：主循环按批计时，回放结束时报告每个阶段单独能达到的包速率
+ * （演示中省略WireGuard封装和加密，没有加密阶段）
+ */
+enum { STAGE_RX, STAGE_MATCH, STAGE_FORWARD, STAGE_SEND, STAGE_COUNT };
+
+static const char *stage_names[STAGE_COUNT] = { "接收+解析", "载荷匹配", "路由+入队", "发送" };
+
+struct stage_stats {
+    uint64_t ns[STAGE_COUNT];
+    uint64_t packets[STAGE_COUNT];
+};
+
+// 把上一个时间点到现在的耗时记到该阶段，空批只推进时间点
+static inline void stage_account(struct stage_stats *st, int stage, uint64_t *mark, uint64_t packets) {
+    uint64_t now = monotonic_ns();
+    if (packets) {
+        st->ns[stage] += now - *mark;
+        st->packets[stage] += packets;
+    }
+    *mark = now;
+}
+
+void stage_report(const struct stage_stats *st) {
+    printf("流水线各阶段:\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        double per = st->packets[i] ? (double)st->ns[i] / st->packets[i] : 0;
+        printf("  %s: %lu 个包, %.1f ns/包, %.2f M包/秒\n", stage_names[i], st->packets[i], per,
+               per > 0 ? 1e3 / per : 0.0);
+    }
+}
+
+/*
+ * 应用感知的QoS
+ *
+ * 流的分类在首包时按端口得出，SNI确定（找到或放弃）后再按SNI规则定一次，
+ * 之后每包只读流表中缓存的结果。用户规则按添加顺序优先，其次是内置端口规则。
+ *
+ * 出口按对端各有三个队列：交互类严格优先；批量和后台类按字节做加权轮转（DRR），
+ * 后台类只能拿到剩余带宽的1/5。设置了 --egress-rate 时每个对端按该速率整形，
+ * 排队发生在这里，交互类包就不必排在隧道瓶颈处的批量数据后面。
+ */
+enum {
+    QOS_INTERACTIVE = 0,
+    QOS_BULK,
+    QOS_BACKGROUND,
+    QOS_CLASSES,
+};
+
+static const char *qos_class_names[QOS_CLASSES] = { "interactive", "bulk", "background" };
+
+struct qos_rule {
+    uint16_t port;                // 服务端端口（主机字节序），0表示不按端口
+    char sni[SNI_MAX_LEN];        // 以'.'开头表示后缀匹配（也匹配去掉'.'的域名本身）
+    uint8_t qos_class;
+};
+
+struct qos_rules {
+    struct qos_rule rules[QOS_MAX_RULES];
+    int nrules;
+};
+
+struct qos_queue {
+    struct pkt_buf *head;
+    struct pkt_buf *tail;
+    int len;
+};
+
+struct peer_egress {
+    struct qos_queue queues[QOS_CLASSES];
+    int deficit[QOS_CLASSES];
+    int drr_current;              // 当前轮到的加权类
+    double tokens;                // 整形令牌（字节）
+    uint64_t last_refill_ns;
+    uint64_t sent[QOS_CLASSES];
+    uint64_t dropped[QOS_CLASSES];
+    uint64_t delay_ns[QOS_CLASSES];  // 累计排队时延
+};
+
+struct egress_sched {
+    struct peer_egress peers[MAX_PEERS];
+    double rate;                  // 每个对端的整形速率（字节/秒），0表示不整形
+    int backlog;                  // 所有队列中的包数
+};
+
+static const int qos_queue_limits[QOS_CLASSES] = { QOS_INTERACTIVE_LIMIT, QOS_BULK_LIMIT, QOS_BACKGROUND_LIMIT };
+static const int qos_quantum[QOS_CLASSES] = { 0, QOS_BULK_QUANTUM, QOS_BACKGROUND_QUANTUM };
+
+/**
+ * 解析QoS规则："port=22:interactive" 或 "sni=.example.com:background"
+ */
+int qos_parse_rule(struct qos_rules *rules, const char *spec) {
+    struct qos_rule *r = &rules->rules[rules->nrules];
+    const char *colon = strrchr(spec, ':');
+    int cls;
+
+    if (rules->nrules >= QOS_MAX_RULES || !colon) return -1;
+    for (cls = 0; cls < QOS_CLASSES; cls++)
+        if (strcmp(colon + 1, qos_class_names[cls]) == 0) break;
+    if (cls == QOS_CLASSES) return -1;
+
+    memset(r, 0, sizeof(*r));
+    if (strncmp(spec, "port=", 5) == 0) {
+        r->port = atoi(spec + 5);
+        if (r->port == 0) return -1;
+    } else if (strncmp(spec, "sni=", 4) == 0 && colon - (spec + 4) > 0 && colon - (spec + 4) < SNI_MAX_LEN) {
+        memcpy(r->sni, spec + 4, colon - (spec + 4));
+    } else {
+        return -1;
+    }
+    r->qos_class = cls;
+    rules->nrules++;
+    return 0;
+}
+
+static int qos_sni_match(const char *rule, const char *sni) {
+    if (rule[0] != '.') return strcasecmp(rule, sni) == 0;
+    size_t rl = strlen(rule), sl = strlen(sni);
+    if (sl + 1 == rl) return strcasecmp(rule + 1, sni) == 0;
+    return sl > rl && strcasecmp(sni + sl - rl, rule) == 0;
+}
+
+static int qos_default_class(const struct flow_entry *flow, uint16_t server_port) {
+    if (flow->key.protocol == IPPROTO_ICMP) return QOS_INTERACTIVE;
+    switch (server_port) {
+    case 22: case 53: case 123: case 3389: case 5060:  // SSH、DNS、NTP、RDP、SIP
+        return QOS_INTERACTIVE;
+    default:
+        return QOS_BULK;
+    }
+}
+
+/**
+ * 返回流的QoS类；只在首包和SNI刚确定时真正计算
+ */
+int qos_flow_class(const struct qos_rules *rules, struct flow_entry *flow) {
+    if (flow->qos_state == 2 || (flow->qos_state == 1 && flow->sni_state == SNI_PENDING))
+        return flow->qos_class;
+
+    uint16_t server_port = ntohs(flow->key.port[!flow->initiator]);
+    int cls = -1;
+    for (int i = 0; i < rules->nrules && cls < 0; i++) {
+        const struct qos_rule *r = &rules->rules[i];
+        if (r->port && r->port == server_port) cls = r->qos_class;
+        if (r->sni[0] && flow->sni_state == SNI_FOUND && qos_sni_match(r->sni, flow->sni)) cls = r->qos_class;
+    }
+    flow->qos_class = cls >= 0 ? cls : qos_default_class(flow, server_port);
+    flow->qos_state = flow->sni_state == SNI_PENDING ? 1 : 2;
+    return flow->qos_class;
+}
+
+/**
+ * 包进入对端的出口队列（转移调用方持有的引用），队列满时尾丢弃
+ * @return 入队返回0，丢弃返回-1
+ */
+int egress_enqueue(struct egress_sched *sched, int peer, struct pkt_pool *pool, struct pkt_buf *pkt,
+                   int cls, uint64_t now_ns) {
+    struct peer_egress *e = &sched->peers[peer];
+    struct qos_queue *q = &e->queues[cls];
+
+    if (q->len >= qos_queue_limits[cls]) {
+        e->dropped[cls]++;
+        pkt_buf_unref(pool, pkt);
+        return -1;
+    }
+    pkt->next = NULL;
+    pkt->queued_ns = now_ns;
+    if (q->tail) {
+        q->tail->next = pkt;
+    } else {
+        q->head = pkt;
+    }
+    q->tail = pkt;
+    q->len++;
+    sched->backlog++;
+    return 0;
+}
+
+// 选出下一个要发送的类：交互类严格优先，其余按字节DRR；全空返回-1
+static int egress_pick(struct peer_egress *e) {
+    if (e->queues[QOS_INTERACTIVE].head) return QOS_INTERACTIVE;
+    if (!e->queues[QOS_BULK].head && !e->queues[QOS_BACKGROUND].head) return -1;
+    if (e->drr_current == QOS_INTERACTIVE) e->drr_current = QOS_BULK;
+
+    for (;;) {
+        int c = e->drr_current;
+        struct pkt_buf *head = e->queues[c].head;
+        if (head && head->len <= e->deficit[c]) return c;
+        if (!head) e->deficit[c] = 0;  // 空队列不积攒额度
+        e->drr_current = c == QOS_BULK ? QOS_BACKGROUND : QOS_BULK;
+        e->deficit[e->drr_current] += qos_quantum[e->drr_current];
+    }
+}
+
+/**
+ * 按调度顺序和整形速率把队列中的包发往对端（经损伤层，可为NULL），socket缓冲满时停下
+ */
+void egress_flush(struct egress_sched *sched, struct route_table *routes, struct pkt_pool *pool,
+                  int udp_fd, struct impair *imp, uint64_t now_ns) {
+    for (int p = 0; p < routes->npeers && sched->backlog > 0; p++) {
+        struct peer_egress *e = &sched->peers[p];
+        struct tun_peer *peer = &routes->peers[p];
+
+        if (sched->rate > 0) {
+            double burst = sched->rate * EGRESS_BURST_NS / 1e9;
+            if (burst < BUFFER_SIZE) burst = BUFFER_SIZE;
+            e->tokens += (now_ns - e->last_refill_ns) * sched->rate / 1e9;
+            if (e->tokens > burst) e->tokens = burst;
+            e->last_refill_ns = now_ns;
+        }
+
+        int cls;
+        while ((cls = egress_pick(e)) >= 0) {
+            struct qos_queue *q = &e->queues[cls];
+            struct pkt_buf *pkt = q->head;
+            if (sched->rate > 0 && e->tokens < pkt->len) break;
+            if (impair_send(imp, udp_fd, pkt, &peer->endpoint, now_ns) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                perror("转发到对端失败");
+            } else {
+                peer->tx_packets++;
+                if (!peer->unanswered_since) peer->unanswered_since = time(NULL);
+                e->sent[cls]++;
+                e->delay_ns[cls] += now_ns - pkt->queued_ns;
+            }
+            if (sched->rate > 0) e->tokens -= pkt->len;
+            if (cls != QOS_INTERACTIVE) e->deficit[cls] -= pkt->len;
+            q->head = pkt->next;
+            if (!q->head) q->tail = NULL;
+            q->len--;
+            sched->backlog--;
+            pkt_buf_unref(pool, pkt);
+        }
+    }
+}
+
+uint64_t egress_drops(const struct egress_sched *sched, int npeers) {
+    uint64_t dropped = 0;
+    for (int p = 0; p < npeers; p++)
+        for (int c = 0; c < QOS_CLASSES; c++) dropped += sched->peers[p].dropped[c];
+    return dropped;
+}
+
+void egress_report(const struct egress_sched *sched, int npeers) {
+    for (int c = 0; c < QOS_CLASSES; c++) {
+        uint64_t sent = 0, dropped = 0, delay = 0;
+        for (int p = 0; p < npeers; p++) {
+            sent += sched->peers[p].sent[c];
+            dropped += sched->peers[p].dropped[c];
+            delay += sched->peers[p].delay_ns[c];
+        }
+        printf("QoS %-11s: 发送 %lu, 丢弃 %lu, 平均排队 %.2fms\n", qos_class_names[c], sent, dropped,
+               sent ? delay / 1e6 / sent : 0.0);
+    }
+}
+
+/**
+ * QoS基准测试：10Mbit/s整形的隧道上，批量流以2倍速率灌满，
+ * 交互流每10ms发一个小包，比较开启/关闭分类时交互包的排队时延（模拟时钟，发往本地回环）
+ */
+int run_qos_benchmark(void) {
+    static struct pkt_pool pool;
+    static struct route_table routes;
+    struct sockaddr_in sink = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t sink_len = sizeof(sink);
+    int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (rx < 0 || tx < 0 || bind(rx, (struct sockaddr*)&sink, sizeof(sink)) < 0 ||
+        getsockname(rx, (struct sockaddr*)&sink, &sink_len) < 0 || pkt_pool_init(&pool, PKT_POOL_SIZE, PKT_POOL_SIZE) < 0)
+        return -1;
+    routes.npeers = 1;
+    routes.peers[0].endpoint = sink;
+    fcntl(rx, F_SETFL, O_NONBLOCK);
+
+    printf("=== QoS基准测试 (10Mbit/s 整形, 批量 20Mbit/s, 交互 100B/10ms) ===\n");
+    for (int qos_on = 0; qos_on <= 1; qos_on++) {
+        static struct egress_sched sched;
+        char drain[BUFFER_SIZE];
+        memset(&sched, 0, sizeof(sched));
+        sched.rate = 10e6 / 8;
+
+        for (uint64_t now = 0; now < 2000000000ULL; now += 100000) {  // 100us步长，共2秒
+            if (now % 500000 == 0) {  // 1250B / 500us = 20Mbit/s
+                struct pkt_buf *pkt = pkt_pool_get(&pool);
+                if (pkt) {
+                    pkt->len = 1250;
+                    egress_enqueue(&sched, 0, &pool, pkt, QOS_BULK, now);
+                }
+            }
+            if (now % 10000000 == 0) {
+                struct pkt_buf *pkt = pkt_pool_get(&pool);
+                if (pkt) {
+                    pkt->len = 100;
+                    egress_enqueue(&sched, 0, &pool, pkt, qos_on ? QOS_INTERACTIVE : QOS_BULK, now);
+                }
+            }
+            egress_flush(&sched, &routes, &pool, tx, NULL, now);
+            while (recv(rx, drain, sizeof(drain), 0) > 0) {
+            }
+        }
+        const struct peer_egress *e = &sched.peers[0];
+        printf("  分类%s: 批量 发送 %lu 丢弃 %lu 平均排队 %.1fms", qos_on ? "开启" : "关闭",
+               e->sent[QOS_BULK], e->dropped[QOS_BULK], e->sent[QOS_BULK] ? e->delay_ns[QOS_BULK] / 1e6 / e->sent[QOS_BULK] : 0);
+        if (qos_on) {
+            printf("; 交互 发送 %lu 平均排队 %.2fms\n", e->sent[QOS_INTERACTIVE],
+                   e->sent[QOS_INTERACTIVE] ? e->delay_ns[QOS_INTERACTIVE] / 1e6 / e->sent[QOS_INTERACTIVE] : 0);
+        } else {
+            printf(" (交互包与批量共用同一FIFO)\n");
+        }
+
+        // 清空残留队列，下一轮复用缓冲池
+        for (int c = 0; c < QOS_CLASSES; c++) {
+            struct pkt_buf *pkt = sched.peers[0].queues[c].head;
+            while (pkt) {
+                struct pkt_buf *next = pkt->next;
+                pkt_buf_unref(&pool, pkt);
+                pkt = next;
+            }
+        }
+    }
+    close(rx);
+    close(tx);
+    pkt_pool_free(&pool);
+    return 0;
+}
+
+/**
+ * 统计接口：每个连接返回一份纯文本快照（HTTP/1.0，读完即关闭），
+ * 可以直接 curl http://127.0.0.1:端口/ 查看
+ */
+int stats_listen(int port) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+void stats_respond(int listen_fd, const struct pkt_pool *pool, const struct flow_table *flows,
+                   const struct egress_sched *egress, uint64_t pattern_drops) {
+    char out[4096], req[1024];
+    int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd < 0) return;
+    fcntl(fd, F_SETFL, O_NONBLOCK);  // 在数据路径上调用，任何一步都不能阻塞
+    // 请求内容不重要，不等它：只取走已到达的部分，否则关闭时内核会回RST
+    while (recv(fd, req, sizeof(req), MSG_DONTWAIT) > 0) {}
+    int n = snprintf(out, sizeof(out), "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+    n += mem_format(out + n, sizeof(out) - n);
+    n += snprintf(out + n, sizeof(out) - n,
+                  "pool.buffers %d\npool.free %d\npool.grown %lu\npool.shrunk %lu\npool.exhausted %lu\n"
+                  "flows.created %lu\nflows.evicted %lu\negress.backlog %d\npatterns.drops %lu\n",
+                  pkt_pool_capacity(pool), pool->nfree, pool->grown, pool->shrunk, pool->exhausted,
+                  flows->flows_created, flows->flows_evicted, egress->backlog, pattern_drops);
+    if (n >= (int)sizeof(out)) n = sizeof(out) - 1;
+    send(fd, out, n, MSG_NOSIGNAL);  // 快照远小于发送缓冲区，非阻塞发送一次写完
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+/**
+ * 内存基准测试：建立 nflows 条流、一个缓冲池和1000个匹配模式，
+ * 按内存记账给出每条流、每个缓冲区、每个对端和每个模式的字节数
+ */
+int run_memory_benchmark(int nflows) {
+    const int npatterns = 1000;
+    static struct flow_table ft;
+    static struct pkt_pool pool;
+    struct pattern_matcher m;
+    int64_t before[MEM_SUBSYS_COUNT], after[MEM_SUBSYS_COUNT];
+    unsigned char pkt[40] = { 0 };
+    struct iphdr *ip = (struct iphdr*)pkt;
+    struct tcphdr *th = (struct tcphdr*)(pkt + 20);
+    unsigned char pat[16];
+    unsigned int seed = 12345;
+    char report[2048];
+
+    mem_snapshot(before, NULL);
+    if (flow_table_init(&ft) < 0 || pkt_pool_init(&pool, PKT_POOL_SIZE, PKT_POOL_SIZE) < 0 || pm_init(&m) < 0) return -1;
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(pkt));
+    ip->protocol = IPPROTO_TCP;
+    th->dest = htons(443);
+    th->doff = 5;
+    th->syn = 1;
+    for (int i = 0; i < nflows; i++) {
+        ip->saddr = htonl(0xc0a8e900 | (i & 0xff));
+        ip->daddr = htonl(0x0a000000 | (i >> 8));
+        th->source = htons(10000 + i % 50000);
+        flow_table_update(&ft, pkt, sizeof(pkt), 1000 + i);
+    }
+    for (int i = 0; i < npatterns; i++) {
+        int len = 4 + rand_r(&seed) % 12;
+        for (int j = 0; j < len; j++) pat[j] = 'a' + rand_r(&seed) % 26;
+        pm_add(&m, pat, len);
+    }
+    pm_compile(&m, 1);
+    mem_snapshot(after, NULL);
+
+    uint64_t active = ft.active;
+    printf("=== 内存基准测试 (%d 条流, %d 个缓冲区, %d 个模式) ===\n", nflows, pkt_pool_capacity(&pool), npatterns);
+    printf("  流表: %ld 字节, 活跃流 %lu, 每条活跃流 %.1f 字节 (索引节点 %zu + 表项 %zu, 索引桶 %u 个)\n",
+           after[MEM_FLOWS] - before[MEM_FLOWS], active,
+           active ? (double)(after[MEM_FLOWS] - before[MEM_FLOWS]) / active : 0.0, ft.index.nodes.obj_size,
+           ft.entries.obj_size, ft.index.table->mask + 1);
+    printf("  缓冲池: %ld 字节, 每个缓冲区 %.1f 字节 (载荷 %d)\n", after[MEM_POOLS] - before[MEM_POOLS],
+           (double)(after[MEM_POOLS] - before[MEM_POOLS]) / pkt_pool_capacity(&pool), BUFFER_SIZE);
+    printf("  对端: 每个 %zu 字节 (路由表项 %zu + 出口队列 %zu), 路由表与出口调度器静态占用 %zu 字节\n",
+           sizeof(struct tun_peer) + sizeof(struct peer_egress), sizeof(struct tun_peer), sizeof(struct peer_egress),
+           sizeof(struct route_table) + sizeof(struct egress_sched));
+    printf("  匹配: %ld 字节, 每个模式 %.1f 字节\n", after[MEM_PATTERNS] - before[MEM_PATTERNS],
+           (double)(after[MEM_PATTERNS] - before[MEM_PATTERNS]) / npatterns);
+    mem_format(report, sizeof(report));
+    printf("%s", report);
+
+    pm_free(&m);
+    pkt_pool_free(&pool);
+    flow_table_free(&ft);
+    mem_snapshot(after, NULL);
+    for (int i = 0; i < MEM_SUBSYS_COUNT; i++) {
+        if (after[i] != before[i]) printf("  警告: %s 释放后仍有 %ld 字节未归还\n", mem_subsys_names[i], after[i] - before[i]);
+    }
+    return 0;
+}
+
+/**
+ * 缓冲池基准测试：突发时按块增长、回落后按观察窗口收缩（模拟时钟），
+ * 以及属主线程本地分配/释放和跨线程释放的每包开销
+ */
+struct pool_bench_ring {
+    struct pkt_pool *pool;
+    struct pkt_buf *ring[1024];
+    uint32_t head, tail;
+    int stopping;
+};
+
+static void *pool_bench_consumer(void *arg) {
+    struct pool_bench_ring *r = arg;
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (r->head == tail) {
+            if (__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE) && r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) break;
+            sched_yield();
+            continue;
+        }
+        while (r->head != tail) {
+            pkt_buf_unref(r->pool, r->ring[r->head % 1024]);
+            __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pkt_pool_flush_thread();
+    return NULL;
+}
+
+int run_pool_benchmark(void) {
+    const int burst = 20000, ops = 10000000;
+    static struct pkt_pool pool;
+    static struct pkt_buf *held[PKT_POOL_MAX_SIZE];
+    uint64_t now = 1;
+
+    if (pkt_pool_init(&pool, PKT_POOL_SIZE, PKT_POOL_MAX_SIZE) < 0) return -1;
+    printf("=== 缓冲池基准测试 (每块 %d 个缓冲区, 上限 %d 块) ===\n", PKT_CHUNK_BUFS, pool.max_chunks);
+    printf("  空闲: %d 块, %s\n", pool.nchunks, pool.chunks[0].hugepage ? "显式大页" : "普通页+透明大页");
+
+    for (int i = 0; i < burst; i++) {
+        held[i] = pkt_pool_get(&pool);
+        if (i % RX_BATCH == 0) pkt_pool_maintain(&pool, now += 1000);
+    }
+    printf("  突发持有 %d 个: %d 块 (增长 %lu 次), 分配失败 %lu\n", burst, pool.nchunks, pool.grown, pool.exhausted);
+    for (int i = 0; i < burst; i++) {
+        if (held[i]) pkt_buf_unref(&pool, held[i]);
+    }
+    int seconds = 0;
+    while (pool.nchunks > pool.min_chunks && seconds < 600) {
+        pkt_pool_maintain(&pool, now += 1000000000ULL);
+        seconds++;
+    }
+    printf("  回落后 %d 秒收缩到 %d 块 (归还 %lu 次)\n", seconds, pool.nchunks, pool.shrunk);
+
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < ops; i++) {
+        struct pkt_buf *buf = pkt_pool_get(&pool);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+        pkt_buf_unref(&pool, buf);
+    }
+    printf("  属主线程 取+还: %.1f ns/包\n", (double)(monotonic_ns() - start) / ops);
+
+    static struct pool_bench_ring r;
+    pthread_t thread;
+    r.pool = &pool;
+    pthread_create(&thread, NULL, pool_bench_consumer, &r);
+    start = monotonic_ns();
+    for (int i = 0; i < ops; ) {
+        struct pkt_buf *buf;
+        if (r.tail - __atomic_load_n(&r.head, __ATOMIC_ACQUIRE) >= 1024) {
+            sched_yield();
+            continue;
+        }
+        if (!(buf = pkt_pool_get(&pool))) {
+            pkt_pool_maintain(&pool, now);
+            continue;
+        }
+        r.ring[r.tail % 1024] = buf;
+        __atomic_store_n(&r.tail, r.tail + 1, __ATOMIC_RELEASE);
+        if (++i % RX_BATCH == 0) pkt_pool_maintain(&pool, now);
+    }
+    __atomic_store_n(&r.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    printf("  跨线程释放: %.1f ns/包, 缓冲池 %d 块\n", (double)(monotonic_ns() - start) / ops, pool.nchunks);
+    pkt_pool_free(&pool);
+    return 0;
+}
+
+/**
+ * slab基准测试：在固定工作集上随机释放/分配流表项，对比malloc；
+ * 再测一个线程分配、另一个线程批量释放的情形（对象经仓库回流）
+ */
+struct slab_bench_ring {
+    struct slab_cache *cache;
+    void *ring[4096];
+    uint32_t head, tail;
+    int stopping;
+};
+
+static void *slab_bench_consumer(void *arg) {
+    struct slab_bench_ring *r = arg;
+    void *batch[SLAB_MAGAZINE_SIZE];
+    uint32_t head = r->head;  // 只有本线程写head，本地推进，取完一批再一次发布
+    for (;;) {
+        uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (tail - head < SLAB_MAGAZINE_SIZE) {
+            if (__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) break;
+            if (!__atomic_load_n(&r->stopping, __ATOMIC_ACQUIRE)) {
+                sched_yield();
+                continue;
+            }
+        }
+        int n = 0;
+        while (head != tail && n < SLAB_MAGAZINE_SIZE) batch[n++] = r->ring[head++ % 4096];
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        slab_free_batch(r->cache, batch, n);
+    }
+    slab_flush_thread(r->cache);
+    return NULL;
+}
+
+int run_slab_benchmark(int working_set) {
+    const int ops = 10000000;
+    static struct slab_cache cache;
+    void **live = calloc(working_set, sizeof(void*));
+    unsigned int seed = 1;
+    int64_t before[MEM_SUBSYS_COUNT], after[MEM_SUBSYS_COUNT];
+
+    if (!live || slab_cache_init(&cache, "flow", sizeof(struct flow_entry), MEM_FLOWS) < 0) return -1;
+    printf("=== slab基准测试 (对象 %zu 字节, 工作集 %d, %d 次替换) ===\n", cache.obj_size, working_set, ops);
+    mem_snapshot(before, NULL);
+    for (int impl = 0; impl < 2; impl++) {
+        for (int i = 0; i < working_set; i++) {
+            live[i] = impl ? slab_alloc(&cache) : malloc(sizeof(struct flow_entry));
+            memset(live[i], 0, sizeof(struct flow_entry));
+        }
+        if (impl) {
+            mem_snapshot(after, NULL);
+            printf("  slab占用 %ld 字节 (%d 个slab), 每个对象 %.1f 字节\n", after[MEM_FLOWS] - before[MEM_FLOWS],
+                   cache.nslabs, (double)(after[MEM_FLOWS] - before[MEM_FLOWS]) / working_set);
+        }
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < ops; i++) {
+            int k = rand_r(&seed) % working_set;
+            if (impl) {
+                slab_free(&cache, live[k]);
+                live[k] = slab_alloc(&cache);
+            } else {
+                free(live[k]);
+                live[k] = malloc(sizeof(struct flow_entry));
+            }
+            ((struct flow_entry*)live[k])->first_ns = i;  // 模拟初始化时的写入
+        }
+        printf("  %-6s 释放+分配: %.1f ns\n", impl ? "slab" : "malloc", (double)(monotonic_ns() - start) / ops);
+        for (int i = 0; i < working_set; i++) {
+            if (impl) slab_free(&cache, live[i]);
+            else free(live[i]);
+        }
+    }
+
+    static struct slab_bench_ring r;
+    pthread_t thread;
+    r.cache = &cache;
+    pthread_create(&thread, NULL, slab_bench_consumer, &r);
+    uint64_t exchanges = cache.depot_exchanges, start = monotonic_ns();
+    for (int i = 0; i < ops; ) {
+        if (r.tail - __atomic_load_n(&r.head, __ATOMIC_ACQUIRE) >= 4096) {
+            sched_yield();
+            continue;
+        }
+        r.ring[r.tail % 4096] = slab_alloc(&cache);
+        __atomic_store_n(&r.tail, r.tail + 1, __ATOMIC_RELEASE);
+        i++;
+    }
+    __atomic_store_n(&r.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    printf("  跨线程 分配/批量释放: %.1f ns/对象, 每 %.0f 个对象进一次仓库, slab %d 个\n",
+           (double)(monotonic_ns() - start) / ops, (double)ops * 2 / (cache.depot_exchanges - exchanges), cache.nslabs);
+
+    int leaked = slab_cache_destroy(&cache);
+    mem_snapshot(after, NULL);
+    printf("  销毁后剩余 %d 个slab, 流表子系统 %ld 字节\n", leaked, after[MEM_FLOWS] - before[MEM_FLOWS]);
+    free(live);
+    return 0;
+}
+
+/**
+ * QSBR压力测试：读线程随机读取一组共享指针并校验对象内容，写线程不停替换指针并挂起旧对象。
+ * 释放函数先把对象涂成 QSBR_STRESS_DEAD 再放进隔离区，过一段时间才真正free，
+ * 读者若读到被提前回收的对象就会看到涂抹值。unsafe 模式不等宽限期直接释放，用来确认能检出错误。
+ */
+#define QSBR_STRESS_SLOTS 64
+#define QSBR_STRESS_QUARANTINE 4096
+#define QSBR_STRESS_LIVE 0x4c495645u
+#define QSBR_STRESS_DEAD 0xdeadbeefu
+
+struct qsbr_stress_obj {
+    struct qsbr_node qsbr;
+    uint32_t magic;
+    uint64_t value;
+    uint64_t check;               // ~value
+};
+
+static struct qsbr qsbr_stress_domain;
+static struct qsbr_stress_obj *qsbr_stress_slots[QSBR_STRESS_SLOTS];
+static int qsbr_stress_stop;
+static int qsbr_stress_unsafe;
+
+struct qsbr_stress_worker {
+    struct qsbr_thread qsbr;
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t violations;
+    int max_limbo;
+    struct qsbr_stress_obj *quarantine[QSBR_STRESS_QUARANTINE];
+    uint32_t quarantine_pos;
+};
+
+static __thread struct qsbr_stress_worker *qsbr_stress_self;
+
+static void qsbr_stress_free(struct qsbr_node *node) {
+    struct qsbr_stress_obj *obj = container_of(node, struct qsbr_stress_obj, qsbr);
+    struct qsbr_stress_worker *w = qsbr_stress_self;
+    __atomic_store_n(&obj->magic, QSBR_STRESS_DEAD, __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->check, obj->value, __ATOMIC_RELAXED);
+    struct qsbr_stress_obj **slot = &w->quarantine[w->quarantine_pos++ % QSBR_STRESS_QUARANTINE];
+    free(*slot);
+    *slot = obj;
+}
+
+static void *qsbr_stress_reader(void *arg) {
+    struct qsbr_stress_worker *w = arg;
+    qsbr_stress_self = w;
+    qsbr_online(&w->qsbr);
+    for (uint64_t batch = 0; !__atomic_load_n(&qsbr_stress_stop, __ATOMIC_RELAXED); batch++) {
+        for (int i = 0; i < 256; i++) {
+            struct qsbr_stress_obj *obj = __atomic_load_n(&qsbr_stress_slots[rand_r(&w->seed) % QSBR_STRESS_SLOTS],
+                                                          __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&obj->magic, __ATOMIC_RELAXED) != QSBR_STRESS_LIVE ||
+                __atomic_load_n(&obj->check, __ATOMIC_RELAXED) != ~obj->value)
+                w->violations++;
+        }
+        w->ops += 256;
+        qsbr_quiescent(&w->qsbr);
+        if (batch % 1024 == 1023) {
+            // 模拟在poll里阻塞
+            struct timespec pause = { 0, 200000 };
+            qsbr_offline(&w->qsbr);
+            nanosleep(&pause, NULL);
+            qsbr_online(&w->qsbr);
+        }
+    }
+    qsbr_offline(&w->qsbr);
+    return NULL;
+}
+
+static void *qsbr_stress_writer(void *arg) {
+    struct qsbr_stress_worker *w = arg;
+    qsbr_stress_self = w;
+    while (!__atomic_load_n(&qsbr_stress_stop, __ATOMIC_RELAXED)) {
+        struct qsbr_stress_obj *obj = malloc(sizeof(*obj));
+        obj->magic = QSBR_STRESS_LIVE;
+        obj->value = w->ops;
+        obj->check = ~obj->value;
+        struct qsbr_stress_obj *old = __atomic_exchange_n(&qsbr_stress_slots[rand_r(&w->seed) % QSBR_STRESS_SLOTS],
+                                                          obj, __ATOMIC_ACQ_REL);
+        if (qsbr_stress_unsafe) {
+            qsbr_stress_free(&old->qsbr);
+        } else {
+            qsbr_retire(&w->qsbr, &old->qsbr, qsbr_stress_free);
+            if (w->qsbr.limbo_count > w->max_limbo) w->max_limbo = w->qsbr.limbo_count;
+        }
+        w->ops++;
+        if (w->ops % 64 == 0) sched_yield();  // 单核机器上也让读者有机会运行
+    }
+    qsbr_barrier(&w->qsbr);
+    return NULL;
+}
+
+int run_qsbr_stress(int seconds, int nreaders, int unsafe) {
+    const int nwriters = 2;
+    int nworkers = nreaders + nwriters;
+    struct qsbr_stress_worker *workers = calloc(nworkers, sizeof(*workers));
+
+    if (!workers || nreaders < 1) return -1;
+    qsbr_init(&qsbr_stress_domain);
+    qsbr_stress_unsafe = unsafe;
+    for (int i = 0; i < QSBR_STRESS_SLOTS; i++) {
+        struct qsbr_stress_obj *obj = malloc(sizeof(*obj));
+        obj->magic = QSBR_STRESS_LIVE;
+        obj->value = i;
+        obj->check = ~obj->value;
+        qsbr_stress_slots[i] = obj;
+    }
+    printf("=== QSBR压力测试 (%d 个读线程, %d 个写线程, %d 秒%s) ===\n", nreaders, nwriters, seconds,
+           unsafe ? ", 不等宽限期直接释放" : "");
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].seed = i + 1;
+        qsbr_register(&qsbr_stress_domain, &workers[i].qsbr);
+        pthread_create(&workers[i].thread, NULL, i < nreaders ? qsbr_stress_reader : qsbr_stress_writer, &workers[i]);
+    }
+    sleep(seconds);
+    __atomic_store_n(&qsbr_stress_stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t reads = 0, updates = 0, violations = 0, retired = 0, reclaimed = 0;
+    int max_limbo = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (i < nreaders) reads += workers[i].ops;
+        else updates += workers[i].ops;
+        violations += workers[i].violations;
+        retired += workers[i].qsbr.retired;
+        reclaimed += workers[i].qsbr.reclaimed;
+        if (workers[i].max_limbo > max_limbo) max_limbo = workers[i].max_limbo;
+    }
+    printf("  读 %.2f M/s, 替换 %.2f M/s, 挂起 %lu, 回收 %lu, 单线程最多待回收 %d\n",
+           reads / 1e6 / seconds, updates / 1e6 / seconds, retired, reclaimed, max_limbo);
+    printf("  读到已回收对象: %lu 次%s\n", violations, violations ? " ✗" : " ✓");
+
+    for (int i = 0; i < QSBR_STRESS_SLOTS; i++) free(qsbr_stress_slots[i]);
+    for (int i = 0; i < nworkers; i++) {
+        for (int j = 0; j < QSBR_STRESS_QUARANTINE; j++) free(workers[i].quarantine[j]);
+    }
+    free(workers);
+    return unsafe || !violations ? 0 : -1;
+}
+
+/**
+ * 并发哈希表基准测试：写者从空表插入 n 个键再全部删除（经历多次翻倍和减半），
+ * 两个读线程同时随机查找已发布的键并校验结果。分别用增量迁移和一次迁移完两种方式，
+ * 比较写操作的最大耗时（按线程CPU时间计，不含被读线程抢占的时间）
+ */
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct chash_bench_shared {
+    struct chash map;
+    struct qsbr qsbr;
+    uint64_t low, high;           // 当前一定存在的键范围 (low, high]
+    int stop;
+};
+
+struct chash_bench_reader {
+    struct chash_bench_shared *shared;
+    struct qsbr_thread qsbr;
+    pthread_t thread;
+    uint64_t lookups, misses;
+};
+
+static void *chash_bench_reader_thread(void *arg) {
+    struct chash_bench_reader *r = arg;
+    struct chash_bench_shared *sh = r->shared;
+    uint64_t x = (uintptr_t)r | 1;
+
+    qsbr_online(&r->qsbr);
+    while (!__atomic_load_n(&sh->stop, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < 64; i++) {
+            // 先读low再读high：两次读取之间删除只会增大low，区间内的键在查找时仍然存在
+            uint64_t low = __atomic_load_n(&sh->low, __ATOMIC_ACQUIRE);
+            uint64_t high = __atomic_load_n(&sh->high, __ATOMIC_ACQUIRE);
+            if (high <= low) continue;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            uint64_t key = low + 1 + x % (high - low);
+            // 查找之后再看一次low：查找期间被删除的键找不到是正常的
+            if ((uint64_t)(uintptr_t)chash_lookup(&sh->map, key) != key &&
+                __atomic_load_n(&sh->low, __ATOMIC_ACQUIRE) < key)
+                r->misses++;
+            r->lookups++;
+        }
+        qsbr_quiescent(&r->qsbr);
+    }
+    qsbr_offline(&r->qsbr);
+    return NULL;
+}
+
+int run_chash_benchmark(int n) {
+    printf("=== 并发哈希表基准测试 (%d 个键, 2 个读线程) ===\n", n);
+    for (int stw = 0; stw <= 1; stw++) {
+        static struct chash_bench_shared sh;
+        static struct chash_bench_reader readers[2];
+        struct qsbr_thread writer;
+
+        memset(&sh, 0, sizeof(sh));
+        qsbr_init(&sh.qsbr);
+        if (chash_init(&sh.map, MEM_PEERS) < 0) return -1;
+        sh.map.stop_the_world = stw;
+        qsbr_register(&sh.qsbr, &writer);  // 写者在锁内访问，保持离线
+        for (int i = 0; i < 2; i++) {
+            memset(&readers[i], 0, sizeof(readers[i]));
+            readers[i].shared = &sh;
+            qsbr_register(&sh.qsbr, &readers[i].qsbr);
+            pthread_create(&readers[i].thread, NULL, chash_bench_reader_thread, &readers[i]);
+        }
+
+        for (int phase = 0; phase < 2; phase++) {
+            uint64_t start = monotonic_ns(), max_ns = 0, slow = 0;
+            for (uint64_t key = 1; key <= (uint64_t)n; key++) {
+                uint64_t t0 = thread_cpu_ns();
+                if (phase == 0) {
+                    chash_insert(&sh.map, &writer, key, (void*)(uintptr_t)key);
+                    __atomic_store_n(&sh.high, key, __ATOMIC_RELEASE);
+                } else {
+                    __atomic_store_n(&sh.low, key, __ATOMIC_RELEASE);
+                    chash_remove(&sh.map, &writer, key);
+                }
+                uint64_t dt = thread_cpu_ns() - t0;
+                if (dt > max_ns) max_ns = dt;
+                if (dt > 1000000) slow++;
+            }
+            while (__atomic_load_n(&sh.map.table, __ATOMIC_RELAXED)->next || sh.map.freeing) chash_maintain(&sh.map, &writer);
+            printf("  %s %s: %.1f ns/次, 最大 %.2f ms, 超过1ms %lu 次, 桶数 %u\n", stw ? "一次迁移" : "增量迁移",
+                   phase ? "删除" : "插入", (double)(monotonic_ns() - start) / n, max_ns / 1e6, slow,
+                   sh.map.table->mask + 1);
+        }
+
+        __atomic_store_n(&sh.stop, 1, __ATOMIC_RELAXED);
+        uint64_t lookups = 0, misses = 0;
+        for (int i = 0; i < 2; i++) {
+            pthread_join(readers[i].thread, NULL);
+            lookups += readers[i].lookups;
+            misses += readers[i].misses;
+        }
+        qsbr_barrier(&writer);
+        printf("  %s 读者: 查找 %lu 次, 错误 %lu, 扩缩容 %lu 次\n", stw ? "一次迁移" : "增量迁移", lookups, misses,
+               sh.map.resizes);
+        chash_destroy(&sh.map);
+    }
+    return 0;
+}
+
+/*
+ * 路由更新风暴基准：后台不断提交路由变更，同时两个读线程持续查找，
+ * 对比有无更新时的查找速度，最后用排序数组逐长度二分的参考实现核对最终FIB
+ */
+struct storm_route {
+    uint32_t prefix;
+    uint8_t len;
+    int16_t group;                // 当前对端组，-1 表示已删除
+};
+
+struct storm_reader {
+    struct route_table *table;
+    struct qsbr_thread qsbr;
+    pthread_t thread;
+    int *phase;                   // 0 无更新, 1 更新风暴, 2 停止
+    uint64_t lookups[2], cpu_ns[2];
+    uint64_t sum;
+};
+
+static void *storm_reader_thread(void *arg) {
+    struct storm_reader *r = arg;
+    uint64_t x = (uintptr_t)r | 1, sum = 0;
+    int phase = 0;
+    uint64_t count = 0, cpu_start = thread_cpu_ns();
+
+    qsbr_online(&r->qsbr);
+    for (;;) {
+        for (int i = 0; i < 64; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            const struct route_fib *fib = __atomic_load_n(&r->table->fib, __ATOMIC_ACQUIRE);
+            sum += route_fib_lookup(fib, 0x0a000000u | (x & 0xffffff));
+        }
+        count += 64;
+        qsbr_quiescent(&r->qsbr);
+        int now = __atomic_load_n(r->phase, __ATOMIC_RELAXED);
+        if (now != phase) {
+            uint64_t cpu = thread_cpu_ns();
+            r->lookups[phase] = count;
+            r->cpu_ns[phase] = cpu - cpu_start;
+            if (now == 2) break;
+            phase = now;
+            count = 0;
+            cpu_start = cpu;
+        }
+    }
+    qsbr_offline(&r->qsbr);
+    r->sum = sum;
+    return NULL;
+}
+
+static int storm_route_cmp(const void *a, const void *b) {
+    const struct storm_route *x = a, *y = b;
+    if (x->len != y->len) return x->len - y->len;
+    return x->prefix < y->prefix ? -1 : x->prefix > y->prefix;
+}
+
+// 参考实现：从 /32 到 /0 逐个长度在排序数组里二分
+static int storm_reference_lookup(const struct storm_route *ref, int n, uint32_t addr) {
+    for (int len = 32; len >= 0; len--) {
+        struct storm_route key = { len ? addr & (0xffffffffu << (32 - len)) : 0, len, 0 };
+        const struct storm_route *r = bsearch(&key, ref, n, sizeof(*ref), storm_route_cmp);
+        if (r && r->group >= 0) return r->group;
+    }
+    return -1;
+}
+
+// 生成 10.0.0.0/8 内的前缀，以 /24 为主，掺杂更短和更长的；排序去重后返回条数
+static int storm_make_routes(struct storm_route *ref, int n, uint64_t *state) {
+    uint64_t x = *state;
+    int m = 0;
+
+    for (int i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int r = x % 10;
+        int len = r < 4 ? 24 : r < 6 ? 17 + (x >> 8) % 7 : r < 8 ? 25 + (x >> 8) % 8 : 8 + (x >> 8) % 9;
+        uint32_t addr = 0x0a000000u | ((x >> 16) & 0xffffff);
+        ref[i] = (struct storm_route){ addr & (0xffffffffu << (32 - len)), len, (x >> 40) % 4 };
+    }
+    qsort(ref, n, sizeof(*ref), storm_route_cmp);
+    for (int i = 0; i < n; i++)
+        if (!m || storm_route_cmp(&ref[m - 1], &ref[i]) != 0) ref[m++] = ref[i];
+    *state = x;
+    return m;
+}
+
+static void route_fib_describe(const struct route_fib *fib, char *out, size_t size) {
+    if (fib->tbl24)
+        snprintf(out, size, "DIR-24-8, 第二级 %u 组, %.1f MB%s", fib->ntbl8,
+                 (FIB_TBL24_BYTES + fib->ntbl8 * 512.0) / (1 << 20), fib->hugepage ? " (大页)" : "");
+    else
+        snprintf(out, size, "字典树, %u 个子节点, %.1f MB", fib->nnodes,
+                 (sizeof(*fib) + fib->nnodes * 1024.0) / (1 << 20));
+}
+
+int run_route_storm_benchmark(int n) {
+    static struct route_table table;
+    static struct qsbr domain;
+    static struct route_builder builder;
+    static struct storm_reader readers[2];
+    static int phase;
+    struct storm_route *ref = malloc(n * sizeof(*ref));
+    struct route_update *updates = malloc(n * sizeof(*updates));
+    uint64_t x = 88172645463325252ULL;
+    int m = 0, errors = 0;
+
+    char desc[96];
+
+    if (!ref || !updates) return -1;
+    printf("=== 路由更新风暴基准测试 (%d 条前缀, 2 个读线程) ===\n", n);
+    m = storm_make_routes(ref, n, &x);
+
+    qsbr_init(&domain);
+    if (route_table_build_fib(&table) < 0 || route_builder_start(&builder, &table, &domain) < 0) return -1;
+    for (int i = 0; i < m; i++) updates[i] = (struct route_update){ ref[i].prefix, ref[i].len, ref[i].group };
+    uint64_t start = monotonic_ns();
+    route_builder_wait(&builder, route_builder_submit(&builder, updates, m));
+    route_fib_describe(table.fib, desc, sizeof(desc));
+    printf("  装载 %d 条前缀: %.1f ms, %s\n", m, (monotonic_ns() - start) / 1e6, desc);
+
+    for (int i = 0; i < 2; i++) {
+        readers[i].table = &table;
+        readers[i].phase = &phase;
+        qsbr_register(&domain, &readers[i].qsbr);
+        pthread_create(&readers[i].thread, NULL, storm_reader_thread, &readers[i]);
+    }
+    uint64_t base_start = monotonic_ns();
+    usleep(1000000);
+    uint64_t base_wall = monotonic_ns() - base_start;
+
+    // 更新风暴：每批256条，随机改组、删除或重新加入，不等待构建线程
+    uint64_t rebuilds = builder.rebuilds, build_ns = builder.build_ns, seq = 0;
+    __atomic_store_n(&phase, 1, __ATOMIC_RELAXED);
+    uint64_t storm_start = monotonic_ns();
+    for (int done = 0; done < n; ) {
+        int batch = n - done < 256 ? n - done : 256;
+        for (int i = 0; i < batch; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            struct storm_route *r = &ref[x % m];
+            r->group = r->group >= 0 && (x >> 32) % 4 == 0 ? -1 : (int)((x >> 40) % 4);
+            updates[i] = (struct route_update){ r->prefix, r->len, r->group };
+        }
+        seq = route_builder_submit(&builder, updates, batch);
+        done += batch;
+        sched_yield();
+    }
+    route_builder_wait(&builder, seq);
+    uint64_t storm_wall = monotonic_ns() - storm_start;
+    __atomic_store_n(&phase, 2, __ATOMIC_RELAXED);
+    for (int i = 0; i < 2; i++) pthread_join(readers[i].thread, NULL);
+
+    uint64_t lookups[2] = {0}, cpu[2] = {0};
+    for (int i = 0; i < 2; i++)
+        for (int p = 0; p < 2; p++) {
+            lookups[p] += readers[i].lookups[p];
+            cpu[p] += readers[i].cpu_ns[p];
+        }
+    rebuilds = builder.rebuilds - rebuilds;
+    build_ns = builder.build_ns - build_ns;
+    printf("  无更新: %.1f M次查找/秒, 每CPU秒 %.1f M次\n", lookups[0] / (base_wall / 1e3),
+           lookups[0] / (cpu[0] / 1e3));
+    printf("  更新风暴: %d 条变更用时 %.1f ms, 重建 %lu 次 (平均 %.2f ms, 最长 %.2f ms)\n", n, storm_wall / 1e6,
+           rebuilds, rebuilds ? build_ns / 1e6 / rebuilds : 0, builder.max_build_ns / 1e6);
+    printf("  风暴期间: %.1f M次查找/秒, 每CPU秒 %.1f M次\n", lookups[1] / (storm_wall / 1e3),
+           lookups[1] / (cpu[1] / 1e3));
+
+    // 核对：最终FIB与参考实现逐地址比较
+    for (int i = 0; i < 200000; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint32_t addr = 0x0a000000u | (x & 0xffffff);
+        if (route_fib_lookup(table.fib, addr) != storm_reference_lookup(ref, m, addr)) errors++;
+    }
+    printf("  核对 200000 个地址: 错误 %d\n", errors);
+
+    route_builder_stop(&builder);
+    route_fib_free(table.fib);
+    table.fib = NULL;
+    free(ref);
+    free(updates);
+    return errors ? -1 : 0;
+}
+
+/*
+ * FIB查找基准：同一组前缀分别建成字典树和DIR-24-8，比较构建耗时、内存和查找速度。
+ * 依赖链查找让下一个地址取决于上一次结果，测的是单次查找的访存延迟
+ */
+int run_fib_benchmark(int n) {
+    struct storm_route *ref = malloc(n * sizeof(*ref));
+    struct rib_entry *rib = malloc(n * sizeof(*rib));
+    const int ops = 20000000;
+    uint64_t x = 88172645463325252ULL;
+    struct route_fib *fibs[2];
+    int errors = 0;
+    char desc[96];
+
+    if (!ref || !rib) return -1;
+    int m = storm_make_routes(ref, n, &x);
+    for (int i = 0; i < m; i++) rib[i] = (struct rib_entry){ ref[i].prefix, ref[i].len, ref[i].group };
+    printf("=== FIB查找基准测试 (%d 条前缀) ===\n", m);
+
+    for (int mode = 0; mode < 2; mode++) {
+        uint64_t start = monotonic_ns();
+        fibs[mode] = route_fib_build(rib, m, mode ? FIB_DIR24 : FIB_TRIE);
+        if (!fibs[mode] || (mode && !fibs[mode]->tbl24)) {
+            printf("  无法建立%s\n", mode ? "DIR-24-8" : "字典树");
+            return -1;
+        }
+        uint64_t build_ns = monotonic_ns() - start;
+        const struct route_fib *fib = fibs[mode];
+        route_fib_describe(fib, desc, sizeof(desc));
+        printf("  %s, 构建 %.1f ms\n", desc, build_ns / 1e6);
+
+        uint64_t y = x, sum = 0;
+        start = monotonic_ns();
+        for (int i = 0; i < ops; i++) {
+            y ^= y << 13;
+            y ^= y >> 7;
+            y ^= y << 17;
+            sum += route_fib_lookup(fib, 0x0a000000u | (y & 0xffffff));
+        }
+        double independent = (double)(monotonic_ns() - start) / ops;
+        uint32_t addr = 0x0a000000u;
+        start = monotonic_ns();
+        for (int i = 0; i < ops; i++)
+            addr = 0x0a000000u | ((addr * 2654435761u + route_fib_lookup(fib, addr)) & 0xffffff);
+        double dependent = (double)(monotonic_ns() - start) / ops;
+        printf("  %-8s 独立查找 %.2f ns/次, 依赖链查找 %.2f ns/次 (校验 %lu/%u)\n", mode ? "DIR-24-8" : "字典树",
+               independent, dependent, sum & 0xffff, addr & 0xffff);
+    }
+
+    for (int i = 0; i < 1000000; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint32_t addr = (x >> 16) % 8 ? 0x0a000000u | (x & 0xffffff) : (uint32_t)x;
+        int expected = storm_reference_lookup(ref, m, addr);
+        if (route_fib_lookup(fibs[0], addr) != expected || route_fib_lookup(fibs[1], addr) != expected) errors++;
+    }
+    printf("  核对 1000000 个地址: 错误 %d\n", errors);
+    route_fib_free(fibs[0]);
+    route_fib_free(fibs[1]);
+    free(ref);
+    free(rib);
+    return errors ? -1 : 0;
+}
+
+/**
+ * 显示使用说明
+ */
+/**
+ * 显示使用说明，内容按实际的包来源（TUN接口、假TUN或抓包回放）给出
+ * @param replay_file 回放的抓包文件，NULL表示不回放
+ * @param fake_tun_pps 假TUN的发包速率，0表示不使用假TUN
+ */
+void show_usage(const char *replay_file, double fake_tun_pps) {
+    printf("\n=== awenawtun 使用说明 ===\n");
+    if (replay_file) {
+        printf("1. 包来源: 回放抓包文件 %s\n", replay_file);
+        printf("2. 未创建TUN接口，没有修改系统地址和路由\n");
+        printf("3. 回放完成后处理完剩余的包即退出，并报告各阶段的包速率\n");
+    } else if (fake_tun_pps > 0) {
+        printf("1. 包来源: 假TUN（socketpair），内置发生器以 %.0f 包/秒发送 192.168.233.1 -> 192.168.233.2 的UDP包\n",
+               fake_tun_pps);
+        printf("2. 未创建TUN接口，没有修改系统地址和路由\n");
+        printf("\n测试方法:\n");
+        printf("  用 --route 192.168.233.0/24=127.0.0.1:端口 配合 --fake-peer 端口 观察转发和往返时延\n");
+    } else {
+        printf("1. 程序已创建 awenawtun 接口\n");
+        printf("2. 配置了IP地址: 192.168.233.1/24\n");
+        printf("3. 添加了路由: 192.168.233.0/24 -> awenawtun\n");
+        printf("\n测试方法:\n");
+        printf("  ping 192.168.233.2    # 会被awenawtun捕获，无出口路由时返回主机不可达\n");
+        printf("  ping 192.168.233.100  # 会被awenawtun捕获\n");
+        printf("  curl 192.168.233.50   # 会被awenawtun捕获，无出口路由时立即失败\n");
+    }
+    printf("\n按 Ctrl+C 退出程序\n");
+    printf("========================\n\n");
+}
+
+static volatile sig_atomic_t stop_requested;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static volatile sig_atomic_t flight_dump_requested;
+
+static void handle_dump_signal(int sig) {
+    (void)sig;
+    flight_dump_requested = 1;
+}
+
+static volatile sig_atomic_t route_reload_requested;
+
+static void handle_reload_signal(int sig) {
+    (void)sig;
+    route_reload_requested = 1;
+}
+
+int main(int argc, char *argv[]) {
+    int tun_fd;
+    int udp_fd = -1;                      // 与出口对端通信的UDP socket
+    char tun_name[IFNAMSIZ] = "awenawtun";  // 设定TUN设备名称
+    int nread;
+    static struct route_table routes;     // 允许IP路由表
+    static struct route_builder route_builder;  // 路由变更在后台重建FIB
+    static struct route_update route_updates[2 * MAX_ROUTES];
+    char *route_specs[MAX_ROUTES];        // 命令行路由，重新加载时与路由文件合并
+    int nroute_specs = 0;
+    const char *route_file = NULL;        // SIGHUP时重新读取的路由文件
+    static struct pkt_pool pool;          // 数据包缓冲池
+    static struct mirror mirror;          // 流量镜像
+    const char *mirror_target = NULL;
+    double mirror_pps = MIRROR_DEFAULT_PPS;
+    struct icmp_limiter icmp_limiter = { .tokens = ICMP_BURST };
+    int echo_mode = 0;                    // 旧行为：无路由的包原样回显
+    static struct flow_table flows;       // 流表
+    static struct pattern_matcher patterns;  // 载荷匹配策略，命中即丢弃
+    int npatterns = 0;
+    uint64_t pattern_drops = 0;
+    static struct qos_rules qos_rules;    // 用户QoS规则
+    static struct egress_sched egress;    // 各对端出口队列
+    static struct impair impair_out, impair_in;  // 对端链路两个方向的损伤模拟
+    static struct fake_host fake_host;    // 假TUN及其流量发生器
+    static struct fake_peer fake_peer;    // 本地回环上的反射对端
+    static struct qsbr qsbr;              // 无锁结构的延迟回收
+    static struct qsbr_thread datapath_qsbr;
+    static struct chash peer_index;       // 对端地址:端口 -> 对端编号+1，收包时按来源查找
+    struct impair_config impair_cfg;
+    int impair_enabled = 0;
+    double fake_tun_pps = 0;
+    static struct replay replay;          // 抓包回放源
+    static struct stage_stats stages;     // 流水线各阶段耗时
+    const char *replay_file = NULL;
+    static struct flight_recorder recorder;  // 主循环的飞行记录器
+    struct flight_recorder *recorders[1] = { &recorder };
+    struct flight_config flight_cfg = { .enabled = 1, .snaplen = FLIGHT_DEFAULT_SNAPLEN, .mb = FLIGHT_DEFAULT_MB,
+                                        .seconds = FLIGHT_DEFAULT_SECONDS };
+    struct flight_trigger flight_trigger = {0};
+    uint64_t unknown_peer_drops = 0;      // 来源不是已知对端的入站包
+    double replay_speed = 1;
+    int replay_loops = 1;
+    int fake_peer_port = 0;
+    int duration = 0;                     // 运行秒数，0表示直到Ctrl+C
+    int verbose = 1;                      // 逐包输出
+    int stats_port = 0;                   // 统计接口端口，0表示不开启
+    int stats_fd = -1;
+    
+    // 解析出口路由和镜像参数
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--route") == 0 && i + 1 < argc) {
+            if (route_add_spec(&routes, argv[++i]) < 0) {
+                printf("无效的路由: %s\n", argv[i]);
+                exit(1);
+            }
+            route_specs[nroute_specs++] = argv[i];
+        } else if (strcmp(argv[i], "--route-file") == 0 && i + 1 < argc) {
+            route_file = argv[++i];
+        } else if (strcmp(argv[i], "--mirror") == 0 && i + 1 < argc) {
+            mirror_target = argv[++i];
+        } else if (strcmp(argv[i], "--mirror-filter") == 0 && i + 1 < argc) {
+            if (mirror_parse_filter(&mirror.filter, argv[++i]) < 0) {
+                printf("无效的镜像过滤条件: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--mirror-rate") == 0 && i + 1 < argc) {
+            mirror_pps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--echo") == 0) {
+            echo_mode = 1;
+        } else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+            if (pm_init(&patterns) < 0 || (npatterns = pm_load_file(&patterns, argv[++i])) < 0) {
+                printf("无法加载模式文件: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--qos") == 0 && i + 1 < argc) {
+            if (qos_parse_rule(&qos_rules, argv[++i]) < 0) {
+                printf("无效的QoS规则: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--egress-rate") == 0 && i + 1 < argc) {
+            egress.rate = atof(argv[++i]) * 1e6 / 8;  // Mbit/s -> 字节/秒
+        } else if (strcmp(argv[i], "--impair") == 0 && i + 1 < argc) {
+            if (impair_parse(&impair_cfg, argv[++i]) < 0) {
+                printf("无效的损伤参数: %s\n", argv[i]);
+                exit(1);
+            }
+            impair_enabled = 1;
+        } else if (strcmp(argv[i], "--fake-tun") == 0 && i + 1 < argc) {
+            fake_tun_pps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--fake-peer") == 0 && i + 1 < argc) {
+            fake_peer_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--recorder") == 0 && i + 1 < argc) {
+            if (flight_parse(&flight_cfg, argv[++i]) < 0) {
+                printf("无效的飞行记录器参数: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "--replay-loop") == 0 && i + 1 < argc) {
+            replay_loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+            i++;
+            replay_speed = strcmp(argv[i], "max") == 0 ? 0 : atof(argv[i]);
+            if (replay_speed < 0 || (replay_speed == 0 && strcmp(argv[i], "max") != 0)) {
+                printf("无效的回放速度: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+            stats_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stress-qsbr") == 0) {
+            int seconds = i + 1 < argc ? atoi(argv[i + 1]) : 5;
+            int readers = i + 2 < argc ? atoi(argv[i + 2]) : 2;
+            int unsafe = i + 3 < argc && strcmp(argv[i + 3], "unsafe") == 0;
+            return run_qsbr_stress(seconds > 0 ? seconds : 5, readers > 0 ? readers : 2, unsafe) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-chash") == 0) {
+            return run_chash_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 2000000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-route-storm") == 0) {
+            return run_route_storm_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-fib") == 0) {
+            return run_fib_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--fib") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "auto") == 0) routes.fib_mode = FIB_AUTO;
+            else if (strcmp(argv[i], "trie") == 0) routes.fib_mode = FIB_TRIE;
+            else if (strcmp(argv[i], "dir24") == 0) routes.fib_mode = FIB_DIR24;
+            else {
+                printf("无效的FIB类型: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--bench-slab") == 0) {
+            return run_slab_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 100000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-pool") == 0) {
+            return run_pool_benchmark() < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-memory") == 0) {
+            return run_memory_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 50000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            verbose = 0;
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-qos") == 0) {
+            return run_qos_benchmark() < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-patterns") == 0) {
+            return run_pattern_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 1000) < 0 ? 1 : 0;
+        } else if (strcmp(argv[i], "--bench-flows") == 0) {
+            // 不创建TUN接口，只测量流表每包开销
+            return run_flow_benchmark(i + 1 < argc ? atoi(argv[i + 1]) : 10000) < 0 ? 1 : 0;
+        } else {
+            printf("用法: %s [--bench-flows [流数]] [--bench-patterns [模式数]] [--bench-qos] [--bench-memory [流数]] [--bench-pool] [--bench-slab [对象数]] [--stress-qsbr [秒] [读线程数] [unsafe]] [--bench-chash [键数]] [--bench-route-storm [前缀数]] [--bench-fib [前缀数]] [--fib auto|trie|dir24] [--patterns 文件] [--echo] [--route 前缀/长度=IP:端口[*权重],...]... [--route-file 文件] "
+                   "[--mirror tun:接口名|udp:IP:端口] [--mirror-filter proto=N,net=前缀,port=N] "
+                   "[--mirror-rate 包每秒] [--qos port=N|sni=域名:interactive|bulk|background]... "
+                   "[--egress-rate Mbit每秒] [--fake-tun 包每秒] [--fake-peer 端口] "
+                   "[--replay pcap文件] [--replay-loop 遍数(0为无限)] [--replay-speed 倍数|max] "
+                   "[--recorder off|size=MB,snaplen=N,seconds=S,drops=每秒,peer=1,dir=目录] "
+                   "[--impair delay=ms,jitter=ms,loss=%%,dup=%%,reorder=%%,rate=Mbit,seed=N] [--stats-port 端口] [--duration 秒] [--quiet]\n", argv[0]);
+            exit(1);
+        }
+    }
+    
+    if (pkt_pool_init(&pool, PKT_POOL_SIZE, PKT_POOL_MAX_SIZE) < 0 || flow_table_init(&flows) < 0) {
+        printf("无法分配数据包缓冲池或流表\n");
+        exit(1);
+    }
+    if (flight_cfg.enabled && flight_init(&recorder, "datapath0", &flight_cfg) < 0) {
+        printf("无法分配飞行记录器\n");
+        exit(1);
+    }
+    
+    if (replay_file) {
+        // 回放源和假TUN一样不需要root
+        if (replay_open(&replay, replay_file) < 0) {
+            printf("无法读取抓包文件或其中没有IP包: %s\n", replay_file);
+            exit(1);
+        }
+        tun_fd = replay_start(&replay, replay_speed, replay_loops);
+        if (tun_fd < 0) {
+            perror("启动抓包回放失败");
+            exit(1);
+        }
+        printf("✓ 回放 %s: %d 个包, 跳过 %lu 条记录, %s, %d 遍\n", replay_file, replay.npkts, replay.skipped,
+               replay_speed > 0 ? "按抓包时间" : "尽快", replay_loops);
+        fake_tun_pps = 0;
+    } else if (fake_tun_pps > 0) {
+        // 假TUN：不需要root，也不配置系统地址和路由
+        tun_fd = fake_tun_start(&fake_host, fake_tun_pps);
+        if (tun_fd < 0) {
+            perror("创建假TUN失败");
+            exit(1);
+        }
+        printf("✓ 假TUN已启动，流量发生器 %.0f 包/秒\n", fake_tun_pps);
+    } else {
+        printf("正在创建 awenawtun 接口...\n");
+        
+        // 1. 创建TUN设备
+        tun_fd = tun_alloc(tun_name);
+        if (tun_fd < 0) {
+            perror("创建TUN接口失败");
+            exit(1);
+        }
+        printf("✓ TUN接口 %s 创建成功\n", tun_name);
+        
+        // 2. 配置TUN接口IP地址和路由
+        if (configure_tun_interface(tun_name, "192.168.233.1/24", "192.168.233.0/24") < 0) {
+            printf("配置TUN接口失败\n");
+            close(tun_fd);
+            exit(1);
+        }
+    }
+    
+    if (fake_peer_port > 0) {
+        if (fake_peer_start(&fake_peer, fake_peer_port) < 0) {
+            perror("启动假对端失败");
+            exit(1);
+        }
+        printf("✓ 假对端在 127.0.0.1:%d 反射数据包\n", fake_peer_port);
+    }
+    if (impair_enabled) {
+        impair_init(&impair_out, &impair_cfg, &pool, 0);
+        impair_init(&impair_in, &impair_cfg, &pool, 1);
+        mem_account(MEM_IMPAIR, sizeof(impair_out) + sizeof(impair_in), 0);
+        printf("✓ 链路损伤: 延迟 %.1fms±%.1fms, 丢包 %.2f%%, 重复 %.2f%%, 乱序 %.2f%%, 带宽 %.1fMbit/s, 种子 %lu\n",
+               impair_cfg.delay_ms, impair_cfg.jitter_ms, impair_cfg.loss * 100, impair_cfg.duplicate * 100,
+               impair_cfg.reorder * 100, impair_cfg.rate * 8 / 1e6, impair_cfg.seed);
+    }
+    
+    // 3. 有出口路由时创建与对端通信的UDP socket（有路由文件时路由可能稍后才加入）
+    if (route_file && route_table_load(&routes, route_specs, nroute_specs, route_file, route_updates) < 0) {
+        printf("无法加载路由文件: %s\n", route_file);
+        exit(1);
+    }
+    if (routes.nroutes > 0 || route_file) {
+        udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_fd < 0) {
+            perror("创建UDP socket失败");
+            close(tun_fd);
+            exit(1);
+        }
+        fcntl(udp_fd, F_SETFL, O_NONBLOCK);  // 发送缓冲满时包留在出口队列里
+        printf("✓ 已加载 %d 条出口路由，%d 个对端\n", routes.nroutes, routes.npeers);
+    }
+    
+    if (npatterns > 0) printf("✓ 已加载 %d 个载荷匹配模式，命中的包将被丢弃\n", npatterns);
+    
+    if (mirror_target && mirror_start(&mirror, &pool, mirror_target, mirror_pps) < 0) {
+        printf("无效的镜像目标: %s\n", mirror_target);
+        mirror_target = NULL;
+    }
+    if (mirror_target) mem_account(MEM_CAPTURE, sizeof(mirror), 0);
+    mem_account(MEM_PEERS, sizeof(routes) + sizeof(egress), 0);
+    
+    if (stats_port > 0) {
+        stats_fd = stats_listen(stats_port);
+        if (stats_fd < 0) {
+            perror("统计接口监听失败");
+        } else {
+            printf("✓ 统计接口: http://127.0.0.1:%d/\n", stats_port);
+        }
+    }
+    
+    // 4. 显示使用说明
+    show_usage(replay_file, fake_tun_pps);
+    
+    // 5. 主循环：按批捕获并处理数据包
+    if (replay_file) printf("开始回放 %s ...\n\n", replay_file);
+    else if (fake_tun_pps > 0) printf("开始处理假TUN产生的流量...\n\n");
+    else printf("开始监听 %s 上 192.168.233.x 网段的流量...\n\n", tun_name);
+    fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL) | O_NONBLOCK);
+    
+    struct sigaction sa = { .sa_handler = handle_stop_signal };  // Ctrl+C 时正常清理
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    struct sigaction sa_dump = { .sa_handler = handle_dump_signal };  // kill -USR1 时飞行记录器落盘
+    sigaction(SIGUSR1, &sa_dump, NULL);
+    
+    qsbr_init(&qsbr);
+    qsbr_register(&qsbr, &datapath_qsbr);
+    if (route_table_build_fib(&routes) < 0) {
+        printf("无法建立路由查找表\n");
+        exit(1);
+    }
+    if (routes.nroutes > 0) {
+        char fib_desc[96];
+        route_fib_describe(routes.fib, fib_desc, sizeof(fib_desc));
+        printf("✓ 路由查找: %s\n", fib_desc);
+    }
+    if (route_file) {
+        // 之后的路由变更由构建线程重建FIB并原子替换，数据路径不等待
+        if (route_builder_start(&route_builder, &routes, &qsbr) < 0) {
+            printf("无法启动路由构建线程\n");
+            exit(1);
+        }
+        struct sigaction sa_reload = { .sa_handler = handle_reload_signal };  // kill -HUP 时重新加载路由文件
+        sigaction(SIGHUP, &sa_reload, NULL);
+        printf("✓ 路由文件 %s，发送 SIGHUP 重新加载\n", route_file);
+    }
+    if (chash_init(&peer_index, MEM_PEERS) < 0) {
+        printf("无法分配对端索引\n");
+        exit(1);
+    }
+    for (int p = 0; p < routes.npeers; p++)
+        chash_insert(&peer_index, &datapath_qsbr, peer_endpoint_key(&routes.peers[p].endpoint), (void*)(intptr_t)(p + 1));
+    
+    int running = 1;
+    time_t next_report = time(NULL) + FLOW_REPORT_SECONDS;
+    time_t deadline = duration > 0 ? time(NULL) + duration : 0;
+    while (running && !stop_requested) {
+        if (deadline && time(NULL) >= deadline) {
+            if (fake_tun_pps <= 0 || fake_host.quiesce) break;
+            fake_host.quiesce = 1;  // 先停发，留1秒让在途的包走完再统计
+            deadline = time(NULL) + 1;
+        }
+        struct pollfd fds[3] = {
+            { .fd = tun_fd, .events = POLLIN },
+            { .fd = udp_fd, .events = POLLIN },
+            { .fd = stats_fd, .events = POLLIN },  // fd为-1时poll忽略该项
+        };
+        // 出口队列有积压时需要按整形速率及时发送，损伤层按最早到期的包唤醒
+        int timeout = egress.backlog > 0 ? 1 : 1000;
+        uint64_t poll_ns = monotonic_ns();
+        int t_out = impair_timeout_ms(&impair_out, poll_ns), t_in = impair_timeout_ms(&impair_in, poll_ns);
+        if (t_out >= 0 && t_out < timeout) timeout = t_out;
+        if (t_in >= 0 && t_in < timeout) timeout = t_in;
+        qsbr_offline(&datapath_qsbr);  // 阻塞期间不拖住其他线程的回收
+        int ready = poll(fds, 3, timeout);
+        qsbr_online(&datapath_qsbr);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll失败");
+            break;
+        }
+        
+        if (route_reload_requested && route_file) {
+            route_reload_requested = 0;
+            int old_npeers = routes.npeers;
+            int nupdates = route_table_load(&routes, route_specs, nroute_specs, route_file, route_updates);
+            if (nupdates > 0) route_builder_submit(&route_builder, route_updates, nupdates);
+            for (int p = old_npeers; p < routes.npeers; p++)
+                chash_insert(&peer_index, &datapath_qsbr, peer_endpoint_key(&routes.peers[p].endpoint),
+                             (void*)(intptr_t)(p + 1));
+            if (nupdates >= 0)
+                printf("重新加载路由: %d 条路由, %d 处变更, %d 个对端\n", routes.nroutes, nupdates, routes.npeers);
+            else
+                printf("重新加载路由失败，保持当前路由\n");
+        }
+        
+        // 每批开始时统一应用健康检查/RTT带来的权重变化，并读取一次时间戳
+        route_commit_weights(&routes, time(NULL));
+        uint64_t batch_ns = monotonic_ns();
+        if (time(NULL) >= next_report) {
+            flow_table_report(&flows, 20);
+            next_report = time(NULL) + FLOW_REPORT_SECONDS;
+        }
+        
+        // 先读满一批并完成解析，再对整批做载荷匹配，最后逐包转发
+        uint64_t stage_ns = monotonic_ns();
+        struct pkt_buf *batch[RX_BATCH];
+        int matched[RX_BATCH];
+        int qos[RX_BATCH];
+        int nbatch = 0;
+        while (nbatch < RX_BATCH && (fds[0].revents & POLLIN)) {
+            struct pkt_buf *pkt = pkt_pool_get(&pool);
+            if (!pkt) break;  // 缓冲区全部被镜像占用，下一批再读
+            
+            // 从TUN接口读取IP数据包
+            nread = read(tun_fd, pkt->data, sizeof(pkt->data));
+            
+            if (nread < 0) {
+                pkt_buf_unref(&pool, pkt);
+                if (errno == EAGAIN) break;
+                perror("读取TUN接口数据失败");
+                running = 0;
+                break;
+            }
+            if (nread == 0) {
+                // 回放源关闭了写方向：处理完这一批后退出
+                pkt_buf_unref(&pool, pkt);
+                running = 0;
+                break;
+            }
+            pkt->len = nread;
+            flight_record(&recorder, pkt->data, nread, FLIGHT_OUT, batch_ns);
+            
+            if (verbose) {
+                printf("\n--- 收到数据包 ---\n");
+                parse_ip_packet(pkt->data, nread);
+            }
+            struct flow_entry *flow = flow_table_update(&flows, pkt->data, nread, batch_ns);
+            if (mirror_target) mirror_offer(&mirror, pkt);
+            qos[nbatch] = flow ? qos_flow_class(&qos_rules, flow) : QOS_BULK;
+            batch[nbatch++] = pkt;
+        }
+        stage_account(&stages, STAGE_RX, &stage_ns, nbatch);
+        if (npatterns > 0) {
+            pm_scan_batch(&patterns, batch, nbatch, matched);
+        } else {
+            memset(matched, 0, sizeof(matched));
+        }
+        stage_account(&stages, STAGE_MATCH, &stage_ns, nbatch);
+        
+        for (int i = 0; i < nbatch; i++) {
+            struct pkt_buf *pkt = batch[i];
+            nread = pkt->len;
+            
+            if (matched[i]) {
+                pattern_drops++;
+                if (verbose) printf("载荷命中 %d 个策略模式，已丢弃\n", matched[i]);
+                pkt_buf_unref(&pool, pkt);
+                continue;
+            }
+            
+            // 匹配出口路由的包按流哈希选择对端，按QoS类进入出口队列，批末统一经UDP发出
+            // （演示中省略WireGuard封装和加密）
+            int peer = route_select_peer(&routes, pkt->data, nread);
+            if (peer >= 0) {
+                struct tun_peer *p = &routes.peers[peer];
+                if (egress_enqueue(&egress, peer, &pool, pkt, qos[i], batch_ns) == 0) {
+                    if (verbose) printf("数据包进入对端 %s:%d 的 %s 队列\n", inet_ntoa(p->endpoint.sin_addr),
+                           ntohs(p->endpoint.sin_port), qos_class_names[qos[i]]);
+                } else if (verbose) {
+                    printf("对端 %s 队列已满，丢弃\n", qos_class_names[qos[i]]);
+                }
+                continue;  // 引用已交给出口队列
+            } else if (echo_mode) {
+                // 简单回显数据包（仅用于演示ICMP ping的响应）
+                if (write(tun_fd, pkt->data, nread) < 0) {
+                    perror("写入TUN接口失败");
+                } else if (verbose) {
+                    printf("数据包已回显\n");
+                }
+            } else if (icmp_send_unreachable(tun_fd, &icmp_limiter, pkt->data, nread, inet_addr("192.168.233.1"),
+                                             &routes) &&
+                       verbose) {
+                printf("无匹配路由，已回送目的不可达\n");
+            }
+            pkt_buf_unref(&pool, pkt);
+        }
+        
+        stage_account(&stages, STAGE_FORWARD, &stage_ns, nbatch);
+        int queued = egress.backlog;
+        if (udp_fd >= 0) egress_flush(&egress, &routes, &pool, udp_fd, &impair_out, monotonic_ns());
+        stage_account(&stages, STAGE_SEND, &stage_ns, queued - egress.backlog);
+        
+        // 对端发回的包写回TUN接口，同时作为对端存活的依据
+        for (int i = 0; i < RX_BATCH && udp_fd >= 0 && (fds[1].revents & POLLIN); i++) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            struct pkt_buf *pkt = pkt_pool_get(&pool);
+            if (!pkt) break;
+            
+            nread = recvfrom(udp_fd, pkt->data, sizeof(pkt->data), MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+            if (nread < 0) {
+                pkt_buf_unref(&pool, pkt);
+                break;
+            }
+            pkt->len = nread;
+            flight_record(&recorder, pkt->data, nread, FLIGHT_IN, batch_ns);
+            
+            int p = (int)(intptr_t)chash_lookup(&peer_index, peer_endpoint_key(&from)) - 1;
+            if (p < 0) {
+                unknown_peer_drops++;
+            } else {
+                routes.peers[p].last_rx = time(NULL);
+                routes.peers[p].unanswered_since = 0;
+                route_set_peer_health(&routes, p, 1);
+                flow_table_update(&flows, pkt->data, nread, batch_ns);
+                // 按流哈希选路，SYN也是经这个对端出去的：握手RTT就是该对端路径的RTT
+                if (flows.rtt_sample_us) route_observe_peer_rtt(&routes, p, flows.rtt_sample_us);
+                if (mirror_target) mirror_offer(&mirror, pkt);
+                if (impair_send(&impair_in, tun_fd, pkt, NULL, batch_ns) < 0) perror("写入TUN接口失败");
+            }
+            pkt_buf_unref(&pool, pkt);
+        }
+        
+        if (fds[2].revents & POLLIN) stats_respond(stats_fd, &pool, &flows, &egress, pattern_drops);
+        
+        uint64_t pump_ns = monotonic_ns();
+        pkt_pool_maintain(&pool, pump_ns);
+        flow_table_expire(&flows, pump_ns);
+        qsbr_quiescent(&datapath_qsbr);  // 本批读到的共享指针到此全部用完
+        impair_pump(&impair_out, pump_ns);
+        impair_pump(&impair_in, pump_ns);
+        
+        int manual_dump = flight_dump_requested;
+        flight_dump_requested = 0;
+        flight_poll(&flight_trigger, &flight_cfg, recorders, 1, pump_ns, manual_dump,
+                    pattern_drops + egress_drops(&egress, routes.npeers) + pool.exhausted, unknown_peer_drops);
+    }
+    
+    // 清理资源
+    printf("\n正在清理资源...\n");
+    qsbr_barrier(&datapath_qsbr);
+    if (route_file) route_builder_stop(&route_builder);  // 数据路径已离线，构建线程的回收不会等它
+    chash_destroy(&peer_index);
+    route_fib_free(routes.fib);
+    if (mirror_target) mirror_stop(&mirror);
+    if (fake_tun_pps > 0) fake_tun_stop(&fake_host);
+    if (replay_file) {
+        replay_stop(&replay);
+        stage_report(&stages);
+    }
+    if (flight_cfg.enabled) {
+        flight_wait(&flight_trigger);
+        if (flight_trigger.dump_at_ns) {  // 退出前补写已触发但还没到时间的记录
+            flight_poll(&flight_trigger, &flight_cfg, recorders, 1, monotonic_ns(), 1, 0, 0);
+            flight_wait(&flight_trigger);
+        }
+        printf("飞行记录器: 记录 %lu 个包, 缓冲 %u 条, 落盘 %lu 次, 未知对端包 %lu\n", recorder.recorded,
+               recorder.nslots, flight_trigger.dumps, unknown_peer_drops);
+        flight_free(&recorder);
+    }
+    flight_config_free(&flight_cfg);
+    if (fake_peer_port > 0) fake_peer_stop(&fake_peer);
+    if (impair_enabled) {
+        printf("链路损伤: 出方向 送达 %lu 丢弃 %lu 重复 %lu 乱序 %lu 溢出 %lu; "
+               "入方向 送达 %lu 丢弃 %lu 重复 %lu 乱序 %lu 溢出 %lu\n",
+               impair_out.passed, impair_out.lost, impair_out.duplicated, impair_out.reordered, impair_out.overflow,
+               impair_in.passed, impair_in.lost, impair_in.duplicated, impair_in.reordered, impair_in.overflow);
+        impair_drain(&impair_out);
+        impair_drain(&impair_in);
+    }
+    flow_table_report(&flows, 20);
+    printf("缓冲池: %d 块 (%d 个缓冲区), 增长 %lu 次, 归还 %lu 次, 耗尽 %lu 次\n", pool.nchunks,
+           pkt_pool_capacity(&pool), pool.grown, pool.shrunk, pool.exhausted);
+    if (routes.npeers > 0) egress_report(&egress, routes.npeers);
+    printf("ICMP不可达: 已发送 %lu, 限速抑制 %lu\n", icmp_limiter.sent, icmp_limiter.suppressed);
+    if (npatterns > 0) {
+        printf("载荷匹配丢弃: %lu 个包\n", pattern_drops);
+        pm_free(&patterns);
+    }
+    if (udp_fd >= 0) close(udp_fd);
+    if (stats_fd >= 0) close(stats_fd);
     close(tun_fd);
     
     // 删除添加的路由（可选）
-    system("ip route del 192.168.233.0/24 dev awenawtun 2>/dev/null");
+    if (fake_tun_pps <= 0 && !replay_file) system("ip route del 192.168.233.0/24 dev awenawtun 2>/dev/null");
     
     return 0;
 }
\ No newline at end of file
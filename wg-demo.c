@@ -3,39 +3,728 @@
  * 展示WireGuard如何通过UDP与对端通信的基本原理
  */
 
+#define _GNU_SOURCE  // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #define WG_DEFAULT_PORT 51820
+#define WG_IDENTITY_PATH "wg-demo.key"          // 本端私钥文件
+#define WG_CHECKPOINT_PATH "wg-demo.sessions"   // 会话检查点文件
 #define BUFFER_SIZE 2000
+#define CACHE_LINE_SIZE 64
+#define WG_REPLAY_WINDOW 64            // 重放窗口大小（位图位数）
+#define WG_SESSION_INDEX_BITS 24       // 会话ID低24位为对端表下标
+#define WG_SESSION_INDEX_MASK ((1u << WG_SESSION_INDEX_BITS) - 1)
+#define WG_MAX_STAGED_PACKETS 16       // 握手完成前最多暂存的待发包数
+#define WG_REJECT_AFTER_TIME 180       // 密钥超过该时长不再使用（秒）
+#define WG_IDLE_RECLAIM_SECONDS (WG_REJECT_AFTER_TIME * 3)  // 空闲超过该时长回收会话
+#define WG_TIMER_BATCH 256             // 定时器每次调用最多检查的活跃会话数
+#define WG_KEY_LEN 32
+#define WG_DH_BATCH 256                // 静态DH预计算时每个线程一次领取的对端数
+#define WG_HANDSHAKE_QUEUE_LEN 1024    // 握手线程池队列长度，满则丢弃新握手
+#define WG_HANDSHAKE_MAX_THREADS 16
+#define WG_RECV_POLL_MS 100            // 启用握手线程池时数据路径等待的最长时间
+#define WG_CLUSTER_MAX_NODES 16
+#define WG_CLUSTER_BATCH 7             // 每个复制报文携带的会话记录数（不超过1500字节MTU）
+#define WG_CLUSTER_FLUSH_MS 100        // 增量批量发送间隔
+#define WG_CLUSTER_COUNTER_MARGIN (1ULL << 20)  // 接管会话时发送计数器的安全跳跃量
+#define WG_CLUSTER_MAC_LEN 16          // 复制报文认证码长度（截断的BLAKE2s）
+#define WG_MAGLEV_TABLE_SIZE 65537     // Maglev查找表大小（质数，远大于分片数）
+#define WG_MAGLEV_MAX_SHARDS 64
+#define WG_TYPE_FORWARDED 0xF0         // 分片间转发的包（外层头部）
+#define WG_SIM_SOCKETS 16              // 模拟器承载虚拟对端的socket数（每个socket代表许多对端）
+#define WG_SIM_HANDSHAKE_WINDOW 256    // 模拟器未完成握手的上限，避免握手队列溢出
+#define WG_SIM_DATA_SECONDS 3          // 模拟器数据阶段时长
+#define WG_SIM_PAYLOAD 512             // 模拟数据包载荷字节数
+
+static int wg_verbose = 1;  // 数据路径逐包输出，压力测试时关闭
 
 // 模拟WireGuard数据包结构
 struct wg_packet {
-    uint8_t type;           // 1=握手, 4=数据包
+    uint8_t type;           // 1=握手, 4=数据包, 0xF0=分片间转发
     uint8_t reserved[3];    
     uint32_t session_id;    // 会话ID
     uint64_t counter;       // 数据包计数器
     uint8_t data[];         // 加密的IP数据包
 } __attribute__((packed));
 
-// WireGuard对等节点信息
+// 本端静态身份（私钥/公钥）
+struct wg_identity {
+    uint8_t private_key[WG_KEY_LEN];
+    uint8_t public_key[WG_KEY_LEN];
+};
+
+// 当前会话的密钥对（真实WireGuard中由握手派生）
+struct wg_keypair {
+    uint8_t send_key[32];         // 发送方向ChaCha20密钥
+    uint8_t recv_key[32];         // 接收方向ChaCha20密钥
+    time_t created;               // 密钥生成时间，用于轮换
+};
+
+// 握手完成前暂存的待发包（单链表）
+struct wg_staged_packet {
+    struct wg_staged_packet *next;
+    size_t len;
+    uint8_t data[];
+};
+
+/*
+ * 活跃会话状态 —— 仅在对端首次握手或首次发包时分配
+ *
+ * 计数器、重放窗口、当前密钥和握手前的待发队列都属于会话，
+ * 长时间空闲后整体回收，空闲对端只剩 wg_peer + wg_peer_cold。
+ * 会话占两个缓存行：计数器、重放窗口和握手状态在第一个，密钥跨在两行之间，
+ * 所以活跃对端的每个包除了热数组中的一项，还要访问会话的一到两个缓存行。
+ */
+struct wg_session {
+    uint64_t tx_counter;          // 发送计数器
+    uint64_t rx_counter;          // 接收计数器（重放窗口上沿）
+    uint64_t replay_bitmap;       // 重放窗口位图
+    time_t last_active;           // 最近一次收发时间，用于空闲回收
+    uint32_t keypair_ready;       // 握手是否已完成
+    uint32_t staged_count;        // 待发队列长度
+    struct wg_keypair keypair;    // 当前密钥
+    struct wg_staged_packet *staged_head;  // 握手完成前暂存的待发包
+    struct wg_staged_packet *staged_tail;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * WireGuard对等节点信息 —— 热数据部分
+ *
+ * 数据路径上每个包都会访问的字段（端点、会话ID、会话指针）压缩到32字节，
+ * 以连续数组存放在 wg_peer_table 中，两个对端共享一个缓存行。
+ * 公钥、时间戳等只在握手/管理路径上使用的字段放在 wg_peer_cold。
+ */
 struct wg_peer {
     struct sockaddr_in endpoint;  // 对端UDP地址
-    uint32_t session_id;          // 当前会话ID
-    uint64_t tx_counter;          // 发送计数器
-    uint64_t rx_counter;          // 接收计数器
+    uint32_t session_id;          // 当前会话ID（低24位为表下标）
+    uint32_t flags;               // WG_PEER_* 状态标志
+    struct wg_session *session;   // 活跃会话，NULL表示对端空闲
+} __attribute__((aligned(32)));
+
+_Static_assert(sizeof(struct wg_peer) == 32, "wg_peer热数据必须保持32字节");
+
+#define WG_PEER_DIRTY 0x1    // 会话有未复制到集群其他节点的变化
+
+#define WG_COLD_DH_CACHED 0x1    // static_static 已预计算（release发布，acquire读取）
+#define WG_COLD_DH_BUSY 0x2      // 某个线程正在写入 static_static
+
+// WireGuard对等节点信息 —— 冷数据部分（与热数据同下标）
+struct wg_peer_cold {
+    uint8_t public_key[WG_KEY_LEN];     // 对端静态公钥
+    uint8_t static_static[WG_KEY_LEN];  // 预计算的 DH(本端静态私钥, 对端静态公钥)
+    uint32_t last_handshake;      // 最近一次握手时间（秒）
+    uint16_t keepalive_interval;  // 心跳间隔（秒）
+    uint16_t flags;               // WG_COLD_* 标志
+    uint32_t handshake_count;     // 握手次数统计
+    uint32_t active_slot;         // 会话存在时在 wg_peer_table.active_peers 中的位置
+};
+
+struct wg_handshake_pool;
+struct wg_shard_map;
+int wg_shard_claim_session_id(const struct wg_shard_map *map, struct wg_peer *peer);
+
+/*
+ * 集群会话复制（active/active 集中器）
+ *
+ * 多个节点在anycast后共享同一个静态身份，任一节点上会话的端点、密钥和
+ * 计数器变化都以批量增量的形式通过UDP发给其他节点，对端流量切换到
+ * 另一个节点时无需重新握手。数据路径只负责打脏标记（已脏时无额外开销），
+ * 收集和发送在 wg_cluster_flush 中按批进行。
+ * 复制报文中的会话记录用由共享静态私钥派生的密钥加密，整个报文再带认证码，
+ * 各节点按 (启动标识, 序号) 拒绝重放，复制通道可以跨主机运行。
+ */
+struct wg_cluster {
+    int sockfd;                     // 复制通道socket
+    uint16_t node_id;
+    unsigned nnodes;                // 其他节点数
+    struct sockaddr_in nodes[WG_CLUSTER_MAX_NODES];
+    uint32_t *dirty;                // 待复制的对端下标
+    uint32_t dirty_count;
+    uint32_t seq;                   // 发送批次序号
+    uint64_t boot;                  // 本节点启动标识（启动时的墙上时间，纳秒），重启后变大
+    struct {
+        uint64_t boot;              // 已接受的最新报文的启动标识和序号，更旧的视为重放
+        uint32_t seq;
+    } received[WG_CLUSTER_MAX_NODES];
+    uint8_t secret[WG_KEY_LEN];     // 复制报文认证密钥，由共享的静态私钥派生
+    uint8_t cipher_key[WG_KEY_LEN]; // 会话记录加密密钥，同样派生，与认证密钥分开
+    uint64_t sent_records;
+    uint64_t applied_records;
+    uint64_t rejected;              // 来源、认证码不对或重放而丢弃的报文数
+};
+
+// 对端表：热数据与冷数据分别连续存放，用同一个下标关联
+struct wg_peer_table {
+    struct wg_peer *hot;          // 热数据数组（缓存行对齐）
+    struct wg_peer_cold *cold;    // 冷数据数组
+    uint32_t count;               // 已使用条目数
+    uint32_t capacity;            // 容量
+    uint32_t active;              // 已分配会话的对端数
+    uint32_t *active_peers;       // 有会话的对端下标（前 active 项有效，无序）
+    const struct wg_identity *identity;  // 本端静态密钥（握手时使用）
+    struct wg_handshake_pool *handshake_pool;  // 非NULL时握手消息交给独立线程池处理
+    struct wg_cluster *cluster;   // 非NULL时会话变化复制到集群其他节点
+    struct wg_shard_map *shards;  // 非NULL时只处理本分片负责的会话，其余转发给所属分片
+    time_t last_timer;            // 定时器上次运行的时间（秒）
+    uint32_t timer_cursor;        // 本轮空闲扫描在 active_peers 中的进度
+    int timer_sweeping;           // 本轮扫描尚未走完 active_peers
 };
 
+// 标记对端会话需要复制，每个对端在一个批次中只入队一次
+static inline void wg_cluster_mark_dirty(struct wg_peer_table *table, struct wg_peer *peer) {
+    struct wg_cluster *cluster = table->cluster;
+    if (!cluster || (peer->flags & WG_PEER_DIRTY)) return;
+
+    peer->flags |= WG_PEER_DIRTY;
+    cluster->dirty[cluster->dirty_count++] = peer - table->hot;
+}
+
 /**
- * 创建UDP socket用于与WireGuard对端通信
+ * 初始化对端表
+ * @param table 对端表
+ * @param capacity 最大对端数
+ * @return 成功返回0，失败返回-1
  */
-int create_wg_socket(int port) {
+int wg_peer_table_init(struct wg_peer_table *table, uint32_t capacity) {
+    if (capacity == 0 || capacity > WG_SESSION_INDEX_MASK + 1) return -1;
+
+    memset(table, 0, sizeof(*table));
+    table->hot = aligned_alloc(CACHE_LINE_SIZE, (size_t)capacity * sizeof(struct wg_peer));
+    table->cold = calloc(capacity, sizeof(struct wg_peer_cold));
+    table->active_peers = malloc((size_t)capacity * sizeof(uint32_t));
+    if (!table->hot || !table->cold || !table->active_peers) {
+        free(table->hot);
+        free(table->cold);
+        free(table->active_peers);
+        return -1;
+    }
+    memset(table->hot, 0, (size_t)capacity * sizeof(struct wg_peer));
+    table->capacity = capacity;
+    return 0;
+}
+
+void wg_peer_table_free(struct wg_peer_table *table) {
+    free(table->hot);
+    free(table->cold);
+    free(table->active_peers);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * 向对端表添加一个对端
+ * @param table 对端表
+ * @param endpoint 对端UDP地址
+ * @param public_key 对端公钥（32字节，可为NULL）
+ * @return 成功返回热数据指针，表满返回NULL
+ */
+struct wg_peer *wg_peer_add(struct wg_peer_table *table, const struct sockaddr_in *endpoint,
+                            const uint8_t *public_key) {
+    if (table->count >= table->capacity) return NULL;
+
+    uint32_t index = table->count++;
+    struct wg_peer *peer = &table->hot[index];
+    struct wg_peer_cold *cold = &table->cold[index];
+
+    memset(peer, 0, sizeof(*peer));
+    peer->endpoint = *endpoint;
+    peer->session_id = (1u << WG_SESSION_INDEX_BITS) | index;  // 高8位为代数，避免旧会话误命中
+
+    memset(cold, 0, sizeof(*cold));
+    if (public_key) memcpy(cold->public_key, public_key, 32);
+    cold->keepalive_interval = 25;
+    return peer;
+}
+
+/**
+ * 激活对端：首次握手或首次发包时分配会话状态
+ * @return 成功返回会话指针，内存不足返回NULL
+ */
+struct wg_session *wg_peer_activate(struct wg_peer_table *table, struct wg_peer *peer) {
+    if (peer->session) return peer->session;
+
+    struct wg_session *session = aligned_alloc(CACHE_LINE_SIZE, sizeof(*session));
+    if (!session) return NULL;
+
+    memset(session, 0, sizeof(*session));
+    session->last_active = time(NULL);
+    peer->session = session;
+
+    uint32_t index = peer - table->hot;
+    table->cold[index].active_slot = table->active;
+    table->active_peers[table->active++] = index;
+    return session;
+}
+
+// 释放会话及其待发队列，对端回到空闲状态
+static void wg_peer_deactivate(struct wg_peer_table *table, struct wg_peer *peer) {
+    struct wg_session *session = peer->session;
+    if (!session) return;
+
+    while (session->staged_head) {
+        struct wg_staged_packet *next = session->staged_head->next;
+        free(session->staged_head);
+        session->staged_head = next;
+    }
+    memset(&session->keypair, 0, sizeof(session->keypair));  // 回收前清除密钥
+    free(session);
+    peer->session = NULL;
+
+    // 用最后一项填补空位，active_peers 保持紧凑
+    uint32_t slot = table->cold[peer - table->hot].active_slot;
+    uint32_t last = table->active_peers[--table->active];
+    table->active_peers[slot] = last;
+    table->cold[last].active_slot = slot;
+}
+
+/**
+ * 检查 active_peers 中的一段会话，回收其中空闲的
+ * 回收时最后一项移到当前位置，该位置需要重新检查，所以游标不前进
+ * @param cursor 起始位置，返回时指向下一个待检查的位置
+ * @param budget 最多检查的会话数
+ * @return 回收的会话数
+ */
+static uint32_t wg_peer_reap_range(struct wg_peer_table *table, time_t now, uint32_t idle_seconds,
+                                   uint32_t *cursor, uint32_t budget) {
+    uint32_t reaped = 0;
+    uint32_t i = *cursor;
+
+    while (i < table->active && budget-- > 0) {
+        struct wg_peer *peer = &table->hot[table->active_peers[i]];
+        if (now - peer->session->last_active >= (time_t)idle_seconds) {
+            wg_peer_deactivate(table, peer);
+            reaped++;
+        } else {
+            i++;
+        }
+    }
+    *cursor = i;
+    return reaped;
+}
+
+/**
+ * 一次性回收所有空闲超过阈值的会话（只遍历有会话的对端）
+ * @param now 当前时间
+ * @param idle_seconds 空闲阈值，0表示回收全部会话
+ * @return 回收的会话数
+ */
+uint32_t wg_peer_reap_idle(struct wg_peer_table *table, time_t now, uint32_t idle_seconds) {
+    uint32_t cursor = 0;
+    return wg_peer_reap_range(table, now, idle_seconds, &cursor, UINT32_MAX);
+}
+
+/**
+ * 定时器：每秒开始一轮空闲扫描，回收空闲超过 WG_IDLE_RECLAIM_SECONDS 的会话
+ * 每次调用最多检查 WG_TIMER_BATCH 个活跃会话，一轮扫描分摊到后续多次调用上，
+ * 数据路径不会因为会话多而停顿。由处理数据包的线程在收包间隙调用，会话只在该线程上释放
+ */
+void wg_peer_timers(struct wg_peer_table *table, time_t now) {
+    if (now != table->last_timer) {
+        table->last_timer = now;
+        if (!table->timer_sweeping) {
+            table->timer_sweeping = 1;
+            table->timer_cursor = 0;
+        }
+    }
+    if (!table->timer_sweeping) return;
+
+    uint32_t reaped = wg_peer_reap_range(table, now, WG_IDLE_RECLAIM_SECONDS, &table->timer_cursor, WG_TIMER_BATCH);
+    if (table->timer_cursor >= table->active) table->timer_sweeping = 0;
+    if (reaped > 0 && wg_verbose) printf("⏲ 回收 %u 个空闲会话 (活跃对端: %u/%u)\n", reaped, table->active, table->count);
+}
+
+/**
+ * 通过数据包中的会话ID查找对端（O(1)，只读热数组中的一项）
+ * 计数器和重放窗口在会话里，调用方处理数据包时还要再访问会话
+ */
+static inline struct wg_peer *wg_peer_lookup(struct wg_peer_table *table, uint32_t session_id) {
+    uint32_t index = session_id & WG_SESSION_INDEX_MASK;
+    if (index >= table->count) return NULL;
+
+    struct wg_peer *peer = &table->hot[index];
+    return peer->session_id == session_id ? peer : NULL;
+}
+
+static inline struct wg_peer_cold *wg_peer_cold(struct wg_peer_table *table, const struct wg_peer *peer) {
+    return &table->cold[peer - table->hot];
+}
+
+/**
+ * 重放窗口检查：接受新计数器或窗口内未见过的计数器
+ * @return 可接受返回1，重放或过旧返回0
+ */
+static inline int wg_replay_check(struct wg_session *session, uint64_t counter) {
+    if (counter > session->rx_counter) {
+        uint64_t shift = counter - session->rx_counter;
+        session->replay_bitmap = shift >= WG_REPLAY_WINDOW ? 1 : (session->replay_bitmap << shift) | 1;
+        session->rx_counter = counter;
+        return 1;
+    }
+
+    uint64_t offset = session->rx_counter - counter;
+    if (offset >= WG_REPLAY_WINDOW || (session->replay_bitmap & (1ULL << offset))) {
+        return 0;
+    }
+    session->replay_bitmap |= 1ULL << offset;
+    return 1;
+}
+
+/*
+ * X25519 椭圆曲线Diffie-Hellman（参照TweetNaCl的紧凑实现）
+ *
+ * 域元素用16个16位limb表示，只用于握手路径，不追求极致性能。
+ */
+typedef int64_t gf25519[16];
+
+static void gf_carry(gf25519 o) {
+    for (int i = 0; i < 16; i++) {
+        o[i] += (1LL << 16);
+        int64_t c = o[i] >> 16;
+        o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+        o[i] -= c * (1LL << 16);
+    }
+}
+
+// 常数时间条件交换：b为1时交换p和q
+static void gf_swap(gf25519 p, gf25519 q, int b) {
+    int64_t mask = ~((int64_t)b - 1);
+    for (int i = 0; i < 16; i++) {
+        int64_t t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void gf_pack(uint8_t *out, const gf25519 n) {
+    gf25519 m, t;
+    memcpy(t, n, sizeof(t));
+    gf_carry(t);
+    gf_carry(t);
+    gf_carry(t);
+    for (int j = 0; j < 2; j++) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int b = (m[15] >> 16) & 1;
+        m[14] &= 0xffff;
+        gf_swap(t, m, 1 - b);
+    }
+    for (int i = 0; i < 16; i++) {
+        out[2 * i] = t[i] & 0xff;
+        out[2 * i + 1] = t[i] >> 8;
+    }
+}
+
+static void gf_unpack(gf25519 o, const uint8_t *n) {
+    for (int i = 0; i < 16; i++) o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+    o[15] &= 0x7fff;
+}
+
+static void gf_add(gf25519 o, const gf25519 a, const gf25519 b) {
+    for (int i = 0; i < 16; i++) o[i] = a[i] + b[i];
+}
+
+static void gf_sub(gf25519 o, const gf25519 a, const gf25519 b) {
+    for (int i = 0; i < 16; i++) o[i] = a[i] - b[i];
+}
+
+static void gf_mul(gf25519 o, const gf25519 a, const gf25519 b) {
+    int64_t t[31] = {0};
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) t[i + j] += a[i] * b[j];
+    }
+    for (int i = 0; i < 15; i++) t[i] += 38 * t[i + 16];
+    memcpy(o, t, 16 * sizeof(int64_t));
+    gf_carry(o);
+    gf_carry(o);
+}
+
+static void gf_invert(gf25519 o, const gf25519 in) {
+    gf25519 c;
+    memcpy(c, in, sizeof(c));
+    for (int a = 253; a >= 0; a--) {
+        gf_mul(c, c, c);
+        if (a != 2 && a != 4) gf_mul(c, c, in);
+    }
+    memcpy(o, c, sizeof(c));
+}
+
+/**
+ * X25519标量乘法
+ * @param out 输出的共享密钥/公钥（32字节）
+ * @param scalar 私钥（32字节，内部做clamp）
+ * @param point 对端公钥的u坐标（32字节）
+ */
+void x25519(uint8_t out[WG_KEY_LEN], const uint8_t scalar[WG_KEY_LEN], const uint8_t point[WG_KEY_LEN]) {
+    static const gf25519 a24 = {0xDB41, 1};
+    uint8_t z[WG_KEY_LEN];
+    gf25519 x, a, b, c, d, e, f;
+
+    memcpy(z, scalar, WG_KEY_LEN);
+    z[31] = (z[31] & 127) | 64;
+    z[0] &= 248;
+
+    gf_unpack(x, point);
+    memcpy(b, x, sizeof(b));
+    memset(a, 0, sizeof(a));
+    memset(c, 0, sizeof(c));
+    memset(d, 0, sizeof(d));
+    a[0] = d[0] = 1;
+
+    // Montgomery阶梯
+    for (int i = 254; i >= 0; i--) {
+        int bit = (z[i >> 3] >> (i & 7)) & 1;
+        gf_swap(a, b, bit);
+        gf_swap(c, d, bit);
+        gf_add(e, a, c);
+        gf_sub(a, a, c);
+        gf_add(c, b, d);
+        gf_sub(b, b, d);
+        gf_mul(d, e, e);
+        gf_mul(f, a, a);
+        gf_mul(a, c, a);
+        gf_mul(c, b, e);
+        gf_add(e, a, c);
+        gf_sub(a, a, c);
+        gf_mul(b, a, a);
+        gf_sub(c, d, f);
+        gf_mul(a, c, a24);
+        gf_add(a, a, d);
+        gf_mul(c, c, a);
+        gf_mul(a, d, f);
+        gf_mul(d, b, x);
+        gf_mul(b, e, e);
+        gf_swap(a, b, bit);
+        gf_swap(c, d, bit);
+    }
+    gf_invert(c, c);
+    gf_mul(a, a, c);
+    gf_pack(out, a);
+    memset(z, 0, sizeof(z));
+}
+
+// 由私钥计算公钥
+void x25519_public(uint8_t out[WG_KEY_LEN], const uint8_t private_key[WG_KEY_LEN]) {
+    static const uint8_t basepoint[WG_KEY_LEN] = {9};
+    x25519(out, private_key, basepoint);
+}
+
+/**
+ * 生成本端静态身份
+ * @return 成功返回0，随机数不可用返回-1
+ */
+int wg_identity_generate(struct wg_identity *identity) {
+    if (getrandom(identity->private_key, WG_KEY_LEN, 0) != WG_KEY_LEN) return -1;
+    x25519_public(identity->public_key, identity->private_key);
+    return 0;
+}
+
+// 从已打开的私钥文件读取身份并关闭文件
+static int wg_identity_read(struct wg_identity *identity, const char *path, int fd) {
+    struct stat st;
+
+    // 与检查点一样，拒绝同组或其他用户可访问、或不属于本用户的私钥文件
+    if (fstat(fd, &st) < 0 || (st.st_mode & 077) || st.st_uid != geteuid()) {
+        printf("⚠ 私钥文件 %s 权限不安全（应为本用户所有且权限0600），拒绝加载\n", path);
+        close(fd);
+        return -1;
+    }
+    ssize_t n = read(fd, identity->private_key, WG_KEY_LEN);
+    close(fd);
+    if (n != WG_KEY_LEN) {
+        printf("⚠ 私钥文件 %s 长度无效\n", path);
+        return -1;
+    }
+    x25519_public(identity->public_key, identity->private_key);
+    return 0;
+}
+
+/**
+ * 从文件加载本端私钥，文件不存在时生成新身份并以0600权限保存
+ * 重启后身份不变，已保存的会话检查点才能继续使用
+ * @return 成功返回0，文件无法读取、无效或权限不安全返回-1
+ */
+int wg_identity_load_or_generate(struct wg_identity *identity, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) return wg_identity_read(identity, path, fd);
+    if (errno != ENOENT) {
+        printf("⚠ 无法读取私钥文件 %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (wg_identity_generate(identity) < 0) return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        // 另一个进程（如集群节点）抢先创建了，只再读一次；悬空的符号链接也会走到这里
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) return wg_identity_read(identity, path, fd);
+        printf("⚠ 无法读取私钥文件 %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fd < 0) return 0;  // 无法保存时仍以临时身份运行
+    if (write(fd, identity->private_key, WG_KEY_LEN) != WG_KEY_LEN) {
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * 静态-静态DH预计算
+ *
+ * Noise IK握手中 DH(本端静态, 对端静态) 在两端密钥不变时结果固定，
+ * 因此在加载对端时一次性算好并缓存在冷数据中，每次握手省掉一次标量乘法。
+ * 多个线程按批次（WG_DH_BATCH个对端）从共享游标领取任务，负载自动均衡。
+ */
+/**
+ * 取出缓存的静态-静态DH，未缓存（例如运行中新增的对端）时当场计算并填充
+ * 多个握手线程可能同时处理同一对端：只有抢到 BUSY 位的线程写缓存，写完后以release
+ * 发布 CACHED；其余线程直接使用自己算出的结果，读者以acquire检查后才读缓存
+ */
+static void wg_peer_static_static(struct wg_peer_table *table, struct wg_peer_cold *cold, uint8_t out[WG_KEY_LEN]) {
+    uint16_t flags = __atomic_load_n(&cold->flags, __ATOMIC_ACQUIRE);
+    if (flags & WG_COLD_DH_CACHED) {
+        memcpy(out, cold->static_static, WG_KEY_LEN);
+        return;
+    }
+    x25519(out, table->identity->private_key, cold->public_key);
+    if (!(flags & WG_COLD_DH_BUSY) &&
+        __atomic_compare_exchange_n(&cold->flags, &flags, flags | WG_COLD_DH_BUSY, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        memcpy(cold->static_static, out, WG_KEY_LEN);
+        __atomic_store_n(&cold->flags, flags | WG_COLD_DH_CACHED, __ATOMIC_RELEASE);
+    }
+}
+
+struct wg_dh_precompute_job {
+    struct wg_peer_table *table;
+    uint32_t next;                // 下一个待领取的对端下标（原子递增）
+};
+
+static void *wg_dh_precompute_worker(void *arg) {
+    struct wg_dh_precompute_job *job = arg;
+    struct wg_peer_table *table = job->table;
+
+    for (;;) {
+        uint32_t begin = __atomic_fetch_add(&job->next, WG_DH_BATCH, __ATOMIC_RELAXED);
+        if (begin >= table->count) break;
+        uint32_t end = begin + WG_DH_BATCH < table->count ? begin + WG_DH_BATCH : table->count;
+
+        for (uint32_t i = begin; i < end; i++) {
+            uint8_t scratch[WG_KEY_LEN];
+            wg_peer_static_static(table, &table->cold[i], scratch);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 为表中所有对端并行预计算静态-静态DH
+ * @param nthreads 工作线程数（0表示在调用线程中完成）
+ * @return 成功返回0
+ */
+int wg_peer_precompute_dh(struct wg_peer_table *table, unsigned nthreads) {
+    struct wg_dh_precompute_job job = { .table = table, .next = 0 };
+    pthread_t threads[64];
+
+    if (!table->identity) return -1;
+    if (nthreads > 64) nthreads = 64;
+
+    unsigned started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, wg_dh_precompute_worker, &job) != 0) break;
+    }
+    wg_dh_precompute_worker(&job);  // 调用线程也参与计算
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
+
+/*
+ * 演示用密钥派生
+ * 真实WireGuard使用BLAKE2s构造的HKDF链式混合各DH结果，这里用简单的
+ * 64位混合函数代替，只用于展示握手所需的DH次数和数据流向。
+ */
+static void wg_kdf_demo(struct wg_keypair *keypair, const uint8_t dh[][WG_KEY_LEN], int ndh) {
+    uint64_t state = 0x6a09e667f3bcc908ULL;
+    uint8_t *out = keypair->send_key;
+
+    for (int k = 0; k < 2 * WG_KEY_LEN; k += 8) {
+        for (int n = 0; n < ndh; n++) {
+            for (int i = 0; i < WG_KEY_LEN; i += 8) {
+                uint64_t word;
+                memcpy(&word, &dh[n][i], 8);
+                state ^= word + k;
+                state *= 0x9e3779b97f4a7c15ULL;
+                state ^= state >> 29;
+            }
+        }
+        uint8_t *dst = k < WG_KEY_LEN ? out + k : keypair->recv_key + (k - WG_KEY_LEN);
+        memcpy(dst, &state, 8);
+    }
+    keypair->created = time(NULL);
+}
+
+/**
+ * 响应方处理握手发起：计算 es、ss（缓存）、ee、se 并派生会话密钥
+ * @param initiator_ephemeral 发起方临时公钥
+ * @param responder_ephemeral 输出本端临时公钥（放入握手响应中）
+ * @param keypair 输出的会话密钥
+ * @return 成功返回0
+ */
+int wg_handshake_respond(struct wg_peer_table *table, struct wg_peer *peer,
+                         const uint8_t initiator_ephemeral[WG_KEY_LEN],
+                         uint8_t responder_ephemeral[WG_KEY_LEN], struct wg_keypair *keypair) {
+    struct wg_peer_cold *cold = wg_peer_cold(table, peer);
+    uint8_t ephemeral_private[WG_KEY_LEN];
+    uint8_t dh[4][WG_KEY_LEN];
+
+    if (!table->identity) return -1;
+    if (getrandom(ephemeral_private, WG_KEY_LEN, 0) != WG_KEY_LEN) return -1;
+
+    x25519(dh[0], table->identity->private_key, initiator_ephemeral);  // es
+    wg_peer_static_static(table, cold, dh[1]);                         // ss（预计算）
+    x25519_public(responder_ephemeral, ephemeral_private);
+    x25519(dh[2], ephemeral_private, initiator_ephemeral);             // ee
+    x25519(dh[3], ephemeral_private, cold->public_key);                // se
+    wg_kdf_demo(keypair, (const uint8_t (*)[WG_KEY_LEN])dh, 4);
+
+    memset(ephemeral_private, 0, sizeof(ephemeral_private));
+    memset(dh, 0, sizeof(dh));
+    return 0;
+}
+
+/**
+ * 创建UDP socket并绑定到指定地址
+ * @param addr_ip 本地地址（网络字节序），INADDR_ANY表示所有接口
+ */
+int create_wg_socket_on(in_addr_t addr_ip, int port) {
     int sockfd;
     struct sockaddr_in addr;
     
@@ -49,7 +738,7 @@ int create_wg_socket(int port) {
     // 绑定到指定端口
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_addr.s_addr = addr_ip;
     addr.sin_port = htons(port);
     
     if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
@@ -63,65 +752,1209 @@ int create_wg_socket(int port) {
 }
 
 /**
- * 模拟发送数据包到WireGuard对端
+ * 创建UDP socket用于与WireGuard对端通信
+ */
+int create_wg_socket(int port) {
+    return create_wg_socket_on(INADDR_ANY, port);
+}
+
+/**
+ * 握手完成前把待发包暂存到会话队列，满则丢弃最旧的包
+ */
+static int wg_session_stage(struct wg_session *session, const void *data, size_t len) {
+    struct wg_staged_packet *staged = malloc(sizeof(*staged) + len);
+    if (!staged) return -1;
+    staged->next = NULL;
+    staged->len = len;
+    memcpy(staged->data, data, len);
+
+    if (session->staged_count == WG_MAX_STAGED_PACKETS) {
+        struct wg_staged_packet *oldest = session->staged_head;
+        session->staged_head = oldest->next;
+        if (!session->staged_head) session->staged_tail = NULL;
+        free(oldest);
+        session->staged_count--;
+    }
+    if (session->staged_tail) {
+        session->staged_tail->next = staged;
+    } else {
+        session->staged_head = staged;
+    }
+    session->staged_tail = staged;
+    session->staged_count++;
+    return 0;
+}
+
+/**
+ * 模拟发送数据包到WireGuard对端
+ * 对端空闲时先激活会话；握手未完成时包被暂存，返回1
+ */
+int send_to_peer(int sockfd, struct wg_peer_table *table, struct wg_peer *peer,
+                 const void *data, size_t len) {
+    struct wg_packet *pkt;
+    size_t total_len = sizeof(struct wg_packet) + len;
+    
+    // 首次发包时才分配会话状态
+    struct wg_session *session = wg_peer_activate(table, peer);
+    if (!session) return -1;
+    session->last_active = time(NULL);
+    
+    if (!session->keypair_ready) {
+        // 在真实WireGuard中，这里会触发握手发起
+        if (wg_verbose) printf("… 会话尚未握手，暂存 %zu 字节 (队列: %u)\n", len, session->staged_count + 1);
+        return wg_session_stage(session, data, len) < 0 ? -1 : 1;
+    }
+    
+    // 分配数据包内存
+    pkt = malloc(total_len);
+    if (!pkt) return -1;
+    
+    // 构造WireGuard数据包
+    pkt->type = 4;  // 数据包类型
+    memset(pkt->reserved, 0, 3);
+    pkt->session_id = peer->session_id;
+    pkt->counter = ++session->tx_counter;
+    wg_cluster_mark_dirty(table, peer);
+    
+    // 在真实WireGuard中，这里会进行ChaCha20+Poly1305加密
+    memcpy(pkt->data, data, len);
+    
+    // 通过UDP发送到对端
+    ssize_t sent = sendto(sockfd, pkt, total_len, 0, 
+                         (struct sockaddr*)&peer->endpoint, 
+                         sizeof(peer->endpoint));
+    
+    if (sent > 0) {
+        if (wg_verbose) printf("→ 发送 %zd 字节到 %s:%d (计数器: %lu)\n", 
+               sent, inet_ntoa(peer->endpoint.sin_addr), 
+               ntohs(peer->endpoint.sin_port), pkt->counter);
+    }
+    
+    free(pkt);
+    return sent > 0 ? 0 : -1;
+}
+
+/**
+ * 握手完成：安装密钥，发出握手响应，再发送握手期间暂存的包
+ * 响应必须在密钥安装之后才发出，否则发起方随即发来的数据包会因会话未就绪被丢弃
+ * @param response 握手响应报文，NULL表示不需要响应
+ */
+int wg_session_install_keypair(int sockfd, struct wg_peer_table *table, struct wg_peer *peer,
+                               const struct wg_keypair *keypair, const void *response, size_t response_len) {
+    struct wg_session *session = wg_peer_activate(table, peer);
+    if (!session) return -1;
+
+    session->keypair = *keypair;
+    session->keypair_ready = 1;
+    session->tx_counter = 0;
+    session->rx_counter = 0;
+    session->replay_bitmap = 0;
+    session->last_active = time(NULL);
+
+    struct wg_peer_cold *cold = wg_peer_cold(table, peer);
+    cold->last_handshake = (uint32_t)session->last_active;
+    cold->handshake_count++;
+    wg_cluster_mark_dirty(table, peer);
+
+    if (response) {
+        sendto(sockfd, response, response_len, 0, (struct sockaddr*)&peer->endpoint, sizeof(peer->endpoint));
+    }
+
+    // 取出暂存队列后再发送，避免发送过程中再次入队
+    struct wg_staged_packet *staged = session->staged_head;
+    session->staged_head = session->staged_tail = NULL;
+    session->staged_count = 0;
+    while (staged) {
+        struct wg_staged_packet *next = staged->next;
+        send_to_peer(sockfd, table, peer, staged->data, staged->len);
+        free(staged);
+        staged = next;
+    }
+    return 0;
+}
+
+/*
+ * 握手线程池
+ *
+ * 握手需要多次X25519标量乘法，比处理一个数据包贵几个数量级。
+ * 数据路径只把类型1/2/3消息复制进有界队列（满则丢弃，不阻塞转发），
+ * 由固定在独立CPU集合上的工作线程计算；结果通过无锁链表发布并经eventfd唤醒数据路径，
+ * 数据路径取走结果、安装密钥后才发出握手响应，计数器和会话始终只由数据路径线程修改。
+ */
+struct wg_handshake_job {
+    struct wg_handshake_job *next;  // 完成链表
+    struct sockaddr_in from;        // 握手消息来源
+    uint32_t session_id;
+    uint8_t type;
+    int ok;                         // 握手是否成功
+    uint8_t ephemeral[WG_KEY_LEN];  // 发起方临时公钥；完成后为本端临时公钥（放入握手响应）
+    struct wg_keypair keypair;      // 派生出的会话密钥
+};
+
+struct wg_handshake_pool {
+    struct wg_peer_table *table;
+    int wake_fd;                    // eventfd，有握手完成时可读
+    pthread_t threads[WG_HANDSHAKE_MAX_THREADS];
+    unsigned nthreads;
+
+    pthread_mutex_t lock;           // 保护待处理队列
+    pthread_cond_t nonempty;
+    struct wg_handshake_job *queue[WG_HANDSHAKE_QUEUE_LEN];
+    uint32_t head, tail;            // 环形队列读写位置
+    int stopping;
+
+    struct wg_handshake_job *completed;  // 已完成的握手（无锁栈，工作线程压入，数据路径整体取走）
+    uint64_t dropped;               // 队列满丢弃的握手数
+};
+
+static void wg_handshake_process(struct wg_handshake_pool *pool, struct wg_handshake_job *job) {
+    struct wg_peer_table *table = pool->table;
+    struct wg_peer *peer = wg_peer_lookup(table, job->session_id);
+
+    job->ok = 0;
+    if (!peer) return;
+
+    if (job->type == 1) {
+        uint8_t ephemeral[WG_KEY_LEN];
+
+        if (wg_handshake_respond(table, peer, job->ephemeral, ephemeral, &job->keypair) < 0) return;
+        memcpy(job->ephemeral, ephemeral, WG_KEY_LEN);  // 握手响应由数据路径在安装密钥后发出
+        job->ok = 1;
+    }
+    // 类型2（握手响应）和3（Cookie回复）属于发起方流程，本演示只实现响应方
+}
+
+static void *wg_handshake_worker(void *arg) {
+    struct wg_handshake_pool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == pool->tail && !pool->stopping) {
+            pthread_cond_wait(&pool->nonempty, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        struct wg_handshake_job *job = pool->queue[pool->head % WG_HANDSHAKE_QUEUE_LEN];
+        pool->head++;
+        pthread_mutex_unlock(&pool->lock);
+
+        wg_handshake_process(pool, job);
+
+        // 无锁发布结果
+        job->next = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&pool->completed, &job->next, job, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        uint64_t one = 1;
+        if (write(pool->wake_fd, &one, sizeof(one)) < 0) {
+            // 计数器溢出才会失败，数据路径仍会在下一个包到来时取走结果
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 创建握手线程池
+ * @param nthreads 工作线程数
+ * @param cpus 工作线程绑定的CPU集合，NULL表示不绑定
+ * @return 成功返回线程池，失败返回NULL
+ */
+struct wg_handshake_pool *wg_handshake_pool_create(struct wg_peer_table *table,
+                                                   unsigned nthreads, const cpu_set_t *cpus) {
+    struct wg_handshake_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+
+    pool->table = table;
+    pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->wake_fd < 0) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->nonempty, NULL);
+
+    if (nthreads == 0) nthreads = 1;
+    if (nthreads > WG_HANDSHAKE_MAX_THREADS) nthreads = WG_HANDSHAKE_MAX_THREADS;
+    for (; pool->nthreads < nthreads; pool->nthreads++) {
+        pthread_t *thread = &pool->threads[pool->nthreads];
+        if (pthread_create(thread, NULL, wg_handshake_worker, pool) != 0) break;
+        if (cpus && pthread_setaffinity_np(*thread, sizeof(*cpus), cpus) != 0) {
+            printf("⚠ 握手线程绑定CPU失败，继续以不绑定方式运行\n");
+        }
+    }
+    if (pool->nthreads == 0) {
+        close(pool->wake_fd);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// 握手完成通知的文件描述符，数据路径把它和UDP socket一起等待
+int wg_handshake_pool_fd(const struct wg_handshake_pool *pool) {
+    return pool->wake_fd;
+}
+
+/**
+ * 数据路径提交握手消息（不阻塞，队列满时丢弃）
+ * @return 成功入队返回0，丢弃返回-1
+ */
+int wg_handshake_pool_submit(struct wg_handshake_pool *pool, const struct wg_packet *pkt,
+                             size_t len, const struct sockaddr_in *from) {
+    if (pkt->type == 1 && len < sizeof(struct wg_packet) + WG_KEY_LEN) return -1;
+
+    struct wg_handshake_job *job = malloc(sizeof(*job));
+    if (!job) return -1;
+    job->from = *from;
+    job->session_id = pkt->session_id;
+    job->type = pkt->type;
+    if (pkt->type == 1) memcpy(job->ephemeral, pkt->data, WG_KEY_LEN);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail - pool->head >= WG_HANDSHAKE_QUEUE_LEN) {
+        pool->dropped++;
+        pthread_mutex_unlock(&pool->lock);
+        free(job);
+        return -1;
+    }
+    pool->queue[pool->tail % WG_HANDSHAKE_QUEUE_LEN] = job;
+    pool->tail++;
+    pthread_cond_signal(&pool->nonempty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * 清除握手完成通知（eventfd可读时调用）。结果总是先入链表再发通知，
+ * 清除后由 wg_handshake_pool_drain 取走链表，不会漏掉任何结果
+ */
+void wg_handshake_pool_ack(struct wg_handshake_pool *pool) {
+    uint64_t pending;
+    if (read(pool->wake_fd, &pending, sizeof(pending)) < 0) {
+        // EAGAIN：通知已被清除
+    }
+}
+
+/**
+ * 数据路径取走已完成的握手，安装密钥后发出握手响应
+ * 没有完成的握手时只是一次原子读，不做系统调用，可以在每个包上调用
+ * @return 安装的密钥数
+ */
+int wg_handshake_pool_drain(struct wg_handshake_pool *pool, int sockfd) {
+    if (!__atomic_load_n(&pool->completed, __ATOMIC_ACQUIRE)) return 0;
+    struct wg_handshake_job *job = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_ACQUIRE);
+    int installed = 0;
+
+    while (job) {
+        struct wg_handshake_job *next = job->next;
+        struct wg_peer *peer = job->ok ? wg_peer_lookup(pool->table, job->session_id) : NULL;
+        if (peer) {
+            // 分片模式下新会话换成映射回本分片的ID，由响应告知发起方
+            if (pool->table->shards) wg_shard_claim_session_id(pool->table->shards, peer);
+
+            // 握手响应（类型2）携带本端临时公钥
+            uint8_t response[sizeof(struct wg_packet) + WG_KEY_LEN];
+            struct wg_packet *resp = (struct wg_packet*)response;
+            memset(resp, 0, sizeof(*resp));
+            resp->type = 2;
+            resp->session_id = peer->session_id;
+            memcpy(resp->data, job->ephemeral, WG_KEY_LEN);
+
+            peer->endpoint = job->from;
+            wg_session_install_keypair(sockfd, pool->table, peer, &job->keypair, response, sizeof(response));
+            if (wg_verbose) printf("  握手完成，会话已激活 (活跃对端: %u/%u)\n", pool->table->active, pool->table->count);
+            installed++;
+        }
+        memset(&job->keypair, 0, sizeof(job->keypair));
+        free(job);
+        job = next;
+    }
+    return installed;
+}
+
+// 停止工作线程并释放所有未处理/未取走的任务
+void wg_handshake_pool_destroy(struct wg_handshake_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->nonempty);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (; pool->head != pool->tail; pool->head++) {
+        free(pool->queue[pool->head % WG_HANDSHAKE_QUEUE_LEN]);
+    }
+    struct wg_handshake_job *job = pool->completed;
+    while (job) {
+        struct wg_handshake_job *next = job->next;
+        free(job);
+        job = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->nonempty);
+    close(pool->wake_fd);
+    free(pool);
+}
+
+/*
+ * 会话检查点：进程重启后恢复活跃会话
+ *
+ * 正常退出时把每个活跃会话的密钥、计数器和重放窗口写入本地文件（0600权限，
+ * 先写临时文件再rename保证原子性），启动时mmap读取并恢复，避免所有对端
+ * 同时重新握手。检查点只能使用一次：读入后立即删除，防止进程崩溃后再次
+ * 用旧计数器恢复导致nonce重用。
+ */
+#define WG_CHECKPOINT_MAGIC "WGCKPT01"
+#define WG_CHECKPOINT_VERSION 1
+
+struct wg_checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;                 // 会话记录数
+    uint8_t identity[WG_KEY_LEN];   // 本端公钥，身份变化时检查点作废
+    int64_t saved_at;
+};
+
+struct wg_checkpoint_record {
+    uint32_t session_id;
+    uint32_t reserved;
+    struct sockaddr_in endpoint;
+    uint8_t peer_public_key[WG_KEY_LEN];  // 对端配置变化时跳过该记录
+    uint64_t tx_counter;
+    uint64_t rx_counter;
+    uint64_t replay_bitmap;
+    int64_t last_active;
+    int64_t keypair_created;
+    uint8_t send_key[WG_KEY_LEN];
+    uint8_t recv_key[WG_KEY_LEN];
+};
+
+/**
+ * 保存所有活跃会话到检查点文件
+ * @return 成功返回保存的会话数，失败返回-1
+ */
+int wg_checkpoint_save(struct wg_peer_table *table, const char *path) {
+    char tmp_path[512];
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < table->count; i++) {
+        struct wg_session *session = table->hot[i].session;
+        if (session && session->keypair_ready) count++;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("创建检查点文件失败");
+        return -1;
+    }
+    fchmod(fd, 0600);  // 文件已存在时open不会修改权限
+
+    size_t size = sizeof(struct wg_checkpoint_header) + (size_t)count * sizeof(struct wg_checkpoint_record);
+    if (ftruncate(fd, size) < 0) {
+        perror("设置检查点文件大小失败");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("映射检查点文件失败");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    struct wg_checkpoint_header *header = map;
+    struct wg_checkpoint_record *record = (struct wg_checkpoint_record*)(header + 1);
+    memcpy(header->magic, WG_CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = WG_CHECKPOINT_VERSION;
+    header->count = count;
+    memcpy(header->identity, table->identity->public_key, WG_KEY_LEN);
+    header->saved_at = time(NULL);
+
+    for (uint32_t i = 0; i < table->count; i++) {
+        struct wg_peer *peer = &table->hot[i];
+        struct wg_session *session = peer->session;
+        if (!session || !session->keypair_ready) continue;
+
+        memset(record, 0, sizeof(*record));
+        record->session_id = peer->session_id;
+        record->endpoint = peer->endpoint;
+        memcpy(record->peer_public_key, table->cold[i].public_key, WG_KEY_LEN);
+        record->tx_counter = session->tx_counter;
+        record->rx_counter = session->rx_counter;
+        record->replay_bitmap = session->replay_bitmap;
+        record->last_active = session->last_active;
+        record->keypair_created = session->keypair.created;
+        memcpy(record->send_key, session->keypair.send_key, WG_KEY_LEN);
+        memcpy(record->recv_key, session->keypair.recv_key, WG_KEY_LEN);
+        record++;
+    }
+
+    int ret = msync(map, size, MS_SYNC);
+    munmap(map, size);
+    if (ret < 0 || fsync(fd) < 0 || rename(tmp_path, path) < 0) {
+        perror("写入检查点文件失败");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * 从检查点文件恢复会话（文件读入后即删除）
+ * @return 恢复的会话数，文件不存在返回0，文件无效返回-1
+ */
+int wg_checkpoint_restore(struct wg_peer_table *table, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+
+    // 检查点包含会话密钥，拒绝其他用户可读写或不属于本用户的文件
+    if (fstat(fd, &st) < 0 || (st.st_mode & 077) || st.st_uid != geteuid()) {
+        printf("⚠ 检查点文件 %s 权限不安全，忽略\n", path);
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct wg_checkpoint_header)) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    unlink(path);  // 只允许恢复一次
+
+    const struct wg_checkpoint_header *header = map;
+    const struct wg_checkpoint_record *record = (const struct wg_checkpoint_record*)(header + 1);
+    time_t now = time(NULL);
+    int restored = 0;
+
+    if (memcmp(header->magic, WG_CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != WG_CHECKPOINT_VERSION ||
+        (size_t)st.st_size != sizeof(*header) + (size_t)header->count * sizeof(*record) ||
+        memcmp(header->identity, table->identity->public_key, WG_KEY_LEN) != 0) {
+        printf("⚠ 检查点文件无效或本端身份已变化，忽略\n");
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header->count; i++, record++) {
+        struct wg_peer *peer = wg_peer_lookup(table, record->session_id);
+        if (!peer || memcmp(wg_peer_cold(table, peer)->public_key, record->peer_public_key, WG_KEY_LEN) != 0) {
+            continue;  // 对端已被删除或配置已改变
+        }
+        if (now - record->keypair_created >= WG_REJECT_AFTER_TIME) {
+            continue;  // 密钥已过期，让对端正常重新握手
+        }
+
+        struct wg_session *session = wg_peer_activate(table, peer);
+        if (!session) break;
+        peer->endpoint = record->endpoint;
+        session->tx_counter = record->tx_counter;
+        session->rx_counter = record->rx_counter;
+        session->replay_bitmap = record->replay_bitmap;
+        session->last_active = record->last_active;
+        session->keypair.created = record->keypair_created;
+        memcpy(session->keypair.send_key, record->send_key, WG_KEY_LEN);
+        memcpy(session->keypair.recv_key, record->recv_key, WG_KEY_LEN);
+        session->keypair_ready = 1;
+        restored++;
+    }
+
+    munmap(map, st.st_size);
+    return restored;
+}
+
+/*
+ * BLAKE2s（RFC 7693），只实现一次性计算
+ *
+ * 用作集群复制报文的带密钥认证码：复制报文携带会话密钥和计数器，
+ * 伪造一条就能让节点回滚计数器、重用nonce。
+ */
+static const uint32_t wg_blake2s_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint8_t wg_blake2s_sigma[10][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+};
+
+static inline uint32_t wg_rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void wg_blake2s_compress(uint32_t h[8], const uint8_t block[64], uint64_t t, int last) {
+    uint32_t m[16], v[16];
+
+    for (int i = 0; i < 16; i++) {
+        m[i] = (uint32_t)block[4 * i] | (uint32_t)block[4 * i + 1] << 8 |
+               (uint32_t)block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+    }
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = wg_blake2s_iv[i];
+    }
+    v[12] ^= (uint32_t)t;
+    v[13] ^= (uint32_t)(t >> 32);
+    if (last) v[14] = ~v[14];
+
+#define WG_BLAKE2S_G(a, b, c, d, x, y) do {                    \
+        v[a] += v[b] + (x); v[d] = wg_rotr32(v[d] ^ v[a], 16); \
+        v[c] += v[d];       v[b] = wg_rotr32(v[b] ^ v[c], 12); \
+        v[a] += v[b] + (y); v[d] = wg_rotr32(v[d] ^ v[a], 8);  \
+        v[c] += v[d];       v[b] = wg_rotr32(v[b] ^ v[c], 7);  \
+    } while (0)
+    for (int r = 0; r < 10; r++) {
+        const uint8_t *s = wg_blake2s_sigma[r];
+        WG_BLAKE2S_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        WG_BLAKE2S_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        WG_BLAKE2S_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        WG_BLAKE2S_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        WG_BLAKE2S_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        WG_BLAKE2S_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        WG_BLAKE2S_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        WG_BLAKE2S_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+#undef WG_BLAKE2S_G
+
+    for (int i = 0; i < 8; i++) h[i] ^= v[i] ^ v[i + 8];
+}
+
+/**
+ * 计算BLAKE2s摘要
+ * @param outlen 输出长度（1-32字节）
+ * @param key 密钥，keylen为0时为普通哈希（最长32字节）
+ */
+void wg_blake2s(uint8_t *out, size_t outlen, const uint8_t *key, size_t keylen, const void *in, size_t inlen) {
+    const uint8_t *p = in;
+    uint8_t block[64];
+    uint32_t h[8];
+    uint64_t t = 0;
+
+    memcpy(h, wg_blake2s_iv, sizeof(h));
+    h[0] ^= 0x01010000 ^ (uint32_t)(keylen << 8) ^ (uint32_t)outlen;
+
+    // 密钥单独占一个块；其后每次压缩前保证还剩数据，最后一块带结束标记
+    if (keylen > 0) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, key, keylen);
+        t = 64;
+        wg_blake2s_compress(h, block, t, inlen == 0);
+    }
+    while (inlen > 64) {
+        t += 64;
+        wg_blake2s_compress(h, p, t, 0);
+        p += 64;
+        inlen -= 64;
+    }
+    if (inlen > 0 || keylen == 0) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, p, inlen);
+        t += inlen;
+        wg_blake2s_compress(h, block, t, 1);
+    }
+
+    for (size_t i = 0; i < outlen; i++) out[i] = (uint8_t)(h[i / 4] >> (8 * (i % 4)));
+    memset(block, 0, sizeof(block));
+}
+
+/*
+ * 集群复制报文：头部 + 最多 WG_CLUSTER_BATCH 条会话记录，
+ * 会话记录与检查点文件使用同一格式。
+ * 复制通道只接受配置的节点地址。记录部分先加密：以 BLAKE2s(加密密钥, 节点编号‖启动标识‖序号‖块号)
+ * 为密钥流的计数器模式，(节点编号, 启动标识, 序号) 每个报文不同，密钥流不会重用；
+ * 再对整个报文计算认证码（计算时认证码字段置零）。接收方先验认证码，
+ * 再要求 (启动标识, 序号) 比该节点上次接受的严格更新，最后解密。
+ */
+#define WG_CLUSTER_MAGIC 0x57474353u  // "WGCS"
+
+struct wg_cluster_header {
+    uint32_t magic;
+    uint16_t node_id;
+    uint16_t count;
+    uint32_t seq;
+    uint32_t reserved;              // 保持记录8字节对齐
+    uint64_t boot;                  // 发送节点的启动标识
+    uint8_t identity[WG_KEY_LEN];   // 只接受共享同一身份的节点
+    uint8_t mac[WG_CLUSTER_MAC_LEN];
+};
+
+_Static_assert(sizeof(struct wg_cluster_header) + WG_CLUSTER_BATCH * sizeof(struct wg_checkpoint_record) <= 1472,
+               "集群复制报文必须放进一个UDP包");
+
+/**
+ * 解析节点地址："IP:端口"，只给端口时为本机回环地址（便于单机多进程测试）
+ * @return 成功返回0，格式无效返回-1
+ */
+int wg_parse_endpoint(const char *spec, struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strrchr(spec, ':');
+    const char *port = colon ? colon + 1 : spec;
+    char *end;
+    long value = strtol(port, &end, 10);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (*port == '\0' || *end != '\0' || value <= 0 || value > 65535) return -1;
+    addr->sin_port = htons((uint16_t)value);
+    if (!colon) return 0;
+    if ((size_t)(colon - spec) >= sizeof(host)) return -1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/**
+ * 创建集群复制通道
+ * @param bind_addr 本节点复制通道的监听地址
+ * @param nodes 其他节点的复制通道地址
+ * @return 成功返回集群句柄，失败返回NULL
+ * 认证和加密密钥由 table->identity 派生，调用前必须已设置身份
+ */
+struct wg_cluster *wg_cluster_create(struct wg_peer_table *table, uint16_t node_id,
+                                     const struct sockaddr_in *bind_addr,
+                                     const struct sockaddr_in *nodes, unsigned nnodes) {
+    struct wg_cluster *cluster = calloc(1, sizeof(*cluster));
+    if (!cluster) return NULL;
+
+    cluster->dirty = malloc((size_t)table->capacity * sizeof(uint32_t));
+    cluster->sockfd = create_wg_socket_on(bind_addr->sin_addr.s_addr, ntohs(bind_addr->sin_port));
+    if (!cluster->dirty || cluster->sockfd < 0) {
+        if (cluster->sockfd >= 0) close(cluster->sockfd);
+        free(cluster->dirty);
+        free(cluster);
+        return NULL;
+    }
+
+    cluster->node_id = node_id;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cluster->boot = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    static const char mac_label[] = "wg-demo cluster replication";
+    static const char cipher_label[] = "wg-demo cluster replication cipher";
+    wg_blake2s(cluster->secret, sizeof(cluster->secret), table->identity->private_key, WG_KEY_LEN,
+               mac_label, sizeof(mac_label) - 1);
+    wg_blake2s(cluster->cipher_key, sizeof(cluster->cipher_key), table->identity->private_key, WG_KEY_LEN,
+               cipher_label, sizeof(cipher_label) - 1);
+    if (nnodes > WG_CLUSTER_MAX_NODES) nnodes = WG_CLUSTER_MAX_NODES;
+    memcpy(cluster->nodes, nodes, nnodes * sizeof(nodes[0]));
+    cluster->nnodes = nnodes;
+    table->cluster = cluster;
+    return cluster;
+}
+
+void wg_cluster_destroy(struct wg_peer_table *table) {
+    struct wg_cluster *cluster = table->cluster;
+    if (!cluster) return;
+
+    for (uint32_t i = 0; i < cluster->dirty_count; i++) {
+        table->hot[cluster->dirty[i]].flags &= ~WG_PEER_DIRTY;
+    }
+    close(cluster->sockfd);
+    memset(cluster->secret, 0, sizeof(cluster->secret));
+    memset(cluster->cipher_key, 0, sizeof(cluster->cipher_key));
+    free(cluster->dirty);
+    free(cluster);
+    table->cluster = NULL;
+}
+
+// 用报文头中的 (节点编号, 启动标识, 序号) 生成密钥流与 data 异或，加密和解密相同
+static void wg_cluster_crypt(const uint8_t key[WG_KEY_LEN], const struct wg_cluster_header *header,
+                             uint8_t *data, size_t len) {
+    uint8_t nonce[2 + 8 + 4 + 4], stream[32];
+
+    memcpy(nonce, &header->node_id, 2);
+    memcpy(nonce + 2, &header->boot, 8);
+    memcpy(nonce + 10, &header->seq, 4);
+    for (uint32_t block = 0; block * sizeof(stream) < len; block++) {
+        memcpy(nonce + 14, &block, 4);
+        wg_blake2s(stream, sizeof(stream), key, WG_KEY_LEN, nonce, sizeof(nonce));
+        size_t off = block * sizeof(stream), n = len - off < sizeof(stream) ? len - off : sizeof(stream);
+        for (size_t i = 0; i < n; i++) data[off + i] ^= stream[i];
+    }
+    memset(stream, 0, sizeof(stream));
+}
+
+static void wg_cluster_send_batch(struct wg_cluster *cluster, uint8_t *datagram, uint16_t count) {
+    struct wg_cluster_header *header = (struct wg_cluster_header*)datagram;
+    size_t len = sizeof(*header) + count * sizeof(struct wg_checkpoint_record);
+
+    header->count = count;
+    header->seq = ++cluster->seq;
+    header->boot = cluster->boot;
+    wg_cluster_crypt(cluster->cipher_key, header, datagram + sizeof(*header), len - sizeof(*header));
+    memset(header->mac, 0, sizeof(header->mac));
+    wg_blake2s(header->mac, sizeof(header->mac), cluster->secret, sizeof(cluster->secret), datagram, len);
+    for (unsigned i = 0; i < cluster->nnodes; i++) {
+        sendto(cluster->sockfd, datagram, len, 0,
+               (struct sockaddr*)&cluster->nodes[i], sizeof(cluster->nodes[i]));
+    }
+    cluster->sent_records += count;
+}
+
+/**
+ * 把所有脏会话打包成批量增量发给其他节点
+ * @return 发送的会话记录数
+ */
+uint32_t wg_cluster_flush(struct wg_peer_table *table) {
+    struct wg_cluster *cluster = table->cluster;
+    uint8_t datagram[sizeof(struct wg_cluster_header) + WG_CLUSTER_BATCH * sizeof(struct wg_checkpoint_record)]
+        __attribute__((aligned(8)));
+    struct wg_cluster_header *header = (struct wg_cluster_header*)datagram;
+    struct wg_checkpoint_record *records = (struct wg_checkpoint_record*)(header + 1);
+    uint16_t count = 0;
+    uint32_t flushed = 0;
+
+    if (!cluster) return 0;
+    header->magic = WG_CLUSTER_MAGIC;
+    header->node_id = cluster->node_id;
+    header->reserved = 0;
+    memcpy(header->identity, table->identity->public_key, WG_KEY_LEN);
+
+    for (uint32_t i = 0; i < cluster->dirty_count; i++) {
+        uint32_t index = cluster->dirty[i];
+        struct wg_peer *peer = &table->hot[index];
+        struct wg_session *session = peer->session;
+        peer->flags &= ~WG_PEER_DIRTY;
+        if (!session || !session->keypair_ready) continue;
+
+        struct wg_checkpoint_record *record = &records[count];
+        memset(record, 0, sizeof(*record));
+        record->session_id = peer->session_id;
+        record->endpoint = peer->endpoint;
+        memcpy(record->peer_public_key, table->cold[index].public_key, WG_KEY_LEN);
+        record->tx_counter = session->tx_counter;
+        record->rx_counter = session->rx_counter;
+        record->replay_bitmap = session->replay_bitmap;
+        record->last_active = session->last_active;
+        record->keypair_created = session->keypair.created;
+        memcpy(record->send_key, session->keypair.send_key, WG_KEY_LEN);
+        memcpy(record->recv_key, session->keypair.recv_key, WG_KEY_LEN);
+
+        flushed++;
+        if (++count == WG_CLUSTER_BATCH) {
+            wg_cluster_send_batch(cluster, datagram, count);
+            count = 0;
+        }
+    }
+    if (count > 0) wg_cluster_send_batch(cluster, datagram, count);
+    cluster->dirty_count = 0;
+    return flushed;
+}
+
+/**
+ * 应用一条来自其他节点的会话记录
+ * @param origin 发出该记录的节点编号，握手时间相同时用于确定性地决出胜者
+ */
+static void wg_cluster_apply(struct wg_peer_table *table, uint16_t origin,
+                             const struct wg_checkpoint_record *record) {
+    struct wg_peer *peer = wg_peer_lookup(table, record->session_id);
+    if (!peer || memcmp(wg_peer_cold(table, peer)->public_key, record->peer_public_key, WG_KEY_LEN) != 0) {
+        return;
+    }
+
+    struct wg_session *session = wg_peer_activate(table, peer);
+    if (!session) return;
+
+    if (!session->keypair_ready || memcmp(session->keypair.send_key, record->send_key, WG_KEY_LEN) != 0) {
+        // 不同的密钥：只有严格更新的握手才采用，时间相同时编号大的节点胜出，
+        // 否则迟到或乱序的旧记录会把本节点刚完成的握手回滚掉
+        if (session->keypair_ready &&
+            (record->keypair_created < session->keypair.created ||
+             (record->keypair_created == session->keypair.created && origin < table->cluster->node_id))) {
+            return;
+        }
+        // 新的握手结果：整体采用对方的会话
+        memcpy(session->keypair.send_key, record->send_key, WG_KEY_LEN);
+        memcpy(session->keypair.recv_key, record->recv_key, WG_KEY_LEN);
+        session->keypair.created = record->keypair_created;
+        session->keypair_ready = 1;
+        session->tx_counter = 0;
+        session->rx_counter = 0;
+        session->replay_bitmap = 0;
+    }
+
+    // 同一密钥下发送计数器跳过对方可能继续使用的区间，避免两个节点重用nonce
+    if (record->tx_counter + WG_CLUSTER_COUNTER_MARGIN > session->tx_counter) {
+        session->tx_counter = record->tx_counter + WG_CLUSTER_COUNTER_MARGIN;
+    }
+    // 接收窗口取两者的并集
+    if (record->rx_counter > session->rx_counter) {
+        uint64_t shift = record->rx_counter - session->rx_counter;
+        session->replay_bitmap = shift >= WG_REPLAY_WINDOW ? 0 : session->replay_bitmap << shift;
+        session->replay_bitmap |= record->replay_bitmap;
+        session->rx_counter = record->rx_counter;
+    } else {
+        uint64_t shift = session->rx_counter - record->rx_counter;
+        if (shift < WG_REPLAY_WINDOW) session->replay_bitmap |= record->replay_bitmap << shift;
+    }
+    if (record->last_active > session->last_active) {
+        session->last_active = record->last_active;
+        peer->endpoint = record->endpoint;  // 以最近活跃节点看到的端点为准
+    }
+    table->cluster->applied_records++;
+}
+
+/**
+ * 接收并应用一个复制报文（socket可读时调用）
+ * @return 应用的记录数，报文无效返回-1
+ */
+int wg_cluster_receive(struct wg_peer_table *table) {
+    struct wg_cluster *cluster = table->cluster;
+    uint8_t datagram[2048] __attribute__((aligned(8)));
+
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(cluster->sockfd, datagram, sizeof(datagram), 0, (struct sockaddr*)&from, &from_len);
+    if (len < 0) return -1;
+
+    // 只接受配置的节点地址
+    unsigned n;
+    for (n = 0; n < cluster->nnodes; n++) {
+        if (from.sin_addr.s_addr == cluster->nodes[n].sin_addr.s_addr &&
+            from.sin_port == cluster->nodes[n].sin_port) break;
+    }
+    if (n == cluster->nnodes || len < (ssize_t)sizeof(struct wg_cluster_header)) {
+        cluster->rejected++;
+        return -1;
+    }
+
+    struct wg_cluster_header *header = (struct wg_cluster_header*)datagram;
+    if (header->magic != WG_CLUSTER_MAGIC || header->node_id == cluster->node_id ||
+        memcmp(header->identity, table->identity->public_key, WG_KEY_LEN) != 0 ||
+        (size_t)len != sizeof(*header) + header->count * sizeof(struct wg_checkpoint_record)) {
+        cluster->rejected++;
+        return -1;
+    }
+
+    // 认证码校验：置零后重算，常数时间比较
+    uint8_t mac[WG_CLUSTER_MAC_LEN], expected[WG_CLUSTER_MAC_LEN], diff = 0;
+    memcpy(mac, header->mac, sizeof(mac));
+    memset(header->mac, 0, sizeof(header->mac));
+    wg_blake2s(expected, sizeof(expected), cluster->secret, sizeof(cluster->secret), datagram, (size_t)len);
+    for (size_t i = 0; i < sizeof(mac); i++) diff |= mac[i] ^ expected[i];
+    if (diff != 0) {
+        cluster->rejected++;
+        return -1;
+    }
+
+    // 重放检查：启动标识更大（对方重启过）或同一次启动中序号更大才接受
+    if (header->boot < cluster->received[n].boot ||
+        (header->boot == cluster->received[n].boot && header->seq <= cluster->received[n].seq)) {
+        cluster->rejected++;
+        return -1;
+    }
+    cluster->received[n].boot = header->boot;
+    cluster->received[n].seq = header->seq;
+    wg_cluster_crypt(cluster->cipher_key, header, datagram + sizeof(*header), (size_t)len - sizeof(*header));
+
+    const struct wg_checkpoint_record *records = (const struct wg_checkpoint_record*)(header + 1);
+    for (uint16_t i = 0; i < header->count; i++) {
+        wg_cluster_apply(table, header->node_id, &records[i]);
+    }
+    return header->count;
+}
+
+/*
+ * Maglev一致性哈希分片
+ *
+ * 对端按公钥、数据包按会话ID映射到N个工作进程之一。每个分片按自己的
+ * (offset, skip) 生成查找表的排列，轮流占位填满 WG_MAGLEV_TABLE_SIZE 个槽，
+ * 各分片份额几乎相等；分片加入或离开时只有约 1/N 的键改变归属。
+ * 分片给本地对端分配会话ID时选择映射回自己的ID，使得握手之后的数据包
+ * 也落在同一分片；收到不属于自己的包时加一层转发头送到所属分片（只转发一跳）。
+ */
+struct wg_shard_map {
+    uint16_t self;                  // 本进程的分片编号
+    uint16_t nshards;
+    uint8_t alive[WG_MAGLEV_MAX_SHARDS];
+    struct sockaddr_in nodes[WG_MAGLEV_MAX_SHARDS];  // 各分片的数据端口
+    uint8_t lookup[WG_MAGLEV_TABLE_SIZE];             // 槽 -> 分片编号
+    uint64_t forwarded;             // 转发给其他分片的包数
+};
+
+// 分片间转发时加在原始包前面的头部，携带对端真实源地址
+struct wg_forward_header {
+    uint8_t type;                   // WG_TYPE_FORWARDED
+    uint8_t reserved[3];
+    struct sockaddr_in origin;
+};
+
+static inline uint64_t wg_hash64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t wg_hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return wg_hash64(h);
+}
+
+/**
+ * 按当前存活的分片重建Maglev查找表
+ * @return 成功返回0，没有存活分片返回-1
+ */
+int wg_maglev_build(struct wg_shard_map *map) {
+    uint32_t offset[WG_MAGLEV_MAX_SHARDS], skip[WG_MAGLEV_MAX_SHARDS], next[WG_MAGLEV_MAX_SHARDS];
+    uint16_t alive = 0;
+
+    for (uint16_t i = 0; i < map->nshards; i++) {
+        if (!map->alive[i]) continue;
+        // 以分片地址作为名字，节点重启或编号变化不影响排列
+        uint64_t h = wg_hash_bytes(&map->nodes[i], sizeof(map->nodes[i]), 0);
+        offset[i] = h % WG_MAGLEV_TABLE_SIZE;
+        skip[i] = (h >> 32) % (WG_MAGLEV_TABLE_SIZE - 1) + 1;
+        next[i] = 0;
+        alive++;
+    }
+    if (alive == 0) return -1;
+
+    memset(map->lookup, 0xff, sizeof(map->lookup));
+    for (uint32_t filled = 0;;) {
+        for (uint16_t i = 0; i < map->nshards; i++) {
+            if (!map->alive[i]) continue;
+            uint32_t slot;
+            do {
+                slot = (offset[i] + (uint64_t)next[i]++ * skip[i]) % WG_MAGLEV_TABLE_SIZE;
+            } while (map->lookup[slot] != 0xff);
+            map->lookup[slot] = i;
+            if (++filled == WG_MAGLEV_TABLE_SIZE) return 0;
+        }
+    }
+}
+
+/**
+ * 初始化分片映射：所有分片都在本机回环地址上，便于多进程测试
+ * @param ports 各分片的数据端口，下标即分片编号
+ */
+int wg_shard_map_init(struct wg_shard_map *map, uint16_t self, const int *ports, uint16_t nshards) {
+    if (nshards == 0 || nshards > WG_MAGLEV_MAX_SHARDS || self >= nshards) return -1;
+
+    memset(map, 0, sizeof(*map));
+    map->self = self;
+    map->nshards = nshards;
+    for (uint16_t i = 0; i < nshards; i++) {
+        map->nodes[i].sin_family = AF_INET;
+        map->nodes[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        map->nodes[i].sin_port = htons(ports[i]);
+        map->alive[i] = 1;
+    }
+    return wg_maglev_build(map);
+}
+
+// 分片加入或离开后重建查找表
+int wg_shard_set_alive(struct wg_shard_map *map, uint16_t shard, int alive) {
+    if (shard >= map->nshards) return -1;
+    map->alive[shard] = alive ? 1 : 0;
+    return wg_maglev_build(map);
+}
+
+static inline uint16_t wg_shard_for_session(const struct wg_shard_map *map, uint32_t session_id) {
+    return map->lookup[wg_hash64(session_id) % WG_MAGLEV_TABLE_SIZE];
+}
+
+static inline uint16_t wg_shard_for_key(const struct wg_shard_map *map, const uint8_t public_key[WG_KEY_LEN]) {
+    return map->lookup[wg_hash_bytes(public_key, WG_KEY_LEN, 1) % WG_MAGLEV_TABLE_SIZE];
+}
+
+/**
+ * 为本分片的对端重新选择会话ID，使其映射回本分片（变化会话ID的高8位代数）
+ * @return 成功返回0，256个代数都映射到其他分片时返回-1
+ */
+int wg_shard_claim_session_id(const struct wg_shard_map *map, struct wg_peer *peer) {
+    uint32_t index = peer->session_id & WG_SESSION_INDEX_MASK;
+    for (uint32_t gen = 1; gen < 256; gen++) {
+        uint32_t session_id = (gen << WG_SESSION_INDEX_BITS) | index;
+        if (wg_shard_for_session(map, session_id) == map->self) {
+            peer->session_id = session_id;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 来源地址是否为本分片以外的某个已知分片
+static int wg_shard_is_peer_node(const struct wg_shard_map *map, const struct sockaddr_in *addr) {
+    for (uint16_t i = 0; i < map->nshards; i++) {
+        if (i != map->self && map->nodes[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+            map->nodes[i].sin_port == addr->sin_port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 把不属于本分片的包转发给所属分片
  */
-int send_to_peer(int sockfd, struct wg_peer *peer, const void *data, size_t len) {
-    struct wg_packet *pkt;
-    size_t total_len = sizeof(struct wg_packet) + len;
-    
-    // 分配数据包内存
-    pkt = malloc(total_len);
-    if (!pkt) return -1;
-    
-    // 构造WireGuard数据包
-    pkt->type = 4;  // 数据包类型
-    memset(pkt->reserved, 0, 3);
-    pkt->session_id = peer->session_id;
-    pkt->counter = ++peer->tx_counter;
-    
-    // 在真实WireGuard中，这里会进行ChaCha20+Poly1305加密
-    memcpy(pkt->data, data, len);
-    
-    // 通过UDP发送到对端
-    ssize_t sent = sendto(sockfd, pkt, total_len, 0, 
-                         (struct sockaddr*)&peer->endpoint, 
-                         sizeof(peer->endpoint));
-    
-    if (sent > 0) {
-        printf("→ 发送 %zd 字节到 %s:%d (计数器: %lu)\n", 
-               sent, inet_ntoa(peer->endpoint.sin_addr), 
-               ntohs(peer->endpoint.sin_port), pkt->counter);
-    }
-    
-    free(pkt);
-    return sent > 0 ? 0 : -1;
+static void wg_shard_forward(int sockfd, struct wg_shard_map *map, uint16_t owner,
+                             const void *packet, size_t len, const struct sockaddr_in *origin) {
+    uint8_t datagram[sizeof(struct wg_forward_header) + BUFFER_SIZE];
+    struct wg_forward_header *header = (struct wg_forward_header*)datagram;
+
+    if (len > BUFFER_SIZE) return;
+    header->type = WG_TYPE_FORWARDED;
+    memset(header->reserved, 0, sizeof(header->reserved));
+    header->origin = *origin;
+    memcpy(header + 1, packet, len);
+    sendto(sockfd, datagram, sizeof(*header) + len, 0,
+           (struct sockaddr*)&map->nodes[owner], sizeof(map->nodes[owner]));
+    map->forwarded++;
 }
 
 /**
  * 模拟从WireGuard对端接收数据包
  */
-int receive_from_peer(int sockfd, void *buffer, size_t buffer_size) {
+int receive_from_peer(int sockfd, struct wg_peer_table *table, void *buffer, size_t buffer_size) {
     struct sockaddr_in from_addr;
     socklen_t from_len = sizeof(from_addr);
     
-    ssize_t received = recvfrom(sockfd, buffer, buffer_size, 0,
-                               (struct sockaddr*)&from_addr, &from_len);
+    ssize_t received;
+    if (table->handshake_pool) {
+        // 有包时直接收，不经poll；socket空了才同时等待UDP包和握手完成通知，
+        // 握手结果要尽快安装并回复，不能等到下一个包到来
+        received = recvfrom(sockfd, buffer, buffer_size, MSG_DONTWAIT, (struct sockaddr*)&from_addr, &from_len);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfds[2] = {
+                { .fd = sockfd, .events = POLLIN },
+                { .fd = wg_handshake_pool_fd(table->handshake_pool), .events = POLLIN },
+            };
+            int ready = poll(pfds, 2, WG_RECV_POLL_MS);
+            if (ready > 0 && (pfds[1].revents & POLLIN)) {
+                wg_handshake_pool_ack(table->handshake_pool);
+                wg_handshake_pool_drain(table->handshake_pool, sockfd);
+            }
+            if (ready <= 0 || !(pfds[0].revents & POLLIN)) return 0;
+            from_len = sizeof(from_addr);
+            received = recvfrom(sockfd, buffer, buffer_size, 0, (struct sockaddr*)&from_addr, &from_len);
+        }
+        // 处理包之前取走已完成的握手，避免先于密钥处理该会话的数据包（链表为空时只是一次原子读）
+        wg_handshake_pool_drain(table->handshake_pool, sockfd);
+    } else {
+        received = recvfrom(sockfd, buffer, buffer_size, 0, (struct sockaddr*)&from_addr, &from_len);
+    }
+    
+    // 其他分片转发来的包：剥掉转发头，以对端真实地址作为来源。
+    // 转发头里的来源地址不经任何校验，只接受来自已知分片地址的转发包
+    if (received > 0 && ((uint8_t*)buffer)[0] == WG_TYPE_FORWARDED && table->shards) {
+        const struct wg_forward_header *header = buffer;
+        if (received < (ssize_t)(sizeof(*header) + sizeof(struct wg_packet)) ||
+            !wg_shard_is_peer_node(table->shards, &from_addr)) {
+            if (wg_verbose) printf("← 来自 %s:%d 的转发包不是已知分片发出的，丢弃\n",
+                                   inet_ntoa(from_addr.sin_addr), ntohs(from_addr.sin_port));
+            return -1;
+        }
+        from_addr = header->origin;
+        received -= sizeof(*header);
+        memmove(buffer, header + 1, received);
+        if (wg_verbose) printf("← 分片转发的包\n");
+    } else if (received >= (ssize_t)sizeof(struct wg_packet) && table->shards) {
+        // 不属于本分片的会话转发给所属分片，只转发一跳。握手按对端公钥归属，
+        // 负责的分片再把会话ID换成映射回自己的ID，之后的数据包按会话ID也落在同一分片
+        const struct wg_packet *pkt = buffer;
+        uint32_t session_id = pkt->session_id;
+        struct wg_peer *peer = pkt->type == 1 ? wg_peer_lookup(table, session_id) : NULL;
+        uint16_t owner = peer ? wg_shard_for_key(table->shards, wg_peer_cold(table, peer)->public_key)
+                              : wg_shard_for_session(table->shards, session_id);
+        if (owner != table->shards->self) {
+            wg_shard_forward(sockfd, table->shards, owner, buffer, received, &from_addr);
+            if (wg_verbose) printf("→ 会话 %u 属于分片 %u，已转发\n", session_id, owner);
+            return 0;
+        }
+    }
     
     if (received > 0) {
         struct wg_packet *pkt = (struct wg_packet*)buffer;
         
-        printf("← 接收 %zd 字节来自 %s:%d\n", 
+        if (wg_verbose) printf("← 接收 %zd 字节来自 %s:%d\n", 
                received, inet_ntoa(from_addr.sin_addr), 
                ntohs(from_addr.sin_port));
         
-        if (received >= sizeof(struct wg_packet)) {
-            printf("  数据包类型: %d, 会话ID: %u, 计数器: %lu\n",
+        if (received >= (ssize_t)sizeof(struct wg_packet)) {
+            if (wg_verbose) printf("  数据包类型: %d, 会话ID: %u, 计数器: %lu\n",
                    pkt->type, pkt->session_id, pkt->counter);
             
+            // 握手消息（类型1/2/3）交给握手线程池，数据路径不做任何X25519计算
+            if (table->handshake_pool && pkt->type >= 1 && pkt->type <= 3) {
+                if (wg_handshake_pool_submit(table->handshake_pool, pkt, received, &from_addr) < 0) {
+                    if (wg_verbose) printf("  握手队列已满或消息无效，丢弃\n");
+                    return -1;
+                }
+                if (wg_verbose) printf("  已提交到握手线程池\n");
+                return 0;
+            }
+            
+            // 数据路径只访问对端的热数据和会话
+            struct wg_peer *peer = wg_peer_lookup(table, pkt->session_id);
+            if (!peer) {
+                if (wg_verbose) printf("  未知会话，丢弃\n");
+                return -1;
+            }
+            if (pkt->type == 1) {
+                // 握手消息：首次握手时才分配会话状态，载荷为发起方临时公钥
+                struct wg_keypair keypair;
+                uint8_t ephemeral[WG_KEY_LEN];
+                if (received < (ssize_t)(sizeof(struct wg_packet) + WG_KEY_LEN)) return -1;
+                if (wg_handshake_respond(table, peer, pkt->data, ephemeral, &keypair) < 0) return -1;
+                if (table->shards) wg_shard_claim_session_id(table->shards, peer);
+                
+                // 握手响应（类型2）携带本端临时公钥，在密钥安装后发出
+                uint8_t response[sizeof(struct wg_packet) + WG_KEY_LEN];
+                struct wg_packet *resp = (struct wg_packet*)response;
+                memset(resp, 0, sizeof(struct wg_packet));
+                resp->type = 2;
+                resp->session_id = peer->session_id;
+                memcpy(resp->data, ephemeral, WG_KEY_LEN);
+                peer->endpoint = from_addr;
+                wg_session_install_keypair(sockfd, table, peer, &keypair, response, sizeof(response));
+                if (wg_verbose) printf("  握手完成，会话已激活 (活跃对端: %u/%u)\n", table->active, table->count);
+                return 0;
+            }
+            struct wg_session *session = peer->session;
+            if (!session || !session->keypair_ready) {
+                if (wg_verbose) printf("  会话未激活，丢弃\n");
+                return -1;
+            }
+            if (!wg_replay_check(session, pkt->counter)) {
+                if (wg_verbose) printf("  重放或过旧的计数器，丢弃\n");
+                return -1;
+            }
+            session->last_active = time(NULL);
+            peer->endpoint = from_addr;  // 端点漫游：以最近一次合法包的源地址为准
+            wg_cluster_mark_dirty(table, peer);
+            
             // 在真实WireGuard中，这里会进行解密
             size_t data_len = received - sizeof(struct wg_packet);
             if (data_len > 0) {
-                printf("  载荷数据: %zu 字节\n", data_len);
+                if (wg_verbose) printf("  载荷数据: %zu 字节\n", data_len);
                 return data_len;
             }
         }
@@ -133,15 +1966,20 @@ int receive_from_peer(int sockfd, void *buffer, size_t buffer_size) {
 /**
  * WireGuard式的心跳保持连接
  */
+struct keepalive_args {
+    struct wg_peer_table *table;
+    struct wg_peer *peer;
+};
+
 void *keepalive_thread(void *arg) {
-    struct wg_peer *peer = (struct wg_peer*)arg;
+    struct keepalive_args *args = (struct keepalive_args*)arg;
     int sockfd = create_wg_socket(0);  // 随机端口
     
     if (sockfd < 0) return NULL;
     
     while (1) {
         // 发送心跳包（空数据包）
-        send_to_peer(sockfd, peer, "", 0);
+        send_to_peer(sockfd, args->table, args->peer, "", 0);
         
         printf("💗 发送心跳到对端\n");
         sleep(25);  // WireGuard默认25秒心跳
@@ -151,6 +1989,14 @@ void *keepalive_thread(void *arg) {
     return NULL;
 }
 
+// SIGINT/SIGTERM 只设置标志，各演示循环检查后退出并清理
+static volatile sig_atomic_t wg_stop_requested;
+
+static void wg_handle_stop_signal(int sig) {
+    (void)sig;
+    wg_stop_requested = 1;
+}
+
 /**
  * 演示WireGuard UDP通信概念
  */
@@ -165,49 +2011,105 @@ void demonstrate_wireguard_udp() {
     }
     
     // 2. 配置对等节点信息
-    struct wg_peer peer = {
-        .endpoint = {
-            .sin_family = AF_INET,
-            .sin_port = htons(51821),  // 对端端口
-            .sin_addr.s_addr = inet_addr("127.0.0.1")  // 本地测试
-        },
-        .session_id = 12345,
-        .tx_counter = 0,
-        .rx_counter = 0
+    struct wg_identity identity;
+    struct wg_peer_table table;
+    if (wg_identity_load_or_generate(&identity, WG_IDENTITY_PATH) < 0 || wg_peer_table_init(&table, 16) < 0) {
+        printf("无法初始化本端身份或对端表\n");
+        close(listen_sockfd);
+        return;
+    }
+    table.identity = &identity;
+    
+    struct sockaddr_in endpoint = {
+        .sin_family = AF_INET,
+        .sin_port = htons(51821),  // 对端端口
+        .sin_addr.s_addr = inet_addr("127.0.0.1")  // 本地测试
     };
+    struct wg_identity remote = { .private_key = "awenaw-demo-remote-peer-key" };  // 演示用：固定的对端身份
+    x25519_public(remote.public_key, remote.private_key);
+    struct wg_peer *peer = wg_peer_add(&table, &endpoint, remote.public_key);
+    wg_peer_precompute_dh(&table, 0);
+    
+    // 恢复上次正常退出时保存的会话，避免重启后重新握手
+    int restored = wg_checkpoint_restore(&table, WG_CHECKPOINT_PATH);
+    if (restored > 0) {
+        printf("✓ 从检查点恢复了 %d 个会话\n", restored);
+    }
     
-    printf("配置对端: %s:%d\n\n", 
-           inet_ntoa(peer.endpoint.sin_addr),
-           ntohs(peer.endpoint.sin_port));
+    // 握手线程池绑定在最后一个CPU上，与数据路径隔离
+    cpu_set_t handshake_cpus;
+    CPU_ZERO(&handshake_cpus);
+    CPU_SET(sysconf(_SC_NPROCESSORS_ONLN) - 1, &handshake_cpus);
+    table.handshake_pool = wg_handshake_pool_create(&table, 1, &handshake_cpus);
     
-    // 3. 模拟发送IP数据包
+    printf("配置对端: %s:%d (会话ID: %u, 空闲内存: %zu 字节)\n\n", 
+           inet_ntoa(peer->endpoint.sin_addr),
+           ntohs(peer->endpoint.sin_port),
+           peer->session_id,
+           sizeof(struct wg_peer) + sizeof(struct wg_peer_cold));
+    
+    // 3. 模拟发送IP数据包：首次发包激活会话，握手完成前包被暂存
     printf("--- 模拟数据传输 ---\n");
     char ip_packet[] = "模拟的IP数据包内容";
-    send_to_peer(listen_sockfd, &peer, ip_packet, strlen(ip_packet));
+    send_to_peer(listen_sockfd, &table, peer, ip_packet, strlen(ip_packet));
+    
+    if (!peer->session->keypair_ready) {
+        struct wg_keypair demo_keypair = { .created = time(NULL) };  // 演示用：省略握手，直接使用全零密钥
+        printf("模拟握手完成，发送暂存的包\n");
+        wg_session_install_keypair(listen_sockfd, &table, peer, &demo_keypair, NULL, 0);
+    }
     
     // 4. 监听接收数据包
     printf("\n--- 监听接收数据 ---\n");
     printf("监听 UDP 端口 %d，等待数据包...\n", WG_DEFAULT_PORT);
-    printf("(可以用 'nc -u localhost %d' 测试发送数据)\n\n", WG_DEFAULT_PORT);
+    printf("(可以用 'nc -u localhost %d' 测试发送数据，Ctrl+C 正常退出并保存会话)\n\n", WG_DEFAULT_PORT);
+    
+    struct sigaction sa = { .sa_handler = wg_handle_stop_signal };  // 不设SA_RESTART，让select被中断
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
     
     char buffer[BUFFER_SIZE];
-    for (int i = 0; i < 3; i++) {  // 只接收3个包作为演示
+    for (int i = 0; i < 3 && !wg_stop_requested; i++) {  // 只接收3个包作为演示
+        wg_peer_timers(&table, time(NULL));
         fd_set readfds;
         struct timeval timeout = {5, 0};  // 5秒超时
         
         FD_ZERO(&readfds);
         FD_SET(listen_sockfd, &readfds);
+        int maxfd = listen_sockfd;
+        if (table.handshake_pool) {
+            // 握手完成通知也要唤醒，及时安装密钥并发出响应
+            int wake_fd = wg_handshake_pool_fd(table.handshake_pool);
+            FD_SET(wake_fd, &readfds);
+            if (wake_fd > maxfd) maxfd = wake_fd;
+        }
         
-        int activity = select(listen_sockfd + 1, &readfds, NULL, NULL, &timeout);
-        if (activity > 0) {
-            receive_from_peer(listen_sockfd, buffer, sizeof(buffer));
+        int activity = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+        if (activity < 0 && errno == EINTR) {
+            continue;
+        } else if (activity > 0) {
+            if (!FD_ISSET(listen_sockfd, &readfds)) {
+                receive_from_peer(listen_sockfd, &table, buffer, sizeof(buffer));
+                i--;  // 只是握手完成通知，不计入演示的收包数
+                continue;
+            }
+            receive_from_peer(listen_sockfd, &table, buffer, sizeof(buffer));
         } else {
             printf("超时，没有收到数据包\n");
         }
     }
     
+    if (table.handshake_pool) wg_handshake_pool_destroy(table.handshake_pool);
     close(listen_sockfd);
     
+    // 正常退出：保存活跃会话，下次启动时恢复
+    int saved = wg_checkpoint_save(&table, WG_CHECKPOINT_PATH);
+    if (saved >= 0) {
+        printf("\n✓ 已保存 %d 个活跃会话到 %s\n", saved, WG_CHECKPOINT_PATH);
+    }
+    wg_peer_reap_idle(&table, time(NULL), 0);
+    wg_peer_table_free(&table);
+    
     printf("\n=== 关键要点 ===\n");
     printf("1. WireGuard使用UDP作为传输协议\n");
     printf("2. 每个数据包都有计数器防重放攻击\n");
@@ -216,7 +2118,774 @@ void demonstrate_wireguard_udp() {
     printf("5. 加密在应用层完成（本例中省略）\n");
 }
 
-int main() {
+/*
+ * 对端表冷热分离基准测试
+ *
+ * 对比两种布局在大量对端、随机访问下的每包开销：
+ * - 混合布局：热字段与公钥、名称、时间戳等冷字段混在一个结构体里
+ * - 冷热分离：热字段压缩在一个缓存行内的连续数组中
+ * 每个"包"执行数据路径上的典型操作：按会话查找、重放检查、读端点、递增发送计数器。
+ */
+
+// 混合布局：模拟冷热不分时的对端结构体（热字段散布在多个缓存行中）
+struct wg_peer_mixed {
+    struct sockaddr_in endpoint;
+    uint8_t public_key[32];
+    char name[32];
+    time_t last_handshake;
+    time_t last_rx;
+    uint32_t session_id;
+    uint32_t keepalive_interval;
+    uint8_t preshared_key[32];
+    uint64_t tx_counter;
+    uint32_t handshake_count;
+    uint32_t flags;
+    uint8_t reserved[40];
+    uint64_t rx_counter;
+    uint64_t replay_bitmap;
+    struct wg_keypair *keypair;
+};
+
+// 打开硬件缓存未命中计数器，不支持时返回-1
+static int perf_cache_miss_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t perf_counter_read(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_report(const char *label, double elapsed_ns, uint64_t misses, int perf_fd,
+                         uint32_t packets, size_t working_set) {
+    printf("  %-10s 工作集 %7.1f MB, %6.1f ns/包", label,
+           working_set / (1024.0 * 1024.0), elapsed_ns / packets);
+    if (perf_fd >= 0) {
+        printf(", %5.2f 缓存未命中/包\n", (double)misses / packets);
+    } else {
+        printf(" (当前环境不支持硬件缓存计数器)\n");
+    }
+}
+
+/**
+ * 运行对端表基准测试
+ * @param npeers 对端数量
+ * @return 成功返回0
+ */
+int run_peer_benchmark(uint32_t npeers) {
+    const uint32_t packets = 4000000;
+    struct wg_peer_table table;
+    struct wg_peer_mixed *mixed;
+    uint32_t *order;
+    uint64_t sink = 0;
+
+    printf("=== 对端表冷热分离基准测试 (%u 个对端, %u 个包) ===\n", npeers, packets);
+
+    if (wg_peer_table_init(&table, npeers) < 0) {
+        printf("无法分配对端表\n");
+        return -1;
+    }
+    mixed = calloc(npeers, sizeof(*mixed));
+    order = malloc(packets * sizeof(*order));
+    if (!mixed || !order) {
+        printf("内存不足\n");
+        free(mixed);
+        free(order);
+        wg_peer_table_free(&table);
+        return -1;
+    }
+
+    struct sockaddr_in endpoint = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (uint32_t i = 0; i < npeers; i++) {
+        endpoint.sin_port = htons(10000 + i % 50000);
+        struct wg_peer *peer = wg_peer_add(&table, &endpoint, NULL);
+        mixed[i].endpoint = peer->endpoint;
+        mixed[i].session_id = peer->session_id;
+        mixed[i].keypair = calloc(1, sizeof(struct wg_keypair));
+    }
+    printf("全部空闲时: %.1f MB (%zu 字节/对端)\n",
+           (double)npeers * (sizeof(struct wg_peer) + sizeof(struct wg_peer_cold)) / (1024.0 * 1024.0),
+           sizeof(struct wg_peer) + sizeof(struct wg_peer_cold));
+    for (uint32_t i = 0; i < npeers; i++) {
+        if (!wg_peer_activate(&table, &table.hot[i])) {
+            printf("内存不足\n");
+            break;
+        }
+        table.hot[i].session->keypair_ready = 1;
+    }
+
+    // 预先生成随机访问序列，模拟大量对端交错发包（xorshift，避免rand()开销进入测量）
+    uint32_t seed = 2463534242u;
+    for (uint32_t i = 0; i < packets; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        order[i] = seed % npeers;
+    }
+
+    int perf_fd = perf_cache_miss_open();
+    printf("每个对端的热数据: %zu 字节, 冷数据: %zu 字节, 活跃会话: %zu 字节, 混合布局: %zu 字节\n",
+           sizeof(struct wg_peer), sizeof(struct wg_peer_cold), sizeof(struct wg_session),
+           sizeof(struct wg_peer_mixed));
+
+    // 混合布局
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    double start = now_ns();
+    for (uint32_t i = 0; i < packets; i++) {
+        struct wg_peer_mixed *peer = &mixed[order[i]];
+        uint64_t counter = peer->rx_counter + 1;
+        if (peer->session_id != 0 && counter > peer->rx_counter) {
+            peer->replay_bitmap = (peer->replay_bitmap << 1) | 1;
+            peer->rx_counter = counter;
+        }
+        sink += peer->endpoint.sin_port + ++peer->tx_counter + peer->keypair->send_key[0];
+    }
+    double mixed_ns = now_ns() - start;
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t mixed_misses = perf_counter_read(perf_fd);
+
+    // 冷热分离
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    start = now_ns();
+    for (uint32_t i = 0; i < packets; i++) {
+        struct wg_peer *peer = wg_peer_lookup(&table, table.hot[order[i]].session_id);
+        struct wg_session *session = peer ? peer->session : NULL;
+        if (session && wg_replay_check(session, session->rx_counter + 1)) {
+            sink += peer->endpoint.sin_port + ++session->tx_counter + session->keypair.send_key[0];
+        }
+    }
+    double split_ns = now_ns() - start;
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t split_misses = perf_counter_read(perf_fd);
+
+    bench_report("混合布局", mixed_ns, mixed_misses, perf_fd, packets,
+                 (size_t)npeers * (sizeof(struct wg_peer_mixed) + sizeof(struct wg_keypair)));
+    bench_report("冷热分离", split_ns, split_misses, perf_fd, packets,
+                 (size_t)npeers * (sizeof(struct wg_peer) + sizeof(struct wg_session)));
+    printf("  (校验值 %lu)\n", sink);
+
+    if (perf_fd >= 0) close(perf_fd);
+    for (uint32_t i = 0; i < npeers; i++) free(mixed[i].keypair);
+    free(order);
+    free(mixed);
+    wg_peer_reap_idle(&table, time(NULL), 0);
+    wg_peer_table_free(&table);
+    return 0;
+}
+
+/**
+ * 静态-静态DH缓存基准测试：并行预计算耗时，以及握手有无缓存时的CPU开销
+ * @param npeers 对端数量
+ * @param nthreads 预计算线程数
+ */
+int run_dh_benchmark(uint32_t npeers, unsigned nthreads) {
+    const uint32_t handshakes = 200;
+    struct wg_identity identity;
+    struct wg_peer_table table;
+
+    printf("=== 静态DH预计算基准测试 (%u 个对端, %u 个线程) ===\n", npeers, nthreads);
+    if (wg_identity_generate(&identity) < 0 || wg_peer_table_init(&table, npeers) < 0) {
+        printf("初始化失败\n");
+        return -1;
+    }
+    table.identity = &identity;
+
+    struct sockaddr_in endpoint = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (uint32_t i = 0; i < npeers; i++) {
+        uint8_t public_key[WG_KEY_LEN];
+        getrandom(public_key, sizeof(public_key), 0);  // 任意32字节都是合法的X25519 u坐标
+        wg_peer_add(&table, &endpoint, public_key);
+    }
+
+    double start = now_ns();
+    wg_peer_precompute_dh(&table, nthreads);
+    double elapsed = now_ns() - start;
+    printf("  预计算: %.2f 秒, %.1f 微秒/对端\n", elapsed / 1e9, elapsed / 1e3 / npeers);
+
+    uint8_t initiator_private[WG_KEY_LEN], initiator_ephemeral[WG_KEY_LEN], responder_ephemeral[WG_KEY_LEN];
+    struct wg_keypair keypair;
+    getrandom(initiator_private, sizeof(initiator_private), 0);
+    x25519_public(initiator_ephemeral, initiator_private);
+
+    start = now_ns();
+    for (uint32_t i = 0; i < handshakes; i++) {
+        wg_handshake_respond(&table, &table.hot[i % npeers], initiator_ephemeral, responder_ephemeral, &keypair);
+    }
+    double cached = (now_ns() - start) / handshakes;
+
+    start = now_ns();
+    for (uint32_t i = 0; i < handshakes; i++) {
+        __atomic_and_fetch(&table.cold[i % npeers].flags, ~WG_COLD_DH_CACHED, __ATOMIC_RELAXED);  // 每次都强制重新计算
+        wg_handshake_respond(&table, &table.hot[i % npeers], initiator_ephemeral, responder_ephemeral, &keypair);
+    }
+    double uncached = (now_ns() - start) / handshakes;
+
+    printf("  握手响应: 无缓存 %.1f 微秒, 有缓存 %.1f 微秒 (节省 %.0f%%)\n",
+           uncached / 1e3, cached / 1e3, 100.0 * (uncached - cached) / uncached);
+
+    wg_peer_table_free(&table);
+    return 0;
+}
+
+/**
+ * 集群节点演示：多个进程互相复制会话（可以在不同主机上）
+ *
+ * 每个节点"负责"一部分对端（下标 % 节点总数 == node_id），为它们模拟握手和
+ * 转发流量；其他节点通过复制通道获得这些会话，输出中可以看到复制过来的
+ * 计数器和密钥，关掉任意一个节点后其余节点仍持有全部会话。
+ * 例如在两个终端中分别运行（只给端口时为本机回环地址）：
+ *   ./wg-demo cluster 0 52900 52901
+ *   ./wg-demo cluster 1 52901 52900
+ * 跨主机时给出 IP:端口，两个节点需共享同一个私钥文件：
+ *   ./wg-demo cluster 0 10.0.0.1:52900 10.0.0.2:52900
+ *   ./wg-demo cluster 1 10.0.0.2:52900 10.0.0.1:52900
+ * @param bind_addr 本节点复制通道的监听地址
+ * @param nodes 其他节点的复制通道地址
+ */
+int run_cluster_node(uint16_t node_id, const struct sockaddr_in *bind_addr,
+                     const struct sockaddr_in *nodes, unsigned nnodes) {
+    const uint32_t npeers = 8;
+    struct wg_identity identity;
+    struct wg_peer_table table;
+
+    printf("=== 集群会话复制演示 (节点 %u, 复制地址 %s:%d, 其他节点 %u 个) ===\n", node_id,
+           inet_ntoa(bind_addr->sin_addr), ntohs(bind_addr->sin_port), nnodes);
+    if (wg_identity_load_or_generate(&identity, WG_IDENTITY_PATH) < 0 || wg_peer_table_init(&table, npeers) < 0) {
+        printf("无法初始化本端身份或对端表\n");
+        return -1;
+    }
+    table.identity = &identity;
+
+    // 所有节点加载相同的对端配置（公钥由下标确定）
+    for (uint32_t i = 0; i < npeers; i++) {
+        struct wg_identity remote = { .private_key = { (uint8_t)(i + 1) } };
+        struct sockaddr_in endpoint = {
+            .sin_family = AF_INET,
+            .sin_port = htons(52000 + i),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+        };
+        x25519_public(remote.public_key, remote.private_key);
+        wg_peer_add(&table, &endpoint, remote.public_key);
+    }
+
+    if (!wg_cluster_create(&table, node_id, bind_addr, nodes, nnodes)) {
+        printf("无法创建复制通道\n");
+        wg_peer_table_free(&table);
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_handler = wg_handle_stop_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    unsigned total_nodes = nnodes + 1;
+    double next_flush = now_ns(), next_report = now_ns() + 1e9;
+    for (int tick = 0; !wg_stop_requested && tick < 300; tick++) {  // 最多运行约30秒
+        // 模拟本节点负责的对端：首次握手，之后每个周期转发若干包
+        for (uint32_t i = node_id % total_nodes; i < npeers; i += total_nodes) {
+            struct wg_peer *peer = &table.hot[i];
+            struct wg_session *session = wg_peer_activate(&table, peer);
+            if (!session) continue;
+            if (!session->keypair_ready) {
+                struct wg_keypair keypair = { .created = time(NULL) };
+                getrandom(keypair.send_key, sizeof(keypair.send_key), 0);
+                getrandom(keypair.recv_key, sizeof(keypair.recv_key), 0);
+                session->keypair = keypair;
+                session->keypair_ready = 1;
+            }
+            session->tx_counter += 10;
+            wg_replay_check(session, session->rx_counter + 10);
+            session->last_active = time(NULL);
+            wg_cluster_mark_dirty(&table, peer);
+        }
+
+        // 等待其他节点的复制报文，直到下一个批量发送时刻
+        next_flush += WG_CLUSTER_FLUSH_MS * 1e6;
+        for (;;) {
+            double wait_ns = next_flush - now_ns();
+            if (wait_ns <= 0) break;
+            fd_set readfds;
+            struct timeval timeout = { 0, (long)(wait_ns / 1e3) };
+            FD_ZERO(&readfds);
+            FD_SET(table.cluster->sockfd, &readfds);
+            if (select(table.cluster->sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0) break;
+            wg_cluster_receive(&table);
+        }
+        wg_cluster_flush(&table);
+        wg_peer_timers(&table, time(NULL));
+
+        if (now_ns() >= next_report) {
+            next_report += 1e9;
+            printf("--- 节点 %u: 活跃会话 %u/%u, 已发送记录 %lu, 已应用记录 %lu, 拒绝报文 %lu ---\n",
+                   node_id, table.active, npeers, table.cluster->sent_records, table.cluster->applied_records,
+                   table.cluster->rejected);
+            for (uint32_t i = 0; i < npeers; i++) {
+                struct wg_session *session = table.hot[i].session;
+                if (!session || !session->keypair_ready) continue;
+                printf("  对端 %u: %s, 发送计数器 %lu, 接收计数器 %lu, 密钥 %02x%02x…\n",
+                       i, i % total_nodes == node_id ? "本节点负责" : "复制而来",
+                       session->tx_counter, session->rx_counter,
+                       session->keypair.send_key[0], session->keypair.send_key[1]);
+            }
+        }
+    }
+
+    wg_cluster_destroy(&table);
+    wg_peer_reap_idle(&table, time(NULL), 0);
+    wg_peer_table_free(&table);
+    return 0;
+}
+
+/**
+ * Maglev分片演示：键分布均匀度，以及分片离开/加入时归属变化的比例
+ * @param nshards 分片数
+ */
+int run_maglev_demo(uint16_t nshards) {
+    const uint32_t nkeys = 1000000;
+    static struct wg_shard_map map;
+    int ports[WG_MAGLEV_MAX_SHARDS + 1];
+    uint32_t counts[WG_MAGLEV_MAX_SHARDS] = {0};
+
+    if (nshards < 2 || nshards >= WG_MAGLEV_MAX_SHARDS) {
+        printf("分片数需在 2 到 %d 之间\n", WG_MAGLEV_MAX_SHARDS - 1);
+        return -1;
+    }
+    printf("=== Maglev一致性哈希分片演示 (%u 个分片, %u 个对端公钥) ===\n", nshards, nkeys);
+    for (uint16_t i = 0; i <= nshards; i++) ports[i] = WG_DEFAULT_PORT + 100 + i;
+
+    uint8_t *owner = malloc(nkeys);
+    uint8_t (*keys)[WG_KEY_LEN] = malloc((size_t)nkeys * WG_KEY_LEN);
+    if (!owner || !keys) {
+        free(owner);
+        free(keys);
+        return -1;
+    }
+    getrandom(keys, (size_t)nkeys * WG_KEY_LEN, 0);
+
+    // 先初始化 nshards+1 个分片，最后一个保持离线，用于演示加入
+    wg_shard_map_init(&map, 0, ports, nshards + 1);
+    map.alive[nshards] = 0;
+    double start = now_ns();
+    wg_maglev_build(&map);
+    printf("  构建查找表: %.2f 毫秒 (%d 个槽)\n", (now_ns() - start) / 1e6, WG_MAGLEV_TABLE_SIZE);
+
+    start = now_ns();
+    for (uint32_t i = 0; i < nkeys; i++) {
+        owner[i] = wg_shard_for_key(&map, keys[i]);
+        counts[owner[i]]++;
+    }
+    printf("  查找: %.1f ns/次\n", (now_ns() - start) / nkeys);
+    for (uint16_t i = 0; i < nshards; i++) {
+        printf("  分片 %u: %5.2f%%\n", i, 100.0 * counts[i] / nkeys);
+    }
+
+    // 分片1离开
+    wg_shard_set_alive(&map, 1, 0);
+    uint32_t moved = 0, moved_elsewhere = 0;
+    for (uint32_t i = 0; i < nkeys; i++) {
+        uint16_t now_owner = wg_shard_for_key(&map, keys[i]);
+        if (now_owner != owner[i]) {
+            moved++;
+            if (owner[i] != 1) moved_elsewhere++;
+        }
+    }
+    printf("  分片1离开: %.2f%% 的对端改变归属 (其中非分片1原有对端 %.2f%%)\n",
+           100.0 * moved / nkeys, 100.0 * moved_elsewhere / nkeys);
+
+    // 分片1恢复，新分片加入
+    wg_shard_set_alive(&map, 1, 1);
+    wg_shard_set_alive(&map, nshards, 1);
+    moved = 0;
+    for (uint32_t i = 0; i < nkeys; i++) {
+        if (wg_shard_for_key(&map, keys[i]) != owner[i]) moved++;
+    }
+    printf("  分片%u加入: %.2f%% 的对端改变归属 (理想值 %.2f%%)\n",
+           nshards, 100.0 * moved / nkeys, 100.0 / (nshards + 1));
+
+    free(owner);
+    free(keys);
+    return 0;
+}
+
+/**
+ * 运行一个分片数据面进程：所有分片加载相同的对端配置，不属于本分片的会话转发给所属分片
+ * @param self 本分片编号
+ * @param ports 各分片的数据端口（本机回环地址），下标即分片编号
+ */
+int run_shard_node(uint16_t self, const int *ports, uint16_t nshards) {
+    const uint32_t npeers = 8;
+    static struct wg_shard_map map;
+    struct wg_identity identity;
+    struct wg_peer_table table;
+
+    if (nshards < 2 || nshards > WG_MAGLEV_MAX_SHARDS || self >= nshards) {
+        printf("分片数需在 2 到 %d 之间，且本分片编号小于分片数\n", WG_MAGLEV_MAX_SHARDS);
+        return -1;
+    }
+    printf("=== Maglev分片数据面 (分片 %u/%u, 数据端口 %d) ===\n", self, nshards, ports[self]);
+    if (wg_shard_map_init(&map, self, ports, nshards) < 0) return -1;
+    if (wg_identity_load_or_generate(&identity, WG_IDENTITY_PATH) < 0 || wg_peer_table_init(&table, npeers) < 0) {
+        printf("无法初始化本端身份或对端表\n");
+        return -1;
+    }
+    table.identity = &identity;
+    table.shards = &map;
+
+    // 所有分片加载相同的对端配置（公钥由下标确定）
+    for (uint32_t i = 0; i < npeers; i++) {
+        struct wg_identity remote = { .private_key = { (uint8_t)(i + 1) } };
+        struct sockaddr_in endpoint = {
+            .sin_family = AF_INET,
+            .sin_port = htons(52000 + i),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+        };
+        x25519_public(remote.public_key, remote.private_key);
+        wg_peer_add(&table, &endpoint, remote.public_key);
+    }
+
+    int sockfd = create_wg_socket(ports[self]);
+    if (sockfd < 0) {
+        wg_peer_table_free(&table);
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_handler = wg_handle_stop_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char buffer[BUFFER_SIZE];
+    for (int tick = 0; !wg_stop_requested && tick < 300; tick++) {  // 最多运行约30秒
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        wg_peer_timers(&table, time(NULL));
+        if (poll(&pfd, 1, 100) > 0) receive_from_peer(sockfd, &table, buffer, sizeof(buffer));
+    }
+
+    printf("--- 分片 %u: 活跃会话 %u/%u, 转发给其他分片 %lu 个包 ---\n", self, table.active, npeers, map.forwarded);
+    close(sockfd);
+    wg_peer_reap_idle(&table, time(NULL), 0);
+    wg_peer_table_free(&table);
+    return 0;
+}
+
+// 当前进程常驻内存（字节），读取失败返回0
+static size_t wg_rss_bytes(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(f);
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+// 模拟器中的集中器：独立线程循环调用 receive_from_peer，统计通过检查的数据包
+struct wg_sim_concentrator {
+    struct wg_peer_table *table;
+    int sockfd;
+    volatile int stop;
+    uint64_t accepted;
+    uint64_t accepted_bytes;
+};
+
+static void *wg_sim_concentrator_thread(void *arg) {
+    struct wg_sim_concentrator *c = arg;
+    uint8_t buffer[BUFFER_SIZE];
+
+    while (!c->stop) {
+        wg_peer_timers(c->table, time(NULL));
+        int n = receive_from_peer(c->sockfd, c->table, buffer, sizeof(buffer));
+        if (n > 0 && ((struct wg_packet*)buffer)->type == 4) {
+            __atomic_fetch_add(&c->accepted, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&c->accepted_bytes, n, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// 收取握手响应，记录各虚拟对端拿到的会话ID；等待至多 timeout_ms
+static uint32_t wg_sim_collect(const int *fds, uint32_t *session_ids, uint32_t nhandshakes, int timeout_ms) {
+    struct pollfd pfds[WG_SIM_SOCKETS];
+    uint8_t buffer[BUFFER_SIZE];
+    uint32_t completed = 0;
+
+    for (int i = 0; i < WG_SIM_SOCKETS; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, WG_SIM_SOCKETS, timeout_ms) <= 0) return 0;
+    for (int i = 0; i < WG_SIM_SOCKETS; i++) {
+        ssize_t n;
+        while ((n = recv(fds[i], buffer, sizeof(buffer), MSG_DONTWAIT)) >= (ssize_t)sizeof(struct wg_packet)) {
+            const struct wg_packet *pkt = (const struct wg_packet*)buffer;
+            uint32_t index = pkt->session_id & WG_SESSION_INDEX_MASK;
+            if (pkt->type == 2 && index < nhandshakes && !session_ids[index]) {
+                session_ids[index] = pkt->session_id;
+                completed++;
+            }
+        }
+    }
+    return completed;
+}
+
+/**
+ * 模拟的握手与数据阶段（集中器线程已在运行）
+ * @param rss_idle 建表后的RSS，用于计算每个活跃会话的内存
+ */
+static void wg_sim_exchange(struct wg_sim_concentrator *concentrator, const int *fds,
+                            const struct sockaddr_in *target, uint32_t nhandshakes,
+                            uint32_t *session_ids, uint64_t *counters, size_t rss_idle) {
+    struct wg_peer_table *table = concentrator->table;
+    uint8_t message[sizeof(struct wg_packet) + WG_SIM_PAYLOAD];
+    struct wg_packet *pkt = (struct wg_packet*)message;
+    uint32_t done = 0, retries = 0;
+
+    // 握手阶段：窗口内发出握手发起，收不到响应的在下一轮重发
+    double start = now_ns();
+    for (int pass = 0; pass < 5 && done < nhandshakes; pass++) {
+        uint32_t outstanding = 0;
+        for (uint32_t i = 0; i < nhandshakes; i++) {
+            if (session_ids[i]) continue;
+            memset(pkt, 0, sizeof(*pkt));
+            pkt->type = 1;
+            pkt->session_id = table->hot[i].session_id;  // 真实协议中由发起方索引换得，这里直接取
+            getrandom(pkt->data, WG_KEY_LEN, 0);
+            sendto(fds[i % WG_SIM_SOCKETS], message, sizeof(*pkt) + WG_KEY_LEN, 0,
+                   (const struct sockaddr*)target, sizeof(*target));
+            if (pass > 0) retries++;
+            if (++outstanding >= WG_SIM_HANDSHAKE_WINDOW) {
+                uint32_t got = wg_sim_collect(fds, session_ids, nhandshakes, 1000);
+                done += got;
+                outstanding = got > 0 ? outstanding - (got < outstanding ? got : outstanding) : 0;
+            }
+        }
+        // 等待本轮剩余响应
+        for (uint32_t got; outstanding > 0 && (got = wg_sim_collect(fds, session_ids, nhandshakes, 1000)) > 0;) {
+            done += got;
+            outstanding -= got < outstanding ? got : outstanding;
+        }
+    }
+    double handshake_s = (now_ns() - start) / 1e9;
+    size_t rss_active = wg_rss_bytes();
+    printf("  握手: %u/%u 完成, %.2f 秒, %.0f 次/秒 (重发 %u)\n",
+           done, nhandshakes, handshake_s, done / handshake_s, retries);
+    if (done > 0) {
+        printf("  活跃会话: %.1f 字节/会话 (结构体 %zu 字节)\n",
+               (double)(rss_active - rss_idle) / done, sizeof(struct wg_session));
+    }
+
+    // 数据阶段：在已握手的对端间轮转发包
+    uint64_t sent = 0;
+    uint64_t accepted_before = __atomic_load_n(&concentrator->accepted, __ATOMIC_RELAXED);
+    memset(message, 0xab, sizeof(message));
+    start = now_ns();
+    for (uint32_t i = 0; done > 0 && now_ns() - start < WG_SIM_DATA_SECONDS * 1e9; i = (i + 1) % nhandshakes) {
+        if (!session_ids[i]) continue;
+        pkt->type = 4;
+        memset(pkt->reserved, 0, sizeof(pkt->reserved));
+        pkt->session_id = session_ids[i];
+        pkt->counter = ++counters[i];
+        if (sendto(fds[i % WG_SIM_SOCKETS], message, sizeof(message), 0,
+                   (const struct sockaddr*)target, sizeof(*target)) > 0) {
+            sent++;
+        }
+    }
+    double data_s = (now_ns() - start) / 1e9;
+    usleep(200000);  // 让集中器处理完socket中剩余的包
+    uint64_t accepted = __atomic_load_n(&concentrator->accepted, __ATOMIC_RELAXED) - accepted_before;
+    printf("  转发: 发出 %lu, 集中器接受 %lu (%.1f%%), %.0f 包/秒, %.1f Mbit/s 载荷\n",
+           sent, accepted, sent ? 100.0 * accepted / sent : 0.0, accepted / data_s,
+           accepted * WG_SIM_PAYLOAD * 8 / data_s / 1e6);
+}
+
+/**
+ * 大规模对端模拟：同一进程内的集中器与N个虚拟对端经本地回环UDP通信
+ *
+ * 虚拟对端复用 WG_SIM_SOCKETS 个socket（对端靠会话ID区分，而不是源端口），
+ * 自身不做任何密码学计算，只生成随机公钥和临时公钥，负载全部落在集中器上。
+ * 依次报告：空闲对端与活跃会话的内存（按RSS增量计算，包含分配器开销）、
+ * 握手速率、数据包转发吞吐，以及一次全表定时器扫描的耗时。
+ * @param npeers 对端表规模
+ * @param nhandshakes 其中执行握手并发送流量的对端数
+ * @param nthreads 握手线程数，0表示在数据路径上同步握手
+ */
+int run_peer_simulation(uint32_t npeers, uint32_t nhandshakes, unsigned nthreads) {
+    struct wg_identity identity;
+    struct wg_peer_table table;
+    struct wg_sim_concentrator concentrator = { .table = &table, .sockfd = -1 };
+    struct sockaddr_in addrs[WG_SIM_SOCKETS], target = { .sin_family = AF_INET };
+    int fds[WG_SIM_SOCKETS];
+    int bufsize = 4 << 20;
+    uint32_t *session_ids = NULL;
+    uint64_t *counters = NULL;
+    pthread_t thread;
+    int ret = -1;
+
+    if (nhandshakes > npeers) nhandshakes = npeers;
+    printf("=== 大规模对端模拟 (%u 个对端, 其中 %u 个握手并发送流量, 握手线程 %u) ===\n",
+           npeers, nhandshakes, nthreads);
+    wg_verbose = 0;
+
+    size_t rss_start = wg_rss_bytes();
+    if (wg_identity_generate(&identity) < 0 || wg_peer_table_init(&table, npeers) < 0) {
+        printf("初始化失败\n");
+        return -1;
+    }
+    table.identity = &identity;
+
+    // 此后的资源都在函数末尾统一释放，中途失败只需跳过后续阶段
+    int ok = 1;
+    for (int i = 0; i < WG_SIM_SOCKETS; i++) fds[i] = -1;
+    for (int i = 0; i < WG_SIM_SOCKETS && ok; i++) {
+        socklen_t len = sizeof(addrs[i]);
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] < 0 || bind(fds[i], (struct sockaddr*)&addrs[i], sizeof(addrs[i])) < 0 ||
+            getsockname(fds[i], (struct sockaddr*)&addrs[i], &len) < 0) {
+            perror("创建虚拟对端socket失败");
+            ok = 0;
+            break;
+        }
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    }
+
+    // 建表：公钥直接取随机数（任意32字节都是合法的X25519 u坐标）
+    size_t rss_idle = 0;
+    if (ok) {
+        double start = now_ns();
+        uint8_t public_key[WG_KEY_LEN];
+        for (uint32_t i = 0; i < npeers; i++) {
+            getrandom(public_key, sizeof(public_key), 0);
+            wg_peer_add(&table, &addrs[i % WG_SIM_SOCKETS], public_key);
+        }
+        rss_idle = wg_rss_bytes();
+        printf("  建表: %.1f 毫秒, 空闲对端 %.1f 字节/对端 (结构体 %zu 字节)\n",
+               (now_ns() - start) / 1e6, (double)(rss_idle - rss_start) / npeers,
+               sizeof(struct wg_peer) + sizeof(struct wg_peer_cold));
+    }
+
+    // 启动集中器
+    if (ok) {
+        socklen_t target_len = sizeof(target);
+        struct timeval rcv_timeout = { 0, 100000 };
+        concentrator.sockfd = create_wg_socket(0);
+        session_ids = calloc(nhandshakes ? nhandshakes : 1, sizeof(uint32_t));
+        counters = calloc(nhandshakes ? nhandshakes : 1, sizeof(uint64_t));
+        ok = concentrator.sockfd >= 0 && session_ids && counters &&
+             getsockname(concentrator.sockfd, (struct sockaddr*)&target, &target_len) == 0;
+        if (ok) {
+            target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            setsockopt(concentrator.sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+            setsockopt(concentrator.sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
+            if (nthreads > 0) table.handshake_pool = wg_handshake_pool_create(&table, nthreads, NULL);
+            ok = pthread_create(&thread, NULL, wg_sim_concentrator_thread, &concentrator) == 0;
+        }
+    }
+
+    if (ok) {
+        wg_sim_exchange(&concentrator, fds, &target, nhandshakes, session_ids, counters, rss_idle);
+        concentrator.stop = 1;
+        pthread_join(thread, NULL);
+
+        // 定时器：走完一轮活跃会话的空闲扫描（不回收任何会话），记录单次调用的最长耗时
+        double start = now_ns(), longest = 0;
+        uint32_t calls = 0;
+        table.last_timer = 0;
+        table.timer_sweeping = 0;
+        do {
+            double call_start = now_ns();
+            wg_peer_timers(&table, time(NULL));
+            double elapsed = now_ns() - call_start;
+            if (elapsed > longest) longest = elapsed;
+            calls++;
+        } while (table.timer_sweeping);
+        printf("  定时器扫描: 共 %.2f 毫秒, 分 %u 次调用, 单次最长 %.1f 微秒 (%u 个对端, %u 个活跃)\n",
+               (now_ns() - start) / 1e6, calls, longest / 1e3, table.count, table.active);
+        ret = 0;
+    } else {
+        printf("模拟环境初始化失败\n");
+    }
+
+    if (table.handshake_pool) wg_handshake_pool_destroy(table.handshake_pool);
+    for (int i = 0; i < WG_SIM_SOCKETS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    if (concentrator.sockfd >= 0) close(concentrator.sockfd);
+    free(session_ids);
+    free(counters);
+    wg_peer_reap_idle(&table, time(NULL), 0);
+    wg_peer_table_free(&table);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        // 用法: ./wg-demo bench [对端数量]
+        uint32_t npeers = argc > 2 ? (uint32_t)atoi(argv[2]) : 100000;
+        return run_peer_benchmark(npeers) < 0 ? 1 : 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench-dh") == 0) {
+        // 用法: ./wg-demo bench-dh [对端数量] [线程数]
+        uint32_t npeers = argc > 2 ? (uint32_t)atoi(argv[2]) : 10000;
+        unsigned nthreads = argc > 3 ? (unsigned)atoi(argv[3]) : (unsigned)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        return run_dh_benchmark(npeers, nthreads) < 0 ? 1 : 0;
+    }
+    if (argc > 3 && strcmp(argv[1], "cluster") == 0) {
+        // 用法: ./wg-demo cluster <节点ID> <[IP:]复制端口> [其他节点[IP:]复制端口...]
+        struct sockaddr_in bind_addr, nodes[WG_CLUSTER_MAX_NODES];
+        unsigned nnodes = 0;
+        if (wg_parse_endpoint(argv[3], &bind_addr) < 0) {
+            printf("无效的复制地址: %s\n", argv[3]);
+            return 1;
+        }
+        for (int i = 4; i < argc && nnodes < WG_CLUSTER_MAX_NODES; i++) {
+            if (wg_parse_endpoint(argv[i], &nodes[nnodes]) < 0) {
+                printf("无效的节点地址: %s\n", argv[i]);
+                return 1;
+            }
+            nnodes++;
+        }
+        return run_cluster_node((uint16_t)atoi(argv[2]), &bind_addr, nodes, nnodes) < 0 ? 1 : 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "maglev") == 0) {
+        // 用法: ./wg-demo maglev [分片数]
+        return run_maglev_demo(argc > 2 ? (uint16_t)atoi(argv[2]) : 5) < 0 ? 1 : 0;
+    }
+    if (argc > 4 && strcmp(argv[1], "shard") == 0) {
+        // 用法: ./wg-demo shard <本分片编号> <分片0数据端口> <分片1数据端口> [...]
+        int ports[WG_MAGLEV_MAX_SHARDS];
+        uint16_t nshards = 0;
+        for (int i = 3; i < argc && nshards < WG_MAGLEV_MAX_SHARDS; i++) {
+            ports[nshards++] = atoi(argv[i]);
+        }
+        return run_shard_node((uint16_t)atoi(argv[2]), ports, nshards) < 0 ? 1 : 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "sim") == 0) {
+        // 用法: ./wg-demo sim [对端数量] [握手对端数] [握手线程数]
+        uint32_t npeers = argc > 2 ? (uint32_t)atoi(argv[2]) : 100000;
+        uint32_t nhandshakes = argc > 3 ? (uint32_t)atoi(argv[3]) : 2000;
+        unsigned nthreads = argc > 4 ? (unsigned)atoi(argv[4]) : 0;
+        return run_peer_simulation(npeers, nhandshakes, nthreads) < 0 ? 1 : 0;
+    }
+    
     demonstrate_wireguard_udp();
     return 0;
 }
\ No newline at end of file